@@ -0,0 +1,160 @@
+/*
+ * file:        arena.c
+ * description: per-thread scratch memory for FSX492 file system
+ *
+ * Each thread allocates from a stack of chunks by bumping a pointer,
+ * with no locks, and releasing a mark pops the chunks pushed since.
+ * Chunks are ARENA_CHUNK bytes, aligned to BLOCK_SIZE; a request too
+ * big for one gets a chunk of its own, freed when it is released.
+ *
+ * A thread keeps one idle chunk for its next operation, so in the
+ * steady state allocating touches neither the allocator nor a lock.
+ * Further idle chunks go to a pool shared by all threads, which keeps
+ * at most ARENA_POOL_MAX of them, and a thread's idle chunk goes there
+ * when it exits. Memory held when idle is thus bounded by the number of
+ * threads plus ARENA_POOL_MAX chunks.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "blkdev.h"
+
+enum {
+	ARENA_CHUNK = 64 * BLOCK_SIZE, /* bytes in a pooled chunk */
+	ARENA_POOL_MAX = 64, /* idle chunks kept in the shared pool */
+	ARENA_ALIGN = 16 /* alignment of arena_alloc, enough for any type */
+};
+
+/** a chunk of memory, starting with this header */
+struct chunk {
+	struct chunk *prev; /* chunk allocated from before this one, or next in pool */
+	size_t size; /* bytes in the chunk, header included */
+};
+
+/** idle chunks shared by all threads */
+static struct chunk *pool;
+static int pool_count;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; /* protects the above */
+
+/** the calling thread's arena */
+static __thread struct chunk *top; /* chunk being allocated from */
+static __thread size_t top_used; /* bytes used in top */
+static __thread struct chunk *spare; /* idle chunk kept by the thread */
+
+/** gives a thread's spare chunk back to the pool when it exits */
+static pthread_key_t spare_key;
+static pthread_once_t spare_once = PTHREAD_ONCE_INIT;
+
+static void pool_put(void *arg)
+{
+	struct chunk *c = arg;
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count < ARENA_POOL_MAX){
+		c->prev = pool;
+		pool = c;
+		pool_count++;
+		c = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free(c);
+}
+
+static void spare_key_create(void)
+{
+	pthread_key_create(&spare_key, pool_put);
+}
+
+static void set_spare(struct chunk *c)
+{
+	pthread_once(&spare_once, spare_key_create);
+	spare = c;
+	pthread_setspecific(spare_key, c);
+}
+
+/* a chunk of at least size bytes, header included, or NULL */
+static struct chunk *chunk_get(size_t size)
+{
+	struct chunk *c = NULL;
+	if (size <= ARENA_CHUNK){
+		if (spare != NULL){
+			c = spare;
+			set_spare(NULL);
+			return c;
+		}
+		pthread_mutex_lock(&pool_lock);
+		if ((c = pool) != NULL){
+			pool = c->prev;
+			pool_count--;
+		}
+		pthread_mutex_unlock(&pool_lock);
+		if (c != NULL){
+			return c;
+		}
+		size = ARENA_CHUNK;
+	} else {
+		size = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	}
+	void *mem;
+	if (posix_memalign(&mem, BLOCK_SIZE, size) != 0){
+		return NULL;
+	}
+	c = mem;
+	c->size = size;
+	return c;
+}
+
+static void chunk_put(struct chunk *c)
+{
+	if (c->size != ARENA_CHUNK){
+		free(c);
+	} else if (spare == NULL){
+		set_spare(c);
+	} else {
+		pool_put(c);
+	}
+}
+
+/* size bytes at a multiple of align, a power of two no larger than BLOCK_SIZE */
+static void *alloc(size_t size, size_t align)
+{
+	size_t off = (top_used + align - 1) & ~(align - 1);
+	if (top == NULL || off + size > top->size){
+		size_t first = (sizeof(struct chunk) + align - 1) & ~(align - 1);
+		struct chunk *c = chunk_get(first + size);
+		if (c == NULL){
+			return NULL;
+		}
+		c->prev = top;
+		top = c;
+		off = first;
+	}
+	top_used = off + size;
+	return (char *)top + off;
+}
+
+struct arena_mark arena_mark(void)
+{
+	return (struct arena_mark){ .chunk = top, .used = top_used };
+}
+
+void arena_release(struct arena_mark mark)
+{
+	while (top != mark.chunk){
+		struct chunk *c = top;
+		top = c->prev;
+		chunk_put(c);
+	}
+	top_used = mark.used;
+}
+
+void *arena_alloc(size_t size)
+{
+	return alloc(size, ARENA_ALIGN);
+}
+
+void *arena_alloc_blocks(size_t count)
+{
+	return alloc(count * BLOCK_SIZE, BLOCK_SIZE);
+}
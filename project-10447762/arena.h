@@ -0,0 +1,31 @@
+/*
+ * file:        arena.h
+ * description: per-thread scratch memory for FSX492 file system
+ *
+ * Scratch buffers are carved from the calling thread's arena and given
+ * back in bulk: take a mark, allocate, and release the mark, which
+ * frees everything allocated since it was taken. Marks are released in
+ * the reverse order they were taken, and by the thread that took them.
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/** a position in the calling thread's arena */
+struct arena_mark {
+	void *chunk; /* chunk being allocated from, NULL if none */
+	size_t used; /* bytes used in it */
+};
+
+extern struct arena_mark arena_mark(void);
+/* free everything allocated by the thread since mark was taken */
+extern void arena_release(struct arena_mark mark);
+
+/* size bytes, aligned for any type; NULL if out of memory */
+extern void *arena_alloc(size_t size);
+/* count blocks, aligned to BLOCK_SIZE for direct I/O; NULL if out of memory */
+extern void *arena_alloc_blocks(size_t count);
+
+#endif /* ARENA_H_ */
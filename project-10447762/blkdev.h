@@ -13,7 +13,18 @@
 enum { BLOCK_SIZE = 1024 };
 
 /** block device operation status */
-enum { SUCCESS = 0, E_BADADDR = -1, E_UNAVAIL = -2, E_SIZE = -3};
+enum { SUCCESS = 0, E_BADADDR = -1, E_UNAVAIL = -2, E_SIZE = -3, E_CORRUPT = -4};
+
+/** An asynchronous request to a block device */
+struct blkdev_req {
+    int write; /* nonzero to write buf to the device, zero to read into it */
+    int first_blk; /* first block to transfer */
+    int num_blks; /* number of blocks to transfer */
+    void *buf; /* must stay valid until the request completes */
+    int status; /* SUCCESS or error once complete */
+    int complete; /* nonzero once the request has completed */
+    struct blkdev_req *next; /* private to the device */
+};
 
 /** Definition of a block device */
 struct blkdev {
@@ -26,8 +37,58 @@ struct blkdev_ops {
     int (*num_blocks)(struct blkdev *dev);
     int (*read)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
     int (*write)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
+    /* make blocks written durable: num_blks from first_blk, or all of
+     * them if num_blks is 0 */
     int (*flush)(struct blkdev *dev, int first_blk, int num_blks);
     void (*close)(struct blkdev *dev);
+    /* optional: a file holding block n at byte n * BLOCK_SIZE, for
+     * splicing data to and from it directly, or -1 if unavailable */
+    int (*fd)(struct blkdev *dev);
+    /* optional: start a request and return SUCCESS, or an error if it
+     * cannot be started; and wait for a started request to complete,
+     * returning its status */
+    int (*submit)(struct blkdev *dev, struct blkdev_req *req);
+    int (*wait)(struct blkdev *dev, struct blkdev_req *req);
+    /* optional, for devices that hold writes back: send the writes
+     * made so far to the device ahead of any made later */
+    int (*barrier)(struct blkdev *dev);
+    /* optional: change the number of blocks to num_blks, adding zeroed
+     * blocks at the end or dropping the last ones */
+    int (*resize)(struct blkdev *dev, int num_blks);
 };
 
+/** Order writes made so far before later ones; returns SUCCESS or error */
+static inline int blkdev_barrier(struct blkdev *dev)
+{
+    return (dev->ops->barrier != NULL) ? dev->ops->barrier(dev) : SUCCESS;
+}
+
+/**
+ * Start a request, carrying it out at once on a device without submit.
+ * Every request started must be waited for with blkdev_wait.
+ */
+static inline int blkdev_submit(struct blkdev *dev, struct blkdev_req *req)
+{
+    req->complete = 0;
+    if (dev->ops->submit != NULL){
+        return dev->ops->submit(dev, req);
+    }
+    if (req->write){
+        req->status = dev->ops->write(dev, req->first_blk, req->num_blks, req->buf);
+    } else {
+        req->status = dev->ops->read(dev, req->first_blk, req->num_blks, req->buf);
+    }
+    req->complete = 1;
+    return SUCCESS;
+}
+
+/** Wait for a request started by blkdev_submit; returns its status */
+static inline int blkdev_wait(struct blkdev *dev, struct blkdev_req *req)
+{
+    if (dev->ops->submit != NULL){
+        return dev->ops->wait(dev, req);
+    }
+    return req->status;
+}
+
 #endif
@@ -0,0 +1,173 @@
+/*
+ * file:        compress.c
+ * description: LZ4 block format compression for FSX492 file system
+ *
+ * Each sequence is a token byte, whose high nibble is the number of
+ * literals and low nibble the match length less 4, 15 in either
+ * meaning more length bytes follow, each adding up to 255; then the
+ * literals, and a 2-byte little-endian offset back to the match. The
+ * last sequence has literals only. As the format requires, the last 5
+ * bytes are always literals and no match starts in the last 12.
+ *
+ * The compressor finds matches with a hash table of the positions of
+ * recent 4-byte strings, checking only the latest one for each hash.
+ * It skips ahead faster the longer it goes without a match, so
+ * incompressible data costs little time.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+enum {
+	HASH_BITS = 12, /* log2 of hash table entries */
+	MIN_MATCH = 4, /* shortest match */
+	LAST_LITERALS = 5, /* bytes at the end that are always literals */
+	MATCH_LIMIT = 12, /* no match starts in this many bytes at the end */
+	MAX_OFFSET = 65535, /* farthest a match may be */
+	SKIP_SHIFT = 6 /* step grows by 1 for each 2^SKIP_SHIFT bytes without a match */
+};
+
+static uint32_t read32(const unsigned char *p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned hash(uint32_t v){
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* write the length bytes that follow a nibble of 15 */
+static unsigned char *put_length(unsigned char *op, size_t len){
+	for (; len >= 255; len -= 255){
+		*op++ = 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/* read the length bytes that follow a nibble of 15 onto *len; returns the new input position, or NULL past end */
+static const unsigned char *get_length(const unsigned char *ip, const unsigned char *end, size_t *len){
+	unsigned b;
+	do {
+		if (ip == end){
+			return NULL;
+		}
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+	return ip;
+}
+
+/* bytes needed to encode lit literals and, if match is nonzero, a match of that length */
+static size_t sequence_size(size_t lit, size_t match){
+	size_t n = 1 + lit + ((lit >= 15) ? (lit - 15) / 255 + 1 : 0);
+	if (match != 0){
+		n += 2 + ((match - MIN_MATCH >= 15) ? (match - MIN_MATCH - 15) / 255 + 1 : 0);
+	}
+	return n;
+}
+
+/* write a sequence; returns the new output position */
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *lit, size_t n_lit, size_t offset, size_t match){
+	unsigned char *token = op++;
+	*token = ((n_lit >= 15) ? 15 : n_lit) << 4;
+	if (n_lit >= 15){
+		op = put_length(op, n_lit - 15);
+	}
+	memcpy(op, lit, n_lit);
+	op += n_lit;
+	if (match != 0){
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		match -= MIN_MATCH;
+		*token |= (match >= 15) ? 15 : match;
+		if (match >= 15){
+			op = put_length(op, match - 15);
+		}
+	}
+	return op;
+}
+
+int lz4_compress(const void *src, int n, void *dst, int cap){
+	const unsigned char *in = src, *end = in + n;
+	const unsigned char *ip = in, *anchor = in;
+	unsigned char *op = dst, *op_end = op + cap;
+	uint32_t table[1 << HASH_BITS];
+	memset(table, 0, sizeof(table));
+	while (ip + MATCH_LIMIT <= end){
+		uint32_t seq = read32(ip);
+		unsigned h = hash(seq);
+		const unsigned char *ref = in + table[h];
+		table[h] = ip - in;
+		if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq){
+			ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+			continue;
+		}
+		size_t match = MIN_MATCH;
+		while (ip + match < end - LAST_LITERALS && ref[match] == ip[match]){
+			match++;
+		}
+		if (op + sequence_size(ip - anchor, match) > op_end){
+			return 0;
+		}
+		op = put_sequence(op, anchor, ip - anchor, ip - ref, match);
+		ip += match;
+		anchor = ip;
+		if (ip + MATCH_LIMIT <= end){
+			table[hash(read32(ip - 2))] = ip - 2 - in;
+		}
+	}
+	if (op + sequence_size(end - anchor, 0) > op_end){
+		return 0;
+	}
+	op = put_sequence(op, anchor, end - anchor, 0, 0);
+	return op - (unsigned char *)dst;
+}
+
+int lz4_decompress(const void *src, int n, void *dst, int cap){
+	const unsigned char *ip = src, *end = ip + n;
+	unsigned char *out = dst, *op = out, *op_end = op + cap;
+	while (ip < end){
+		unsigned token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15 && (ip = get_length(ip, end, &lit)) == NULL){
+			return -1;
+		}
+		if (lit > (size_t)(end - ip) || lit > (size_t)(op_end - op)){
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == end){
+			break; /* the last sequence has no match */
+		}
+		if (end - ip < 2){
+			return -1;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t match = token & 15;
+		if (match == 15 && (ip = get_length(ip, end, &match)) == NULL){
+			return -1;
+		}
+		match += MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - out) || match > (size_t)(op_end - op)){
+			return -1;
+		}
+		const unsigned char *ref = op - offset;
+		if (offset >= match){
+			memcpy(op, ref, match);
+		} else {
+			/* the match overlaps the bytes it produces, repeating them */
+			for (size_t i = 0; i < match; i++){
+				op[i] = ref[i];
+			}
+		}
+		op += match;
+	}
+	return op - out;
+}
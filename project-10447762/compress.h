@@ -0,0 +1,28 @@
+/*
+ * file:        compress.h
+ * description: block compression for FSX492 file system
+ *
+ * Data is compressed in the LZ4 block format: a sequence of literal
+ * runs and back references of at least 4 bytes to the last 64 KB of
+ * output, with no header or checksum, so the caller keeps the sizes.
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+/*
+ * Compress n bytes from src into at most cap bytes at dst.
+ *
+ * @return: the compressed size, or 0 if it would be more than cap
+ */
+extern int lz4_compress(const void *src, int n, void *dst, int cap);
+
+/*
+ * Decompress n bytes from src into at most cap bytes at dst.
+ *
+ * @return: the decompressed size, or -1 if src is not valid
+ *   compressed data or decompresses to more than cap bytes
+ */
+extern int lz4_decompress(const void *src, int n, void *dst, int cap);
+
+#endif /* COMPRESS_H_ */
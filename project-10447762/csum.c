@@ -0,0 +1,517 @@
+/*
+ * file:        csum.c
+ * description: checksumming block device stacked on an FSX492 image
+ *
+ * The image's checksums (see struct fs_super) are kept in memory.
+ * Each block read is checked against its checksum, and each block
+ * written gets a new one. The region blocks holding changed checksums
+ * are written at the next barrier or flush, after the writes made
+ * before it, so the region matches the image at every barrier. A crash
+ * while a barrier's writes are reaching the device can leave blocks
+ * that fail their check until they are written again; scrubbing the
+ * file system finds them.
+ *
+ * Reads started with submit are checked when they are waited for. An
+ * upper device may also wait here for requests it completed itself,
+ * so the reads started here are kept in a list.
+ *
+ * A block's data and checksum do not change at the same moment: a
+ * write's checksum is recorded after a synchronous write and before
+ * a submitted one. A read racing with a write may therefore see one
+ * without the other, so writes in flight are kept in a list too, and
+ * a block failing its check is read again once no write to it is in
+ * flight before it is reported.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fsx492.h"
+#include "blkdev.h"
+#include "hash.h"
+#include "csum.h"
+
+enum {
+	SUMS_PER_BLK = BLOCK_SIZE / sizeof(uint32_t), /* checksums in a block of the region */
+	CHUNK = 64 /* blocks checksummed at a time */
+};
+
+/** a write in flight, from before its data or checksum changes until both have */
+struct span {
+	int first_blk;
+	int num_blks;
+	struct blkdev_req *req; /* the request, for a write started with submit */
+	struct span *next;
+};
+
+/** definition of checksum block device */
+struct csum_dev {
+	struct blkdev *lower; /* device holding the image */
+	int num_blocks; /* blocks checked: the file system's */
+	int region_blocks; /* blocks of checksums, from num_blocks on */
+	pthread_mutex_t lock; /* protects the fields below */
+	uint32_t *sums; /* checksum of each block, region_blocks blocks of them */
+	char *dirty; /* per block of the region, set if changed since written */
+	int n_dirty; /* blocks set in dirty */
+	int written; /* nonzero if region blocks were written since the last flush */
+	struct blkdev_req **reading; /* reads started, not yet waited for */
+	int n_reading, reading_cap;
+	struct span *writing; /* writes in flight */
+	pthread_cond_t settled; /* broadcast when a write is no longer in flight */
+};
+
+/* checksums of count blocks from first_blk held in buf */
+static void compute(int first_blk, int count, const char *buf, uint32_t *sums)
+{
+	crc32c_blocks(first_blk, buf, BLOCK_SIZE, count, sums);
+}
+
+/* whether a write to a block is in flight; call with the lock held */
+static bool writing(struct csum_dev *cd, int blk)
+{
+	for (struct span *s = cd->writing; s != NULL; s = s->next){
+		if (blk >= s->first_blk && blk < s->first_blk + s->num_blks){
+			return true;
+		}
+	}
+	return false;
+}
+
+/* list a write as in flight */
+static void begin_write(struct csum_dev *cd, struct span *span)
+{
+	pthread_mutex_lock(&cd->lock);
+	span->next = cd->writing;
+	cd->writing = span;
+	pthread_mutex_unlock(&cd->lock);
+}
+
+/* take a write off the list of those in flight, waking readers waiting for it */
+static void end_write(struct csum_dev *cd, struct span *span)
+{
+	pthread_mutex_lock(&cd->lock);
+	for (struct span **link = &cd->writing; *link != NULL; link = &(*link)->next){
+		if (*link == span){
+			*link = span->next;
+			break;
+		}
+	}
+	pthread_cond_broadcast(&cd->settled);
+	pthread_mutex_unlock(&cd->lock);
+}
+
+/*
+ * Check a block that failed its check again, reading it once no write
+ * to it is in flight, until its checksum stays the same across a read.
+ * The block read is left in buf.
+ *
+ * @return: SUCCESS, E_CORRUPT, or the error reading the block
+ */
+static int recheck(struct csum_dev *cd, int blk, char *buf)
+{
+	for (;;){
+		pthread_mutex_lock(&cd->lock);
+		while (writing(cd, blk)){
+			pthread_cond_wait(&cd->settled, &cd->lock);
+		}
+		uint32_t expected = cd->sums[blk];
+		pthread_mutex_unlock(&cd->lock);
+		int status = cd->lower->ops->read(cd->lower, blk, 1, buf);
+		if (status != SUCCESS){
+			return status;
+		}
+		uint32_t sum;
+		compute(blk, 1, buf, &sum);
+		if (sum == expected){
+			return SUCCESS;
+		}
+		pthread_mutex_lock(&cd->lock);
+		bool moved = cd->sums[blk] != expected || writing(cd, blk);
+		pthread_mutex_unlock(&cd->lock);
+		if (!moved){
+			return E_CORRUPT;
+		}
+	}
+}
+
+/* check blocks just read against their checksums; returns SUCCESS, E_CORRUPT or a read error */
+static int check(struct csum_dev *cd, int first_blk, int nblks, char *buf)
+{
+	int retval = SUCCESS;
+	for (int done = 0; done < nblks; done += CHUNK){
+		uint32_t sums[CHUNK];
+		bool bad[CHUNK];
+		int count = (nblks - done < CHUNK) ? nblks - done : CHUNK;
+		compute(first_blk + done, count, buf + (size_t)done * BLOCK_SIZE, sums);
+		pthread_mutex_lock(&cd->lock);
+		for (int i = 0; i < count; i++){
+			bad[i] = sums[i] != cd->sums[first_blk + done + i];
+		}
+		pthread_mutex_unlock(&cd->lock);
+		for (int i = 0; i < count; i++){
+			int status = bad[i] ? recheck(cd, first_blk + done + i, buf + (size_t)(done + i) * BLOCK_SIZE) : SUCCESS;
+			if (status == E_CORRUPT){
+				fprintf(stderr, "csum: block %d does not match its checksum\n", first_blk + done + i);
+			}
+			if (status != SUCCESS && retval == SUCCESS){
+				retval = status;
+			}
+		}
+	}
+	return retval;
+}
+
+/* record the checksums of blocks being written */
+static void update(struct csum_dev *cd, int first_blk, int nblks, const char *buf)
+{
+	for (int done = 0; done < nblks; done += CHUNK){
+		uint32_t sums[CHUNK];
+		int count = (nblks - done < CHUNK) ? nblks - done : CHUNK;
+		compute(first_blk + done, count, buf + (size_t)done * BLOCK_SIZE, sums);
+		pthread_mutex_lock(&cd->lock);
+		for (int i = 0; i < count; i++){
+			int b = first_blk + done + i;
+			cd->sums[b] = sums[i];
+			if (!cd->dirty[b / SUMS_PER_BLK]){
+				cd->dirty[b / SUMS_PER_BLK] = 1;
+				cd->n_dirty++;
+			}
+		}
+		pthread_mutex_unlock(&cd->lock);
+	}
+}
+
+/* write the region blocks changed since they were last written, in runs; call with the lock held */
+static int write_sums(struct csum_dev *cd)
+{
+	int retval = SUCCESS;
+	for (int k = 0; k < cd->region_blocks && cd->n_dirty > 0; ){
+		if (!cd->dirty[k]){
+			k++;
+			continue;
+		}
+		int run = 1;
+		while (k + run < cd->region_blocks && cd->dirty[k + run]){
+			run++;
+		}
+		int status = cd->lower->ops->write(cd->lower, cd->num_blocks + k, run, (char *)cd->sums + (size_t)k * BLOCK_SIZE);
+		if (status == SUCCESS){
+			memset(cd->dirty + k, 0, run);
+			cd->n_dirty -= run;
+			cd->written = 1;
+		} else if (retval == SUCCESS){
+			retval = status;
+		}
+		k += run;
+	}
+	return retval;
+}
+
+static int csum_num_blocks(struct blkdev *dev)
+{
+	struct csum_dev *cd = dev->private;
+	return cd->num_blocks;
+}
+
+static int csum_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct csum_dev *cd = dev->private;
+	if (first_blk < 0 || first_blk + nblks > cd->num_blocks){
+		return E_BADADDR;
+	}
+	int retval = cd->lower->ops->read(cd->lower, first_blk, nblks, buf);
+	return (retval == SUCCESS) ? check(cd, first_blk, nblks, buf) : retval;
+}
+
+static int csum_write(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct csum_dev *cd = dev->private;
+	if (first_blk < 0 || first_blk + nblks > cd->num_blocks){
+		return E_BADADDR;
+	}
+	struct span span = { .first_blk = first_blk, .num_blks = nblks, .req = NULL };
+	begin_write(cd, &span);
+	int retval = cd->lower->ops->write(cd->lower, first_blk, nblks, buf);
+	if (retval == SUCCESS){
+		update(cd, first_blk, nblks, buf);
+	}
+	end_write(cd, &span);
+	return retval;
+}
+
+/* write the changed checksums once the lower device has ordered the writes before them */
+static int csum_barrier(struct blkdev *dev)
+{
+	struct csum_dev *cd = dev->private;
+	int retval = blkdev_barrier(cd->lower);
+	pthread_mutex_lock(&cd->lock);
+	int written = write_sums(cd);
+	pthread_mutex_unlock(&cd->lock);
+	return (retval != SUCCESS) ? retval : written;
+}
+
+/* flush the blocks, and the region too if checksums were written since it was last flushed */
+static int csum_flush(struct blkdev *dev, int first_blk, int nblks)
+{
+	struct csum_dev *cd = dev->private;
+	int retval = csum_barrier(dev);
+	int flushed = cd->lower->ops->flush(cd->lower, first_blk, nblks);
+	pthread_mutex_lock(&cd->lock);
+	int written = cd->written;
+	cd->written = 0;
+	pthread_mutex_unlock(&cd->lock);
+	if (flushed == SUCCESS && written && nblks != 0){
+		flushed = cd->lower->ops->flush(cd->lower, cd->num_blocks, cd->region_blocks);
+	}
+	return (retval != SUCCESS) ? retval : flushed;
+}
+
+/* take a write started here off the list of those in flight; returns whether it was on it */
+static bool finish_write(struct csum_dev *cd, struct blkdev_req *req)
+{
+	struct span *span = NULL;
+	pthread_mutex_lock(&cd->lock);
+	for (struct span *s = cd->writing; s != NULL && span == NULL; s = s->next){
+		if (s->req == req){
+			span = s;
+		}
+	}
+	pthread_mutex_unlock(&cd->lock);
+	if (span != NULL){
+		end_write(cd, span);
+		free(span);
+	}
+	return span != NULL;
+}
+
+/* take a read off the list of those started here; returns whether it was on it */
+static bool untrack(struct csum_dev *cd, struct blkdev_req *req)
+{
+	bool found = false;
+	pthread_mutex_lock(&cd->lock);
+	for (int i = 0; i < cd->n_reading && !found; i++){
+		if (cd->reading[i] == req){
+			cd->reading[i] = cd->reading[--cd->n_reading];
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&cd->lock);
+	return found;
+}
+
+/*
+ * Writes have their checksums recorded as they start, while the
+ * buffer is sure to be valid, and are in flight until waited for;
+ * reads are listed, to be checked by csum_wait.
+ */
+static int csum_submit(struct blkdev *dev, struct blkdev_req *req)
+{
+	struct csum_dev *cd = dev->private;
+	if (req->first_blk < 0 || req->first_blk + req->num_blks > cd->num_blocks){
+		return E_BADADDR;
+	}
+	if (req->write){
+		struct span *span = malloc(sizeof(*span));
+		if (span == NULL){
+			return E_UNAVAIL;
+		}
+		*span = (struct span){ .first_blk = req->first_blk, .num_blks = req->num_blks, .req = req };
+		begin_write(cd, span);
+		update(cd, req->first_blk, req->num_blks, req->buf);
+		int retval = blkdev_submit(cd->lower, req);
+		if (retval != SUCCESS){
+			finish_write(cd, req);
+		}
+		return retval;
+	}
+	pthread_mutex_lock(&cd->lock);
+	if (cd->n_reading == cd->reading_cap){
+		int cap = (cd->reading_cap == 0) ? 16 : 2 * cd->reading_cap;
+		struct blkdev_req **reading = realloc(cd->reading, cap * sizeof(*reading));
+		if (reading == NULL){
+			pthread_mutex_unlock(&cd->lock);
+			return E_UNAVAIL;
+		}
+		cd->reading = reading;
+		cd->reading_cap = cap;
+	}
+	cd->reading[cd->n_reading++] = req;
+	pthread_mutex_unlock(&cd->lock);
+	int retval = blkdev_submit(cd->lower, req);
+	if (retval != SUCCESS){
+		untrack(cd, req);
+	}
+	return retval;
+}
+
+/* wait for a request, checking it if it is a read started here */
+static int csum_wait(struct blkdev *dev, struct blkdev_req *req)
+{
+	struct csum_dev *cd = dev->private;
+	int status = blkdev_wait(cd->lower, req);
+	if (req->write){
+		finish_write(cd, req);
+	} else if (untrack(cd, req) && status == SUCCESS){
+		status = req->status = check(cd, req->first_blk, req->num_blks, req->buf);
+	}
+	return status;
+}
+
+/*
+ * Change the number of blocks checked, moving the region to just after
+ * them. Blocks that become the file system's, whether added or the old
+ * region's, get the checksums of what they hold. On growing, the old
+ * region is left as it was until the file system takes its blocks,
+ * so the image stays usable with the old size until the superblock
+ * says otherwise.
+ */
+static int csum_resize(struct blkdev *dev, int nblks)
+{
+	struct csum_dev *cd = dev->private;
+	if (cd->lower->ops->resize == NULL){
+		return E_UNAVAIL;
+	}
+	int region_blocks = (nblks + SUMS_PER_BLK - 1) / SUMS_PER_BLK;
+	uint32_t *sums = calloc(region_blocks, BLOCK_SIZE);
+	char *dirty = calloc(region_blocks, 1);
+	char *buf = malloc(CHUNK * BLOCK_SIZE);
+	if (sums == NULL || dirty == NULL || buf == NULL){
+		free(sums);
+		free(dirty);
+		free(buf);
+		return E_UNAVAIL;
+	}
+	pthread_mutex_lock(&cd->lock);
+	int kept = (nblks < cd->num_blocks) ? nblks : cd->num_blocks;
+	memcpy(sums, cd->sums, (size_t)kept * sizeof(uint32_t));
+	int retval = SUCCESS;
+	if (nblks > cd->num_blocks){
+		retval = cd->lower->ops->resize(cd->lower, nblks + region_blocks);
+	}
+	for (int b = kept; b < nblks && retval == SUCCESS; b += CHUNK){
+		int count = (nblks - b < CHUNK) ? nblks - b : CHUNK;
+		if ((retval = cd->lower->ops->read(cd->lower, b, count, buf)) == SUCCESS){
+			compute(b, count, buf, sums + b);
+		}
+	}
+	if (retval == SUCCESS){
+		retval = cd->lower->ops->write(cd->lower, nblks, region_blocks, sums);
+	}
+	if (retval == SUCCESS && nblks < cd->num_blocks){
+		retval = cd->lower->ops->resize(cd->lower, nblks + region_blocks);
+	}
+	if (retval == SUCCESS){
+		free(cd->sums);
+		free(cd->dirty);
+		cd->sums = sums;
+		cd->dirty = dirty;
+		cd->n_dirty = 0;
+		cd->written = 1;
+		cd->num_blocks = nblks;
+		cd->region_blocks = region_blocks;
+		sums = NULL;
+		dirty = NULL;
+	}
+	pthread_mutex_unlock(&cd->lock);
+	free(sums);
+	free(dirty);
+	free(buf);
+	return retval;
+}
+
+static void csum_close(struct blkdev *dev)
+{
+	struct csum_dev *cd = dev->private;
+	csum_barrier(dev);
+	cd->lower->ops->close(cd->lower);
+}
+
+/** Operations on this block device; there is no fd, as data moved through it could not be checked */
+static struct blkdev_ops csum_ops = {
+    .num_blocks = csum_num_blocks,
+    .read = csum_read,
+    .write = csum_write,
+    .flush = csum_flush,
+    .close = csum_close,
+    .submit = csum_submit,
+    .wait = csum_wait,
+    .barrier = csum_barrier,
+    .resize = csum_resize
+};
+
+int csum_format(struct blkdev *dev, int num_blocks)
+{
+    int region_blocks = (num_blocks + SUMS_PER_BLK - 1) / SUMS_PER_BLK;
+    uint32_t *sums = calloc(region_blocks, BLOCK_SIZE);
+    char *buf = malloc(CHUNK * BLOCK_SIZE);
+    int retval = (sums == NULL || buf == NULL) ? E_UNAVAIL : SUCCESS;
+    for (int b = 0; b < num_blocks && retval == SUCCESS; b += CHUNK){
+        int count = (num_blocks - b < CHUNK) ? num_blocks - b : CHUNK;
+        if ((retval = dev->ops->read(dev, b, count, buf)) == SUCCESS){
+            compute(b, count, buf, sums + b);
+        }
+    }
+    if (retval == SUCCESS){
+        retval = dev->ops->write(dev, num_blocks, region_blocks, sums);
+    }
+    free(sums);
+    free(buf);
+    return retval;
+}
+
+struct blkdev *csum_create(struct blkdev *lower)
+{
+    struct fs_super sb;
+    if (lower->ops->read(lower, 0, 1, &sb) != SUCCESS){
+        errno = EIO;
+        return NULL;
+    }
+    if (sb.magic != FS_MAGIC || !(sb.features & FS_FEAT_CSUM)){
+        return lower;
+    }
+    if ((uint64_t)sb.csum_blocks * SUMS_PER_BLK < sb.num_blocks
+            || (uint64_t)sb.num_blocks + sb.csum_blocks > (uint64_t)lower->ops->num_blocks(lower)){
+        errno = EINVAL;
+        return NULL;
+    }
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct csum_dev *cd = malloc(sizeof(*cd));
+    uint32_t *sums = malloc((size_t)sb.csum_blocks * BLOCK_SIZE);
+    char *dirty = calloc(sb.csum_blocks, 1);
+    if (dev == NULL || cd == NULL || sums == NULL || dirty == NULL){
+        free(dev);
+        free(cd);
+        free(sums);
+        free(dirty);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (lower->ops->read(lower, sb.num_blocks, sb.csum_blocks, sums) != SUCCESS){
+        free(dev);
+        free(cd);
+        free(sums);
+        free(dirty);
+        errno = EIO;
+        return NULL;
+    }
+    cd->lower = lower;
+    cd->num_blocks = sb.num_blocks;
+    cd->region_blocks = sb.csum_blocks;
+    pthread_mutex_init(&cd->lock, NULL);
+    cd->sums = sums;
+    cd->dirty = dirty;
+    cd->n_dirty = 0;
+    cd->written = 0;
+    cd->reading = NULL;
+    cd->n_reading = cd->reading_cap = 0;
+    cd->writing = NULL;
+    pthread_cond_init(&cd->settled, NULL);
+    dev->private = cd;
+    dev->ops = &csum_ops;
+    return dev;
+}
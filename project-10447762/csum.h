@@ -0,0 +1,35 @@
+/*
+ * file:        csum.h
+ * description: checksumming block device for FSX492 images
+ */
+
+#ifndef CSUM_H_
+#define CSUM_H_
+
+#include "blkdev.h"
+
+/*
+ * Write the checksums of an image's blocks to its checksum region,
+ * for mkfs once it has written the rest of the image. Every block is
+ * read, so blocks mkfs left alone are covered too.
+ *
+ * @param dev: the device holding the image
+ * @param num_blocks: the file system's blocks, followed by the region
+ * @return: SUCCESS, or the error reading or writing the device
+*/
+extern int csum_format(struct blkdev *dev, int num_blocks);
+
+/*
+ * Create a block device that checks each block read from an image
+ * with FS_FEAT_CSUM against its checksum, failing the read with
+ * E_CORRUPT if they differ, and updates the checksums of blocks
+ * written. Its blocks are the file system's, without the region.
+ *
+ * @param lower: the device holding the image
+ * @return: the block device, lower itself if the image has no
+ *   checksums, or NULL with errno set to EINVAL if the region does
+ *   not fit the image, or to EIO or ENOMEM
+*/
+extern struct blkdev *csum_create(struct blkdev *lower);
+
+#endif /* CSUM_H_ */
@@ -19,9 +19,21 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "fsx492.h"
+#include "fs.h"
 #include "blkdev.h"
+#include "stats.h"
+#include "arena.h"
+#include "compress.h"
+#include "hash.h"
+#include "fsx492_ioctl.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01 /* from linux/falloc.h */
+#endif
 
 /* 
  * disk access - the global variable 'disk' points to a blkdev
@@ -41,9 +53,14 @@ static int split(char *p, char *toks[], int n, char *delim)
     if (n == 0){
         n = INT_MAX;
     }
+    struct arena_mark mark = arena_mark();
     if (toks == NULL){
         // do not alter p if not returning names
-        p = strdup(p);
+        char *copy = arena_alloc(strlen(p) + 1);
+        if (copy == NULL){
+            return -1;
+        }
+        p = strcpy(copy, p);
     }
     char *str;
     char *lasts = NULL;
@@ -55,1498 +72,6542 @@ static int split(char *p, char *toks[], int n, char *delim)
         }
     }
     if (toks == NULL){
-        free(p);
+        arena_release(mark);
     }
     return i;
 }
 static struct fs_super superblock;
-static int inode_used(int inode_num){
-	char *inode_bitmap = malloc(FS_BLOCK_SIZE * superblock.inode_map_sz);
-	if (inode_bitmap == NULL){
-		return -1;
-	}
-	if (disk->ops->read(disk, 1, superblock.inode_map_sz, inode_bitmap) != SUCCESS){
-		free(inode_bitmap);
-		return -1;
-	}
-	int result = inode_bitmap[inode_num / 8] & (1 << (inode_num % 8));
-	free(inode_bitmap);
-	return result;
-}
 
-static int read_inode(int inode_num, struct fs_inode* buf){
-	char temp_block[FS_BLOCK_SIZE];
-	int block_number = 1 + superblock.inode_map_sz + superblock.block_map_sz + inode_num / INODES_PER_BLK;
-	if(disk->ops->read(disk, block_number, 1, temp_block) != SUCCESS){
-		return -1;
+/* superblock features this code supports */
+enum { FS_FEATURES = FS_FEAT_GROUPS | FS_FEAT_INLINE | FS_FEAT_BIG_INODES | FS_FEAT_LINKS | FS_FEAT_REFLINK
+	| FS_FEAT_SNAPSHOTS | FS_FEAT_COMPRESS | FS_FEAT_CSUM | FS_FEAT_DYN_INODES };
+
+struct fs_options fs_options = { .atime = FS_ATIME_RELATIME };
+
+static int inode_size = FS_INODE_V1_SIZE; /* bytes per inode in this image */
+static int inodes_per_blk = INODES_PER_BLK; /* inodes per inode table block */
+
+/*
+ * Dirty block tracking for fsync. Each block written on behalf of an
+ * inode - its data, indirect and inode table blocks, a directory's
+ * block, and the bitmap blocks their allocations change - is recorded
+ * against it, so that fsync flushes just those. Writes are on behalf
+ * of the calling thread's dirty_owner, set by the operations that
+ * change a file and cleared as each operation ends; an inode's table
+ * block is recorded against it whoever writes it.
+ *
+ * A record goes when its inode is fsynced or freed, and every record
+ * goes when the whole device is flushed. Records of files never
+ * fsynced would otherwise pile up, so past DIRTY_TOTAL_MAX blocks
+ * recorded in all they are dropped, and the next fsync flushes the
+ * whole device instead.
+ */
+enum {
+	DIRTY_BUCKETS = 256,
+	DIRTY_MAX = 65536, /* blocks recorded for an inode before it gets the whole device flushed */
+	DIRTY_TOTAL_MAX = 1 << 20, /* room for blocks in all records before they are all dropped */
+	DIRTY_GAP = 32 /* clean blocks between two dirty ones that fsync flushes rather than splitting the range */
+};
+struct dirty_inode {
+	struct dirty_inode *next; /* next in hash chain */
+	int inode_num;
+	bool overflow; /* too many blocks, or no memory, to record */
+	int count;
+	int cap;
+	uint32_t *blocks; /* in no order, maybe repeated */
+};
+static struct dirty_inode *dirty_table[DIRTY_BUCKETS];
+static bool dirty_lost; /* an inode's blocks could not be recorded at all */
+static int dirty_total; /* room for blocks in all records */
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER; /* protects the above */
+static __thread int dirty_owner; /* inode the calling thread writes for, 0 for none */
+
+/* drop every record; call with dirty_lock held */
+static void dirty_drop_all(void){
+	for (int i = 0; i < DIRTY_BUCKETS; i++){
+		while (dirty_table[i] != NULL){
+			struct dirty_inode *d = dirty_table[i];
+			dirty_table[i] = d->next;
+			free(d->blocks);
+			free(d);
+		}
 	}
-	int offset_in_block = inode_num % INODES_PER_BLK;
-	memcpy(buf, temp_block + offset_in_block * sizeof(struct fs_inode), sizeof(struct fs_inode));
-	return 0;
+	dirty_total = 0;
 }
 
-enum {MAX_PATH = 4096 };
-
-static int scan_dir_block(int block_number, char *filename){
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	if(disk->ops->read(disk, block_number, 1, entries) != SUCCESS){
-		return -1;
+/* record blocks written on behalf of an inode */
+static void dirty_add(int inode_num, uint32_t first, int count){
+	if (inode_num <= 0){
+		return;
+	}
+	pthread_mutex_lock(&dirty_lock);
+	struct dirty_inode *d = dirty_table[inode_num % DIRTY_BUCKETS];
+	while (d != NULL && d->inode_num != inode_num){
+		d = d->next;
+	}
+	if (d == NULL){
+		if ((d = calloc(1, sizeof(*d))) == NULL){
+			dirty_lost = true;
+			pthread_mutex_unlock(&dirty_lock);
+			return;
+		}
+		d->inode_num = inode_num;
+		d->next = dirty_table[inode_num % DIRTY_BUCKETS];
+		dirty_table[inode_num % DIRTY_BUCKETS] = d;
 	}
-	for (int i = 0; i < DIRENTS_PER_BLK; i++){
-		if (!entries[i].valid){
-			continue;
+	for (uint32_t block = first; block < first + count && !d->overflow; block++){
+		if (d->count > 0 && d->blocks[d->count - 1] == block){
+			continue; /* the inode block, written again by the same operation */
 		}
-		if (!strcmp(entries[i].name, filename)){
-			return entries[i].inode;
+		if (d->count == d->cap){
+			int cap = d->cap ? 2 * d->cap : 16;
+			if (dirty_total + cap - d->cap > DIRTY_TOTAL_MAX){
+				dirty_drop_all();
+				dirty_lost = true;
+				break;
+			}
+			uint32_t *blocks = NULL;
+			if (d->cap < DIRTY_MAX){
+				blocks = realloc(d->blocks, cap * sizeof(uint32_t));
+			}
+			if (blocks == NULL){
+				/* the whole device gets flushed, so the blocks need not be kept */
+				d->overflow = true;
+				free(d->blocks);
+				d->blocks = NULL;
+				dirty_total -= d->cap;
+				d->count = d->cap = 0;
+				break;
+			}
+			d->blocks = blocks;
+			dirty_total += cap - d->cap;
+			d->cap = cap;
 		}
+		d->blocks[d->count++] = block;
 	}
-	return 0;
+	pthread_mutex_unlock(&dirty_lock);
 }
 
-static int inode_from_full_path(const char *path){
-	if(path[0] != '/'){
-		fprintf(stderr, "cannot get inode from relative path\n");
-		return -ENOENT;
-	}
-	char temp_path[MAX_PATH];
-	strcpy(temp_path, path);
-	int number_of_path_components = split(temp_path, NULL, 0, "/");
-	if (number_of_path_components == 0){
-		return superblock.root_inode;
+/* remove and return an inode's record, NULL if none */
+static struct dirty_inode *dirty_take(int inode_num){
+	pthread_mutex_lock(&dirty_lock);
+	struct dirty_inode **link = &dirty_table[inode_num % DIRTY_BUCKETS];
+	while (*link != NULL && (*link)->inode_num != inode_num){
+		link = &(*link)->next;
+	}
+	struct dirty_inode *d = *link;
+	if (d != NULL){
+		*link = d->next;
+		dirty_total -= d->cap;
+	}
+	pthread_mutex_unlock(&dirty_lock);
+	return d;
+}
+
+static void dirty_free(struct dirty_inode *d){
+	if (d != NULL){
+		free(d->blocks);
+		free(d);
 	}
-	char** path_components = malloc(number_of_path_components * sizeof(char*));
-	split(temp_path, path_components, number_of_path_components, "/");
-	int inode = superblock.root_inode;
-	struct fs_inode current_inode;
-	for (int i = 0; i < number_of_path_components; i++){
-		int inode_used_result = inode_used(inode);
-		if (inode_used_result == -1){
-			fprintf(stderr, "error reading from disk on line %d\n", __LINE__);
-			free(path_components);
-			return -1;
-		}
-		if (inode_used_result == 0 || inode == 0){
-			fprintf(stderr, "could not get inode from full path: inode %u not used (or 0)\nwhen trying to find the inode of file '%s'\n", inode, path);
-			free(path_components);
-			return -ENOENT;
-		}
-		if (read_inode(inode, &current_inode) != 0){
-			free(path_components);
-			return -1;
-		}
-		if (!S_ISDIR(current_inode.mode)){
-			free(path_components);
-			return -ENOTDIR;
-		}
-		int scan_result = scan_dir_block(current_inode.direct[0], path_components[i]);
-		if (scan_result == -1){
-			free(path_components);
-			return -1;
-		}
-		if (scan_result > 0){
-			inode = scan_result;
-		} else {
-			free(path_components);
-			return -ENOENT;
+}
+
+/*
+ * Flush the whole device, which makes every record needless. They are
+ * dropped before the flush starts, so blocks written meanwhile are
+ * recorded afresh; if the flush fails, the next fsync flushes the whole
+ * device again.
+ *
+ * @return: SUCCESS or the device's error
+ */
+static int flush_all(void){
+	pthread_mutex_lock(&dirty_lock);
+	dirty_drop_all();
+	dirty_lost = false;
+	pthread_mutex_unlock(&dirty_lock);
+	int retval = disk->ops->flush(disk, 0, 0);
+	if (retval != SUCCESS){
+		pthread_mutex_lock(&dirty_lock);
+		dirty_lost = true;
+		pthread_mutex_unlock(&dirty_lock);
+	}
+	return retval;
+}
+
+/*
+ * Snapshots (see struct fs_super). A block that held a snapshot's
+ * contents when it was taken is copied before it is first written,
+ * and the snapshot's map records the copy. Taking a snapshot copies
+ * just the superblock, bitmaps and inode tables, dynamic ones too;
+ * file data and directories are copied as they change. Snapshot state
+ * changes only under the exclusive lock, as the only blocks written
+ * under the shared lock, inode table blocks getting new access times,
+ * are never held by a snapshot.
+ */
+struct snapshot {
+	int map_num; /* inode holding the map, 0 if the slot is empty */
+	uint32_t *map; /* the map, by block number */
+	char *map_dirty; /* per block of the map, set if changed since written */
+	char *used; /* block bitmap when the snapshot was taken */
+};
+static struct snapshot snapshots[FS_MAX_SNAPSHOTS]; /* by slot, as in the superblock */
+static int n_snapshots;
+static char *snap_held; /* blocks some snapshot still reads in place, NULL without snapshots */
+
+static int snap_preserve(uint32_t first, int count);
+static int snapshots_load(void);
+
+static bool is_snapshot_map(int inode_num){
+	for (int i = 0; i < FS_MAX_SNAPSHOTS; i++){
+		if (inode_num != 0 && snapshots[i].map_num == inode_num){
+			return true;
 		}
+	}
+	return false;
+}
 
+/* write blocks to the disk, recording them against the thread's dirty_owner */
+static int write_blocks(uint32_t first, int count, void *buf){
+	if (snap_preserve(first, count) != 0){
+		return E_UNAVAIL;
 	}
-	free(path_components);
-	return inode;
+	dirty_add(dirty_owner, first, count);
+	return disk->ops->write(disk, first, count, buf);
 }
 
-int split_path(const char* path, char *temp_path, char *new_file_name){
-	strcpy(temp_path, path);
-	int len = strlen(temp_path);
-	if (temp_path[len-1] == '/'){
-		temp_path[len-1] = '\0';
-		len--;
+/*
+ * Block groups. An image without FS_FEAT_GROUPS is handled as a single
+ * group holding the global bitmaps and inode region.
+ *
+ * The bitmaps of all groups are kept in memory, concatenated so that
+ * bit n stands for block (or inode) n. Each group's slice is written
+ * back to the group's own bitmap blocks when it changes, under the
+ * group's lock, so allocations in different groups do not contend.
+ */
+struct block_group {
+	uint32_t start; /* first block of the group */
+	uint32_t blocks; /* number of blocks in the group */
+	uint32_t block_map; /* first block of the group's block bitmap */
+	uint32_t inode_map; /* first block of the group's inode bitmap */
+	uint32_t inode_table; /* first block of the group's inode table */
+	uint32_t data; /* first data block of the group */
+	uint32_t first_inode; /* first inode number of the group */
+	uint32_t inodes; /* number of inodes in the group */
+	uint32_t free_blocks; /* free data blocks */
+	uint32_t free_inodes; /* free inodes */
+	pthread_mutex_t lock; /* protects the group's bitmap slices and counts */
+};
+static struct block_group *groups;
+static int n_groups;
+static uint32_t n_inodes; /* one past the last inode number, of the groups or dynamic */
+static char *block_bitmap_mem; /* block bitmaps of all groups */
+static char *inode_bitmap_mem; /* inode bitmaps of all groups, then the dynamic inodes' bits */
+static size_t block_bitmap_bytes; /* size of a whole block bitmap */
+static size_t inode_bitmap_bytes; /* size of a whole inode bitmap */
+
+/*
+ * Dynamic inodes (see struct fs_super). The whole inode map is kept
+ * in memory, with the dynamic inodes' bits following the groups' in
+ * inode_bitmap_mem; the block of the map file holding an entry is
+ * written when the entry changes.
+ */
+static struct fs_imap_entry *imap; /* by table block, NULL without FS_FEAT_DYN_INODES */
+static uint32_t imap_count; /* dynamic inode table blocks */
+static uint32_t imap_free; /* dynamic inodes not in use */
+static pthread_mutex_t imap_lock = PTHREAD_MUTEX_INITIALIZER; /* protects the dynamic inodes' bits and imap_free */
+
+static int dyn_inode_allocate(int goal, uint32_t hint);
+static int dyn_inode_free(int inode_num);
+
+static bool is_dyn_inode(int inode_num){
+	return (superblock.features & FS_FEAT_DYN_INODES) && (uint32_t)inode_num >= superblock.dyn_inode_base;
+}
+
+static int group_of_block(uint32_t block_num){
+	return (n_groups == 1) ? 0 : block_num / superblock.group_blocks;
+}
+
+/* group of an inode, for a dynamic inode the group of its table block */
+static int group_of_inode(int inode_num){
+	if (is_dyn_inode(inode_num)){
+		return group_of_block(imap[(inode_num - superblock.dyn_inode_base) / inodes_per_blk].block);
 	}
-	int i;
-	for (i = len-1; i >= 0; i--){
-		if (temp_path[i] == '/'){
-			i++;
-			break;
-		}
+	return (n_groups == 1) ? 0 : inode_num / superblock.group_inodes;
+}
+
+/* block of the inode table that holds an inode */
+static int inode_block(int inode_num){
+	if (is_dyn_inode(inode_num)){
+		return imap[(inode_num - superblock.dyn_inode_base) / inodes_per_blk].block;
 	}
-	if (len - i > FS_FILENAME_SIZE){
-		return -ENAMETOOLONG;
+	struct block_group *g = &groups[group_of_inode(inode_num)];
+	return g->inode_table + (inode_num - g->first_inode) / inodes_per_blk;
+}
+
+static bool is_data_block(uint32_t block_num){
+	return block_num < superblock.num_blocks && block_num >= groups[group_of_block(block_num)].data;
+}
+
+static int count_clear(const char *bitmap, uint32_t first, uint32_t count){
+	int n = 0;
+	for (uint32_t i = first; i < first + count; i++){
+		n += !(bitmap[i / 8] & (1 << (i % 8)));
 	}
-	strcpy(new_file_name, temp_path + i);
-	temp_path[i] = '\0';
-	return 0;
+	return n;
 }
 
-static int logical_to_physical(struct fs_inode *inode, int logical){
-	if (logical < N_DIRECT){
-		return inode->direct[logical];
-	} else if (logical - N_DIRECT < PTRS_PER_BLK){
-		if (inode->indir_1 == 0){
-			return 0;
-		}
-		uint32_t indir_1_block[PTRS_PER_BLK];
-		if (disk->ops->read(disk, inode->indir_1, 1, indir_1_block) != SUCCESS){
-			return -EIO;
+/*
+ * Read or write the slice of an in-memory bitmap covering count bits
+ * from bit first, which is stored in map_blocks blocks at map. Bits
+ * past count in the last stored block are written as zero.
+ */
+static int slice_io(bool write, char *bitmap, uint32_t first, uint32_t count, uint32_t map, uint32_t map_blocks){
+	char *buf = calloc(map_blocks, FS_BLOCK_SIZE);
+	int retval = 0;
+	if (buf == NULL){
+		return -ENOMEM;
+	}
+	if (write){
+		memcpy(buf, bitmap + first / 8, (count + 7) / 8);
+		if (write_blocks(map, map_blocks, buf) != SUCCESS){
+			retval = -EIO;
 		}
-		return indir_1_block[logical - N_DIRECT];
+	} else if (disk->ops->read(disk, map, map_blocks, buf) != SUCCESS){
+		retval = -EIO;
 	} else {
-		if (inode->indir_2 == 0){
-			return 0;
-		}
-		uint32_t indir_2_block[PTRS_PER_BLK];
-		if (disk->ops->read(disk, inode->indir_2, 1, indir_2_block) != SUCCESS){
-			return -EIO;
-		}
-		if (indir_2_block[(logical - N_DIRECT - PTRS_PER_BLK) / PTRS_PER_BLK] == 0){
-			return 0;
+		memcpy(bitmap + first / 8, buf, (count + 7) / 8);
+	}
+	free(buf);
+	return retval;
+}
+
+static int write_block_slice(struct block_group *g){
+	g->free_blocks = count_clear(block_bitmap_mem, g->data, g->start + g->blocks - g->data);
+	return slice_io(true, block_bitmap_mem, g->start, g->blocks, g->block_map, superblock.block_map_sz);
+}
+
+static int write_inode_slice(struct block_group *g){
+	g->free_inodes = count_clear(inode_bitmap_mem, g->first_inode, g->inodes);
+	return slice_io(true, inode_bitmap_mem, g->first_inode, g->inodes, g->inode_map, superblock.inode_map_sz);
+}
+
+/*
+ * Free inode summary, for finding a free inode without scanning the
+ * inode bitmap. Level 0 has a bit for each 64-bit word of the bitmap,
+ * set if the word has a clear bit, and each level above has a bit for
+ * each word of the level below, set if that word is not zero; the top
+ * level is one word. A search from any inode then looks at a word or
+ * two on each level. The summary is built from the bitmap at mount
+ * and follows its changes in memory; it is never written.
+ */
+enum { SUMMARY_MAX_LEVELS = 5 };
+static uint64_t *summary[SUMMARY_MAX_LEVELS]; /* by level */
+static int summary_levels;
+static uint64_t summary_cap; /* inodes the levels have room for, a power of 64 */
+static pthread_mutex_t summary_lock = PTHREAD_MUTEX_INITIALIZER; /* protects the summary */
+
+/* word w of the inode bitmap, with the bits of inodes past n_inodes set */
+static uint64_t inode_word(uint32_t w){
+	uint64_t word = 0;
+	for (int k = 7; k >= 0; k--){
+		size_t byte = (size_t)w * 8 + k;
+		word = (word << 8) | ((byte < inode_bitmap_bytes) ? (uint8_t)inode_bitmap_mem[byte] : 0xff);
+	}
+	uint64_t first = (uint64_t)w * 64;
+	if (first + 64 > n_inodes){
+		word |= (first >= n_inodes) ? UINT64_MAX : UINT64_MAX << (n_inodes - first);
+	}
+	return word;
+}
+
+/* set the summary from the inode bitmap */
+static void summary_fill(void){
+	pthread_mutex_lock(&summary_lock);
+	for (int l = 0, words = summary_cap / (64 * 64); l < summary_levels; l++, words /= 64){
+		memset(summary[l], 0, words * sizeof(uint64_t));
+	}
+	for (uint32_t w = 0; (uint64_t)w * 64 < n_inodes; w++){
+		if (inode_word(w) != UINT64_MAX){
+			summary[0][w / 64] |= 1ULL << (w % 64);
 		}
-		uint32_t second_indir[PTRS_PER_BLK];
-		if (disk->ops->read(disk, indir_2_block[(logical - N_DIRECT - PTRS_PER_BLK) / PTRS_PER_BLK], 1, second_indir) != SUCCESS){
-			return -EIO;
+	}
+	for (int l = 1, words = summary_cap / (64 * 64 * 64); l < summary_levels; l++, words /= 64){
+		for (int j = 0; j < words * 64; j++){
+			if (summary[l - 1][j] != 0){
+				summary[l][j / 64] |= 1ULL << (j % 64);
+			}
 		}
-		return second_indir[(logical - N_DIRECT - PTRS_PER_BLK) % PTRS_PER_BLK];
 	}
+	pthread_mutex_unlock(&summary_lock);
 }
 
-int read_block_of_file(uint32_t logical_block_number, struct fs_inode *inode, void *buf){
-	int physical_block_number = logical_to_physical(inode, logical_block_number);
-	if (physical_block_number < 0){
-		return physical_block_number;
+/*
+ * Make room in the summary for inodes inodes, filling it in again if
+ * it is reallocated.
+ *
+ * @return: 0 if successful, or -ENOMEM with the summary unchanged
+ */
+static int summary_reserve(uint64_t inodes){
+	if (summary_levels > 0 && inodes <= summary_cap){
+		return 0;
 	}
-	if (physical_block_number == 0){
-		return -1;
+	uint64_t cap = 64 * 64;
+	int levels = 1;
+	while (cap < inodes){
+		cap *= 64;
+		levels++;
+	}
+	uint64_t *levels_new[SUMMARY_MAX_LEVELS] = { NULL };
+	for (int l = 0, words = cap / (64 * 64); l < levels; l++, words /= 64){
+		if ((levels_new[l] = malloc(words * sizeof(uint64_t))) == NULL){
+			for (int k = 0; k < l; k++){
+				free(levels_new[k]);
+			}
+			return -ENOMEM;
+		}
 	}
-	if (disk->ops->read(disk, physical_block_number, 1, buf) != SUCCESS){
-		return -EIO;
+	pthread_mutex_lock(&summary_lock);
+	for (int l = 0; l < SUMMARY_MAX_LEVELS; l++){
+		free(summary[l]);
+		summary[l] = levels_new[l];
 	}
+	summary_levels = levels;
+	summary_cap = cap;
+	pthread_mutex_unlock(&summary_lock);
+	summary_fill();
 	return 0;
 }
 
-int write_block_to_file(uint32_t block_number, struct fs_inode *inode, void *buf){
-	int physical_block_number = logical_to_physical(inode, block_number);
-	if (physical_block_number < 0){
-		return physical_block_number;
-	}
-	if (physical_block_number == 0){
-		return -1;
-	}
-	if (disk->ops->write(disk, physical_block_number, 1, buf) != SUCCESS){
-		return -EIO;
+/* bring the summary up to date for inode_num's word of the bitmap; call with summary_lock held */
+static void summary_update(uint32_t inode_num){
+	uint32_t j = inode_num / 64;
+	bool has_free = inode_word(j) != UINT64_MAX;
+	for (int l = 0; l < summary_levels; l++){
+		uint64_t *w = &summary[l][j / 64];
+		bool was_empty = (*w == 0);
+		*w = has_free ? (*w | (1ULL << (j % 64))) : (*w & ~(1ULL << (j % 64)));
+		if ((*w == 0) == was_empty){
+			break;
+		}
+		has_free = (*w != 0);
+		j /= 64;
 	}
-	return 0;
 }
 
-static int allocate_zeroed_block(){
-	char *block_bitmap = malloc(FS_BLOCK_SIZE * superblock.block_map_sz);
-	if (block_bitmap == NULL){
-		return -EIO;
+/* the first free inode from inode_num on, or -1 if none; call with summary_lock held */
+static int summary_find(uint32_t inode_num){
+	if (inode_num >= n_inodes){
+		return -1;
 	}
-	if (disk->ops->read(disk, 1 + superblock.inode_map_sz, superblock.block_map_sz, block_bitmap) != SUCCESS){
-		free(block_bitmap);
-		return -EIO;
+	uint32_t j = inode_num / 64;
+	uint64_t free_bits = ~inode_word(j) & (UINT64_MAX << (inode_num % 64));
+	if (free_bits != 0){
+		return j * 64 + __builtin_ctzll(free_bits);
 	}
-	int new_block_num = -1;
-	for (int i = 0; i < superblock.num_blocks; i++){
-		if (!(block_bitmap[i/8] & (1 << (i % 8)))){
-			new_block_num = i;
+	/* climb to the first level with a set bit past the one for j, then follow the lowest set bits down */
+	int l = 0;
+	for (j++; ; j = j / 64 + 1, l++){
+		if (l == summary_levels || (uint64_t)j >= summary_cap >> (6 * (l + 1))){
+			return -1;
+		}
+		uint64_t bits = summary[l][j / 64] & (UINT64_MAX << (j % 64));
+		if (bits != 0){
+			j = j / 64 * 64 + __builtin_ctzll(bits);
 			break;
 		}
 	}
-	if (new_block_num == -1){
-		free(block_bitmap);
-		return -ENOSPC;
+	while (l > 0){
+		l--;
+		j = j * 64 + __builtin_ctzll(summary[l][j]);
 	}
-	char zeros[FS_BLOCK_SIZE];
-	memset(zeros, 0, FS_BLOCK_SIZE);
-	if (disk->ops->write(disk, new_block_num, 1, zeros) != SUCCESS){
-		free(block_bitmap);
-		return -EIO;
+	free_bits = ~inode_word(j);
+	return (free_bits != 0) ? (int)(j * 64 + __builtin_ctzll(free_bits)) : -1;
+}
+
+/* set n_groups and n_inodes from the superblock and imap_count */
+static void count_groups(void){
+	bool grouped = superblock.features & FS_FEAT_GROUPS;
+	n_groups = grouped ? (superblock.num_blocks + superblock.group_blocks - 1) / superblock.group_blocks : 1;
+	n_inodes = grouped ? n_groups * superblock.group_inodes : superblock.inode_region_sz * inodes_per_blk;
+	if (superblock.features & FS_FEAT_DYN_INODES){
+		n_inodes = superblock.dyn_inode_base + imap_count * inodes_per_blk;
 	}
-	block_bitmap[new_block_num / 8] |= 1 << (new_block_num % 8);
-	if (disk->ops->write(disk, 1 + superblock.inode_map_sz, superblock.block_map_sz, block_bitmap) != SUCCESS){
-		free(block_bitmap);
-		return -EIO;
+}
+
+/* lay out group i as the superblock describes it */
+static void group_layout(struct block_group *g, int i){
+	bool grouped = superblock.features & FS_FEAT_GROUPS;
+	g->start = grouped ? i * superblock.group_blocks : 0;
+	g->blocks = grouped ? superblock.group_blocks : superblock.num_blocks;
+	if (g->start + g->blocks > superblock.num_blocks){
+		g->blocks = superblock.num_blocks - g->start;
+	}
+	g->inode_map = (i == 0) ? 1 : g->start;
+	g->block_map = g->inode_map + superblock.inode_map_sz;
+	g->inode_table = g->block_map + superblock.block_map_sz;
+	g->data = g->inode_table + superblock.inode_region_sz;
+	g->first_inode = grouped ? i * superblock.group_inodes : 0;
+	g->inodes = grouped ? superblock.group_inodes : superblock.inode_region_sz * inodes_per_blk;
+	if ((superblock.features & FS_FEAT_DYN_INODES) && g->first_inode + g->inodes > superblock.dyn_inode_base){
+		g->inodes = (g->first_inode < superblock.dyn_inode_base) ? superblock.dyn_inode_base - g->first_inode : 0;
 	}
-	free(block_bitmap);
-	return new_block_num;
 }
 
-static int put_block_in_file(struct fs_inode *inode, int logical_block, void *buf){
-	if (logical_block < N_DIRECT){
-		if (inode->direct[logical_block] == 0){
-			int temp = allocate_zeroed_block();
-			if (temp < 0){
-				return temp;
-			}
-			inode->direct[logical_block] = temp;
+/*
+ * Set up the groups described by the superblock and load their bitmaps.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int groups_init(void){
+	bool grouped = superblock.features & FS_FEAT_GROUPS;
+	if (grouped && (superblock.group_blocks == 0 || superblock.group_blocks % 8 != 0
+			|| superblock.group_inodes == 0 || superblock.group_inodes % inodes_per_blk != 0)){
+		return -EINVAL;
+	}
+	count_groups();
+	groups = calloc(n_groups, sizeof(struct block_group));
+	block_bitmap_bytes = (superblock.num_blocks + 7) / 8;
+	inode_bitmap_bytes = (n_inodes + 7) / 8;
+	block_bitmap_mem = calloc(block_bitmap_bytes, 1);
+	inode_bitmap_mem = calloc(inode_bitmap_bytes, 1);
+	if (groups == NULL || block_bitmap_mem == NULL || inode_bitmap_mem == NULL){
+		return -ENOMEM;
+	}
+	for (int i = 0; i < n_groups; i++){
+		struct block_group *g = &groups[i];
+		group_layout(g, i);
+		pthread_mutex_init(&g->lock, NULL);
+		if (g->data > g->start + g->blocks){
+			return -EINVAL;
 		}
-		if (disk->ops->write(disk, inode->direct[logical_block], 1, buf) != SUCCESS){
+		if (slice_io(false, block_bitmap_mem, g->start, g->blocks, g->block_map, superblock.block_map_sz) != 0
+				|| slice_io(false, inode_bitmap_mem, g->first_inode, g->inodes, g->inode_map, superblock.inode_map_sz) != 0){
 			return -EIO;
 		}
-	} else if (logical_block - N_DIRECT < PTRS_PER_BLK){
-		if (inode->indir_1 == 0){
-			int temp = allocate_zeroed_block();
-			if (temp < 0){
-				return temp;
+		g->free_blocks = count_clear(block_bitmap_mem, g->data, g->start + g->blocks - g->data);
+		g->free_inodes = count_clear(inode_bitmap_mem, g->first_inode, g->inodes);
+	}
+	return summary_reserve(n_inodes);
+}
+
+/*
+ * Copy the block bitmap of the whole file system into a buffer of
+ * block_bitmap_bytes bytes.
+ */
+static int read_block_bitmap(char *bitmap){
+	for (int i = 0; i < n_groups; i++){
+		pthread_mutex_lock(&groups[i].lock);
+		memcpy(bitmap + groups[i].start / 8, block_bitmap_mem + groups[i].start / 8, (groups[i].blocks + 7) / 8);
+		pthread_mutex_unlock(&groups[i].lock);
+	}
+	return 0;
+}
+
+/*
+ * Replace the block bitmap of the whole file system, writing the
+ * slices of groups that changed.
+ *
+ * @return: 0 if successful, or -EIO
+ */
+static int write_block_bitmap(const char *bitmap){
+	int retval = 0;
+	for (int i = 0; i < n_groups; i++){
+		struct block_group *g = &groups[i];
+		size_t offset = g->start / 8, len = (g->blocks + 7) / 8;
+		pthread_mutex_lock(&g->lock);
+		if (memcmp(block_bitmap_mem + offset, bitmap + offset, len) != 0){
+			memcpy(block_bitmap_mem + offset, bitmap + offset, len);
+			if (write_block_slice(g) != 0){
+				retval = -EIO;
 			}
-			inode->indir_1 = temp;
-		}
-		uint32_t indir_1_block[PTRS_PER_BLK];
-		if (disk->ops->read(disk, inode->indir_1, 1, indir_1_block) != SUCCESS){
-			return -EIO;
 		}
-		if (indir_1_block[logical_block - N_DIRECT] == 0){
-			int temp = allocate_zeroed_block();
-			if (temp < 0){
-				return temp;
+		pthread_mutex_unlock(&g->lock);
+	}
+	return retval;
+}
+
+/* inode bitmap counterpart of read_block_bitmap, with the dynamic inodes' bits */
+static int read_inode_bitmap(char *bitmap){
+	for (int i = 0; i < n_groups; i++){
+		pthread_mutex_lock(&groups[i].lock);
+		memcpy(bitmap + groups[i].first_inode / 8, inode_bitmap_mem + groups[i].first_inode / 8, (groups[i].inodes + 7) / 8);
+		pthread_mutex_unlock(&groups[i].lock);
+	}
+	if (imap != NULL){
+		pthread_mutex_lock(&imap_lock);
+		size_t first = superblock.dyn_inode_base / 8;
+		memcpy(bitmap + first, inode_bitmap_mem + first, inode_bitmap_bytes - first);
+		pthread_mutex_unlock(&imap_lock);
+	}
+	return 0;
+}
+
+/* the 64 bits of a bitmap from bit i, a multiple of 64, bit 0 of the first byte lowest */
+static uint64_t bitmap_word(const char *bitmap, uint32_t i){
+	uint64_t word = 0;
+	for (int k = 7; k >= 0; k--){
+		word = (word << 8) | (uint8_t)bitmap[i / 8 + k];
+	}
+	return word;
+}
+
+/*
+ * Set and return the first clear bit of count bits from first that is
+ * also clear in avoid, if not NULL, or -1 if none. Whole words of set
+ * bits are skipped 64 bits at a time.
+ */
+static int take_bit(char *bitmap, const char *avoid, uint32_t first, uint32_t count){
+	uint32_t end = first + count;
+	for (uint32_t i = first; i < end; ){
+		if (i % 64 == 0 && end - i >= 64){
+			uint64_t word = bitmap_word(bitmap, i) | ((avoid != NULL) ? bitmap_word(avoid, i) : 0);
+			if (word == UINT64_MAX){
+				i += 64;
+				continue;
 			}
-			indir_1_block[logical_block - N_DIRECT] = temp;
-		}
-		if (disk->ops->write(disk, indir_1_block[logical_block - N_DIRECT], 1, buf) != SUCCESS){
-			return -EIO;
+			i += __builtin_ctzll(~word);
+		} else if ((bitmap[i / 8] | ((avoid != NULL) ? avoid[i / 8] : 0)) & (1 << (i % 8))){
+			i++;
+			continue;
 		}
-		if (disk->ops->write(disk, inode->indir_1, 1, indir_1_block) != SUCCESS){
-			return -EIO;
+		bitmap[i / 8] |= 1 << (i % 8);
+		return i;
+	}
+	return -1;
+}
+
+/*
+ * Allocate the lowest free data block of the goal group, or of the
+ * following groups if it is full. Blocks a snapshot still reads in
+ * place are taken only when no other block is free, as writing them
+ * means copying them first.
+ *
+ * @return: the block number, or -error number
+ */
+static int allocate_block(int goal){
+	for (int pass = (snap_held != NULL) ? 0 : 1; pass < 2; pass++){
+		for (int i = 0; i < n_groups; i++){
+			struct block_group *g = &groups[(goal + i) % n_groups];
+			pthread_mutex_lock(&g->lock);
+			int block_num = (g->free_blocks == 0) ? -1
+				: take_bit(block_bitmap_mem, (pass == 0) ? snap_held : NULL, g->data, g->start + g->blocks - g->data);
+			int retval = (block_num < 0) ? 0 : write_block_slice(g);
+			pthread_mutex_unlock(&g->lock);
+			if (retval != 0){
+				return retval;
+			}
+			if (block_num >= 0){
+				return block_num;
+			}
 		}
-	} else {
+	}
+	return -ENOSPC;
+}
+
+/*
+ * Set and return the bit of the first free inode of count from first,
+ * searching from hint on and then from first, or -1 if none is free.
+ */
+static int take_inode(uint32_t first, uint32_t count, uint32_t hint){
+	pthread_mutex_lock(&summary_lock);
+	int inode_num = (hint > first && hint < first + count) ? summary_find(hint) : -1;
+	if (inode_num < 0 || (uint32_t)inode_num >= first + count){
+		inode_num = summary_find(first);
+	}
+	if (inode_num >= 0 && (uint32_t)inode_num < first + count){
+		inode_bitmap_mem[inode_num / 8] |= 1 << (inode_num % 8);
+		summary_update(inode_num);
+	} else {
+		inode_num = -1;
+	}
+	pthread_mutex_unlock(&summary_lock);
+	return inode_num;
+}
+
+/* clear an inode's bit */
+static void release_inode(int inode_num){
+	pthread_mutex_lock(&summary_lock);
+	inode_bitmap_mem[inode_num / 8] &= ~(1 << (inode_num % 8));
+	summary_update(inode_num);
+	pthread_mutex_unlock(&summary_lock);
+}
+
+/* write the block of a group's inode bitmap that holds an inode's bit */
+static int write_inode_bit(struct block_group *g, int inode_num){
+	uint32_t k = (inode_num - g->first_inode) / BITS_PER_BLK;
+	uint32_t count = g->inodes - k * BITS_PER_BLK;
+	return slice_io(true, inode_bitmap_mem, g->first_inode + k * BITS_PER_BLK, (count < BITS_PER_BLK) ? count : BITS_PER_BLK,
+			g->inode_map + k, 1);
+}
+
+/*
+ * Locality hints: for recently used directories, the inode after the
+ * last one given to a file made in it, where the search for the next
+ * one starts, so the files of a directory get inodes next to each
+ * other and share inode table blocks. Direct-mapped by directory
+ * inode number; they change only under the exclusive lock.
+ */
+enum { HINT_SLOTS = 256 };
+static struct inode_hint {
+	int dir; /* 0 if unused */
+	uint32_t next; /* where to search from */
+} inode_hints[HINT_SLOTS];
+
+static uint32_t inode_hint(int dir){
+	struct inode_hint *h = &inode_hints[dir % HINT_SLOTS];
+	return (h->dir == dir) ? h->next : 0;
+}
+
+static void inode_hint_set(int dir, uint32_t next){
+	inode_hints[dir % HINT_SLOTS] = (struct inode_hint){ .dir = dir, .next = next };
+}
+
+/*
+ * Allocate an inode. Files go in their parent directory's group so
+ * their inodes and blocks are near the directory's. Directories go
+ * in the group with the most free blocks among those with at least
+ * the average number of free inodes, to spread subtrees out. Once
+ * no group has a free inode, a dynamic inode is taken instead, in a
+ * table block near the chosen group. A file's inode is searched for
+ * from the parent's locality hint, and the free inode summary finds
+ * it without scanning the bitmap.
+ *
+ * @param parent: inode number of the parent directory
+ * @param is_dir: whether the new inode is a directory
+ * @return: the inode number, or -error number
+ */
+static int allocate_inode(int parent, bool is_dir){
+	int goal = group_of_inode(parent);
+	if (is_dir && n_groups > 1){
+		uint64_t total_free = 0;
+		for (int i = 0; i < n_groups; i++){
+			total_free += groups[i].free_inodes;
+		}
+		for (int i = 0, best_free = -1; i < n_groups; i++){
+			int g = (goal + 1 + i) % n_groups;
+			if ((uint64_t)groups[g].free_inodes * n_groups >= total_free && groups[g].free_inodes > 0
+					&& (int)groups[g].free_blocks > best_free){
+				best_free = groups[g].free_blocks;
+				goal = g;
+			}
+		}
+	}
+	uint32_t hint = is_dir ? 0 : inode_hint(parent);
+	int inode_num = -1;
+	for (int i = 0; i < n_groups && inode_num < 0; i++){
+		struct block_group *g = &groups[(goal + i) % n_groups];
+		pthread_mutex_lock(&g->lock);
+		inode_num = (g->free_inodes == 0) ? -1 : take_inode(g->first_inode, g->inodes, hint);
+		int retval = 0;
+		if (inode_num >= 0){
+			g->free_inodes--;
+			retval = write_inode_bit(g, inode_num);
+		}
+		pthread_mutex_unlock(&g->lock);
+		if (retval != 0){
+			return retval;
+		}
+	}
+	if (inode_num < 0){
+		inode_num = dyn_inode_allocate(goal, hint);
+	}
+	if (inode_num >= 0 && !is_dir){
+		inode_hint_set(parent, inode_num + 1);
+	}
+	return inode_num;
+}
+
+/* free an inode allocated by allocate_inode */
+static int free_inode(int inode_num){
+	if (is_dyn_inode(inode_num)){
+		return dyn_inode_free(inode_num);
+	}
+	struct block_group *g = &groups[group_of_inode(inode_num)];
+	pthread_mutex_lock(&g->lock);
+	release_inode(inode_num);
+	g->free_inodes++;
+	int retval = write_inode_bit(g, inode_num);
+	pthread_mutex_unlock(&g->lock);
+	return retval;
+}
+
+static int inode_used(int inode_num){
+	if (inode_num < 0 || inode_num >= n_inodes){
+		return 0;
+	}
+	return inode_bitmap_mem[inode_num / 8] & (1 << (inode_num % 8));
+}
+
+/*
+ * Inode cache - holds recently read or written inodes with their
+ * extensions, so getattr and path lookups after a readdir or another
+ * access to the same file do not re-read the inode table. It is
+ * direct-mapped by inode number and written through: every inode
+ * write goes to disk and to the cache. Readers under the shared lock
+ * only insert what they read if no inode was written meanwhile, which
+ * with the shared lock held can only be an access time update.
+ * With fs_options.attr_timeout set, entries are also dropped when
+ * older than that, for images that may change behind our back.
+ */
+enum { ICACHE_SIZE = 1024 };
+struct icache_entry {
+	int inode_num; /* 0 if entry unused */
+	uint64_t loaded; /* stats_now() when cached */
+	struct fs_inode inode;
+	struct fs_inode_ext ext;
+};
+static struct icache_entry icache[ICACHE_SIZE];
+
+/* whether a cache entry made at stats_now() time 'loaded' is too old to use */
+static bool cache_expired(uint64_t loaded){
+	return fs_options.attr_timeout > 0 && stats_now() - loaded > fs_options.attr_timeout * 1e9;
+}
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned icache_gen; /* incremented by every inode write */
+
+static bool icache_lookup(int inode_num, struct fs_inode *inode, struct fs_inode_ext *ext){
+	bool found = false;
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e = &icache[inode_num % ICACHE_SIZE];
+	if (e->inode_num == inode_num && !cache_expired(e->loaded)){
+		*inode = e->inode;
+		*ext = e->ext;
+		found = true;
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return found;
+}
+
+static unsigned icache_generation(void){
+	pthread_mutex_lock(&icache_lock);
+	unsigned gen = icache_gen;
+	pthread_mutex_unlock(&icache_lock);
+	return gen;
+}
+
+/* cache an inode read from disk, unless an inode was written since generation gen */
+static void icache_insert(int inode_num, const struct fs_inode *inode, const struct fs_inode_ext *ext, unsigned gen){
+	pthread_mutex_lock(&icache_lock);
+	if (gen == icache_gen){
+		struct icache_entry *e = &icache[inode_num % ICACHE_SIZE];
+		e->inode_num = inode_num;
+		e->loaded = stats_now();
+		e->inode = *inode;
+		e->ext = *ext;
+	}
+	pthread_mutex_unlock(&icache_lock);
+}
+
+/* record an inode write; a NULL ext keeps the cached extension */
+static void icache_update(int inode_num, const struct fs_inode *inode, const struct fs_inode_ext *ext){
+	struct fs_inode_ext v1_ext;
+	if (inode_size < FS_INODE_V2_SIZE){
+		/* cache what decode_inode would read back */
+		memset(&v1_ext, 0, sizeof(v1_ext));
+		v1_ext.atime = inode->mtime;
+		ext = &v1_ext;
+	}
+	pthread_mutex_lock(&icache_lock);
+	icache_gen++;
+	struct icache_entry *e = &icache[inode_num % ICACHE_SIZE];
+	if (ext != NULL){
+		e->inode_num = inode_num;
+		e->loaded = stats_now();
+		e->ext = *ext;
+	}
+	if (e->inode_num == inode_num){
+		e->inode = *inode;
+	}
+	pthread_mutex_unlock(&icache_lock);
+}
+
+/* copy an inode and its extension out of a block of the inode table */
+static void decode_inode(const char *block, int inode_num, struct fs_inode *inode, struct fs_inode_ext *ext){
+	const char *slot = block + (inode_num % inodes_per_blk) * inode_size;
+	memcpy(inode, slot, sizeof(struct fs_inode));
+	if (inode_size >= FS_INODE_V2_SIZE){
+		memcpy(ext, slot + sizeof(struct fs_inode), sizeof(struct fs_inode_ext));
+	} else {
+		memset(ext, 0, sizeof(*ext));
+		ext->atime = inode->mtime;
+	}
+}
+
+/*
+ * Read several inodes, visiting them in inode number order so each
+ * block of the inode table is read at most once, and skipping those
+ * in the inode cache. With 64-byte inodes the extension reads as
+ * zero except atime, which is mtime.
+ *
+ * @param count: number of inodes, at most DIRENTS_PER_BLK
+ * @param nums: the inode numbers
+ * @param inodes: receives the inodes, in the order of nums
+ * @param exts: receives the extensions, or NULL
+ * @return: 0 if successful, or -1 on an I/O error
+ */
+static int read_inodes(int count, const int *nums, struct fs_inode *inodes, struct fs_inode_ext *exts){
+	int order[DIRENTS_PER_BLK];
+	for (int i = 0; i < count; i++){
+		int j = i;
+		for (; j > 0 && nums[order[j - 1]] > nums[i]; j--){
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+	char block[FS_BLOCK_SIZE];
+	int loaded = -1;
+	unsigned gen = icache_generation();
+	for (int k = 0; k < count; k++){
+		int i = order[k];
+		struct fs_inode_ext scratch;
+		struct fs_inode_ext *ext = (exts != NULL) ? &exts[i] : &scratch;
+		if (icache_lookup(nums[i], &inodes[i], ext)){
+			continue;
+		}
+		int block_number = inode_block(nums[i]);
+		if (block_number != loaded){
+			if (disk->ops->read(disk, block_number, 1, block) != SUCCESS){
+				return -1;
+			}
+			loaded = block_number;
+		}
+		decode_inode(block, nums[i], &inodes[i], ext);
+		icache_insert(nums[i], &inodes[i], ext, gen);
+	}
+	return 0;
+}
+
+/*
+ * Read an inode and, if ext is not NULL, its extension.
+ *
+ * @param inode_num: the inode number
+ * @param inode: receives the inode
+ * @param ext: receives the extension, or NULL
+ * @return: 0 if successful, or -1 on an I/O error
+ */
+static int read_inode_ext(int inode_num, struct fs_inode *inode, struct fs_inode_ext *ext){
+	return read_inodes(1, &inode_num, inode, ext);
+}
+
+static int read_inode(int inode_num, struct fs_inode* buf){
+	return read_inode_ext(inode_num, buf, NULL);
+}
+
+/*
+ * Write an inode and, if ext is not NULL and the image has room for
+ * it, its extension. Bytes of the slot past the extension are left
+ * as they are.
+ *
+ * @param inode_num: the inode number
+ * @param inode: the inode
+ * @param ext: the extension, or NULL to keep the one on disk
+ * @return: 0 if successful, or -EIO
+ */
+static int write_inode_ext(int inode_num, const struct fs_inode *inode, const struct fs_inode_ext *ext){
+	char temp_block[FS_BLOCK_SIZE];
+	int block_number = inode_block(inode_num);
+	if (disk->ops->read(disk, block_number, 1, temp_block) != SUCCESS){
+		return -EIO;
+	}
+	char *slot = temp_block + (inode_num % inodes_per_blk) * inode_size;
+	memcpy(slot, inode, sizeof(struct fs_inode));
+	if (ext != NULL && inode_size >= FS_INODE_V2_SIZE){
+		memcpy(slot + sizeof(struct fs_inode), ext, sizeof(struct fs_inode_ext));
+	}
+	dirty_add(inode_num, block_number, 1);
+	if (write_blocks(block_number, 1, temp_block) != SUCCESS){
+		return -EIO;
+	}
+	icache_update(inode_num, inode, ext);
+	return 0;
+}
+
+static int write_inode(int inode_num, const struct fs_inode *inode){
+	return write_inode_ext(inode_num, inode, NULL);
+}
+
+/* serializes atime updates, which are made under the shared lock */
+static pthread_mutex_t atime_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum { RELATIME_SECS = 24 * 60 * 60 };
+
+static struct timespec now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts;
+}
+
+/* give a new inode and a zeroed extension the current time */
+static void set_new_times(struct fs_inode *inode, struct fs_inode_ext *ext){
+	struct timespec ts = now();
+	memset(ext, 0, sizeof(*ext));
+	inode->ctime = inode->mtime = ext->atime = ts.tv_sec;
+	ext->ctime_ns = ext->mtime_ns = ext->atime_ns = ts.tv_nsec;
+}
+
+static void set_mtime(struct fs_inode *inode, struct fs_inode_ext *ext){
+	struct timespec ts = now();
+	inode->mtime = ts.tv_sec;
+	ext->mtime_ns = ts.tv_nsec;
+}
+
+static void inode_to_stat(int inode_num, const struct fs_inode *inode, const struct fs_inode_ext *ext, struct stat *sb){
+	memset(sb, 0, sizeof(*sb));
+	sb->st_ino = inode_num;
+	sb->st_mode = inode->mode;
+	sb->st_nlink = (inode->nlink != 0) ? inode->nlink : 1;
+	sb->st_uid = inode->uid;
+	sb->st_gid = inode->gid;
+	sb->st_size = inode->size;
+	sb->st_blksize = FS_BLOCK_SIZE;
+	sb->st_blocks = (inode->flags & FS_INODE_INLINE) ? 0 : inode->size / 512 + (inode->size % 512 != 0);
+	sb->st_ctim.tv_sec = inode->ctime;
+	sb->st_ctim.tv_nsec = ext->ctime_ns;
+	sb->st_mtim.tv_sec = inode->mtime;
+	sb->st_mtim.tv_nsec = ext->mtime_ns;
+	sb->st_atim.tv_sec = ext->atime;
+	sb->st_atim.tv_nsec = ext->atime_ns;
+}
+
+/*
+ * Record an access to an inode read with read_inode_ext, as the atime
+ * policy says. Under relatime the inode is only written when atime is
+ * not after mtime or is more than a day old, so repeated reads of a
+ * file cost at most one inode write a day. Access times are kept on a
+ * best-effort basis: a failure to record one is not the caller's.
+ *
+ * @return: 0 if successful, or -EIO
+ */
+static int touch_atime(int inode_num, const struct fs_inode *inode, const struct fs_inode_ext *ext){
+	if (inode_size < FS_INODE_V2_SIZE || fs_options.atime == FS_ATIME_NOATIME || fs_options.read_only){
+		return 0;
+	}
+	struct timespec ts = now();
+	if (fs_options.atime == FS_ATIME_RELATIME){
+		bool after_mtime = ext->atime > inode->mtime
+			|| (ext->atime == inode->mtime && ext->atime_ns > ext->mtime_ns);
+		if (after_mtime && ts.tv_sec - (time_t)ext->atime < RELATIME_SECS){
+			return 0;
+		}
+	}
+	/* a table block a snapshot holds would need a copy, which only the exclusive lock may make */
+	uint32_t table_block = inode_block(inode_num);
+	if (snap_held != NULL && (snap_held[table_block / 8] & (1 << (table_block % 8)))){
+		return 0;
+	}
+	/* re-read under the lock, since readers of other inodes in the block may be writing it */
+	pthread_mutex_lock(&atime_lock);
+	struct fs_inode fresh;
+	struct fs_inode_ext fresh_ext;
+	int retval = read_inode_ext(inode_num, &fresh, &fresh_ext) == 0 ? 0 : -EIO;
+	if (retval == 0){
+		fresh_ext.atime = ts.tv_sec;
+		fresh_ext.atime_ns = ts.tv_nsec;
+		retval = write_inode_ext(inode_num, &fresh, &fresh_ext);
+	}
+	pthread_mutex_unlock(&atime_lock);
+	return retval;
+}
+
+enum {MAX_PATH = 4096 };
+
+/*
+ * Virtual read-only file that reports per-operation latency
+ * percentiles. It is not stored in the image and is not listed
+ * by readdir.
+ */
+static const char STATS_FILE[] = "/" FS_STATS_NAME;
+enum { STATS_BUF_SIZE = 8192 };
+
+static bool is_stats_file(const char *path){
+	return !strcmp(path, STATS_FILE);
+}
+
+/* render the report into a new buffer for the caller to free, or return NULL */
+char *fs_stats_text(void){
+	char *text = malloc(STATS_BUF_SIZE);
+	if (text != NULL){
+		stats_render(text, STATS_BUF_SIZE);
+	}
+	return text;
+}
+
+void fs_stats_getattr(struct stat *sb){
+	char *text = malloc(STATS_BUF_SIZE);
+	memset(sb, 0, sizeof(*sb));
+	sb->st_mode = S_IFREG | 0444;
+	sb->st_nlink = 1;
+	sb->st_uid = getuid();
+	sb->st_gid = getgid();
+	sb->st_size = (text != NULL) ? stats_render(text, STATS_BUF_SIZE) : 0;
+	sb->st_blksize = FS_BLOCK_SIZE;
+	sb->st_ctime = sb->st_mtime = sb->st_atime = time(NULL);
+	free(text);
+}
+
+static int scan_dir_block(int block_number, char *filename){
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	if(disk->ops->read(disk, block_number, 1, entries) != SUCCESS){
+		return -1;
+	}
+	for (int i = 0; i < DIRENTS_PER_BLK; i++){
+		if (!entries[i].valid){
+			continue;
+		}
+		if (!strcmp(entries[i].name, filename)){
+			return entries[i].inode;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Directory entry cache - maps (directory inode, name) to the inode
+ * of that entry, so resolving many paths under the same directory
+ * does not re-read every directory on the way for each path. It is
+ * direct-mapped; a colliding insert simply replaces the old entry.
+ * Entries must be removed when a name is unlinked or renamed.
+ */
+enum { DCACHE_SIZE = 1024 };
+struct dcache_entry {
+	int parent; /* directory inode, 0 if entry unused */
+	int inode; /* inode of the entry */
+	char name[FS_FILENAME_SIZE];
+};
+static struct dcache_entry dcache[DCACHE_SIZE];
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dcache_entry *dcache_slot(int parent, const char *name){
+	unsigned hash = parent * 31;
+	for (const char *p = name; *p != '\0'; p++){
+		hash = hash * 31 + (unsigned char)*p;
+	}
+	return &dcache[hash % DCACHE_SIZE];
+}
+
+static int dcache_lookup(int parent, const char *name){
+	int inode = 0;
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *e = dcache_slot(parent, name);
+	if (e->parent == parent && !strcmp(e->name, name)){
+		inode = e->inode;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return inode;
+}
+
+static void dcache_insert(int parent, const char *name, int inode){
+	if (strlen(name) >= FS_FILENAME_SIZE){
+		return;
+	}
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *e = dcache_slot(parent, name);
+	e->parent = parent;
+	e->inode = inode;
+	strcpy(e->name, name);
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+static void dcache_remove(int parent, const char *name){
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *e = dcache_slot(parent, name);
+	if (e->parent == parent && !strcmp(e->name, name)){
+		e->parent = 0;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * Path cache - maps a whole path to its inode, so repeated getattr and
+ * open calls on the same path skip the per-component walk. It is
+ * direct-mapped and holds paths shorter than PCACHE_PATH_SIZE. Every
+ * unlink, rmdir or rename bumps pcache_gen, dropping all entries at
+ * once, since a rename moves every path under the renamed directory.
+ * Entries also expire like those of the inode cache.
+ */
+enum { PCACHE_SIZE = 1024, PCACHE_PATH_SIZE = 128 };
+struct pcache_entry {
+	unsigned gen; /* pcache_gen when inserted */
+	int inode; /* 0 if entry unused */
+	uint64_t loaded; /* stats_now() when cached */
+	char path[PCACHE_PATH_SIZE];
+};
+static struct pcache_entry pcache[PCACHE_SIZE];
+static unsigned pcache_gen = 1;
+static pthread_mutex_t pcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct pcache_entry *pcache_slot(const char *path){
+	unsigned hash = 0;
+	for (const char *p = path; *p != '\0'; p++){
+		hash = hash * 31 + (unsigned char)*p;
+	}
+	return &pcache[hash % PCACHE_SIZE];
+}
+
+static int pcache_lookup(const char *path){
+	int inode = 0;
+	pthread_mutex_lock(&pcache_lock);
+	struct pcache_entry *e = pcache_slot(path);
+	if (e->gen == pcache_gen && e->inode != 0 && !cache_expired(e->loaded) && !strcmp(e->path, path)){
+		inode = e->inode;
+	}
+	pthread_mutex_unlock(&pcache_lock);
+	return inode;
+}
+
+static void pcache_insert(const char *path, int inode, unsigned gen){
+	if (strlen(path) >= PCACHE_PATH_SIZE){
+		return;
+	}
+	pthread_mutex_lock(&pcache_lock);
+	if (gen == pcache_gen){
+		struct pcache_entry *e = pcache_slot(path);
+		e->gen = gen;
+		e->inode = inode;
+		e->loaded = stats_now();
+		strcpy(e->path, path);
+	}
+	pthread_mutex_unlock(&pcache_lock);
+}
+
+/* drop all cached paths; call when a name is unlinked or renamed */
+static void pcache_invalidate(void){
+	pthread_mutex_lock(&pcache_lock);
+	pcache_gen++;
+	pthread_mutex_unlock(&pcache_lock);
+}
+
+static int walk_path(const char *path);
+
+static int inode_from_full_path(const char *path){
+	if(path[0] != '/'){
+		fprintf(stderr, "cannot get inode from relative path\n");
+		return -ENOENT;
+	}
+	int inode = pcache_lookup(path);
+	if (inode > 0){
+		return inode;
+	}
+	pthread_mutex_lock(&pcache_lock);
+	unsigned gen = pcache_gen;
+	pthread_mutex_unlock(&pcache_lock);
+	inode = walk_path(path);
+	if (inode > 0){
+		pcache_insert(path, inode, gen);
+	}
+	return inode;
+}
+
+/* resolve an absolute path one component at a time */
+static int walk_path(const char *path){
+	char temp_path[MAX_PATH];
+	strcpy(temp_path, path);
+	int number_of_path_components = split(temp_path, NULL, 0, "/");
+	if (number_of_path_components <= 0){
+		return (number_of_path_components == 0) ? superblock.root_inode : -ENOMEM;
+	}
+	struct arena_mark mark = arena_mark();
+	char** path_components = arena_alloc(number_of_path_components * sizeof(char*));
+	if (path_components == NULL){
+		return -ENOMEM;
+	}
+	split(temp_path, path_components, number_of_path_components, "/");
+	int inode = superblock.root_inode;
+	struct fs_inode current_inode;
+	for (int i = 0; i < number_of_path_components; i++){
+		int cached = dcache_lookup(inode, path_components[i]);
+		if (cached > 0){
+			inode = cached;
+			continue;
+		}
+		int inode_used_result = inode_used(inode);
+		if (inode_used_result == -1){
+			fprintf(stderr, "error reading from disk on line %d\n", __LINE__);
+			arena_release(mark);
+			return -1;
+		}
+		if (inode_used_result == 0 || inode == 0){
+			fprintf(stderr, "could not get inode from full path: inode %u not used (or 0)\nwhen trying to find the inode of file '%s'\n", inode, path);
+			arena_release(mark);
+			return -ENOENT;
+		}
+		if (read_inode(inode, &current_inode) != 0){
+			arena_release(mark);
+			return -1;
+		}
+		if (!S_ISDIR(current_inode.mode)){
+			arena_release(mark);
+			return -ENOTDIR;
+		}
+		int scan_result = scan_dir_block(current_inode.direct[0], path_components[i]);
+		if (scan_result == -1){
+			arena_release(mark);
+			return -1;
+		}
+		if (scan_result > 0){
+			dcache_insert(inode, path_components[i], scan_result);
+			inode = scan_result;
+		} else {
+			arena_release(mark);
+			return -ENOENT;
+		}
+
+	}
+	arena_release(mark);
+	return inode;
+}
+
+int fs_ilookup(int dir_num, const char *name){
+	if (strlen(name) >= FS_FILENAME_SIZE){
+		return -ENAMETOOLONG;
+	}
+	int inode = dcache_lookup(dir_num, name);
+	if (inode > 0){
+		return inode;
+	}
+	struct fs_inode dir;
+	if (read_inode(dir_num, &dir) != 0){
+		return -EIO;
+	}
+	if (!S_ISDIR(dir.mode)){
+		return -ENOTDIR;
+	}
+	char filename[FS_FILENAME_SIZE];
+	strcpy(filename, name);
+	inode = scan_dir_block(dir.direct[0], filename);
+	if (inode < 0){
+		return -EIO;
+	}
+	if (inode == 0){
+		return -ENOENT;
+	}
+	dcache_insert(dir_num, name, inode);
+	return inode;
+}
+
+int split_path(const char* path, char *temp_path, char *new_file_name){
+	strcpy(temp_path, path);
+	int len = strlen(temp_path);
+	if (temp_path[len-1] == '/'){
+		temp_path[len-1] = '\0';
+		len--;
+	}
+	int i;
+	for (i = len-1; i >= 0; i--){
+		if (temp_path[i] == '/'){
+			i++;
+			break;
+		}
+	}
+	if (len - i > FS_FILENAME_SIZE){
+		return -ENAMETOOLONG;
+	}
+	strcpy(new_file_name, temp_path + i);
+	temp_path[i] = '\0';
+	return 0;
+}
+
+/*
+ * Indirect blocks most recently read by logical_to_physical. Passing
+ * the same cursor while walking a file in order reads each indirect
+ * block once instead of once per data block.
+ */
+struct map_cursor {
+	uint32_t indir_blk; /* block held in indir, 0 if none */
+	uint32_t indir[PTRS_PER_BLK];
+	uint32_t second_blk; /* block held in second, 0 if none */
+	uint32_t second[PTRS_PER_BLK];
+};
+
+static int cursor_load(uint32_t block, uint32_t *cached_block, uint32_t *table){
+	if (*cached_block == block){
+		return 0;
+	}
+	if (disk->ops->read(disk, block, 1, table) != SUCCESS){
+		*cached_block = 0;
+		return -EIO;
+	}
+	*cached_block = block;
+	return 0;
+}
+
+/*
+ * Get the physical block for a logical block of a file.
+ *
+ * @param inode: the file inode
+ * @param logical: logical block number
+ * @param cursor: cached indirect blocks, or NULL
+ * @return: physical block number, 0 if not allocated, or -EIO
+ */
+static int logical_to_physical(struct fs_inode *inode, int logical, struct map_cursor *cursor){
+	struct map_cursor local;
+	if (cursor == NULL){
+		cursor = &local;
+		cursor->indir_blk = cursor->second_blk = 0;
+	}
+	if (logical < N_DIRECT){
+		return inode->direct[logical];
+	} else if (logical - N_DIRECT < PTRS_PER_BLK){
+		if (inode->indir_1 == 0){
+			return 0;
+		}
+		if (cursor_load(inode->indir_1, &cursor->indir_blk, cursor->indir) != 0){
+			return -EIO;
+		}
+		return cursor->indir[logical - N_DIRECT];
+	} else {
 		if (inode->indir_2 == 0){
-			int temp = allocate_zeroed_block();
-			if (temp < 0){
-				return temp;
+			return 0;
+		}
+		if (cursor_load(inode->indir_2, &cursor->indir_blk, cursor->indir) != 0){
+			return -EIO;
+		}
+		uint32_t second_level = cursor->indir[(logical - N_DIRECT - PTRS_PER_BLK) / PTRS_PER_BLK];
+		if (second_level == 0){
+			return 0;
+		}
+		if (cursor_load(second_level, &cursor->second_blk, cursor->second) != 0){
+			return -EIO;
+		}
+		return cursor->second[(logical - N_DIRECT - PTRS_PER_BLK) % PTRS_PER_BLK];
+	}
+}
+
+int read_block_of_file(uint32_t logical_block_number, struct fs_inode *inode, void *buf){
+	int physical_block_number = logical_to_physical(inode, logical_block_number, NULL);
+	if (physical_block_number < 0){
+		return physical_block_number;
+	}
+	if (physical_block_number == 0){
+		return -1;
+	}
+	if (disk->ops->read(disk, physical_block_number, 1, buf) != SUCCESS){
+		return -EIO;
+	}
+	return 0;
+}
+
+int write_block_to_file(uint32_t block_number, struct fs_inode *inode, void *buf){
+	int physical_block_number = logical_to_physical(inode, block_number, NULL);
+	if (physical_block_number < 0){
+		return physical_block_number;
+	}
+	if (physical_block_number == 0){
+		return -1;
+	}
+	if (write_blocks(physical_block_number, 1, buf) != SUCCESS){
+		return -EIO;
+	}
+	return 0;
+}
+
+/* allocate a block in or after group goal and clear it */
+static int allocate_zeroed_block(int goal){
+	int new_block_num = allocate_block(goal);
+	if (new_block_num < 0){
+		return new_block_num;
+	}
+	char zeros[FS_BLOCK_SIZE];
+	memset(zeros, 0, FS_BLOCK_SIZE);
+	if (write_blocks(new_block_num, 1, zeros) != SUCCESS){
+		return -EIO;
+	}
+	return new_block_num;
+}
+
+/* block allocator used by map_block: returns a block number or -error */
+typedef int (*block_allocator)(void *arg);
+
+/* arg points to the goal group */
+static int allocate_zeroed_block_cb(void *arg){
+	return allocate_zeroed_block(*(int *)arg);
+}
+
+/*
+ * Block reference counts, for files made with FSX492_IOC_CLONE that
+ * share data blocks. From the first clone on, the image has
+ * FS_FEAT_REFLINK and the counts are the contents of an inode no
+ * directory names, superblock.refcount_inode: a uint16_t per block,
+ * indexed by block number, counting the owners of the block beyond
+ * the first, so unshared and free blocks count 0. The whole map is
+ * kept in memory, and changed blocks of it are written by
+ * refcount_flush.
+ *
+ * A count goes up before the file taking a share of the block is
+ * written, and down on disk only once the file giving up its share
+ * has been written without the block, so an interrupted operation
+ * leaves a count too high, leaking the block, but never too low.
+ */
+static uint16_t *refcounts; /* NULL without FS_FEAT_REFLINK */
+static char *refcount_dirty; /* per block of the map, set if changed since written */
+static int refcount_map_blocks; /* blocks in the map */
+static uint32_t *refcount_pending; /* blocks given up by the current operation */
+static int refcount_n_pending, refcount_pending_cap;
+
+static bool block_shared(uint32_t block_num){
+	return refcounts != NULL && refcounts[block_num] != 0;
+}
+
+/* count one more owner of a block */
+static void refcount_get(uint32_t block_num){
+	refcounts[block_num]++;
+	refcount_dirty[block_num * sizeof(uint16_t) / FS_BLOCK_SIZE] = 1;
+}
+
+/*
+ * Give up a file's share of a shared block. The count goes down in
+ * memory at once, so a file with more than one pointer to the block
+ * frees it on giving up the last share, but is written only by
+ * refcount_commit, once the file is written without the block.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int refcount_put(uint32_t block_num){
+	if (refcount_n_pending == refcount_pending_cap){
+		int cap = (refcount_pending_cap == 0) ? PTRS_PER_BLK : 2 * refcount_pending_cap;
+		uint32_t *pending = realloc(refcount_pending, cap * sizeof(uint32_t));
+		if (pending == NULL){
+			return -ENOMEM;
+		}
+		refcount_pending = pending;
+		refcount_pending_cap = cap;
+	}
+	refcount_pending[refcount_n_pending++] = block_num;
+	refcounts[block_num]--;
+	return 0;
+}
+
+/* write the blocks of the map changed since they were last written; returns 0 or -error */
+static int refcount_flush(void){
+	if (refcounts == NULL){
+		return 0;
+	}
+	struct fs_inode map;
+	if (read_inode(superblock.refcount_inode, &map) != 0){
+		return -EIO;
+	}
+	for (int i = 0; i < refcount_map_blocks; i++){
+		if (refcount_dirty[i]){
+			if (write_block_to_file(i, &map, (char *)refcounts + i * FS_BLOCK_SIZE) != 0){
+				return -EIO;
+			}
+			refcount_dirty[i] = 0;
+		}
+	}
+	return 0;
+}
+
+/* restore the shares given up by an operation that failed, leaving their counts too high */
+static void refcount_abort(void){
+	for (int i = 0; i < refcount_n_pending; i++){
+		refcounts[refcount_pending[i]]++;
+	}
+	refcount_n_pending = 0;
+}
+
+/* write the shares given up with refcount_put, once the files giving them up are written */
+static int refcount_commit(void){
+	if (refcount_n_pending > 0 && blkdev_barrier(disk) != SUCCESS){
+		refcount_abort();
+		return -EIO;
+	}
+	for (int i = 0; i < refcount_n_pending; i++){
+		refcount_dirty[refcount_pending[i] * sizeof(uint16_t) / FS_BLOCK_SIZE] = 1;
+	}
+	refcount_n_pending = 0;
+	return refcount_flush();
+}
+
+/* blocks in a map with an entry of entry_size bytes for each block of the image */
+static int map_blocks_needed(size_t entry_size){
+	return (superblock.num_blocks * entry_size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+}
+
+/* read the map of an image with FS_FEAT_REFLINK; returns 0 or -error */
+static int refcount_load(void){
+	struct fs_inode map;
+	if (read_inode(superblock.refcount_inode, &map) != 0){
+		return -EIO;
+	}
+	refcount_map_blocks = map_blocks_needed(sizeof(uint16_t));
+	refcounts = calloc(refcount_map_blocks, FS_BLOCK_SIZE);
+	refcount_dirty = calloc(refcount_map_blocks, 1);
+	if (refcounts == NULL || refcount_dirty == NULL){
+		return -ENOMEM;
+	}
+	for (int i = 0; i < refcount_map_blocks; i++){
+		if (read_block_of_file(i, &map, (char *)refcounts + i * FS_BLOCK_SIZE) != 0){
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Load indirect block *ptr into table. If *ptr is 0, a new block is
+ * allocated and table is cleared instead.
+ *
+ * @return: 1 if the block is new and must be written, 0 if it was
+ *   read, or -error number
+ */
+static int load_indirect(uint32_t *ptr, uint32_t *table, block_allocator alloc, void *arg){
+	if (*ptr == 0){
+		int temp = alloc(arg);
+		if (temp < 0){
+			return temp;
+		}
+		*ptr = temp;
+		memset(table, 0, FS_BLOCK_SIZE);
+		return 1;
+	}
+	if (disk->ops->read(disk, *ptr, 1, table) != SUCCESS){
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Fill pointer *slot from alloc if it is 0 or, with overwrite, if it
+ * points to a shared block, which the file then gives up for a block
+ * of its own that the caller is to write in full.
+ *
+ * @return: 1 if filled, 0 if not, or -error number
+ */
+static int fill_slot(uint32_t *slot, block_allocator alloc, void *arg, bool overwrite){
+	if (*slot != 0 && !(overwrite && block_shared(*slot))){
+		return 0;
+	}
+	int temp = alloc(arg);
+	if (temp < 0){
+		return temp;
+	}
+	if (*slot != 0){
+		int retval = refcount_put(*slot);
+		if (retval != 0){
+			return retval;
+		}
+	}
+	*slot = temp;
+	return 1;
+}
+
+/*
+ * Get the physical block for a logical block of a file, allocating
+ * the block and any indirect blocks leading to it from alloc. With
+ * overwrite, a block shared with a clone is replaced as fill_slot
+ * does. Changed indirect blocks are written; the caller must write
+ * the inode, then call refcount_commit.
+ *
+ * @return: the physical block number, or -error number
+ */
+static int map_block(struct fs_inode *inode, int logical, block_allocator alloc, void *arg, bool overwrite){
+	int temp;
+	if (logical < N_DIRECT){
+		if ((temp = fill_slot(&inode->direct[logical], alloc, arg, overwrite)) < 0){
+			return temp;
+		}
+		return inode->direct[logical];
+	}
+	logical -= N_DIRECT;
+	uint32_t table[PTRS_PER_BLK];
+	if (logical < PTRS_PER_BLK){
+		int fresh = load_indirect(&inode->indir_1, table, alloc, arg);
+		if (fresh < 0){
+			return fresh;
+		}
+		if ((temp = fill_slot(&table[logical], alloc, arg, overwrite)) < 0){
+			return temp;
+		}
+		if ((fresh || temp) && write_blocks(inode->indir_1, 1, table) != SUCCESS){
+			return -EIO;
+		}
+		return table[logical];
+	}
+	logical -= PTRS_PER_BLK;
+	if (logical >= PTRS_PER_BLK * PTRS_PER_BLK){
+		return -EFBIG;
+	}
+	uint32_t second_indir[PTRS_PER_BLK];
+	int fresh = load_indirect(&inode->indir_2, table, alloc, arg);
+	if (fresh < 0){
+		return fresh;
+	}
+	int fresh_second = load_indirect(&table[logical / PTRS_PER_BLK], second_indir, alloc, arg);
+	if (fresh_second < 0){
+		return fresh_second;
+	}
+	if ((temp = fill_slot(&second_indir[logical % PTRS_PER_BLK], alloc, arg, overwrite)) < 0){
+		return temp;
+	}
+	if ((fresh_second || temp) && write_blocks(table[logical / PTRS_PER_BLK], 1, second_indir) != SUCCESS){
+		return -EIO;
+	}
+	if ((fresh || fresh_second) && write_blocks(inode->indir_2, 1, table) != SUCCESS){
+		return -EIO;
+	}
+	return second_indir[logical % PTRS_PER_BLK];
+}
+
+static int put_block_in_file(struct fs_inode *inode, int logical_block, int goal, void *buf){
+	int physical_block_number = map_block(inode, logical_block, allocate_zeroed_block_cb, &goal, true);
+	if (physical_block_number < 0){
+		return physical_block_number;
+	}
+	if (write_blocks(physical_block_number, 1, buf) != SUCCESS){
+		return -EIO;
+	}
+	return 0;
+}
+
+/* block visitor used by walk_blocks: returns 0 to continue, or -error number */
+typedef int (*block_visitor)(uint32_t *ptr, void *arg);
+
+/*
+ * Visit the block *ptr and, for an indirect block, the blocks it
+ * points to. If a visitor changes a pointer in the indirect block,
+ * the indirect block is written back to the block *ptr points to
+ * after its own visit.
+ *
+ * @param depth: 0 for a data block, 1 for a single indirect block
+ *   and 2 for a double indirect block
+ * @param data_only: visit data blocks only, not indirect blocks
+ */
+static int walk_table(uint32_t *ptr, int depth, bool data_only, block_visitor visit, void *arg){
+	if (*ptr == 0 || *ptr == FS_CLUSTER_COMPRESSED){
+		return 0;
+	}
+	int retval = 0;
+	if (depth == 0 || !data_only){
+		retval = visit(ptr, arg);
+	}
+	if (retval != 0 || depth == 0){
+		return retval;
+	}
+	uint32_t table[PTRS_PER_BLK];
+	if (disk->ops->read(disk, *ptr, 1, table) != SUCCESS){
+		return -EIO;
+	}
+	bool changed = false;
+	for (int i = 0; i < PTRS_PER_BLK; i++){
+		uint32_t old = table[i];
+		if ((retval = walk_table(&table[i], depth - 1, data_only, visit, arg)) != 0){
+			return retval;
+		}
+		changed |= (table[i] != old);
+	}
+	if (changed && write_blocks(*ptr, 1, table) != SUCCESS){
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Visit every block of a file in the order a sequential read uses
+ * them, each indirect block just before the blocks it points to.
+ * Unallocated pointers and the FS_CLUSTER_COMPRESSED markers of
+ * compressed clusters are skipped, and inline files have no blocks.
+ * The visitor may change a pointer
+ * to relocate a block, having copied the block first; the caller
+ * must write the inode.
+ *
+ * @param data_only: skip indirect blocks, for walk_data_blocks
+ * @return: 0 if successful, or -error number from visit or the disk
+ */
+static int walk_file(struct fs_inode *inode, bool data_only, block_visitor visit, void *arg){
+	int retval;
+	if (inode->flags & FS_INODE_INLINE){
+		return 0;
+	}
+	for (int i = 0; i < N_DIRECT; i++){
+		if ((retval = walk_table(&inode->direct[i], 0, data_only, visit, arg)) != 0){
+			return retval;
+		}
+	}
+	if ((retval = walk_table(&inode->indir_1, 1, data_only, visit, arg)) != 0){
+		return retval;
+	}
+	return walk_table(&inode->indir_2, 2, data_only, visit, arg);
+}
+
+static int walk_blocks(struct fs_inode *inode, block_visitor visit, void *arg){
+	return walk_file(inode, false, visit, arg);
+}
+
+/* walk_blocks, visiting only the data blocks of a file */
+static int walk_data_blocks(struct fs_inode *inode, block_visitor visit, void *arg){
+	return walk_file(inode, true, visit, arg);
+}
+
+/*
+ * Inline data. A regular file that is empty and has no blocks starts
+ * keeping its data in the inode when it is first written, as long as
+ * it fits in FS_INLINE_SIZE bytes; reading it then needs only the
+ * inode. When it grows past that, the data moves to a first block.
+ */
+static bool inline_eligible(const struct fs_inode *inode){
+	if (!S_ISREG(inode->mode) || (inode->flags & FS_INODE_INLINE) || inode->size != 0
+			|| inode->indir_1 != 0 || inode->indir_2 != 0){
+		return false;
+	}
+	for (int i = 0; i < N_DIRECT; i++){
+		if (inode->direct[i] != 0){
+			return false;
+		}
+	}
+	return true;
+}
+
+/* set a feature flag in the superblock if it is not yet set */
+static int enable_feature(uint32_t feature){
+	if (superblock.features & feature){
+		return 0;
+	}
+	superblock.features |= feature;
+	if (write_blocks(0, 1, &superblock) != SUCCESS){
+		superblock.features &= ~feature;
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Dynamic inodes. Once no group has a free inode, new inodes are made
+ * in dynamic inode table blocks, which are taken from the data area
+ * as the ones there are fill up and are not given back. The first
+ * sets FS_FEAT_DYN_INODES, with dyn_inode_base past the groups'
+ * inodes, rounded up so the dynamic inodes' bits start a byte of the
+ * inode bitmap and their table blocks hold whole blocks of inodes.
+ */
+
+/* write the block of the map file holding entry i; returns 0 or -EIO */
+static int imap_write(uint32_t i){
+	uint32_t k = i / IMAP_ENTRIES_PER_BLK;
+	if (write_block_to_file(k, &superblock.inode_map, (char *)imap + (size_t)k * FS_BLOCK_SIZE) != 0){
+		return -EIO;
+	}
+	return 0;
+}
+
+/* size the map in memory and the inode bitmap for count table blocks, the new parts clear; returns 0 or -ENOMEM */
+static int imap_fit(uint32_t count){
+	size_t old_bytes = (size_t)(imap_count + IMAP_ENTRIES_PER_BLK - 1) / IMAP_ENTRIES_PER_BLK * FS_BLOCK_SIZE;
+	size_t map_bytes = (size_t)(count + IMAP_ENTRIES_PER_BLK) / IMAP_ENTRIES_PER_BLK * FS_BLOCK_SIZE;
+	struct fs_imap_entry *entries = realloc(imap, map_bytes);
+	if (entries == NULL){
+		return -ENOMEM;
+	}
+	if (imap == NULL){
+		old_bytes = 0;
+	}
+	if (map_bytes > old_bytes){
+		memset((char *)entries + old_bytes, 0, map_bytes - old_bytes);
+	}
+	imap = entries;
+	size_t bytes = (superblock.dyn_inode_base + (size_t)count * inodes_per_blk + 7) / 8;
+	if (bytes > inode_bitmap_bytes){
+		char *bitmap = realloc(inode_bitmap_mem, bytes);
+		if (bitmap == NULL){
+			return -ENOMEM;
+		}
+		memset(bitmap + inode_bitmap_bytes, 0, bytes - inode_bitmap_bytes);
+		inode_bitmap_mem = bitmap;
+		inode_bitmap_bytes = bytes;
+	}
+	return 0;
+}
+
+/* read the map of an image with FS_FEAT_DYN_INODES and mark the dynamic inodes in use; returns 0 or -error */
+static int imap_load(void){
+	if (superblock.dyn_inode_base % 16 != 0){
+		return -EINVAL;
+	}
+	uint32_t count = superblock.inode_map.size / sizeof(struct fs_imap_entry);
+	int retval = imap_fit(count);
+	if (retval != 0){
+		return retval;
+	}
+	for (uint32_t k = 0; k * IMAP_ENTRIES_PER_BLK < count; k++){
+		if (read_block_of_file(k, &superblock.inode_map, (char *)imap + (size_t)k * FS_BLOCK_SIZE) != 0){
+			return -EIO;
+		}
+	}
+	for (uint32_t i = 0; i < count * inodes_per_blk; i++){
+		uint32_t inode_num = superblock.dyn_inode_base + i;
+		if (imap[i / inodes_per_blk].used & (1 << (i % inodes_per_blk))){
+			inode_bitmap_mem[inode_num / 8] |= 1 << (inode_num % 8);
+		} else {
+			imap_free++;
+		}
+	}
+	imap_count = count;
+	n_inodes = superblock.dyn_inode_base + count * inodes_per_blk;
+	if ((retval = summary_reserve(n_inodes)) == 0){
+		summary_fill();
+	}
+	return retval;
+}
+
+/*
+ * Add a dynamic inode table block near group goal, with its entry in
+ * the map. The block is cleared, and the map and the superblock, which
+ * holds the map file's inode, are written before any of its inodes is
+ * used.
+ *
+ * @return: 0 if successful, or -error number
+ *	-ENOSPC - no free block, or no inode numbers left that a directory entry can hold
+ */
+static int imap_grow(int goal){
+	if (n_inodes + inodes_per_blk > (1u << 30)){
+		return -ENOSPC;
+	}
+	uint32_t i = imap_count;
+	int retval = imap_fit(i + 1);
+	if (retval == 0){
+		retval = summary_reserve(n_inodes + inodes_per_blk);
+	}
+	if (retval != 0){
+		return retval;
+	}
+	if (i % IMAP_ENTRIES_PER_BLK == 0){
+		int physical = map_block(&superblock.inode_map, i / IMAP_ENTRIES_PER_BLK, allocate_zeroed_block_cb, &goal, false);
+		if (physical < 0){
+			return physical;
+		}
+	}
+	int block_num = allocate_zeroed_block(goal);
+	if (block_num < 0){
+		return block_num;
+	}
+	imap[i] = (struct fs_imap_entry){ .block = block_num };
+	superblock.inode_map.size = (i + 1) * sizeof(struct fs_imap_entry);
+	if (imap_write(i) != 0 || write_blocks(0, 1, &superblock) != SUCCESS){
+		return -EIO;
+	}
+	pthread_mutex_lock(&imap_lock);
+	imap_count++;
+	imap_free += inodes_per_blk;
+	n_inodes += inodes_per_blk;
+	pthread_mutex_lock(&summary_lock);
+	for (uint32_t inode_num = n_inodes - inodes_per_blk; inode_num < n_inodes; inode_num++){
+		summary_update(inode_num);
+	}
+	pthread_mutex_unlock(&summary_lock);
+	pthread_mutex_unlock(&imap_lock);
+	return 0;
+}
+
+/* record in the map whether a dynamic inode is in use; call with imap_lock held */
+static int imap_mark(int inode_num, bool used){
+	uint32_t i = (inode_num - superblock.dyn_inode_base) / inodes_per_blk;
+	uint16_t bit = 1 << ((inode_num - superblock.dyn_inode_base) % inodes_per_blk);
+	imap[i].used = used ? (imap[i].used | bit) : (imap[i].used & ~bit);
+	return imap_write(i);
+}
+
+/*
+ * Take a free dynamic inode, searching from hint on, and adding a
+ * table block near group goal if there is none.
+ *
+ * @return: the inode number, or -error number
+ */
+static int dyn_inode_allocate(int goal, uint32_t hint){
+	int retval = 0;
+	if (!(superblock.features & FS_FEAT_DYN_INODES)){
+		superblock.dyn_inode_base = (n_inodes + 15) / 16 * 16;
+		if ((retval = summary_reserve(superblock.dyn_inode_base)) != 0 || (retval = imap_fit(0)) != 0
+				|| (retval = enable_feature(FS_FEAT_DYN_INODES)) != 0){
+			return retval;
+		}
+		n_inodes = superblock.dyn_inode_base;
+		summary_fill();
+	}
+	if (imap_free == 0 && (retval = imap_grow(goal)) != 0){
+		return retval;
+	}
+	pthread_mutex_lock(&imap_lock);
+	int inode_num = take_inode(superblock.dyn_inode_base, imap_count * inodes_per_blk, hint);
+	if (inode_num < 0){
+		/* imap_free disagrees with the bitmap */
+		pthread_mutex_unlock(&imap_lock);
+		return -ENOSPC;
+	}
+	imap_free--;
+	retval = imap_mark(inode_num, true);
+	pthread_mutex_unlock(&imap_lock);
+	return (retval != 0) ? retval : inode_num;
+}
+
+static int dyn_inode_free(int inode_num){
+	pthread_mutex_lock(&imap_lock);
+	release_inode(inode_num);
+	imap_free++;
+	int retval = imap_mark(inode_num, false);
+	pthread_mutex_unlock(&imap_lock);
+	return retval;
+}
+
+/*
+ * Visit the dynamic inode table blocks and the blocks of the map file,
+ * which no inode owns, as walk_blocks visits a file's. The visitor may
+ * move them, having copied them; the map and the superblock are then
+ * written.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int walk_imap(block_visitor visit, void *arg){
+	if (imap == NULL){
+		return 0;
+	}
+	struct fs_inode before = superblock.inode_map;
+	int retval = walk_blocks(&superblock.inode_map, visit, arg);
+	bool moved = memcmp(&before, &superblock.inode_map, sizeof(before)) != 0;
+	for (uint32_t i = 0; i < imap_count && retval == 0; i++){
+		uint32_t old = imap[i].block;
+		retval = visit(&imap[i].block, arg);
+		moved |= (imap[i].block != old);
+	}
+	for (uint32_t i = 0; moved && i < imap_count && retval == 0; i += IMAP_ENTRIES_PER_BLK){
+		retval = imap_write(i);
+	}
+	if (retval == 0 && moved && write_blocks(0, 1, &superblock) != SUCCESS){
+		retval = -EIO;
+	}
+	return retval;
+}
+
+/* make an eligible inode keep its data inline; the caller must write the inode */
+static int make_inline(struct fs_inode *inode){
+	int retval = enable_feature(FS_FEAT_INLINE);
+	if (retval == 0){
+		memset(inode->inline_data, 0, FS_INLINE_SIZE);
+		inode->flags |= FS_INODE_INLINE;
+	}
+	return retval;
+}
+
+/*
+ * Move inline data to a newly allocated first block. If this fails,
+ * the inode in memory is unusable, but the one on disk is unchanged
+ * as long as the caller does not write it.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int inline_to_blocks(struct fs_inode *inode, int goal){
+	char block[FS_BLOCK_SIZE];
+	memset(block, 0, FS_BLOCK_SIZE);
+	memcpy(block, inode->inline_data, inode->size);
+	memset(inode->inline_data, 0, FS_INLINE_SIZE);
+	inode->flags &= ~FS_INODE_INLINE;
+	return (inode->size == 0) ? 0 : put_block_in_file(inode, 0, goal, block);
+}
+
+/*
+ * A set of blocks reserved with a single block bitmap update, handed
+ * out in order by map_block. Used by fallocate so a whole
+ * file is allocated contiguously where possible.
+ */
+struct block_pool {
+	uint32_t *blocks; /* reserved block numbers, in search order */
+	int count; /* number of reserved blocks */
+	int next; /* index of next block to hand out */
+};
+
+static int block_pool_alloc(void *arg){
+	struct block_pool *pool = arg;
+	if (pool->next == pool->count){
+		return -ENOSPC;
+	}
+	return pool->blocks[pool->next++];
+}
+
+/*
+ * Choose count clear bits of a block bitmap for block_pool_reserve.
+ *
+ * @return: the number of blocks chosen, count unless too few are free
+ */
+static int choose_blocks(const char *block_bitmap, uint32_t *blocks, int count, int goal){
+	uint32_t base = groups[goal].start, n_blocks = superblock.num_blocks;
+	int run_start = -1;
+	for (uint32_t j = 0, run = 0; j < n_blocks && run_start < 0; j++){
+		uint32_t i = (base + j) % n_blocks;
+		run = (block_bitmap[i / 8] & (1 << (i % 8))) ? 0 : run + 1;
+		if (run == count){
+			run_start = i - count + 1;
+		}
+	}
+	int n = 0;
+	for (uint32_t j = 0; j < n_blocks && n < count; j++){
+		uint32_t i = (((run_start < 0) ? base : run_start) + j) % n_blocks;
+		if (!(block_bitmap[i / 8] & (1 << (i % 8)))){
+			blocks[n++] = i;
+		}
+	}
+	return n;
+}
+
+/*
+ * Reserve count blocks, preferring the first contiguous run of free
+ * blocks that is long enough and otherwise taking the first free
+ * blocks. The search starts at group goal and wraps around to the
+ * groups before it. As with allocate_block, blocks a snapshot still
+ * reads in place are taken only if there are too few others. Either
+ * all blocks are reserved or none.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int block_pool_reserve(struct block_pool *pool, int count, int goal){
+	pool->blocks = malloc(count * sizeof(uint32_t));
+	pool->count = count;
+	pool->next = 0;
+	struct arena_mark mark = arena_mark();
+	char *block_bitmap = arena_alloc(block_bitmap_bytes);
+	char *avoiding = (snap_held != NULL) ? arena_alloc(block_bitmap_bytes) : NULL;
+	if (pool->blocks == NULL || block_bitmap == NULL || (snap_held != NULL && avoiding == NULL)){
+		free(pool->blocks);
+		arena_release(mark);
+		return -ENOMEM;
+	}
+	read_block_bitmap(block_bitmap);
+	int n = 0;
+	if (avoiding != NULL){
+		for (size_t i = 0; i < block_bitmap_bytes; i++){
+			avoiding[i] = block_bitmap[i] | snap_held[i];
+		}
+		n = choose_blocks(avoiding, pool->blocks, count, goal);
+	}
+	if (n < count){
+		n = choose_blocks(block_bitmap, pool->blocks, count, goal);
+	}
+	if (n < count){
+		free(pool->blocks);
+		arena_release(mark);
+		return -ENOSPC;
+	}
+	for (int j = 0; j < count; j++){
+		block_bitmap[pool->blocks[j] / 8] |= 1 << (pool->blocks[j] % 8);
+	}
+	int retval = write_block_bitmap(block_bitmap);
+	if (retval != 0){
+		free(pool->blocks);
+	}
+	arena_release(mark);
+	return retval;
+}
+
+/*
+ * Return the blocks of a pool that were not handed out to the free
+ * block bitmap, and release the pool.
+ */
+static int block_pool_release(struct block_pool *pool){
+	int retval = 0;
+	if (pool->next < pool->count){
+		struct arena_mark mark = arena_mark();
+		char *block_bitmap = arena_alloc(block_bitmap_bytes);
+		if (block_bitmap == NULL){
+			retval = -ENOMEM;
+		} else {
+			read_block_bitmap(block_bitmap);
+			for (int j = pool->next; j < pool->count; j++){
+				block_bitmap[pool->blocks[j] / 8] &= ~(1 << (pool->blocks[j] % 8));
+			}
+			retval = write_block_bitmap(block_bitmap);
+		}
+		arena_release(mark);
+	}
+	free(pool->blocks);
+	return retval;
+}
+
+
+/* 
+ * CS492: FUSE functions
+*/
+
+
+/*
+ * init - this is called once by the FUSE framework at startup.
+ *
+ * This is a good place to read in the super-block and set up any
+ * global variables you need. You don't need to worry about the
+ * argument or the return value.
+ *
+ * @param conn: fuse connection information, or NULL outside FUSE
+ * @return: unused - returns NULL
+*/
+
+void* fs_init(struct fuse_conn_info *conn)
+{
+	int retval = disk->ops->read(disk, 0, 1, &superblock);
+	if(retval != SUCCESS){
+		fprintf(stderr, "fs_init: got return value of %d when reading the superblock\n", retval);
+		abort();
+	}
+	if (superblock.magic != FS_MAGIC){
+		fprintf(stderr, "fs_init: superblocks contains wrong magic number, probably corrupt\n");
+	}
+	if (disk->ops->num_blocks(disk) != superblock.num_blocks){
+		fprintf(stderr, "fs_init: superblock contains wrong number of blocks, probably corrupt\n");
+	}
+	if (superblock.features & ~FS_FEATURES){
+		fprintf(stderr, "fs_init: superblock has unknown features 0x%x\n", superblock.features & ~FS_FEATURES);
+		abort();
+	}
+	if ((superblock.features & FS_FEAT_CSUM) && disk->ops->num_blocks(disk) != superblock.num_blocks){
+		fprintf(stderr, "fs_init: image has checksums, but the device does not keep them (see csum_create)\n");
+		abort();
+	}
+	inode_size = (superblock.inode_size == 0) ? FS_INODE_V1_SIZE : superblock.inode_size;
+	if ((inode_size != FS_INODE_V1_SIZE && inode_size != FS_INODE_V2_SIZE && inode_size != FS_INODE_MAX_SIZE)
+			|| (inode_size > FS_INODE_V1_SIZE) != !!(superblock.features & FS_FEAT_BIG_INODES)){
+		fprintf(stderr, "fs_init: superblock has bad inode size %d\n", inode_size);
+		abort();
+	}
+	inodes_per_blk = FS_BLOCK_SIZE / inode_size;
+	if ((retval = groups_init()) != 0){
+		fprintf(stderr, "fs_init: cannot load block groups: %s\n", strerror(-retval));
+		abort();
+	}
+	if ((superblock.features & FS_FEAT_DYN_INODES) && (retval = imap_load()) != 0){
+		fprintf(stderr, "fs_init: cannot load the dynamic inode map: %s\n", strerror(-retval));
+		abort();
+	}
+	if ((superblock.features & FS_FEAT_REFLINK) && (retval = refcount_load()) != 0){
+		fprintf(stderr, "fs_init: cannot load block reference counts: %s\n", strerror(-retval));
+		abort();
+	}
+	if ((superblock.features & FS_FEAT_SNAPSHOTS) && (retval = snapshots_load()) != 0){
+		fprintf(stderr, "fs_init: cannot load snapshots: %s\n", strerror(-retval));
+		abort();
+	}
+	if (conn != NULL){
+		/* take written data spliced from the FUSE device, and splice read data to it */
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+	}
+	return NULL;
+}
+
+
+/* getattr by inode number */
+int fs_iattr(int inode_num, struct stat *sb){
+	struct fs_inode inode_of_file;
+	struct fs_inode_ext ext;
+	if (read_inode_ext(inode_num, &inode_of_file, &ext) != 0){
+		return -EIO;
+	}
+	inode_to_stat(inode_num, &inode_of_file, &ext, sb);
+	return 0;
+}
+
+/*
+ * getattr - get file or directory attributes. For a description of
+ * the fields in 'struct stat', see 'man lstat'.
+ *
+ * st_nlink counts the names of a file, and is 1 for a directory. With
+ * 64-byte inodes st_atime is st_mtime and the timestamps have no
+ * nanoseconds.
+ *
+ * @param path: the file path
+ * @param sb: pointer to stat struct
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOENT  - a component of the path is not present
+ *	-ENOTDIR - an intermediate component of path not a directory
+*/
+static int fs_getattr(const char *path, struct stat *sb)
+{
+	if (path[0] != '/'){
+		fprintf(stderr, "Error: stat must be used with an absolute path\n");
+		return -EINVAL;
+	}
+	if (is_stats_file(path)){
+		fs_stats_getattr(sb);
+		return 0;
+	}
+	int inode_number_of_file = inode_from_full_path(path);
+	if (inode_number_of_file == -1){
+		return -EIO;
+	}
+	if (inode_number_of_file < 0){
+		return inode_number_of_file;
+	}
+	return fs_iattr(inode_number_of_file, sb);
+}
+
+/* opendir by inode number */
+int fs_iopendir(int inode_num){
+	struct fs_inode inode;
+	if (read_inode(inode_num, &inode) != 0){
+		return -EIO;
+	}
+	if (!S_ISDIR(inode.mode)){
+		return -ENOTDIR; 
+	}
+	return 0;
+}
+
+/*
+ * opendir - open file directory
+ *
+ * You can save information about the open directory in fi->fh. 
+ * If you allocate memory, free it in fs_releasedir.
+ *
+ * @param path: the file path
+ * @param fi: fuse file system information
+ *
+ * @return: 0 if successful, or -error number
+ *	-ENOENT  - a component of the path is not present
+ *	-ENOTDIR - an intermediate component of path not a directory
+*/
+
+static int fs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	int inode_number = inode_from_full_path(path);
+	if (inode_number == -1){
+		return -EIO;
+	}
+	if (inode_number < 0){
+		return inode_number;
+	}
+	return fs_iopendir(inode_number);
+}
+
+
+/* readdir by inode number */
+int fs_ireaddir(int inode_num, void *ptr, fs_filler_t filler, off_t offset){
+	struct fs_inode inode;
+	struct fs_inode_ext ext;
+	if (read_inode_ext(inode_num, &inode, &ext) != 0){
+		return -EIO;
+	}
+	if (!S_ISDIR(inode.mode)){
+		return -ENOTDIR; 
+	}
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	if (disk->ops->read(disk, inode.direct[0], 1, entries) != SUCCESS){
+		return -EIO;
+	}
+	int slots[DIRENTS_PER_BLK], nums[DIRENTS_PER_BLK], count = 0;
+	for (int i = (offset > 0) ? offset : 0; i < DIRENTS_PER_BLK; i++){
+		if (entries[i].valid){
+			slots[count] = i;
+			nums[count++] = entries[i].inode;
+		}
+	}
+	struct fs_inode inodes[DIRENTS_PER_BLK];
+	struct fs_inode_ext exts[DIRENTS_PER_BLK];
+	if (read_inodes(count, nums, inodes, exts) != 0){
+		return -EIO;
+	}
+	for (int i = 0; i < count; i++){
+		struct fs_dirent *entry = &entries[slots[i]];
+		struct stat sb;
+		inode_to_stat(nums[i], &inodes[i], &exts[i], &sb);
+		dcache_insert(inode_num, entry->name, nums[i]);
+		if (filler(ptr, entry->name, &sb, slots[i] + 1) != 0){
+			break;
+		}
+	}
+	touch_atime(inode_num, &inode, &ext);
+	return 0;
+}
+
+/*
+    readdir - get directory contents
+
+    For each entry in the directory, invoke the 'filler' function, 
+	which is passed as a function pointer, as follows:
+    filler(buf, <name>, <statbuf>, <offset of next entry>) 
+	where <statbuf> is a struct stat, just like in getattr.
+	Listing stops early when filler returns nonzero; the offset
+	it was given resumes it. The entries' inodes are read a block
+	of the inode table at a time and left in the inode cache, and
+	their names in the directory entry cache, so getattr calls
+	that follow need no disk reads.
+
+    @param path: the directory path
+    @param ptr: filler buf pointer
+    @param filler filler function to call for each entry
+    @param offset: index of the entry to start at, 0 for the first
+    @param fi: the fuse file information -- you do not have to use it
+
+    @return: 0 if successful, or -error number
+    	-ENOENT  - a component of the path is not present
+    	-ENOTDIR - an intermediate component of path not a directory
+*/
+static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	int inode_number = inode_from_full_path(path);
+	if (inode_number == -1){
+		return -EIO;
+	}
+	if (inode_number < 0){
+		return inode_number;
+	}
+	return fs_ireaddir(inode_number, ptr, filler, offset);
+}
+
+/*
+ * Release resources when directory is closed.
+ * If you allocate memory in fs_opendir, free it here.
+ *
+ * @param path: the directory path
+ * @param fi: fuse file system information -- you do not have to use it
+ *
+ * @return: 0 if successful, or -error number
+ *	-ENOENT  - a component of the path is not present
+ *	-ENOTDIR - an intermediate component of path not a directory
+*/
+static int fs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	int inode_number = inode_from_full_path(path);
+	if (inode_number == -1){
+		return -EIO;
+	}
+	if (inode_number < 0){
+		return inode_number; 
+	}
+	struct fs_inode inode;
+	if (read_inode(inode_number, &inode) != 0){
+		return -EIO;
+	}
+	if (!S_ISDIR(inode.mode)){
+		return -ENOTDIR;
+	}
+	return 0;
+}
+
+/*
+ * Find a free entry in a directory for a new name.
+ *
+ * @param dir_num: the directory's inode number
+ * @param name: the new name
+ * @param dir: receives the directory's inode
+ * @param entries: receives the directory's entries
+ * @return: index of a free entry, or -error number
+ * 	-ENOTDIR  - dir_num not a directory
+ * 	-EEXIST   - name already exists
+ * 	-ENOSPC   - directory full
+ * 	-ENAMETOOLONG - name too long
+ */
+static int new_entry_at(int dir_num, const char *name, struct fs_inode *dir, struct fs_dirent *entries){
+	if (strlen(name) >= FS_FILENAME_SIZE){
+		return -ENAMETOOLONG;
+	}
+	if (read_inode(dir_num, dir) != 0){
+		return -EIO;
+	}
+	if (!S_ISDIR(dir->mode)){
+		return -ENOTDIR;
+	}
+	if (disk->ops->read(disk, dir->direct[0], 1, entries) != SUCCESS){
+		return -EIO;
+	}
+	int entry_index = -ENOSPC;
+	for (int i = 0; i < DIRENTS_PER_BLK; i++){
+		if (!entries[i].valid){
+			if (entry_index < 0){
+				entry_index = i;
+			}
+			continue;
+		}
+		if (!strcmp(entries[i].name, name)){
+			return -EEXIST;
+		}
+	}
+	return entry_index;
+}
+
+/*
+ * Store a symbolic link's target as the contents of its new inode:
+ * inline if it fits, so reading it back needs no block read, and in
+ * blocks otherwise.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int set_link_target(struct fs_inode *inode, int goal, const char *target){
+	size_t len = strlen(target);
+	inode->size = len;
+	if (len <= FS_INLINE_SIZE){
+		int retval = make_inline(inode);
+		if (retval == 0){
+			memcpy(inode->inline_data, target, len);
+		}
+		return retval;
+	}
+	char block[FS_BLOCK_SIZE];
+	for (size_t done = 0; done < len; done += FS_BLOCK_SIZE){
+		size_t n = (len - done < FS_BLOCK_SIZE) ? len - done : FS_BLOCK_SIZE;
+		memset(block, 0, FS_BLOCK_SIZE);
+		memcpy(block, target + done, n);
+		int retval = put_block_in_file(inode, done / FS_BLOCK_SIZE, goal, block);
+		if (retval != 0){
+			return retval;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Create an empty file or directory, or a symbolic link, in a directory.
+ *
+ * @param dir_num: the directory's inode number
+ * @param name: name of the new entry
+ * @param mode: complete mode of the new inode, S_IFREG, S_IFDIR or S_IFLNK
+ * @param uid: owner
+ * @param gid: group
+ * @param target: the target of a symbolic link, NULL otherwise
+ * @return: the new inode number, or -error number as for new_entry_at
+ * 	-ENOSPC   - free inode or block not available
+ */
+static int create_at(int dir_num, const char *name, mode_t mode, uid_t uid, gid_t gid, const char *target){
+	struct fs_inode dir_inode;
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	dirty_owner = dir_num;
+	int entry_index = new_entry_at(dir_num, name, &dir_inode, entries);
+	if (entry_index < 0){
+		return entry_index;
+	}
+	bool is_dir = S_ISDIR(mode);
+	int new_inode_num = allocate_inode(dir_num, is_dir);
+	if (new_inode_num < 0){
+		return new_inode_num;
+	}
+	struct fs_inode new_inode = {
+		.uid = uid,
+		.gid = gid,
+		.mode = mode,
+		.size = 0,
+	};
+	if ((dir_inode.flags & FS_INODE_COMPRESSED) && (is_dir || S_ISREG(mode))){
+		new_inode.flags = FS_INODE_COMPRESSED;
+	}
+	if (is_dir){
+		/* the directory block goes in the new directory's group */
+		int new_block_num = allocate_block(group_of_inode(new_inode_num));
+		if (new_block_num < 0){
+			free_inode(new_inode_num);
+			return new_block_num;
+		}
+		char zeros[FS_BLOCK_SIZE];
+		memset(zeros, 0, FS_BLOCK_SIZE);
+		if (write_blocks(new_block_num, 1, zeros) != SUCCESS){
+			return -EIO;
+		}
+		new_inode.direct[0] = new_block_num;
+	}
+	if (target != NULL){
+		int retval = set_link_target(&new_inode, group_of_inode(new_inode_num), target);
+		if (retval != 0){
+			free_inode(new_inode_num);
+			return retval;
+		}
+	}
+	struct fs_inode_ext new_ext;
+	set_new_times(&new_inode, &new_ext);
+	if (write_inode_ext(new_inode_num, &new_inode, &new_ext) != 0){
+		return -EIO;
+	}
+	/* the inode reaches the disk before the entry naming it */
+	if (blkdev_barrier(disk) != SUCCESS){
+		return -EIO;
+	}
+	entries[entry_index].valid = 1;
+	entries[entry_index].isDir = is_dir;
+	entries[entry_index].inode = new_inode_num;
+	strcpy(entries[entry_index].name, name);
+	if (write_blocks(dir_inode.direct[0], 1, entries) != SUCCESS){
+		fprintf(stderr, "Error updating directory inode %d to contain new entry %s, after creating the inode for it. Disk is probably corrupt.\n", dir_num, name);
+		return -EIO;
+	}
+	dcache_insert(dir_num, name, new_inode_num);
+	return new_inode_num;
+}
+
+int fs_imknod(int dir_num, const char *name, mode_t mode, uid_t uid, gid_t gid){
+	return create_at(dir_num, name, (mode & 07777) | S_IFREG, uid, gid, NULL);
+}
+
+int fs_imkdir(int dir_num, const char *name, mode_t mode, uid_t uid, gid_t gid){
+	return create_at(dir_num, name, (mode & 07777) | S_IFDIR, uid, gid, NULL);
+}
+
+int fs_isymlink(int dir_num, const char *name, const char *target, uid_t uid, gid_t gid){
+	if (strlen(target) >= PATH_MAX){
+		return -ENAMETOOLONG;
+	}
+	return create_at(dir_num, name, S_IFLNK | 0777, uid, gid, target);
+}
+
+/*
+ * Add a directory entry for an existing file. Its link count goes up
+ * before the entry is written, so a crash can leave the count too
+ * high, leaking the file, but never too low.
+ *
+ * @param inode_num: the file, which must not be a directory
+ * @param new_dir_num: the directory for the new entry
+ * @param new_name: its name
+ * @return: 0 if successful, or -error number as for new_entry_at
+ * 	-EPERM    - inode_num is a directory
+ * 	-EMLINK   - the file has as many links as an inode can count
+ */
+int fs_ilink(int inode_num, int new_dir_num, const char *new_name){
+	struct fs_inode inode, dir_inode;
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	dirty_owner = new_dir_num;
+	if (read_inode(inode_num, &inode) != 0){
+		return -EIO;
+	}
+	if (S_ISDIR(inode.mode)){
+		return -EPERM;
+	}
+	if (inode.nlink == UINT16_MAX){
+		return -EMLINK;
+	}
+	int entry_index = new_entry_at(new_dir_num, new_name, &dir_inode, entries);
+	if (entry_index < 0){
+		return entry_index;
+	}
+	int retval = enable_feature(FS_FEAT_LINKS);
+	if (retval != 0){
+		return retval;
+	}
+	inode.nlink = (inode.nlink == 0) ? 2 : inode.nlink + 1;
+	if (write_inode(inode_num, &inode) != 0 || blkdev_barrier(disk) != SUCCESS){
+		return -EIO;
+	}
+	entries[entry_index] = (struct fs_dirent){ .valid = 1, .isDir = 0, .inode = inode_num };
+	strcpy(entries[entry_index].name, new_name);
+	if (write_blocks(dir_inode.direct[0], 1, entries) != SUCCESS){
+		return -EIO;
+	}
+	dcache_insert(new_dir_num, new_name, inode_num);
+	return 0;
+}
+
+/*
+ * Make a file no directory names, of map_blocks zeroed blocks, to hold
+ * a map the file system keeps about its blocks. It is complete on disk
+ * before the superblock can refer to it. If this fails, the inode and
+ * the blocks given to it may be lost, but nothing else changes.
+ *
+ * @return: the new inode number, or -error number
+ */
+static int create_map_file(int map_blocks){
+	int map_num = allocate_inode(superblock.root_inode, false);
+	if (map_num < 0){
+		return map_num;
+	}
+	struct fs_inode map = { .mode = S_IFREG, .size = map_blocks * FS_BLOCK_SIZE };
+	struct fs_inode_ext ext;
+	set_new_times(&map, &ext);
+	int goal = group_of_inode(map_num);
+	for (int i = 0; i < map_blocks; i++){
+		int physical = map_block(&map, i, allocate_zeroed_block_cb, &goal, false);
+		if (physical < 0){
+			return physical;
+		}
+	}
+	if (write_inode_ext(map_num, &map, &ext) != 0 || blkdev_barrier(disk) != SUCCESS){
+		return -EIO;
+	}
+	return map_num;
+}
+
+/*
+ * Make the map of block reference counts for the first clone and set
+ * FS_FEAT_REFLINK. If this fails, the map may be lost, but nothing
+ * else changes.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int refcount_create(void){
+	int map_blocks = map_blocks_needed(sizeof(uint16_t));
+	uint16_t *counts = calloc(map_blocks, FS_BLOCK_SIZE);
+	char *dirty = calloc(map_blocks, 1);
+	if (counts == NULL || dirty == NULL){
+		free(counts);
+		free(dirty);
+		return -ENOMEM;
+	}
+	int map_num = create_map_file(map_blocks);
+	int retval = (map_num < 0) ? map_num : 0;
+	if (retval == 0){
+		superblock.refcount_inode = map_num;
+		if ((retval = enable_feature(FS_FEAT_REFLINK)) != 0){
+			superblock.refcount_inode = 0;
+		}
+	}
+	if (retval != 0){
+		free(counts);
+		free(dirty);
+		return retval;
+	}
+	refcounts = counts;
+	refcount_dirty = dirty;
+	refcount_map_blocks = map_blocks;
+	return 0;
+}
+
+/* block visitor: -EMLINK if a block has as many owners as it can count */
+static int clone_check_cb(uint32_t *ptr, void *arg){
+	return (refcounts[*ptr] == UINT16_MAX) ? -EMLINK : 0;
+}
+
+/* number of indirect blocks of a file, or -error number */
+static int count_tables(struct fs_inode *inode){
+	int count = (inode->indir_1 != 0);
+	if (inode->indir_2 != 0){
+		uint32_t table[PTRS_PER_BLK];
+		if (disk->ops->read(disk, inode->indir_2, 1, table) != SUCCESS){
+			return -EIO;
+		}
+		count++;
+		for (int i = 0; i < PTRS_PER_BLK; i++){
+			count += (table[i] != 0);
+		}
+	}
+	return count;
+}
+
+/*
+ * Replace indirect block *ptr of a clone, at depth 1 for a table of
+ * data blocks or 2 for a table of tables, with a copy from pool, and
+ * take a share of each data block it leads to, counting them in
+ * *taken.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int clone_table(uint32_t *ptr, int depth, struct block_pool *pool, int *taken){
+	if (*ptr == 0){
+		return 0;
+	}
+	uint32_t table[PTRS_PER_BLK];
+	if (disk->ops->read(disk, *ptr, 1, table) != SUCCESS){
+		return -EIO;
+	}
+	for (int i = 0; i < PTRS_PER_BLK; i++){
+		if (table[i] == 0 || table[i] == FS_CLUSTER_COMPRESSED){
+			continue;
+		}
+		if (depth == 1){
+			refcount_get(table[i]);
+			(*taken)++;
+		} else {
+			int retval = clone_table(&table[i], 1, pool, taken);
+			if (retval != 0){
+				return retval;
+			}
+		}
+	}
+	int new_block_num = block_pool_alloc(pool);
+	if (new_block_num < 0){
+		return new_block_num;
+	}
+	if (write_blocks(new_block_num, 1, table) != SUCCESS){
+		return -EIO;
+	}
+	*ptr = new_block_num;
+	return 0;
+}
+
+/* block visitor: give back one of the shares a failed clone took, stopping with 1 once none are left */
+static int clone_drop_cb(uint32_t *ptr, void *arg){
+	int *left = arg;
+	if (*left == 0){
+		return 1;
+	}
+	refcounts[*ptr]--;
+	refcount_dirty[*ptr * sizeof(uint16_t) / FS_BLOCK_SIZE] = 1;
+	(*left)--;
+	return 0;
+}
+
+/*
+ * Make a new file in a directory with the contents of a regular file,
+ * sharing its data blocks until either file writes them. The clone
+ * gets indirect blocks of its own, the source's owner and mode, and
+ * new times.
+ *
+ * @return: the new inode number, or -error number as for new_entry_at
+ * 	-EISDIR   - the source is a directory
+ * 	-EINVAL   - the source is not a regular file
+ * 	-EMLINK   - a block of the source is shared too many times
+ * 	-ENOSPC   - free inode or block not available
+ */
+static int fs_iclone(int inode_num, int dir_num, const char *name){
+	struct fs_inode inode, dir_inode;
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	dirty_owner = dir_num;
+	if (read_inode(inode_num, &inode) != 0){
+		return -EIO;
+	}
+	if (S_ISDIR(inode.mode)){
+		return -EISDIR;
+	}
+	if (!S_ISREG(inode.mode)){
+		return -EINVAL;
+	}
+	int entry_index = new_entry_at(dir_num, name, &dir_inode, entries);
+	if (entry_index < 0){
+		return entry_index;
+	}
+	bool inline_data = (inode.flags & FS_INODE_INLINE) != 0;
+	int retval = 0;
+	if (!inline_data && refcounts == NULL && (retval = refcount_create()) != 0){
+		return retval;
+	}
+	if (!inline_data && (retval = walk_blocks(&inode, clone_check_cb, NULL)) != 0){
+		return retval;
+	}
+	int tables = inline_data ? 0 : count_tables(&inode);
+	if (tables < 0){
+		return tables;
+	}
+	int new_inode_num = allocate_inode(dir_num, false);
+	if (new_inode_num < 0){
+		return new_inode_num;
+	}
+	struct block_pool pool = { .blocks = NULL, .count = 0, .next = 0 };
+	if (tables > 0 && (retval = block_pool_reserve(&pool, tables, group_of_inode(new_inode_num))) != 0){
+		free_inode(new_inode_num);
+		return retval;
+	}
+	struct fs_inode clone = inode;
+	clone.nlink = 0;
+	int taken = 0; /* shares of the source's blocks taken, in the order walk_data_blocks visits them */
+	if (!inline_data){
+		for (int i = 0; i < N_DIRECT; i++){
+			if (clone.direct[i] != 0 && clone.direct[i] != FS_CLUSTER_COMPRESSED){
+				refcount_get(clone.direct[i]);
+				taken++;
+			}
+		}
+		retval = clone_table(&clone.indir_1, 1, &pool, &taken);
+		if (retval == 0){
+			retval = clone_table(&clone.indir_2, 2, &pool, &taken);
+		}
+		/* the counts and the clone's tables reach the disk before the clone */
+		if (retval == 0){
+			retval = refcount_flush();
+		}
+		if (retval == 0 && blkdev_barrier(disk) != SUCCESS){
+			retval = -EIO;
+		}
+	}
+	struct fs_inode_ext clone_ext;
+	if (retval == 0){
+		set_new_times(&clone, &clone_ext);
+		if (write_inode_ext(new_inode_num, &clone, &clone_ext) != 0 || blkdev_barrier(disk) != SUCCESS){
+			retval = -EIO;
+		}
+	}
+	if (retval == 0){
+		entries[entry_index] = (struct fs_dirent){ .valid = 1, .isDir = 0, .inode = new_inode_num };
+		strcpy(entries[entry_index].name, name);
+		if (write_blocks(dir_inode.direct[0], 1, entries) != SUCCESS){
+			retval = -EIO;
+		}
+	}
+	if (retval != 0){
+		/*
+		 * Nothing names the clone: give back the shares it took, which
+		 * reach the disk with the next change to the counts, and its
+		 * tables, which were taken from the pool.
+		 */
+		walk_data_blocks(&inode, clone_drop_cb, &taken);
+		pool.next = 0;
+	}
+	if (tables > 0){
+		block_pool_release(&pool);
+	}
+	if (retval != 0){
+		free_inode(new_inode_num);
+		return retval;
+	}
+	dcache_insert(dir_num, name, new_inode_num);
+	return new_inode_num;
+}
+
+/*
+ * Read a symbolic link's target into buf as a string, cut short to
+ * fit size bytes.
+ *
+ * @return: 0 if successful, or -error number
+ * 	-EINVAL   - not a symbolic link
+ */
+int fs_ireadlink(int inode_num, char *buf, size_t size){
+	struct fs_inode inode;
+	if (read_inode(inode_num, &inode) != 0){
+		return -EIO;
+	}
+	if (!S_ISLNK(inode.mode) || size == 0){
+		return -EINVAL;
+	}
+	size_t len = (inode.size < size) ? inode.size : size - 1;
+	if (inode.flags & FS_INODE_INLINE){
+		memcpy(buf, inode.inline_data, len);
+	} else {
+		int retval = fs_iread(inode_num, buf, len, 0);
+		if (retval < 0){
+			return retval;
+		}
+	}
+	buf[len] = '\0';
+	return 0;
+}
+
+/*
+ * mknod - create a new file with permissions (mode & 01777). Behavior undefined when mode bits other than the low 9 bits are used.
+ * 	
+ * @param path: the file path
+ * @param mode: indicating block or character-special file
+ * @param dev: the character or block I/O device specification - you do not have to use it
+ * 			 
+ * @return: 0 if successful, or -error number
+ * 	-ENOTDIR  - component of path not a directory
+ * 	-EEXIST   - file already exists
+ * 	-ENOSPC   - free inode not available
+ * 	-ENOSPC   - results in >32 entries in directory
+*/
+static int fs_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	if (path[0] == '\0'){
+		return -EINVAL;
+	}
+	if (!strcmp(path, "/") || is_stats_file(path)){
+		return -EEXIST;
+	}
+	char temp_path[MAX_PATH];
+	char new_file_name[FS_FILENAME_SIZE];
+	if (split_path(path, temp_path, new_file_name) == -ENAMETOOLONG){
+		return -ENAMETOOLONG;
+	}
+	int inode_num_of_dir = inode_from_full_path(temp_path);
+	if (inode_num_of_dir == -1){
+		return -EIO;
+	}
+	if (inode_num_of_dir < 0){
+		return inode_num_of_dir;
+	}
+	struct fuse_context *ctx = fuse_get_context();
+	int retval = fs_imknod(inode_num_of_dir, new_file_name, (mode & 01777 & ~ctx->umask) | S_IFREG, ctx->uid, ctx->gid);
+	return (retval < 0) ? retval : 0;
+}
+
+/*
+ * 	mkdir - create a directory with the given mode. Behavior undefined when mode bits other than the low 9 bits are used.
+ *
+ * 	@param path: path to directory
+ * 	@param mode: the mode for the new directory
+ *
+ * 	@return: 0 if successful, or -error number
+ * 		-ENOTDIR  - component of path not a directory
+ * 		-EEXIST   - file already exists
+ * 		-ENOSPC   - free inode not available
+ * 		-ENOSPC   - results in >32 entries in directory
+*/
+static int fs_mkdir(const char *path, mode_t mode)
+{
+	if (path[0] == '\0'){
+		return -EINVAL;
+	}
+	if (!strcmp(path, "/")){
+		return -EEXIST;
+	}
+	char temp_path[MAX_PATH];
+	char new_dir_name[FS_FILENAME_SIZE];
+	if (split_path(path, temp_path, new_dir_name) == -ENAMETOOLONG){
+		return -ENAMETOOLONG;
+	}
+	int inode_num_of_containing_dir = inode_from_full_path(temp_path);
+	if (inode_num_of_containing_dir == -1){
+		return -EIO;
+	}
+	if (inode_num_of_containing_dir < 0){
+		return inode_num_of_containing_dir;
+	}
+	struct fuse_context *ctx = fuse_get_context();
+	int retval = fs_imkdir(inode_num_of_containing_dir, new_dir_name, mode & 01777 & ~ctx->umask, ctx->uid, ctx->gid);
+	return (retval < 0) ? retval : 0;
+}
+
+
+static void unset_block_bit(int block_num, char *block_bitmap){
+	if (block_num != 0){
+		block_bitmap[(block_num) / 8] &= ~(1 << (block_num % 8));
+	}
+}
+
+static int unset_block_bit_cb(uint32_t *ptr, void *arg){
+	if (block_shared(*ptr)){
+		return refcount_put(*ptr);
+	}
+	unset_block_bit(*ptr, arg);
+	return 0;
+}
+
+/*
+ * Clear the bits of all blocks of a file, including indirect blocks,
+ * except those shared with a clone, which the file gives up instead.
+ */
+static int unset_bits(struct fs_inode *inode, char *block_bitmap){
+	return walk_blocks(inode, unset_block_bit_cb, block_bitmap);
+}
+
+static void ccache_forget(int inode_num);
+
+/*
+ * Free an inode and all of its blocks.
+ *
+ * @param inode_num: an inode no directory entry refers to
+ * @return: 0 if successful, or -error number
+ */
+int fs_ifree(int inode_num){
+	struct fs_inode inode;
+	if (read_inode(inode_num, &inode) != 0){
+		return -EIO;
+	}
+	struct arena_mark mark = arena_mark();
+	char *block_bitmap = arena_alloc(block_bitmap_bytes);
+	if (block_bitmap == NULL){
+		return -ENOMEM;
+	}
+	read_block_bitmap(block_bitmap);
+	int retval = 0;
+	if (unset_bits(&inode, block_bitmap) != 0 || write_block_bitmap(block_bitmap) != 0){
+		retval = -EIO;
+	}
+	arena_release(mark);
+	if (retval == 0 && (retval = free_inode(inode_num)) != 0){
+		fprintf(stderr, "Error updating inode bitmap when freeing inode %d. Disk is probably corrupt.\n", inode_num);
+	}
+	if (retval == 0){
+		retval = refcount_commit();
+	} else {
+		refcount_abort();
+	}
+	dirty_free(dirty_take(inode_num));
+	ccache_forget(inode_num);
+	return retval;
+}
+
+/*
+ * Drop one of an inode's links after removing a directory entry that
+ * named it, freeing the inode along with its last link.
+ *
+ * @param orphan: if not NULL, receives the inode number if that was
+ *   the last link, leaving the inode allocated for the caller to free
+ *   with fs_ifree, or 0 if not
+ * @return: 0 if successful, or -error number
+ */
+static int drop_link(int inode_num, int *orphan){
+	struct fs_inode inode;
+	if (read_inode(inode_num, &inode) != 0){
+		return -EIO;
+	}
+	if (inode.nlink > 1){
+		inode.nlink--;
+		if (orphan != NULL){
+			*orphan = 0;
+		}
+		return write_inode(inode_num, &inode);
+	}
+	if (orphan != NULL){
+		*orphan = inode_num;
+		return 0;
+	}
+	return fs_ifree(inode_num);
+}
+
+/*
+ * Remove a file or empty directory from a directory.
+ *
+ * @param dir_num: the directory's inode number
+ * @param name: the name to remove
+ * @param want_dir: whether name must be a directory, or must not be
+ * @param orphan: as for drop_link
+ * @return: 0 if successful, or -error number
+ */
+static int remove_at(int dir_num, const char *name, bool want_dir, int *orphan){
+	struct fs_inode dir_inode;
+	dirty_owner = dir_num;
+	if (read_inode(dir_num, &dir_inode) != 0){
+		return -EIO;
+	}
+	if (!S_ISDIR(dir_inode.mode)){
+		return -ENOTDIR;
+	}
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	if (disk->ops->read(disk, dir_inode.direct[0], 1, entries) != SUCCESS){
+		return -EIO;
+	}
+	int entry_index = -1;
+	for (int i = 0; i < DIRENTS_PER_BLK; i++){
+		if (entries[i].valid && !strcmp(entries[i].name, name)){
+			entry_index = i;
+			break;
+		}
+	}
+	if (entry_index == -1){
+		return -ENOENT;
+	}
+	int inode_num = entries[entry_index].inode;
+	struct fs_inode inode;
+	if (read_inode(inode_num, &inode) != 0){
+		return -EIO;
+	}
+	if (S_ISDIR(inode.mode) != want_dir){
+		return want_dir ? -ENOTDIR : -EISDIR;
+	}
+	if (want_dir){
+		struct fs_dirent children[DIRENTS_PER_BLK];
+		if (disk->ops->read(disk, inode.direct[0], 1, children) != SUCCESS){
+			return -EIO;
+		}
+		for (int i = 0; i < DIRENTS_PER_BLK; i++){
+			if (children[i].valid){
+				return -ENOTEMPTY;
+			}
+		}
+	}
+	/* drop the entry first, so a failure below leaks the inode rather than leaving a dangling entry */
+	entries[entry_index].valid = 0;
+	dcache_remove(dir_num, name);
+	pcache_invalidate();
+	if (write_blocks(dir_inode.direct[0], 1, entries) != SUCCESS){
+		fprintf(stderr, "Error updating contents of directory inode %d when deleting '%s'. This directory is now corrupt.\n", dir_num, name);
+		return -EIO;
+	}
+	if (blkdev_barrier(disk) != SUCCESS){
+		return -EIO;
+	}
+	return drop_link(inode_num, orphan);
+}
+
+int fs_iunlink(int dir_num, const char *name, int *orphan){
+	return remove_at(dir_num, name, false, orphan);
+}
+
+int fs_irmdir(int dir_num, const char *name, int *orphan){
+	return remove_at(dir_num, name, true, orphan);
+}
+
+/*
+ * unlink - delete a file
+ *
+ * @param path: path to file
+ *
+ * @return 0 if successful, or error value
+ *	-ENOENT   - file does not exist
+ * 	-ENOTDIR  - component of path not a directory
+ * 	-EISDIR   - cannot unlink a directory
+*/
+static int fs_unlink(const char *path)
+{
+	if (path[0] == '\0'){
+		return -EINVAL;
+	}
+	if (!strcmp(path, "/")){
+		return -EISDIR;
+	}
+	if (is_stats_file(path)){
+		return -EPERM;
+	}
+	char temp_path[MAX_PATH];
+	char new_file_name[FS_FILENAME_SIZE];
+	if (split_path(path, temp_path, new_file_name) == -ENAMETOOLONG){
+		return -ENOENT; 
+	}
+	int inode_num_of_dir = inode_from_full_path(temp_path);
+	if (inode_num_of_dir == -1){
+		return -EIO;
+	}
+	if (inode_num_of_dir < 0){
+		return inode_num_of_dir;
+	}
+	return fs_iunlink(inode_num_of_dir, new_file_name, NULL);
+}
+
+/*
+ * rmdir - remove a directory
+ *
+ * @param path: the path of the directory
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOENT   - file does not exist
+ *  	-ENOTDIR  - component of path not a directory
+ *  	-ENOTDIR  - path not a directory
+ *  	-ENOEMPTY - directory not empty
+*/
+
+static int fs_rmdir(const char *path)
+{
+	if (path[0] == '\0'){
+		return -EINVAL;
+	}
+	if (!strcmp(path, "/")){
+		return -ENOTEMPTY;
+	}
+	char temp_path[MAX_PATH];
+	char dir_name[FS_FILENAME_SIZE];
+	if (split_path(path, temp_path, dir_name) == -ENAMETOOLONG){
+		return -ENOENT;
+	}
+
+	int inode_num_of_containing_dir = inode_from_full_path(temp_path);
+	if (inode_num_of_containing_dir == -1){
+		return -EIO;
+	}
+	if (inode_num_of_containing_dir < 0){
+		return inode_num_of_containing_dir;
+	}
+	return fs_irmdir(inode_num_of_containing_dir, dir_name, NULL);
+}
+
+/* index of the valid entry with a name in a directory block, or -1 */
+static int find_entry(const struct fs_dirent *entries, const char *name){
+	for (int i = 0; i < DIRENTS_PER_BLK; i++){
+		if (entries[i].valid && !strcmp(entries[i].name, name)){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Rename an entry, within its directory or into another, replacing
+ * any entry of the new name. Only directory entries change: the entry
+ * is added to the destination, which reaches the disk first, and then
+ * removed from the source, so a crash in between leaves the file with
+ * both names rather than none. The caller makes sure a directory is
+ * not moved into itself or below itself.
+ *
+ * @param dir_num: inode number of the source directory
+ * @param name: the entry to rename
+ * @param new_dir_num: inode number of the destination directory
+ * @param new_name: the new name
+ * @param orphan: as for drop_link, for the inode of the entry replaced;
+ *   receives 0 if there was none
+ * @return: 0 if successful, or -error number as for fs_rename
+ */
+int fs_irename(int dir_num, const char *name, int new_dir_num, const char *new_name, int *orphan){
+	if (orphan != NULL){
+		*orphan = 0;
+	}
+	if (strlen(new_name) >= FS_FILENAME_SIZE){
+		return -ENAMETOOLONG;
+	}
+	struct fs_inode dir_inode, new_dir_inode;
+	struct fs_dirent entries[DIRENTS_PER_BLK], other_entries[DIRENTS_PER_BLK];
+	struct fs_dirent *new_entries = entries;
+	if (read_inode(dir_num, &dir_inode) != 0){
+		return -EIO;
+	}
+	if (!S_ISDIR(dir_inode.mode)){
+		return -ENOTDIR;
+	}
+	if (disk->ops->read(disk, dir_inode.direct[0], 1, entries) != SUCCESS){
+		return -EIO;
+	}
+	new_dir_inode = dir_inode;
+	if (new_dir_num != dir_num){
+		if (read_inode(new_dir_num, &new_dir_inode) != 0){
+			return -EIO;
+		}
+		if (!S_ISDIR(new_dir_inode.mode)){
+			return -ENOTDIR;
+		}
+		if (disk->ops->read(disk, new_dir_inode.direct[0], 1, other_entries) != SUCCESS){
+			return -EIO;
+		}
+		new_entries = other_entries;
+	}
+	int entry_index = find_entry(entries, name);
+	if (entry_index == -1){
+		return -ENOENT;
+	}
+	int inode_num = entries[entry_index].inode;
+	int new_index = find_entry(new_entries, new_name);
+	int replaced = 0;
+	if (new_index >= 0){
+		replaced = new_entries[new_index].inode;
+		if (replaced == inode_num){
+			return 0;
+		}
+		if (!new_entries[new_index].isDir != !entries[entry_index].isDir){
+			return entries[entry_index].isDir ? -ENOTDIR : -EISDIR;
+		}
+		if (new_entries[new_index].isDir){
+			struct fs_inode target;
+			struct fs_dirent children[DIRENTS_PER_BLK];
+			if (read_inode(replaced, &target) != 0
+					|| disk->ops->read(disk, target.direct[0], 1, children) != SUCCESS){
+				return -EIO;
+			}
+			for (int i = 0; i < DIRENTS_PER_BLK; i++){
+				if (children[i].valid){
+					return -ENOTEMPTY;
+				}
+			}
+		}
+	} else if (new_dir_num == dir_num){
+		new_index = entry_index;
+	} else {
+		for (int i = 0; i < DIRENTS_PER_BLK && new_index < 0; i++){
+			if (!new_entries[i].valid){
+				new_index = i;
+			}
+		}
+		if (new_index < 0){
+			return -ENOSPC;
+		}
+	}
+	dcache_remove(dir_num, name);
+	dcache_remove(new_dir_num, new_name);
+	pcache_invalidate();
+	new_entries[new_index] = entries[entry_index];
+	strcpy(new_entries[new_index].name, new_name);
+	if (new_entries != entries){
+		dirty_owner = new_dir_num;
+		if (write_blocks(new_dir_inode.direct[0], 1, new_entries) != SUCCESS){
+			return -EIO;
+		}
+		if (blkdev_barrier(disk) != SUCCESS){
+			return -EIO;
+		}
+	}
+	if (new_index != entry_index){
+		entries[entry_index].valid = 0;
+	}
+	dirty_owner = dir_num;
+	if (write_blocks(dir_inode.direct[0], 1, entries) != SUCCESS){
+		fprintf(stderr, "Error removing '%s' from directory inode %d after renaming it. The file now has two names.\n", name, dir_num);
+		return -EIO;
+	}
+	dcache_insert(new_dir_num, new_name, inode_num);
+	if (replaced == 0){
+		return 0;
+	}
+	if (blkdev_barrier(disk) != SUCCESS){
+		return -EIO;
+	}
+	return drop_link(replaced, orphan);
+}
+
+/*
+ * rename - rename a file or directory, moving it to another directory
+ * if the destination is in one, and replacing the destination if it
+ * exists.
+ *
+ *  @param src_path: the source path
+ *  @param dst_path: the destination path
+ *
+ *  @return: 0 if successful, or -error number
+ *  -ENOENT - source file or directory does not exist
+ *  -ENOTDIR - component of source or target path not a directory
+ *  -ENOTDIR - source is a directory and destination is not
+ *  -EISDIR - destination is a directory and source is not
+ *  -ENOTEMPTY - destination is a directory that is not empty
+ *  -EINVAL - moving a directory below itself
+ *  -ENOSPC - destination directory full
+*/
+static int fs_rename(const char *src_path, const char *dst_path)
+{
+	if (src_path[0] == '\0' || dst_path[0] == '\0'){
+		return -EINVAL;
+	}
+	if (!strcmp(src_path, "/") || !strcmp(dst_path, "/")){
+		return -EINVAL;
+	}
+	if (is_stats_file(src_path) || is_stats_file(dst_path)){
+		return -EPERM;
+	}
+	size_t src_len = strlen(src_path);
+	if (!strncmp(dst_path, src_path, src_len) && dst_path[src_len] == '/'){
+		return -EINVAL;
+	}
+	char src_prefix[MAX_PATH];
+	char src_suffix[FS_FILENAME_SIZE];
+	if (split_path(src_path, src_prefix, src_suffix) == -ENAMETOOLONG){
+		return -ENOENT; 
+	}
+	char dest_prefix[MAX_PATH];
+	char dest_suffix[FS_FILENAME_SIZE];
+	if (split_path(dst_path, dest_prefix, dest_suffix) == -ENAMETOOLONG){
+		return -ENAMETOOLONG;
+	}
+	int inode_num_of_containing_dir = inode_from_full_path(src_prefix);
+	if (inode_num_of_containing_dir == -1){
+		return -EIO;
+	}
+	if (inode_num_of_containing_dir < 0){
+		return inode_num_of_containing_dir;
+	}
+	int inode_num_of_dest_dir = inode_from_full_path(dest_prefix);
+	if (inode_num_of_dest_dir == -1){
+		return -EIO;
+	}
+	if (inode_num_of_dest_dir < 0){
+		return inode_num_of_dest_dir;
+	}
+	return fs_irename(inode_num_of_containing_dir, src_suffix, inode_num_of_dest_dir, dest_suffix, NULL);
+}
+
+/*
+ * link - make a new name for a file
+ *
+ * @param path: the existing file
+ * @param new_path: the new name
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOENT   - file does not exist
+ * 	-ENOTDIR  - component of path not a directory
+ * 	-EEXIST   - new_path already exists
+ * 	-EPERM    - file is a directory
+ * 	-EMLINK   - file has too many links
+ * 	-ENOSPC   - results in >32 entries in directory
+*/
+static int fs_link(const char *path, const char *new_path)
+{
+	if (path[0] == '\0' || new_path[0] == '\0'){
+		return -EINVAL;
+	}
+	if (is_stats_file(path) || is_stats_file(new_path)){
+		return -EPERM;
+	}
+	int inode_num = inode_from_full_path(path);
+	if (inode_num == -1){
+		return -EIO;
+	}
+	if (inode_num < 0){
+		return inode_num;
+	}
+	char temp_path[MAX_PATH];
+	char new_file_name[FS_FILENAME_SIZE];
+	if (split_path(new_path, temp_path, new_file_name) == -ENAMETOOLONG){
+		return -ENAMETOOLONG;
+	}
+	int inode_num_of_dir = inode_from_full_path(temp_path);
+	if (inode_num_of_dir == -1){
+		return -EIO;
+	}
+	if (inode_num_of_dir < 0){
+		return inode_num_of_dir;
+	}
+	return fs_ilink(inode_num, inode_num_of_dir, new_file_name);
+}
+
+/*
+ * symlink - make a symbolic link
+ *
+ * @param target: what the link points to, stored as given
+ * @param path: the link
+ *
+ * @return: 0 if successful, or -error number as for mknod
+*/
+static int fs_symlink(const char *target, const char *path)
+{
+	if (path[0] == '\0'){
+		return -EINVAL;
+	}
+	if (!strcmp(path, "/") || is_stats_file(path)){
+		return -EEXIST;
+	}
+	char temp_path[MAX_PATH];
+	char new_file_name[FS_FILENAME_SIZE];
+	if (split_path(path, temp_path, new_file_name) == -ENAMETOOLONG){
+		return -ENAMETOOLONG;
+	}
+	int inode_num_of_dir = inode_from_full_path(temp_path);
+	if (inode_num_of_dir == -1){
+		return -EIO;
+	}
+	if (inode_num_of_dir < 0){
+		return inode_num_of_dir;
+	}
+	struct fuse_context *ctx = fuse_get_context();
+	int retval = fs_isymlink(inode_num_of_dir, new_file_name, target, ctx->uid, ctx->gid);
+	return (retval < 0) ? retval : 0;
+}
+
+/*
+ * readlink - read the target of a symbolic link
+ *
+ * @param path: the link
+ * @param buf: receives the target, with a trailing NUL
+ * @param size: size of buf; a longer target is cut short
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOENT   - link does not exist
+ * 	-EINVAL   - path not a symbolic link
+*/
+static int fs_readlink(const char *path, char *buf, size_t size)
+{
+	if (is_stats_file(path)){
+		return -EINVAL;
+	}
+	int inode_num = inode_from_full_path(path);
+	if (inode_num == -1){
+		return -EIO;
+	}
+	if (inode_num < 0){
+		return inode_num;
+	}
+	return fs_ireadlink(inode_num, buf, size);
+}
+
+/* chmod by inode number */
+int fs_ichmod(int inode_num, mode_t mode){
+	struct fs_inode inode;
+	if (read_inode(inode_num, &inode) != 0){
+		return -EIO;
+	}
+	inode.mode = (inode.mode & ~0777) | (mode & 0777);
+	return write_inode(inode_num, &inode);
+}
+
+/*
+ * chmod - change file permissions
+ *
+ * @param path: the file or directory path
+ * @param mode: the mode_t mode value -- see man 'chmod'
+ * for description
+ *
+ *  @return: 0 if successful, or -error number
+ *  	-ENOENT   - file does not exist
+ *  	-ENOTDIR  - component of path not a directory
+*/
+static int fs_chmod(const char *path, mode_t mode)
+{
+	if (path[0] == '\0'){
+		return -EINVAL;
+	}
+	if (is_stats_file(path)){
+		return -EPERM;
+	}
+	int inode_num = inode_from_full_path(path);
+	if (inode_num == -1){
+		return -EIO;
+	}
+	if (inode_num < 0){
+		return inode_num;
+	}
+	return fs_ichmod(inode_num, mode);
+}
+
+/* open by inode number */
+int fs_iopen(int inode_num){
+	struct fs_inode inode;
+	if (read_inode(inode_num, &inode) != 0){
+		return -EIO;
+	}
+	if (S_ISDIR(inode.mode)){
+		return -EISDIR;
+	}
+	return 0;
+}
+
+/*
+ * Open a filesystem file or directory path.
+ *
+ * @param path: the path
+ * @param fuse: file info data
+ *
+ * @return: 0 if successful, or -error number
+ *	-ENOENT - file does not exist
+ *	-ENOTDIR - component of path not a directory
+*/
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{
+	if (is_stats_file(path)){
+		if ((fi->flags & O_ACCMODE) != O_RDONLY){
+			return -EACCES;
+		}
+		/* snapshot the report so successive reads see consistent text */
+		char *text = fs_stats_text();
+		if (text == NULL){
+			return -ENOMEM;
+		}
+		fi->fh = (uint64_t)(uintptr_t)text;
+		fi->direct_io = 1; /* size reported by getattr is only a hint */
+		return 0;
+	}
+	int inode_num = inode_from_full_path(path);
+	if (inode_num == -1){
+		return -EIO;
+	}
+	if (inode_num < 0){
+		return inode_num;
+	}
+	return fs_iopen(inode_num);
+}
+
+/*
+ * Device requests in flight together, so that the transfers of one
+ * operation overlap with each other and with the indirect block reads
+ * that map them. Start them with batch_add; batch_wait must follow
+ * before the buffers are used or go away, on error paths too.
+ */
+enum { IO_BATCH = 16 };
+struct io_batch {
+	struct blkdev_req reqs[IO_BATCH];
+	int count; /* requests in flight */
+	int status; /* 0, or -EIO once a request has failed */
+};
+
+/* wait for a batch's requests; returns 0 if all of them succeeded, or -EIO */
+static int batch_wait(struct io_batch *batch){
+	for (int i = 0; i < batch->count; i++){
+		if (blkdev_wait(disk, &batch->reqs[i]) != SUCCESS){
+			batch->status = -EIO;
+		}
+	}
+	batch->count = 0;
+	return batch->status;
+}
+
+/* start a request, first waiting for the batch if it is full */
+static int batch_add(struct io_batch *batch, bool write, int first_blk, int num_blks, void *buf){
+	if (batch->count == IO_BATCH && batch_wait(batch) != 0){
+		return -EIO;
+	}
+	struct blkdev_req *req = &batch->reqs[batch->count];
+	*req = (struct blkdev_req){ .write = write, .first_blk = first_blk, .num_blks = num_blks, .buf = buf };
+	if (blkdev_submit(disk, req) != SUCCESS){
+		return -EIO;
+	}
+	batch->count++;
+	return 0;
+}
+
+/*
+ * Check a file can be read and limit a read to its size, updating its
+ * access time.
+ *
+ * @param inode_num: the file's inode number
+ * @param inode: filled in with the file's inode
+ * @param len: bytes to read, reduced to those before end of file
+ * @param offset: where the read starts
+ * @return: 0 if successful, or -error number
+ */
+static int read_begin(int inode_num, struct fs_inode *inode, size_t *len, off_t offset){
+	struct fs_inode_ext ext;
+	if (read_inode_ext(inode_num, inode, &ext) != 0){
+		return -EIO;
+	}
+	if (S_ISDIR(inode->mode)){
+		return -EISDIR;
+	}
+	touch_atime(inode_num, inode, &ext);
+	if (offset >= inode->size){
+		*len = 0;
+	} else if (offset + *len > inode->size){
+		*len = inode->size - offset;
+	}
+	return 0;
+}
+
+/*
+ * Called by map_read for each piece of a read: 'count' blocks from
+ * 'physical' (0 for a hole) in full, or n bytes at in_block of one
+ * block, going to byte 'done' of the result.
+ */
+typedef int (*read_piece)(void *arg, int physical, int count, size_t in_block, size_t n, size_t done);
+
+/*
+ * Split a read of a block-mapped file into pieces: runs of physically
+ * contiguous whole blocks, and single blocks only partly read or not
+ * allocated.
+ */
+static int map_read(struct fs_inode *inode, size_t len, off_t offset, read_piece piece, void *arg){
+	struct map_cursor cursor = { 0 };
+	size_t done = 0;
+	while (done < len){
+		int logical = (offset + done) / FS_BLOCK_SIZE;
+		size_t in_block = (offset + done) % FS_BLOCK_SIZE;
+		int physical = logical_to_physical(inode, logical, &cursor);
+		if (physical < 0){
+			return -EIO;
+		}
+		int retval;
+		if (physical == 0 || in_block != 0 || len - done < FS_BLOCK_SIZE){
+			size_t n = FS_BLOCK_SIZE - in_block;
+			if (n > len - done){
+				n = len - done;
+			}
+			if ((retval = piece(arg, physical, 1, in_block, n, done)) != 0){
+				return retval;
+			}
+			done += n;
+			continue;
+		}
+		int run = 1;
+		while ((run + 1) * FS_BLOCK_SIZE <= len - done){
+			int next = logical_to_physical(inode, logical + run, &cursor);
+			if (next < 0){
+				return -EIO;
+			}
+			if (next != physical + run){
+				break;
+			}
+			run++;
+		}
+		if ((retval = piece(arg, physical, run, 0, run * FS_BLOCK_SIZE, done)) != 0){
+			return retval;
+		}
+		done += run * FS_BLOCK_SIZE;
+	}
+	return 0;
+}
+
+/* read a piece into memory at dst */
+static int read_piece_to(char *dst, int physical, int count, size_t in_block, size_t n){
+	if (in_block == 0 && n == count * FS_BLOCK_SIZE){
+		if (physical == 0){
+			memset(dst, 0, n);
+		} else if (disk->ops->read(disk, physical, count, dst) != SUCCESS){
+			return -EIO;
+		}
+		return 0;
+	}
+	char block[FS_BLOCK_SIZE];
+	if (physical == 0){
+		memset(block, 0, FS_BLOCK_SIZE);
+	} else if (disk->ops->read(disk, physical, 1, block) != SUCCESS){
+		return -EIO;
+	}
+	memcpy(dst, block + in_block, n);
+	return 0;
+}
+
+/* state of fs_iread */
+struct read_mem {
+	char *buf; /* the caller's buffer */
+	struct io_batch batch;
+};
+
+/* read_piece for fs_iread: runs of whole blocks are read straight into the caller's buffer, overlapped */
+static int read_piece_mem(void *arg, int physical, int count, size_t in_block, size_t n, size_t done){
+	struct read_mem *rm = arg;
+	if (physical != 0 && in_block == 0 && n == count * FS_BLOCK_SIZE){
+		return batch_add(&rm->batch, false, physical, count, rm->buf + done);
+	}
+	return read_piece_to(rm->buf + done, physical, count, in_block, n);
+}
+
+/*
+ * Compressed clusters (see fsx492.h). A file with FS_INODE_COMPRESSED
+ * is written a cluster at a time: writing part of a cluster loads the
+ * rest of it, and the whole cluster is stored again. Clusters stored
+ * plain are read as those of other files are.
+ *
+ * Decompressed clusters are kept in a cache, direct-mapped by inode
+ * and cluster number, so reading a cluster piece by piece or writing
+ * it bit by bit decompresses it once. Storing a cluster updates its
+ * entry and freeing an inode drops its entries. Readers under the
+ * shared lock fill it too, hence its own lock. With
+ * fs_options.attr_timeout set, entries expire as the inode cache's do.
+ */
+enum {
+	CLUSTER_SIZE = FS_CLUSTER_BLOCKS * FS_BLOCK_SIZE, /* bytes in a cluster */
+	FILE_BLOCKS = N_DIRECT + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK, /* logical blocks a file can have */
+	CCACHE_SIZE = 64
+};
+struct ccache_entry {
+	int inode_num; /* 0 if entry unused */
+	int cluster;
+	uint64_t loaded; /* stats_now() when cached */
+	char data[CLUSTER_SIZE];
+};
+static struct ccache_entry ccache[CCACHE_SIZE];
+static pthread_mutex_t ccache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ccache_entry *ccache_slot(int inode_num, int cluster){
+	return &ccache[((unsigned)inode_num * 31 + cluster) % CCACHE_SIZE];
+}
+
+/* copy a cluster into data if it is cached; returns whether it was */
+static bool ccache_lookup(int inode_num, int cluster, char *data){
+	bool found = false;
+	pthread_mutex_lock(&ccache_lock);
+	struct ccache_entry *e = ccache_slot(inode_num, cluster);
+	if (e->inode_num == inode_num && e->cluster == cluster && !cache_expired(e->loaded)){
+		memcpy(data, e->data, CLUSTER_SIZE);
+		found = true;
+	}
+	pthread_mutex_unlock(&ccache_lock);
+	return found;
+}
+
+/* cache the contents of a cluster, or with data NULL drop them */
+static void ccache_insert(int inode_num, int cluster, const char *data){
+	pthread_mutex_lock(&ccache_lock);
+	struct ccache_entry *e = ccache_slot(inode_num, cluster);
+	if (data != NULL){
+		e->inode_num = inode_num;
+		e->cluster = cluster;
+		e->loaded = stats_now();
+		memcpy(e->data, data, CLUSTER_SIZE);
+	} else if (e->inode_num == inode_num && e->cluster == cluster){
+		e->inode_num = 0;
+	}
+	pthread_mutex_unlock(&ccache_lock);
+}
+
+static void ccache_forget(int inode_num){
+	pthread_mutex_lock(&ccache_lock);
+	for (int i = 0; i < CCACHE_SIZE; i++){
+		if (ccache[i].inode_num == inode_num){
+			ccache[i].inode_num = 0;
+		}
+	}
+	pthread_mutex_unlock(&ccache_lock);
+}
+
+/* get the pointers of a cluster's logical blocks; those past the largest file read as 0 */
+static int cluster_pointers(struct fs_inode *inode, int cluster, uint32_t *ptrs, struct map_cursor *cursor){
+	for (int i = 0; i < FS_CLUSTER_BLOCKS; i++){
+		int logical = cluster * FS_CLUSTER_BLOCKS + i;
+		int physical = (logical < FILE_BLOCKS) ? logical_to_physical(inode, logical, cursor) : 0;
+		if (physical < 0){
+			return -EIO;
+		}
+		ptrs[i] = physical;
+	}
+	return 0;
+}
+
+/* read the blocks ptrs points to into buf, a run of consecutive blocks at a time; 0 reads as zeros */
+static int read_pointers(const uint32_t *ptrs, int count, char *buf){
+	for (int i = 0, run; i < count; i += run){
+		for (run = 1; i + run < count && ptrs[i] != 0 && ptrs[i + run] == ptrs[i] + run; run++){
+			;
+		}
+		if (ptrs[i] == 0){
+			memset(buf + i * FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE);
+		} else if (disk->ops->read(disk, ptrs[i], run, buf + i * FS_BLOCK_SIZE) != SUCCESS){
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read a whole cluster of a file, with the bytes past its data
+ * reading as 0. A compressed cluster comes from the cache if it is
+ * there, and goes there if not.
+ *
+ * @param ptrs: the cluster's pointers, from cluster_pointers
+ * @param data: CLUSTER_SIZE bytes
+ * @return: 0 if successful, or -error number
+ */
+static int cluster_load(int inode_num, int cluster, const uint32_t *ptrs, char *data){
+	if (ptrs[0] != FS_CLUSTER_COMPRESSED){
+		return read_pointers(ptrs, FS_CLUSTER_BLOCKS, data);
+	}
+	if (ccache_lookup(inode_num, cluster, data)){
+		return 0;
+	}
+	int count = 0;
+	while (count < FS_CLUSTER_BLOCKS - 1 && ptrs[count + 1] != 0){
+		count++;
+	}
+	struct arena_mark mark = arena_mark();
+	char *packed = arena_alloc_blocks(FS_CLUSTER_BLOCKS);
+	if (packed == NULL){
+		return -ENOMEM;
+	}
+	struct fs_cluster header;
+	int retval = read_pointers(ptrs + 1, count, packed);
+	if (retval == 0){
+		memcpy(&header, packed, sizeof(header));
+		if (count == 0 || header.size > CLUSTER_SIZE || header.compressed > count * FS_BLOCK_SIZE - sizeof(header)
+				|| lz4_decompress(packed + sizeof(header), header.compressed, data, header.size) != (int)header.size){
+			retval = -EIO; /* a damaged cluster */
+		}
+	}
+	arena_release(mark);
+	if (retval == 0){
+		memset(data + header.size, 0, CLUSTER_SIZE - header.size);
+		ccache_insert(inode_num, cluster, data);
+	}
+	return retval;
+}
+
+/* fs_iread of a file with FS_INODE_COMPRESSED */
+static int read_clusters(int inode_num, struct fs_inode *inode, char *buf, size_t len, off_t offset){
+	struct map_cursor cursor = { 0 };
+	struct read_mem rm = { .batch = { .count = 0 } };
+	struct arena_mark mark = arena_mark();
+	char *data = NULL;
+	int retval = 0;
+	for (size_t done = 0, n; done < len && retval == 0; done += n){
+		int cluster = (offset + done) / CLUSTER_SIZE;
+		size_t in_cluster = (offset + done) % CLUSTER_SIZE;
+		n = (len - done < CLUSTER_SIZE - in_cluster) ? len - done : CLUSTER_SIZE - in_cluster;
+		uint32_t ptrs[FS_CLUSTER_BLOCKS];
+		if ((retval = cluster_pointers(inode, cluster, ptrs, &cursor)) != 0){
+			break;
+		}
+		if (ptrs[0] != FS_CLUSTER_COMPRESSED){
+			/* only the blocks wanted, straight into buf */
+			rm.buf = buf + done;
+			retval = map_read(inode, n, offset + done, read_piece_mem, &rm);
+			continue;
+		}
+		if (data == NULL && (data = arena_alloc_blocks(FS_CLUSTER_BLOCKS)) == NULL){
+			retval = -ENOMEM;
+		} else if ((retval = cluster_load(inode_num, cluster, ptrs, data)) == 0){
+			memcpy(buf + done, data + in_cluster, n);
+		}
+	}
+	int waited = batch_wait(&rm.batch);
+	arena_release(mark);
+	return (retval != 0) ? retval : waited;
+}
+
+/* read by inode number */
+int fs_iread(int inode_num, char *buf, size_t len, off_t offset){
+	struct fs_inode inode;
+	int retval = read_begin(inode_num, &inode, &len, offset);
+	if (retval != 0 || len == 0){
+		return retval;
+	}
+	if (inode.flags & FS_INODE_INLINE){
+		memcpy(buf, inode.inline_data + offset, len);
+		return len;
+	}
+	if (inode.flags & FS_INODE_COMPRESSED){
+		retval = read_clusters(inode_num, &inode, buf, len, offset);
+		return (retval == 0) ? len : retval;
+	}
+	struct read_mem rm = { .buf = buf, .batch = { .count = 0 } };
+	retval = map_read(&inode, len, offset, read_piece_mem, &rm);
+	int waited = batch_wait(&rm.batch);
+	if (retval == 0){
+		retval = waited;
+	}
+	return (retval == 0) ? len : retval;
+}
+
+/*
+ * A vector built by fs_iread_buf, in the reading thread's arena along
+ * with its memory buffers, and the mark fs_free_buf releases them to.
+ */
+struct read_vec {
+	struct arena_mark mark;
+	struct fuse_bufvec bufv; /* last, as its array of buffers is extended */
+};
+
+/* add a memory buffer of n bytes to a vector built by fs_iread_buf */
+static char *bufvec_add_mem(struct fuse_bufvec *bufv, size_t n){
+	struct fuse_buf *b = &bufv->buf[bufv->count];
+	if ((b->mem = arena_alloc_blocks((n + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE)) == NULL){
+		return NULL;
+	}
+	b->size = n;
+	b->flags = 0;
+	b->fd = -1;
+	bufv->count++;
+	return b->mem;
+}
+
+/* state of fs_iread_buf */
+struct read_buf {
+	struct fuse_bufvec *bufv; /* the vector being built */
+	struct io_batch batch;
+};
+
+/*
+ * read_piece for fs_iread_buf: runs of whole blocks become ranges of
+ * the device's file, anything else is read into memory.
+ */
+static int read_piece_buf(void *arg, int physical, int count, size_t in_block, size_t n, size_t done){
+	struct read_buf *rb = arg;
+	struct fuse_bufvec *bufv = rb->bufv;
+	int fd = (disk->ops->fd != NULL) ? disk->ops->fd(disk) : -1;
+	if (physical != 0 && in_block == 0 && n == count * FS_BLOCK_SIZE && fd >= 0){
+		struct fuse_buf *b = &bufv->buf[bufv->count++];
+		*b = (struct fuse_buf){ .size = n, .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+			.fd = fd, .pos = (off_t)physical * BLOCK_SIZE };
+		return 0;
+	}
+	char *mem = bufvec_add_mem(bufv, n);
+	if (mem == NULL){
+		return -ENOMEM;
+	}
+	if (physical != 0 && in_block == 0 && n == count * FS_BLOCK_SIZE){
+		return batch_add(&rb->batch, false, physical, count, mem);
+	}
+	return read_piece_to(mem, physical, count, in_block, n);
+}
+
+/*
+ * Read by inode number without copying whole blocks: the data is
+ * described by a vector of ranges of the device's file, where the
+ * device has one, and memory buffers. The ranges are only valid while
+ * the file system lock is held, so reply with the vector before
+ * releasing it. Free it, and the memory buffers, with fs_free_buf in
+ * the same thread.
+ */
+int fs_iread_buf(int inode_num, struct fuse_bufvec **bufp, size_t len, off_t offset){
+	struct fs_inode inode;
+	int retval = read_begin(inode_num, &inode, &len, offset);
+	if (retval != 0){
+		return retval;
+	}
+	/* at most one piece per block, plus a partial block at each end */
+	size_t max_pieces = len / FS_BLOCK_SIZE + 2;
+	size_t size = sizeof(struct read_vec) + max_pieces * sizeof(struct fuse_buf);
+	struct arena_mark mark = arena_mark();
+	struct read_vec *rv = arena_alloc(size);
+	if (rv == NULL){
+		return -ENOMEM;
+	}
+	memset(rv, 0, size);
+	rv->mark = mark;
+	struct fuse_bufvec *bufv = &rv->bufv;
+	if (len > 0 && (inode.flags & FS_INODE_INLINE)){
+		char *mem = bufvec_add_mem(bufv, len);
+		if (mem == NULL){
+			retval = -ENOMEM;
+		} else {
+			memcpy(mem, inode.inline_data + offset, len);
+		}
+	} else if (len > 0 && (inode.flags & FS_INODE_COMPRESSED)){
+		char *mem = bufvec_add_mem(bufv, len);
+		retval = (mem == NULL) ? -ENOMEM : read_clusters(inode_num, &inode, mem, len, offset);
+	} else if (len > 0){
+		struct read_buf rb = { .bufv = bufv, .batch = { .count = 0 } };
+		retval = map_read(&inode, len, offset, read_piece_buf, &rb);
+		int waited = batch_wait(&rb.batch);
+		if (retval == 0){
+			retval = waited;
+		}
+	}
+	if (retval != 0){
+		fs_free_buf(bufv);
+		return retval;
+	}
+	*bufp = bufv;
+	return len;
+}
+
+void fs_free_buf(struct fuse_bufvec *bufv){
+	if (bufv == NULL){
+		return;
+	}
+	struct read_vec *rv = (struct read_vec *)((char *)bufv - offsetof(struct read_vec, bufv));
+	arena_release(rv->mark);
+}
+
+/*
+ * read - read data from an open file.
+ *
+ * 	@param path: the path to the file
+ * 	@param buf: the buffer to keep the data
+ * 	@param len: the number of bytes to read
+ * 	@param offset: the location to start reading at
+ * 	@param fi: fuse file info
+ *
+ * 	@return: return exactly the number of bytes requested, except:
+ * 	- if offset >= file len, return 0
+ * 	- if offset+len > file len, return bytes from offset to EOF
+ * 	- on error, return <0
+ * 		-ENOENT  - file does not exist
+ * 		-ENOTDIR - component of path not a directory
+ * 		-EIO     - error reading block
+*/
+static int fs_read(const char *path, char *buf, size_t len, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	if (is_stats_file(path)){
+		char *text = (char *)(uintptr_t)fi->fh;
+		if (text == NULL){
+			return -EBADF;
+		}
+		size_t text_len = strlen(text);
+		if (offset >= text_len){
+			return 0;
+		}
+		if (offset + len > text_len){
+			len = text_len - offset;
+		}
+		memcpy(buf, text + offset, len);
+		return len;
+	}
+	int inode_num = inode_from_full_path(path);
+	if (inode_num == -1){
+		return -EIO;
+	}
+	if (inode_num < 0){
+		return inode_num;
+	}
+	return fs_iread(inode_num, buf, len, offset);
+}
+
+/* skip the next n bytes of a vector */
+static void bufvec_skip(struct fuse_bufvec *bufv, size_t n){
+	while (n > 0 && bufv->idx < bufv->count){
+		size_t avail = bufv->buf[bufv->idx].size - bufv->off;
+		if (avail > n){
+			bufv->off += n;
+			return;
+		}
+		n -= avail;
+		bufv->idx++;
+		bufv->off = 0;
+	}
+}
+
+/* take the next n bytes of a vector into memory */
+static int bufvec_take(struct fuse_bufvec *src, void *dst, size_t n){
+	struct fuse_bufvec to = FUSE_BUFVEC_INIT(n);
+	to.buf[0].mem = dst;
+	return (fuse_buf_copy(&to, src, 0) == (ssize_t)n) ? 0 : -EIO;
+}
+
+/*
+ * Write the next count blocks of a vector to the device. Blocks in
+ * memory are written asynchronously in a batch, from where they lie;
+ * blocks in a pipe or file are copied straight into the device's file
+ * if it has one, spliced from a pipe, and gathered into memory if not.
+ */
+static int bufvec_write_blocks(struct io_batch *batch, struct fuse_bufvec *src, int physical, int count){
+	size_t n = count * FS_BLOCK_SIZE;
+	if (snap_preserve(physical, count) != 0){
+		return -EIO;
+	}
+	const struct fuse_buf *b = &src->buf[src->idx];
+	if (src->idx < src->count && !(b->flags & FUSE_BUF_IS_FD) && b->size - src->off >= n){
+		dirty_add(dirty_owner, physical, count);
+		int retval = batch_add(batch, true, physical, count, (char *)b->mem + src->off);
+		bufvec_skip(src, n);
+		return retval;
+	}
+	int fd = (disk->ops->fd != NULL) ? disk->ops->fd(disk) : -1;
+	if (fd >= 0){
+		struct fuse_bufvec to = FUSE_BUFVEC_INIT(n);
+		to.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		to.buf[0].fd = fd;
+		to.buf[0].pos = (off_t)physical * BLOCK_SIZE;
+		dirty_add(dirty_owner, physical, count);
+		return (fuse_buf_copy(&to, src, 0) == (ssize_t)n) ? 0 : -EIO;
+	}
+	struct arena_mark mark = arena_mark();
+	char *data = arena_alloc_blocks(count);
+	if (data == NULL){
+		return -ENOMEM;
+	}
+	int retval = bufvec_take(src, data, n);
+	if (retval == 0 && write_blocks(physical, count, data) != SUCCESS){
+		retval = -EIO;
+	}
+	arena_release(mark);
+	return retval;
+}
+
+/* write by inode number */
+int fs_iwrite(int inode_num, const char *buf, size_t len, off_t offset){
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(len);
+	src.buf[0].mem = (void *)buf;
+	return fs_iwrite_buf(inode_num, &src, offset);
+}
+
+/*
+ * Set the pointers of count logical blocks of a file from logical on,
+ * allocating the indirect blocks they need and writing those changed.
+ * The caller must write the inode.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int set_pointers(struct fs_inode *inode, int logical, const uint32_t *ptrs, int count, int goal){
+	for (; count > 0 && logical < N_DIRECT; count--){
+		inode->direct[logical++] = *ptrs++;
+	}
+	while (count > 0){
+		/* the pointers in one indirect block, whose number is at *holder */
+		uint32_t *holder = &inode->indir_1;
+		uint32_t top[PTRS_PER_BLK], table[PTRS_PER_BLK];
+		int index = logical - N_DIRECT, fresh = 0;
+		if (index >= PTRS_PER_BLK){
+			index -= PTRS_PER_BLK;
+			if ((fresh = load_indirect(&inode->indir_2, top, allocate_zeroed_block_cb, &goal)) < 0){
+				return fresh;
 			}
-			inode->indir_2 = temp;
+			holder = &top[index / PTRS_PER_BLK];
+			index %= PTRS_PER_BLK;
+		}
+		int n = (count < PTRS_PER_BLK - index) ? count : PTRS_PER_BLK - index;
+		int fresh_table = load_indirect(holder, table, allocate_zeroed_block_cb, &goal);
+		if (fresh_table < 0){
+			return fresh_table;
 		}
-		uint32_t indir_2_block[PTRS_PER_BLK];
-		if (disk->ops->read(disk, inode->indir_2, 1, indir_2_block) != SUCCESS){
+		if (holder != &inode->indir_1 && (fresh || fresh_table) && write_blocks(inode->indir_2, 1, top) != SUCCESS){
 			return -EIO;
 		}
-		const uint32_t index_in_indir_2 = (logical_block - N_DIRECT - PTRS_PER_BLK) / PTRS_PER_BLK;
-		if (indir_2_block[index_in_indir_2] == 0){
-			int temp = allocate_zeroed_block();
-			if (temp < 0){
-				return temp;
+		memcpy(table + index, ptrs, n * sizeof(uint32_t));
+		if (write_blocks(*holder, 1, table) != SUCCESS){
+			return -EIO;
+		}
+		logical += n;
+		ptrs += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/*
+ * Store a cluster of a file, compressed if that takes fewer blocks.
+ * The cluster's blocks are rewritten in place, except those shared
+ * with a clone, which the file gives up; blocks no longer needed are
+ * freed and any more needed are allocated. The caller must write the
+ * inode, then call refcount_commit.
+ *
+ * @param ptrs: the cluster's pointers, from cluster_pointers
+ * @param data: CLUSTER_SIZE bytes, of which the first size are the
+ *   file's and the rest are 0
+ * @return: 0 if successful, or -error number
+ */
+static int cluster_store(int inode_num, struct fs_inode *inode, int cluster, const uint32_t *ptrs,
+		const char *data, size_t size, int goal){
+	struct arena_mark mark = arena_mark();
+	char *packed = arena_alloc_blocks(FS_CLUSTER_BLOCKS);
+	uint32_t *unneeded = malloc(FS_CLUSTER_BLOCKS * sizeof(uint32_t));
+	if (packed == NULL || unneeded == NULL){
+		free(unneeded);
+		arena_release(mark);
+		return -ENOMEM;
+	}
+	/* compressed, it must leave a block free after the marker */
+	int count = (size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+	struct fs_cluster header = { .compressed = 0, .size = size };
+	if (count > 1){
+		header.compressed = lz4_compress(data, size, packed + sizeof(header), (count - 1) * FS_BLOCK_SIZE - sizeof(header));
+	}
+	uint32_t new_ptrs[FS_CLUSTER_BLOCKS] = { 0 };
+	uint32_t *blocks = new_ptrs;
+	const char *from = data;
+	if (header.compressed > 0){
+		count = (sizeof(header) + header.compressed + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+		memcpy(packed, &header, sizeof(header));
+		memset(packed + sizeof(header) + header.compressed, 0, count * FS_BLOCK_SIZE - sizeof(header) - header.compressed);
+		new_ptrs[0] = FS_CLUSTER_COMPRESSED;
+		blocks = new_ptrs + 1;
+		from = packed;
+	}
+	int n = 0, n_unneeded = 0, retval = 0;
+	for (int i = 0; i < FS_CLUSTER_BLOCKS && retval == 0; i++){
+		if (ptrs[i] == 0 || ptrs[i] == FS_CLUSTER_COMPRESSED){
+			continue;
+		}
+		if (block_shared(ptrs[i])){
+			retval = refcount_put(ptrs[i]);
+		} else if (n < count){
+			blocks[n++] = ptrs[i];
+		} else {
+			unneeded[n_unneeded++] = ptrs[i];
+		}
+	}
+	struct block_pool pool = { .blocks = NULL, .count = 0, .next = 0 };
+	if (retval == 0 && n < count && (retval = block_pool_reserve(&pool, count - n, goal)) == 0){
+		while (n < count){
+			blocks[n++] = block_pool_alloc(&pool);
+		}
+		retval = block_pool_release(&pool);
+	}
+	for (int i = 0, run; i < count && retval == 0; i += run){
+		for (run = 1; i + run < count && blocks[i + run] == blocks[i] + run; run++){
+			;
+		}
+		if (write_blocks(blocks[i], run, (char *)from + i * FS_BLOCK_SIZE) != SUCCESS){
+			retval = -EIO;
+		}
+	}
+	if (retval == 0){
+		/* pointers past the last the cluster had or now has are 0 already */
+		int used = 0;
+		for (int i = 0; i < FS_CLUSTER_BLOCKS; i++){
+			if (ptrs[i] != 0 || new_ptrs[i] != 0){
+				used = i + 1;
 			}
-			indir_2_block[index_in_indir_2] = temp;
 		}
-		uint32_t second_indir[PTRS_PER_BLK];
-		if (disk->ops->read(disk, indir_2_block[index_in_indir_2], 1, second_indir) != SUCCESS){
-			return -EIO;
+		retval = set_pointers(inode, cluster * FS_CLUSTER_BLOCKS, new_ptrs, used, goal);
+	}
+	if (retval == 0){
+		/* returning the blocks no longer needed is releasing a pool of them that was never used */
+		struct block_pool old = { unneeded, n_unneeded, 0 };
+		retval = block_pool_release(&old);
+	} else {
+		free(unneeded);
+	}
+	ccache_insert(inode_num, cluster, (retval == 0 && header.compressed > 0) ? data : NULL);
+	arena_release(mark);
+	return retval;
+}
+
+/*
+ * write_buf for a file with FS_INODE_COMPRESSED: each cluster written
+ * is loaded, unless the write replaces all of the file's data in it,
+ * changed, and stored again.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int write_clusters(int inode_num, struct fs_inode *inode, struct fuse_bufvec *src, off_t offset, size_t len, int goal){
+	struct arena_mark mark = arena_mark();
+	char *data = arena_alloc_blocks(FS_CLUSTER_BLOCKS);
+	if (data == NULL){
+		return -ENOMEM;
+	}
+	off_t end = (offset + (off_t)len > inode->size) ? offset + (off_t)len : inode->size;
+	int retval = 0;
+	for (off_t pos = offset, n; pos < offset + (off_t)len && retval == 0; pos += n){
+		int cluster = pos / CLUSTER_SIZE;
+		off_t start = (off_t)cluster * CLUSTER_SIZE;
+		size_t in_cluster = pos - start;
+		n = (offset + (off_t)len - pos < CLUSTER_SIZE - in_cluster) ? offset + (off_t)len - pos : CLUSTER_SIZE - in_cluster;
+		size_t size = (end - start < CLUSTER_SIZE) ? end - start : CLUSTER_SIZE;
+		size_t old_size = (inode->size <= start) ? 0 : (inode->size - start < CLUSTER_SIZE) ? inode->size - start : CLUSTER_SIZE;
+		/* storing a cluster may change the indirect blocks a cursor would hold */
+		struct map_cursor cursor = { 0 };
+		uint32_t ptrs[FS_CLUSTER_BLOCKS];
+		if ((retval = cluster_pointers(inode, cluster, ptrs, &cursor)) != 0){
+			break;
 		}
-		const uint32_t index_in_second_indir = (logical_block - N_DIRECT - PTRS_PER_BLK) % PTRS_PER_BLK;
-		if (second_indir[index_in_second_indir] == 0){
-			int temp = allocate_zeroed_block();
-			if (temp < 0){
-				return temp;
+		if (in_cluster > 0 || in_cluster + n < old_size){
+			retval = cluster_load(inode_num, cluster, ptrs, data);
+		} else {
+			memset(data, 0, CLUSTER_SIZE);
+		}
+		memset(data + size, 0, CLUSTER_SIZE - size);
+		if (retval == 0 && bufvec_take(src, data + in_cluster, n) != 0){
+			retval = -EIO;
+		}
+		if (retval == 0){
+			retval = cluster_store(inode_num, inode, cluster, ptrs, data, size, goal);
+		}
+	}
+	arena_release(mark);
+	return retval;
+}
+
+/* extend a file to end if it is shorter, and write its inode once the data written is on disk; returns 0 or -EIO */
+static int write_end(int inode_num, struct fs_inode *inode, struct fs_inode_ext *ext, off_t end){
+	if (end > inode->size){
+		inode->size = end;
+	}
+	/* the data reaches the disk before the inode that makes it part of the file */
+	if (blkdev_barrier(disk) != SUCCESS || write_inode_ext(inode_num, inode, ext) != 0){
+		return -EIO;
+	}
+	return 0;
+}
+
+/* fs_iwrite_buf, leaving shares of blocks the file gave up to the caller */
+static int write_buf(int inode_num, struct fuse_bufvec *src, off_t offset){
+	size_t len = fuse_buf_size(src);
+	struct fs_inode inode;
+	struct fs_inode_ext ext;
+	dirty_owner = inode_num;
+	if (read_inode_ext(inode_num, &inode, &ext) != 0){
+		return -EIO;
+	}
+	if (S_ISDIR(inode.mode)){
+		return -EISDIR;
+	}
+	if (offset > inode.size){
+		return -EINVAL;
+	}
+	if (len == 0){
+		return 0;
+	}
+	set_mtime(&inode, &ext);
+	const int MAX_FILE_SIZE = FS_BLOCK_SIZE * N_DIRECT + PTRS_PER_BLK * FS_BLOCK_SIZE + PTRS_PER_BLK * PTRS_PER_BLK * FS_BLOCK_SIZE;
+	if (offset == MAX_FILE_SIZE){
+		if (len == 0){
+			return 0;
+		} else {
+			return -EFBIG;
+		}
+	}
+	if (offset + len >= MAX_FILE_SIZE){
+		len = MAX_FILE_SIZE - offset;
+	}
+	int goal = group_of_inode(inode_num); /* new blocks go near the inode */
+	if ((inode.flags & FS_INODE_INLINE) || inline_eligible(&inode)){
+		int retval = 0;
+		if (offset + len <= FS_INLINE_SIZE){
+			if (!(inode.flags & FS_INODE_INLINE) && (retval = make_inline(&inode)) != 0){
+				return retval;
+			}
+			if (bufvec_take(src, inode.inline_data + offset, len) != 0){
+				return -EIO;
+			}
+			if (offset + len > inode.size){
+				inode.size = offset + len;
+			}
+			return (write_inode_ext(inode_num, &inode, &ext) == 0) ? len : -EIO;
+		}
+		if ((inode.flags & FS_INODE_INLINE) && (retval = inline_to_blocks(&inode, goal)) != 0){
+			return retval;
+		}
+	}
+	if (inode.flags & FS_INODE_COMPRESSED){
+		int retval = write_clusters(inode_num, &inode, src, offset, len, goal);
+		if (retval != 0){
+			return retval;
+		}
+		return (write_end(inode_num, &inode, &ext, offset + len) == 0) ? len : -EIO;
+	}
+	uint32_t first_logical_block_num = offset / FS_BLOCK_SIZE;
+	uint32_t last_logical_block_num = (offset + len - 1) / FS_BLOCK_SIZE;
+	if (last_logical_block_num > N_DIRECT + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK){
+		last_logical_block_num = N_DIRECT + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK;
+		len = MAX_FILE_SIZE - offset;
+	}
+	char first_block[FS_BLOCK_SIZE];
+	switch(read_block_of_file(first_logical_block_num, &inode, first_block)){
+	case -EIO:
+		return -EIO;
+	case -1:
+		;
+		char empty_block[FS_BLOCK_SIZE];
+		memset(empty_block, 0, FS_BLOCK_SIZE);
+		int temp = put_block_in_file(&inode, first_logical_block_num, goal, empty_block);
+		if (temp < 0){
+			return temp;
+		}
+		memset(first_block, 0, FS_BLOCK_SIZE);
+		break;
+	case 0:
+		;
+	}
+	if (bufvec_take(src, first_block + offset % FS_BLOCK_SIZE, (len <= FS_BLOCK_SIZE - offset % FS_BLOCK_SIZE) ? len : FS_BLOCK_SIZE - offset % FS_BLOCK_SIZE) != 0){
+		return -EIO;
+	}
+	switch(put_block_in_file(&inode, first_logical_block_num, goal, first_block)){
+	case -EIO:
+		return -EIO;
+	case -ENOSPC:
+		return -ENOSPC;
+	}
+	if (first_logical_block_num != last_logical_block_num){
+		size_t offset_in_buf = FS_BLOCK_SIZE - offset % FS_BLOCK_SIZE; //amount written to the first block
+		struct io_batch batch = { .count = 0 };
+		int retval = 0;
+		for (int log_block = first_logical_block_num + 1; log_block <= last_logical_block_num - 1 && retval == 0; ){
+			/* write each run of physically contiguous blocks with one request */
+			int physical = map_block(&inode, log_block, allocate_zeroed_block_cb, &goal, true);
+			if (physical < 0){
+				retval = physical;
+				break;
+			}
+			int run = 1;
+			while (log_block + run <= last_logical_block_num - 1){
+				int next = map_block(&inode, log_block + run, allocate_zeroed_block_cb, &goal, true);
+				if (next < 0){
+					retval = next;
+					break;
+				}
+				if (next != physical + run){
+					break;
+				}
+				run++;
 			}
-			second_indir[index_in_indir_2] = temp;
+			if (retval == 0){
+				retval = bufvec_write_blocks(&batch, src, physical, run);
+			}
+			log_block += run;
+			offset_in_buf += run * FS_BLOCK_SIZE;
+		}
+		int waited = batch_wait(&batch);
+		if (retval != 0 || waited != 0){
+			return (retval != 0) ? retval : waited;
 		}
-		if (disk->ops->write(disk, second_indir[index_in_second_indir], 1, buf) != SUCCESS){
+		char last_block[FS_BLOCK_SIZE];
+		switch(read_block_of_file(last_logical_block_num, &inode, last_block)){
+		case -EIO:
 			return -EIO;
+		case -1:
+			;
+			char empty_block[FS_BLOCK_SIZE];
+			memset(empty_block, 0, FS_BLOCK_SIZE);
+			int temp = put_block_in_file(&inode, last_logical_block_num, goal, empty_block);
+			if (temp < 0){
+				return temp;
+			}
+			memset(last_block, 0, FS_BLOCK_SIZE);
+			break;
 		}
-		if (disk->ops->write(disk, indir_2_block[index_in_indir_2], 1, second_indir) != SUCCESS){
+		if (bufvec_take(src, last_block, len - offset_in_buf) != 0){
 			return -EIO;
 		}
-		if (disk->ops->write(disk, inode->indir_2, 1, indir_2_block) != SUCCESS){
+		switch(put_block_in_file(&inode, last_logical_block_num, goal, last_block)){
+		case -EIO:
 			return -EIO;
+		case -ENOSPC:
+			return -ENOSPC;
 		}
 	}
-	return 0;
+	return (write_end(inode_num, &inode, &ext, offset + len) == 0) ? len : -EIO;
 }
 
-
-/* 
- * CS492: FUSE functions
-*/
-
+/*
+ * Write by inode number from a vector of buffers, which may be in
+ * memory, files or pipes. Whole blocks go to the device without
+ * passing through memory where the device has a file.
+ */
+int fs_iwrite_buf(int inode_num, struct fuse_bufvec *src, off_t offset){
+	int retval = write_buf(inode_num, src, offset);
+	if (retval < 0){
+		refcount_abort();
+		return retval;
+	}
+	int committed = refcount_commit();
+	return (committed != 0) ? committed : retval;
+}
 
 /*
- * init - this is called once by the FUSE framework at startup.
+ * write - write data to a file
  *
- * This is a good place to read in the super-block and set up any
- * global variables you need. You don't need to worry about the
- * argument or the return value.
+ * @param path: the file path
+ * @param buf: the buffer to write
+ * @param len: the number of bytes to write
+ * @param offset: the offset to starting writing at
+ * @param fi: the Fuse file info for writing
  *
- * @param conn: fuse connection information - unused
- * @return: unused - returns NULL
+ * @return: It should return exactly the number of bytes requested, except on error:
+ * 	-ENOENT  - file does not exist
+ *	-ENOTDIR - component of path not a directory
+ *	-EINVAL  - if 'offset' is greater than current file length. (POSIX semantics support the creation of files with "holes" in them, but we don't)
 */
+static int fs_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi) {
+	if (is_stats_file(path)){
+		return -EACCES;
+	}
+	int inode_num = inode_from_full_path(path);
+	if (inode_num == -1){
+		return -EIO;
+	}
+	if (inode_num < 0){
+		return inode_num;
+	}
+	return fs_iwrite(inode_num, buf, len, offset);
+}
 
-void* fs_init(struct fuse_conn_info *conn)
+/*
+ * write_buf - write data to a file from a vector of buffers, which
+ * FUSE fills by splicing from its device where it can, so whole blocks
+ * reach the image without being copied through memory. Same arguments
+ * and return values as write.
+ */
+static int fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
 {
-	int retval = disk->ops->read(disk, 0, 1, &superblock);
-	if(retval != SUCCESS){
-		fprintf(stderr, "fs_init: got return value of %d when reading the superblock\n", retval);
-		abort();
+	if (is_stats_file(path)){
+		return -EACCES;
 	}
-	if (superblock.magic != FS_MAGIC){
-		fprintf(stderr, "fs_init: superblocks contains wrong magic number, probably corrupt\n");
+	int inode_num = inode_from_full_path(path);
+	if (inode_num == -1){
+		return -EIO;
 	}
-	if (disk->ops->num_blocks(disk) != superblock.num_blocks){
-		fprintf(stderr, "fs_init: superblock contains wrong number of blocks, probably corrupt\n");
+	if (inode_num < 0){
+		return inode_num;
 	}
-	return NULL;
+	return fs_iwrite_buf(inode_num, buf, offset);
 }
 
 
-/*
- * getattr - get file or directory attributes. For a description of
- * the fields in 'struct stat', see 'man lstat'.
- *
- * Note: you can handle some fields as follows:
- * st_nlink: always set to 1
- * st_atime, st_ctime: set to same value as st_mtime
+/* 
+ * Release resources created by pending open call.
  *
- * @param path: the file path
- * @param sb: pointer to stat struct
+ * @param path: path to the file
+ * @param fi: the fuse file info
  *
  * @return: 0 if successful, or -error number
- * 	-ENOENT  - a component of the path is not present
- *	-ENOTDIR - an intermediate component of path not a directory
+ *	-ENOENT   - file does not exist
+ *	-ENOTDIR  - component of path not a directory
 */
-static int fs_getattr(const char *path, struct stat *sb)
+static int fs_release(const char *path, struct fuse_file_info *fi)
 {
-	if (path[0] != '/'){
-		fprintf(stderr, "Error: stat must be used with an absolute path\n");
-		return -EINVAL;
+	if (is_stats_file(path)){
+		free((char *)(uintptr_t)fi->fh);
+		fi->fh = 0;
+		return 0;
 	}
-	int inode_number_of_file = inode_from_full_path(path);
-	if (inode_number_of_file == -1){
+	return fs_open(path, fi);
+}
+
+static int compare_blocks(const void *a, const void *b){
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* fsync by inode number; the blocks it flushes are those written for it since its last fsync */
+int fs_ifsync(int inode_num){
+	if (blkdev_barrier(disk) != SUCCESS){
 		return -EIO;
 	}
-	if (inode_number_of_file < 0){
-		return inode_number_of_file;
-	}
-	struct fs_inode inode_of_file;
-	if (read_inode(inode_number_of_file, &inode_of_file) != 0){
-		return -EIO;
+	struct dirty_inode *d = dirty_take(inode_num);
+	pthread_mutex_lock(&dirty_lock);
+	bool whole = dirty_lost || (d != NULL && d->overflow);
+	pthread_mutex_unlock(&dirty_lock);
+	int retval = SUCCESS;
+	if (whole){
+		retval = flush_all();
+	} else if (d != NULL && d->count > 0){
+		/* flush ranges of nearby dirty blocks */
+		qsort(d->blocks, d->count, sizeof(uint32_t), compare_blocks);
+		uint32_t first = d->blocks[0], last = d->blocks[0];
+		for (int i = 1; i <= d->count && retval == SUCCESS; i++){
+			if (i < d->count && d->blocks[i] <= last + DIRTY_GAP){
+				last = d->blocks[i];
+				continue;
+			}
+			retval = disk->ops->flush(disk, first, last - first + 1);
+			if (i < d->count){
+				first = last = d->blocks[i];
+			}
+		}
 	}
-	sb->st_dev = 0;
-	sb->st_ino = inode_number_of_file;
-	sb->st_mode = inode_of_file.mode;
-	sb->st_nlink = 1;
-	sb->st_uid = inode_of_file.uid;
-	sb->st_gid = inode_of_file.gid;
-	sb->st_rdev = 0;
-	sb->st_size = inode_of_file.size;
-	sb->st_blksize = FS_BLOCK_SIZE;
-	sb->st_blocks = inode_of_file.size / 512 + (inode_of_file.size % 512 != 0);
-	sb->st_ctime = inode_of_file.ctime;
-	sb->st_mtime = inode_of_file.mtime;
-	sb->st_atime = inode_of_file.mtime;
-	return 0;
+	dirty_free(d);
+	return (retval == SUCCESS) ? 0 : -EIO;
 }
 
 /*
- * opendir - open file directory
- *
- * You can save information about the open directory in fi->fh. 
- * If you allocate memory, free it in fs_releasedir.
+ * fsync - make a file's changes durable: its data, inode and indirect
+ * blocks, and the bitmap blocks its allocations changed. Whether the
+ * directory entry naming it is durable depends on fsync of the
+ * directory. datasync is treated as a full fsync.
  *
  * @param path: the file path
- * @param fi: fuse file system information
- *
+ * @param datasync: if nonzero, only the data need be flushed
+ * @param fi: the fuse file info
  * @return: 0 if successful, or -error number
- *	-ENOENT  - a component of the path is not present
- *	-ENOTDIR - an intermediate component of path not a directory
-*/
-
-static int fs_opendir(const char *path, struct fuse_file_info *fi)
+ *	-ENOENT  - file does not exist
+ *	-ENOTDIR - component of path not a directory
+ *	-EIO     - error flushing the device
+ */
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
-	int inode_number = inode_from_full_path(path);
-	if (inode_number == -1){
-		return -EIO;
-	}
-	if (inode_number < 0){
-		return inode_number;
+	if (is_stats_file(path)){
+		return 0;
 	}
-	struct fs_inode inode;
-	if (read_inode(inode_number, &inode) != 0){
+	int inode_num = inode_from_full_path(path);
+	if (inode_num == -1){
 		return -EIO;
 	}
-	if (!S_ISDIR(inode.mode)){
-		return -ENOTDIR; 
+	if (inode_num < 0){
+		return inode_num;
 	}
-	return 0;
-} 
-
+	return fs_ifsync(inode_num);
+}
 
 /*
-    readdir - get directory contents
+ * fsyncdir - make a directory's entries durable, and the inodes and
+ * bitmap blocks of files created or removed in it. Same arguments and
+ * return values as fsync.
+ */
+static int fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	return fs_fsync(path, datasync, fi);
+}
 
-    For each entry in the directory, invoke the 'filler' function, 
-	which is passed as a function pointer, as follows:
-    filler(buf, <name>, <statbuf>, 0) 
-	where <statbuf> is a struct stat, just like in getattr.
 
-    @param path: the directory path
-    @param ptr: filler buf pointer
-    @param filler filler function to call for each entry
-    @param offset: the file offset -- unused
-    @param fi: the fuse file information -- you do not have to use it
+/*
+ * statfs without a path. The inodes counted include those that could
+ * still be made in dynamic inode table blocks, one free block holding
+ * inodes_per_blk of them.
+ */
+int fs_istatfs(struct statvfs *st)
+{
+	long total_blocks = 0, available_blocks = 0, available_inodes = 0, total_inodes = 0;
+	for (int i = 0; i < n_groups; i++){
+		pthread_mutex_lock(&groups[i].lock);
+		total_blocks += groups[i].start + groups[i].blocks - groups[i].data;
+		available_blocks += groups[i].free_blocks;
+		available_inodes += groups[i].free_inodes;
+		total_inodes += groups[i].inodes;
+		pthread_mutex_unlock(&groups[i].lock);
+	}
+	pthread_mutex_lock(&imap_lock);
+	total_inodes += imap_count * inodes_per_blk;
+	available_inodes += imap_free;
+	/* blocks of inode numbers left that a directory entry can hold */
+	long room = ((1L << 30) - ((superblock.features & FS_FEAT_DYN_INODES) ? n_inodes : (n_inodes + 15) / 16 * 16)) / inodes_per_blk;
+	pthread_mutex_unlock(&imap_lock);
+	room = ((room < available_blocks) ? room : available_blocks) * inodes_per_blk;
 
-    @return: 0 if successful, or -error number
-    	-ENOENT  - a component of the path is not present
-    	-ENOTDIR - an intermediate component of path not a directory
-*/
-static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	int inode_number = inode_from_full_path(path);
-	if (inode_number == -1){
-		return -EIO;
-	}
-	if (inode_number < 0){
-		return inode_number;
-	}
-	struct fs_inode inode;
-	if (read_inode(inode_number, &inode) != 0){
-		return -EIO;
-	}
-	if (!S_ISDIR(inode.mode)){
-		return -ENOTDIR; 
-	}
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	if (disk->ops->read(disk, inode.direct[0], 1, entries) != SUCCESS){
-		return -EIO;
-	}
-	for (int i = 0; i < DIRENTS_PER_BLK; i++){
-		if (!entries[i].valid){
-			continue;
-		}
-		struct fs_inode inode_of_entry;
-		if (read_inode(entries[i].inode, &inode_of_entry) != 0){
-			return -EIO;
-		}
-		struct stat sb;
-		sb.st_dev = 0; 
-		sb.st_ino = entries[i].inode;
-		sb.st_mode = inode_of_entry.mode;
-		sb.st_nlink = 1;
-		sb.st_uid = inode_of_entry.uid;
-		sb.st_gid = inode_of_entry.gid;
-		sb.st_rdev = 0;
-		sb.st_size = inode_of_entry.size;
-		sb.st_blksize = FS_BLOCK_SIZE;
-		sb.st_blocks = inode_of_entry.size / 512 + (inode_of_entry.size % 512 != 0); 
-		sb.st_ctime = inode_of_entry.ctime;
-		sb.st_mtime = inode_of_entry.mtime;
-		sb.st_atime = inode_of_entry.mtime;
-		filler(ptr, entries[i].name, &sb, 0);
-	}
+	st->f_bsize = FS_BLOCK_SIZE;
+	st->f_blocks = total_blocks;
+	st->f_bfree = available_blocks;
+	st->f_bavail = available_blocks;
+	st->f_files = total_inodes + room;
+	st->f_ffree = available_inodes + room;
+	st->f_namemax = FS_FILENAME_SIZE;
+	st->f_fsid = 0;
+	st->f_frsize = 0;
+	st->f_flag = 0;
 	return 0;
 }
 
 /*
- * Release resources when directory is closed.
- * If you allocate memory in fs_opendir, free it here.
+ * statfs - get file system statistics. See 'man 2 statfs' for 
+ * description of 'struct statvfs'.
  *
- * @param path: the directory path
- * @param fi: fuse file system information -- you do not have to use it
+ * @param path: the path to the file
+ * @param st: pointer to the destination statvfs struct
  *
  * @return: 0 if successful, or -error number
- *	-ENOENT  - a component of the path is not present
+ * 	-ENOENT  - a component of the path is not present
  *	-ENOTDIR - an intermediate component of path not a directory
 */
-static int fs_releasedir(const char *path, struct fuse_file_info *fi)
+static int fs_statfs(const char *path, struct statvfs *st)
 {
-	int inode_number = inode_from_full_path(path);
-	if (inode_number == -1){
-		return -EIO;
-	}
-	if (inode_number < 0){
-		return inode_number; 
+	return fs_istatfs(st);
+}
+
+/* utimens by inode number */
+int fs_iutimens(int inode_num, const struct timespec tv[2]){
+	struct timespec times[2];
+	for (int i = 0; i < 2; i++){
+		times[i] = tv[i];
+		if (times[i].tv_nsec == UTIME_NOW){
+			times[i] = now();
+		} else if (times[i].tv_nsec != UTIME_OMIT && (times[i].tv_nsec < 0 || times[i].tv_nsec >= 1000000000)){
+			return -EINVAL;
+		}
 	}
 	struct fs_inode inode;
-	if (read_inode(inode_number, &inode) != 0){
+	struct fs_inode_ext ext;
+	if (read_inode_ext(inode_num, &inode, &ext) != 0){
 		return -EIO;
 	}
-	if (!S_ISDIR(inode.mode)){
-		return -ENOTDIR;
+	if (times[0].tv_nsec != UTIME_OMIT){
+		ext.atime = times[0].tv_sec;
+		ext.atime_ns = times[0].tv_nsec;
 	}
-	return 0;
+	if (times[1].tv_nsec != UTIME_OMIT){
+		inode.mtime = times[1].tv_sec;
+		ext.mtime_ns = times[1].tv_nsec;
+	}
+	return write_inode_ext(inode_num, &inode, &ext);
 }
 
 /*
- * mknod - create a new file with permissions (mode & 01777). Behavior undefined when mode bits other than the low 9 bits are used.
- * 	
+ * utimens - set the access and modification times of a file. With
+ * 64-byte inodes there is no access time, and times are truncated to
+ * seconds.
+ *
  * @param path: the file path
- * @param mode: indicating block or character-special file
- * @param dev: the character or block I/O device specification - you do not have to use it
- * 			 
+ * @param tv: access time, then modification time; a tv_nsec of
+ *   UTIME_NOW means the current time, and UTIME_OMIT leaves it as is
+ *
  * @return: 0 if successful, or -error number
- * 	-ENOTDIR  - component of path not a directory
- * 	-EEXIST   - file already exists
- * 	-ENOSPC   - free inode not available
- * 	-ENOSPC   - results in >32 entries in directory
-*/
-static int fs_mknod(const char *path, mode_t mode, dev_t dev)
-{
-	if (path[0] == '\0'){
-		return -EINVAL;
-	}
-	if (!strcmp(path, "/")){
-		return -EEXIST;
-	}
-	char temp_path[MAX_PATH];
-	char new_file_name[FS_FILENAME_SIZE];
-	if (split_path(path, temp_path, new_file_name) == -ENAMETOOLONG){
-		return -ENAMETOOLONG;
+ *	-ENOENT  - file does not exist
+ *	-ENOTDIR - component of path not a directory
+ *	-EINVAL  - tv_nsec out of range
+ */
+static int fs_utimens(const char *path, const struct timespec tv[2]){
+	if (is_stats_file(path)){
+		return -EPERM;
 	}
-	int inode_num_of_dir = inode_from_full_path(temp_path);
-	if (inode_num_of_dir == -1){
+	int inode_num = inode_from_full_path(path);
+	if (inode_num == -1){
 		return -EIO;
 	}
-	if (inode_num_of_dir < 0){
-		return inode_num_of_dir;
+	if (inode_num < 0){
+		return inode_num;
 	}
-	struct fs_inode dir_inode;
-	if (read_inode(inode_num_of_dir, &dir_inode) != 0){
-		return -EIO;
+	return fs_iutimens(inode_num, tv);
+}
+
+/* utime - as utimens, with NULL timebuf meaning the current time */
+static int fs_utime(const char *path, struct utimbuf *timebuf){
+	struct timespec tv[2] = {
+		{ .tv_nsec = UTIME_NOW },
+		{ .tv_nsec = UTIME_NOW },
+	};
+	if (timebuf != NULL){
+		tv[0] = (struct timespec){ .tv_sec = timebuf->actime };
+		tv[1] = (struct timespec){ .tv_sec = timebuf->modtime };
 	}
-	if (!S_ISDIR(dir_inode.mode)){
-		return -ENOTDIR;
+	return fs_utimens(path, tv);
+}
+
+static int fs_truncate(const char *path, off_t offset){
+	return -ENOSYS;
+}
+
+/*
+ * Zero bytes from to to of a file whose blocks are all mapped, for a
+ * fallocate that extends the file over them. Blocks shared with a
+ * clone are given up for blocks of the file's own, as by a write.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int zero_file_range(struct fs_inode *inode, off_t from, off_t to, int goal){
+	int retval = 0;
+	if (from % FS_BLOCK_SIZE != 0){
+		char block[FS_BLOCK_SIZE];
+		switch(read_block_of_file(from / FS_BLOCK_SIZE, inode, block)){
+		case 0:
+			break;
+		case -1:
+			memset(block, 0, FS_BLOCK_SIZE);
+			break;
+		default:
+			return -EIO;
+		}
+		memset(block + from % FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE - from % FS_BLOCK_SIZE);
+		if ((retval = put_block_in_file(inode, from / FS_BLOCK_SIZE, goal, block)) != 0){
+			return retval;
+		}
 	}
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	if (disk->ops->read(disk, dir_inode.direct[0], 1, entries) != SUCCESS){
-		return -EIO;
+	int first = (from + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+	int last = (to - 1) / FS_BLOCK_SIZE;
+	if (first > last){
+		return 0;
 	}
-	bool dir_has_space = false;
-	int entry_index = -1;
-	for (int i = 0; i < DIRENTS_PER_BLK; i++){
-		if (!entries[i].valid){
-			if (!dir_has_space){
-				dir_has_space = true;
-				entry_index = i;
+	/* clear each contiguous run at once */
+	enum { ZERO_RUN = 32 };
+	struct arena_mark mark = arena_mark();
+	char *zeros = arena_alloc_blocks(ZERO_RUN);
+	if (zeros == NULL){
+		return -ENOMEM;
+	}
+	memset(zeros, 0, ZERO_RUN * FS_BLOCK_SIZE);
+	for (int log_block = first, run; log_block <= last && retval == 0; log_block += run){
+		int physical = map_block(inode, log_block, allocate_zeroed_block_cb, &goal, true);
+		if (physical < 0){
+			retval = physical;
+			break;
+		}
+		for (run = 1; run < ZERO_RUN && log_block + run <= last; run++){
+			int next = map_block(inode, log_block + run, allocate_zeroed_block_cb, &goal, true);
+			if (next < 0){
+				retval = next;
+				break;
+			}
+			if (next != physical + run){
+				break;
 			}
-			continue;
 		}
-		if (!strcmp(entries[i].name, new_file_name)){
-			return -EEXIST;
+		if (retval == 0 && write_blocks(physical, run, zeros) != SUCCESS){
+			retval = -EIO;
 		}
 	}
-	if (!dir_has_space){
-		return -ENOSPC;
+	arena_release(mark);
+	return retval;
+}
+
+/* fallocate by inode number */
+int fs_ifallocate(int inode_num, int mode, off_t offset, off_t len){
+	if (mode & ~FALLOC_FL_KEEP_SIZE){
+		return -EOPNOTSUPP;
 	}
-	int new_inode_num = -1;
-	char *inode_bitmap = malloc(FS_BLOCK_SIZE * superblock.inode_map_sz);
-	if (inode_bitmap == NULL){
+	dirty_owner = inode_num;
+	struct fs_inode inode;
+	if (read_inode(inode_num, &inode) != 0){
 		return -EIO;
 	}
-	if (disk->ops->read(disk, 1, superblock.inode_map_sz, inode_bitmap) != SUCCESS){
-		free(inode_bitmap);
-		return -EIO;
+	if (S_ISDIR(inode.mode)){
+		return -EISDIR;
 	}
-	for (int i = 0; i < INODES_PER_BLK * superblock.inode_region_sz; i++){
-		if (!(inode_bitmap[i / 8] & (1 << (i % 8)))){
-			new_inode_num = i;
-			break;
-		}
+	if (inode.flags & FS_INODE_COMPRESSED){
+		return -EOPNOTSUPP; /* the blocks a cluster needs are only known when it is written */
 	}
-	if (new_inode_num == -1){
-		free(inode_bitmap);
-		return -ENOSPC;
+	if (offset > inode.size || len <= 0){
+		return -EINVAL;
 	}
-	inode_bitmap[new_inode_num / 8] |= 1 << (new_inode_num % 8);
-	if (disk->ops->write(disk, 1, superblock.inode_map_sz, inode_bitmap) != SUCCESS){
-		free(inode_bitmap);
-		return -EIO;
+	const off_t MAX_FILE_SIZE = (off_t)FS_BLOCK_SIZE * (N_DIRECT + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK);
+	if (offset + len > MAX_FILE_SIZE){
+		return -EFBIG;
+	}
+	if ((inode.flags & FS_INODE_INLINE) || inline_eligible(&inode)){
+		int retval = 0;
+		if (offset + len <= FS_INLINE_SIZE){
+			/* the range fits inline, which needs no blocks */
+			if ((mode & FALLOC_FL_KEEP_SIZE) || offset + len <= inode.size){
+				return 0;
+			}
+			if (!(inode.flags & FS_INODE_INLINE) && (retval = make_inline(&inode)) != 0){
+				return retval;
+			}
+			inode.size = offset + len;
+			return (write_inode(inode_num, &inode) == 0) ? 0 : -EIO;
+		}
+		if ((inode.flags & FS_INODE_INLINE) && (retval = inline_to_blocks(&inode, group_of_inode(inode_num))) != 0){
+			return retval;
+		}
+	}
+	int first_logical_block_num = offset / FS_BLOCK_SIZE;
+	int last_logical_block_num = (offset + len - 1) / FS_BLOCK_SIZE;
+
+	/* upper bound: all data blocks plus every indirect block the range may need */
+	int count = last_logical_block_num - first_logical_block_num + 1 + 2;
+	if (last_logical_block_num >= N_DIRECT + PTRS_PER_BLK){
+		count += (last_logical_block_num - N_DIRECT - PTRS_PER_BLK) / PTRS_PER_BLK + 1;
+	}
+	struct block_pool pool;
+	int retval = block_pool_reserve(&pool, count, group_of_inode(inode_num));
+	if (retval != 0){
+		return retval;
+	}
+	for (int log_block = first_logical_block_num; log_block <= last_logical_block_num && retval == 0; log_block++){
+		int physical = map_block(&inode, log_block, block_pool_alloc, &pool, false);
+		if (physical < 0){
+			retval = physical;
+		}
 	}
-	free(inode_bitmap);
-	struct fs_inode new_inode = {
-		.uid = fuse_get_context()->uid,
-		.gid = fuse_get_context()->gid,
-		.mode = (mode & 01777 & ~(fuse_get_context()->umask)) | S_IFREG,
-		.ctime = time(NULL),
-		.mtime = time(NULL),
-		.size = 0,
-		.indir_1 = 0,
-		.indir_2 = 0,
-	};
-	for (int i = 0; i < N_DIRECT; i++){
-		new_inode.direct[i] = 0;
+	if (retval == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode.size){
+		/* blocks reserved earlier with FALLOC_FL_KEEP_SIZE and the old last block may hold old contents */
+		retval = zero_file_range(&inode, inode.size, offset + len, group_of_inode(inode_num));
+		if (retval == 0){
+			inode.size = offset + len;
+		}
 	}
-	int block_number_that_contains_new_inode =
-		1 + superblock.inode_map_sz + superblock.block_map_sz
-		+ (new_inode_num / INODES_PER_BLK);
-	struct fs_inode block_containing_new_inode[INODES_PER_BLK];
-	if (disk->ops->read(disk, block_number_that_contains_new_inode, 1, block_containing_new_inode) != SUCCESS){
-		return -EIO;
+	/* write the inode even on failure so blocks already mapped are not lost */
+	if (blkdev_barrier(disk) != SUCCESS && retval == 0){
+		retval = -EIO;
 	}
-	memcpy(&block_containing_new_inode[new_inode_num % INODES_PER_BLK],
-		&new_inode, sizeof(struct fs_inode));
-	if (disk->ops->write(disk, block_number_that_contains_new_inode, 1, block_containing_new_inode) != SUCCESS){
-		return -EIO;
+	if (write_inode(inode_num, &inode) != 0 && retval == 0){
+		retval = -EIO;
 	}
-	entries[entry_index].valid = 1;
-	entries[entry_index].isDir = 0;
-	entries[entry_index].inode = new_inode_num;
-	strcpy(entries[entry_index].name, new_file_name);
-	if (disk->ops->write(disk, dir_inode.direct[0], 1, entries) != SUCCESS){
-		fprintf(stderr, "Error updating directory %s to contain new file %s, after creating the inode for it. Disk is probably corrupt.\n", temp_path, new_file_name);
-		return -EIO;
+	int released = block_pool_release(&pool);
+	if (retval != 0){
+		refcount_abort();
+		return retval;
 	}
-	return 0;
+	int committed = refcount_commit();
+	return (committed != 0) ? committed : released;
 }
 
 /*
- * 	mkdir - create a directory with the given mode. Behavior undefined when mode bits other than the low 9 bits are used.
+ * fallocate - reserve the blocks for a range of a file with a single
+ * block bitmap update, contiguous where possible. Files cannot have
+ * holes, so the range must start at or before the end of the file.
  *
- * 	@param path: path to directory
- * 	@param mode: the mode for the new directory
+ * @param path: the file path
+ * @param mode: 0 to also extend the file size over the range, or
+ *   FALLOC_FL_KEEP_SIZE to only reserve the blocks
+ * @param offset: start of the range
+ * @param len: length of the range
+ * @param fi: fuse file info
  *
- * 	@return: 0 if successful, or -error number
- * 		-ENOTDIR  - component of path not a directory
- * 		-EEXIST   - file already exists
- * 		-ENOSPC   - free inode not available
- * 		-ENOSPC   - results in >32 entries in directory
-*/
-static int fs_mkdir(const char *path, mode_t mode)
+ * @return: 0 if successful, or -error number
+ *	-ENOENT  - file does not exist
+ *	-ENOTDIR - component of path not a directory
+ *	-EINVAL  - offset greater than current file length
+ *	-ENOSPC  - not enough free blocks
+ *	-EOPNOTSUPP - mode other than FALLOC_FL_KEEP_SIZE, or a compressed file
+ */
+static int fs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi)
 {
-	if (path[0] == '\0'){
-		return -EINVAL;
-	}
-	if (!strcmp(path, "/")){
-		return -EEXIST;
+	if (mode & ~FALLOC_FL_KEEP_SIZE){
+		return -EOPNOTSUPP;
 	}
-	char temp_path[MAX_PATH];
-	char new_dir_name[FS_FILENAME_SIZE];
-	if (split_path(path, temp_path, new_dir_name) == -ENAMETOOLONG){
-		return -ENAMETOOLONG;
+	if (is_stats_file(path)){
+		return -EACCES;
 	}
-	int inode_num_of_containing_dir = inode_from_full_path(temp_path);
-	if (inode_num_of_containing_dir == -1){
+	int inode_num = inode_from_full_path(path);
+	if (inode_num == -1){
 		return -EIO;
 	}
-	if (inode_num_of_containing_dir < 0){
-		return inode_num_of_containing_dir;
+	if (inode_num < 0){
+		return inode_num;
+	}
+	return fs_ifallocate(inode_num, mode, offset, len);
+}
+
+/*
+ * Defragmentation. Files are visited in directory order: each
+ * directory, then the files in it, then its subdirectories, so that
+ * files that are used together end up near each other.
+ */
+
+/* inodes in the order defrag visits them */
+struct inode_order {
+	int *inodes; /* inode numbers in visiting order */
+	int count; /* number of inodes in order */
+	char *inode_bitmap; /* inode map, for checking entries */
+	char *seen; /* one flag per inode already in order */
+};
+
+static int order_add(struct inode_order *order, int inode_num){
+	if (inode_num <= 0 || inode_num >= n_inodes
+			|| !(order->inode_bitmap[inode_num / 8] & (1 << (inode_num % 8)))
+			|| order->seen[inode_num]){
+		return 0;
 	}
-	struct fs_inode containing_dir_inode;
-	if (read_inode(inode_num_of_containing_dir, &containing_dir_inode) != 0){
+	order->seen[inode_num] = 1;
+	order->inodes[order->count++] = inode_num;
+	return 1;
+}
+
+static int order_dir(struct inode_order *order, int dir_inode_num){
+	struct fs_inode dir;
+	if (read_inode(dir_inode_num, &dir) != 0){
 		return -EIO;
 	}
-	if (!S_ISDIR(containing_dir_inode.mode)){
-		return -ENOTDIR;
+	if (!S_ISDIR(dir.mode) || dir.direct[0] == 0){
+		return 0;
 	}
 	struct fs_dirent entries[DIRENTS_PER_BLK];
-	if (disk->ops->read(disk, containing_dir_inode.direct[0], 1, entries) != SUCCESS){
+	if (disk->ops->read(disk, dir.direct[0], 1, entries) != SUCCESS){
 		return -EIO;
 	}
-	bool dir_has_space = false;
-	int entry_index = -1;
-	for (int i = 0; i < DIRENTS_PER_BLK; i++){
-		if (!entries[i].valid){
-			if (!dir_has_space){
-				dir_has_space = true;
-				entry_index = i;
+	/* files on the first pass, subdirectories on the second */
+	for (int pass = 0; pass < 2; pass++){
+		for (int i = 0; i < DIRENTS_PER_BLK; i++){
+			if (!entries[i].valid || entries[i].isDir != pass || !order_add(order, entries[i].inode)){
+				continue;
+			}
+			int retval = (pass == 1) ? order_dir(order, entries[i].inode) : 0;
+			if (retval != 0){
+				return retval;
 			}
-			continue;
-		}
-		if (!strcmp(entries[i].name, new_dir_name)){
-			return -EEXIST;
 		}
 	}
-	if (!dir_has_space){
-		return -ENOSPC;
-	}
-	int new_inode_num = -1;
-	char *inode_bitmap = malloc(FS_BLOCK_SIZE * superblock.inode_map_sz);
-	if (inode_bitmap == NULL){
-		return -EIO;
-	}
-	if (disk->ops->read(disk, 1, superblock.inode_map_sz, inode_bitmap) != SUCCESS){
-		free(inode_bitmap);
-		return -EIO;
-	}
-	for (int i = 0; i < INODES_PER_BLK * superblock.inode_region_sz; i++){
-		if (!(inode_bitmap[i / 8] & (1 << (i % 8)))){
-			new_inode_num = i;
-			break;
+	return 0;
+}
+
+/*
+ * Build the list of all used inodes in directory order, followed by
+ * any used inodes that no directory refers to.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int inode_order_build(struct inode_order *order){
+	order->count = 0;
+	order->inodes = malloc(n_inodes * sizeof(int));
+	order->seen = calloc(n_inodes, 1);
+	order->inode_bitmap = malloc(inode_bitmap_bytes);
+	if (order->inodes == NULL || order->seen == NULL || order->inode_bitmap == NULL){
+		return -ENOMEM;
+	}
+	read_inode_bitmap(order->inode_bitmap);
+	order_add(order, superblock.root_inode);
+	int retval = order_dir(order, superblock.root_inode);
+	for (int i = 0; i < n_inodes && retval == 0; i++){
+		order_add(order, i);
+	}
+	return retval;
+}
+
+static void inode_order_free(struct inode_order *order){
+	free(order->inodes);
+	free(order->seen);
+	free(order->inode_bitmap);
+}
+
+/* block and extent counts of one file */
+struct frag_count {
+	uint32_t blocks; /* blocks visited */
+	uint32_t extents; /* runs of consecutive blocks */
+	uint32_t last; /* last block visited */
+	uint32_t shared; /* blocks shared with a clone */
+};
+
+static int frag_count_cb(uint32_t *ptr, void *arg){
+	struct frag_count *fc = arg;
+	if (fc->blocks == 0 || *ptr != fc->last + 1){
+		fc->extents++;
+	}
+	fc->last = *ptr;
+	fc->blocks++;
+	fc->shared += block_shared(*ptr);
+	return 0;
+}
+
+static int count_extents(struct fs_inode *inode, struct frag_count *fc){
+	memset(fc, 0, sizeof(*fc));
+	return walk_blocks(inode, frag_count_cb, fc);
+}
+
+/*
+ * Measure the fragmentation of all files in order.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int measure_fragmentation(struct inode_order *order, struct fsx492_frag *frag){
+	memset(frag, 0, sizeof(*frag));
+	for (int i = 0; i < order->count; i++){
+		struct fs_inode inode;
+		struct frag_count fc;
+		if (read_inode(order->inodes[i], &inode) != 0 || count_extents(&inode, &fc) != 0){
+			return -EIO;
+		}
+		if (fc.blocks > 0){
+			frag->files++;
+			frag->blocks += fc.blocks;
+			frag->extents += fc.extents;
+			frag->fragmented += (fc.extents > 1);
 		}
 	}
-	if (new_inode_num == -1){
-		free(inode_bitmap);
-		return -ENOSPC;
+	struct arena_mark mark = arena_mark();
+	char *block_bitmap = arena_alloc(block_bitmap_bytes);
+	if (block_bitmap == NULL){
+		return -ENOMEM;
 	}
-	struct fs_inode new_inode = {
-		.uid = fuse_get_context()->uid,
-		.gid = fuse_get_context()->gid,
-		.mode = (mode & 01777 & ~(fuse_get_context()->umask)) | S_IFDIR,
-		.ctime = time(NULL),
-		.mtime = time(NULL),
-		.size = 0,
-		.indir_1 = 0,
-		.indir_2 = 0,
-	};
-	for (int i = 1; i < N_DIRECT; i++){
-		new_inode.direct[i] = 0;
+	read_block_bitmap(block_bitmap);
+	for (int i = superblock.num_blocks - 1; i >= 0 && frag->end == 0; i--){
+		if (block_bitmap[i / 8] & (1 << (i % 8))){
+			frag->end = i + 1;
+		}
 	}
-	int new_block_num = -1;
-	char *block_bitmap = malloc(FS_BLOCK_SIZE * superblock.block_map_sz);
-	if (block_bitmap == NULL){
-		free(inode_bitmap);
+	arena_release(mark);
+	return 0;
+}
+
+/* blocks a file is being moved to, and the blocks it gives up */
+struct relocation {
+	struct block_pool pool; /* contiguous destination blocks */
+	uint32_t *old; /* blocks given up */
+	int n_old; /* number of blocks given up */
+};
+
+static int relocate_block_cb(uint32_t *ptr, void *arg){
+	struct relocation *r = arg;
+	char block[FS_BLOCK_SIZE];
+	int new_block = block_pool_alloc(&r->pool);
+	if (new_block < 0){
+		return new_block;
+	}
+	if (disk->ops->read(disk, *ptr, 1, block) != SUCCESS
+			|| write_blocks(new_block, 1, block) != SUCCESS){
 		return -EIO;
 	}
-	if (disk->ops->read(disk, 1 + superblock.inode_map_sz, superblock.block_map_sz, block_bitmap) != SUCCESS){
-		free(block_bitmap);
-		free(inode_bitmap);
-		return -EIO;
+	r->old[r->n_old++] = *ptr;
+	*ptr = new_block;
+	return 0;
+}
+
+/*
+ * Move a file's blocks into one contiguous run of free blocks. The
+ * copies and their indirect blocks are written before the inode, and
+ * the old blocks are only freed after it, so an interrupted move
+ * leaves the file intact.
+ *
+ * @param blocks: number of blocks in the file, including indirect blocks
+ * @return: 0 if moved or no run is long enough, or -error number
+ */
+static int defrag_file(int inode_num, struct fs_inode *inode, int blocks){
+	struct relocation r;
+	int retval = block_pool_reserve(&r.pool, blocks, group_of_inode(inode_num));
+	if (retval == -ENOSPC){
+		return 0;
 	}
-	for (int i = 0; i < superblock.num_blocks; i++){
-		if (!(block_bitmap[i / 8] & (1 << (i % 8)))){
-			new_block_num = i;
-			break;
-		}
+	if (retval != 0){
+		return retval;
 	}
-	if (new_block_num == -1){
-		free(block_bitmap);
-		free(inode_bitmap);
-		return -ENOSPC;
+	if (r.pool.blocks[blocks - 1] - r.pool.blocks[0] != blocks - 1){
+		return block_pool_release(&r.pool);
 	}
-	block_bitmap[new_block_num / 8] |= 1 << (new_block_num % 8);
-	if (disk->ops->write(disk, 1 + superblock.inode_map_sz, superblock.block_map_sz, block_bitmap) != SUCCESS){
-		free(block_bitmap);
-		free(inode_bitmap);
-		return -EIO;
+	r.n_old = 0;
+	if ((r.old = malloc(blocks * sizeof(uint32_t))) == NULL){
+		retval = -ENOMEM;
 	}
-	free(block_bitmap);
-	inode_bitmap[new_inode_num / 8] |= 1 << (new_inode_num % 8);
-	if (disk->ops->write(disk, 1, superblock.inode_map_sz, inode_bitmap) != SUCCESS){
-		free(inode_bitmap);
-		return -EIO;
+	if (retval == 0){
+		retval = walk_blocks(inode, relocate_block_cb, &r);
 	}
-	free(inode_bitmap);
-	struct fs_dirent zeros[FS_BLOCK_SIZE];
-	memset(zeros, 0, FS_BLOCK_SIZE);
-	if (disk->ops->write(disk, new_block_num, 1, zeros) != SUCCESS){
-		return -EIO;
+	if (retval == 0 && blkdev_barrier(disk) != SUCCESS){
+		retval = -EIO;
 	}
-	new_inode.direct[0] = new_block_num;
-	int block_number_that_contains_new_inode =
-		1 + superblock.inode_map_sz + superblock.block_map_sz
-		+ (new_inode_num / INODES_PER_BLK);
-	struct fs_inode block_containing_new_inode[INODES_PER_BLK];
-	if (disk->ops->read(disk, block_number_that_contains_new_inode, 1, block_containing_new_inode) != SUCCESS){
-		return -EIO;
+	if (retval == 0){
+		retval = write_inode(inode_num, inode);
 	}
-	memcpy(&block_containing_new_inode[new_inode_num % INODES_PER_BLK],
-		&new_inode, sizeof(struct fs_inode));
-	if (disk->ops->write(disk, block_number_that_contains_new_inode, 1, block_containing_new_inode) != SUCCESS){
-		return -EIO;
+	if (retval != 0){
+		r.pool.next = 0; /* the inode still points at the old blocks */
+		free(r.old);
+		block_pool_release(&r.pool);
+		return retval;
 	}
-	entries[entry_index].valid = 1;
-	entries[entry_index].isDir = 1;
-	entries[entry_index].inode = new_inode_num;
-	strcpy(entries[entry_index].name, new_dir_name);
-	if (disk->ops->write(disk, containing_dir_inode.direct[0], 1, entries) != SUCCESS){
-		fprintf(stderr, "Error updating directory %s to contain new directory %s, after creating the inode for it. Disk is probably corrupt.\n", temp_path, new_dir_name);
-		return -EIO;
+	/* returning the old blocks is releasing a pool of them that was never used */
+	struct block_pool old = { r.old, r.n_old, 0 };
+	block_pool_release(&r.pool);
+	return block_pool_release(&old);
+}
+
+/*
+ * Move each fragmented file, in directory order, to the first free
+ * run of blocks that holds it. Files that are already contiguous or
+ * for which no run is long enough are left alone, and so are files
+ * sharing blocks with a clone, which moving would unshare, and
+ * snapshot maps, which a mounted snapshot may be reading.
+ */
+static int defrag_files(struct inode_order *order){
+	for (int i = 0; i < order->count; i++){
+		struct fs_inode inode;
+		struct frag_count fc;
+		if (read_inode(order->inodes[i], &inode) != 0 || count_extents(&inode, &fc) != 0){
+			return -EIO;
+		}
+		if (fc.extents > 1 && fc.shared == 0 && !is_snapshot_map(order->inodes[i])){
+			int retval = defrag_file(order->inodes[i], &inode, fc.blocks);
+			if (retval != 0){
+				return retval;
+			}
+		}
 	}
 	return 0;
 }
 
+/* new location of every block, for defrag_compact */
+struct compact_plan {
+	uint32_t *new_loc; /* new block number by old block number, 0 if free */
+	uint32_t next; /* next data block to assign */
+};
 
-static void unset_block_bit(int block_num, char *block_bitmap){
-	if (block_num != 0){
-		block_bitmap[(block_num) / 8] &= ~(1 << (block_num % 8));
+static int plan_block_cb(uint32_t *ptr, void *arg){
+	struct compact_plan *plan = arg;
+	if (is_data_block(*ptr) && plan->new_loc[*ptr] != 0 && block_shared(*ptr)){
+		return 0; /* placed with the first file sharing it */
 	}
+	if (!is_data_block(*ptr) || plan->new_loc[*ptr] != 0){
+		return -EIO; /* not a data block or owned twice: leave the image alone */
+	}
+	plan->new_loc[*ptr] = plan->next;
+	/* skip the bitmaps and inode table of the following groups */
+	while (++plan->next < superblock.num_blocks && !is_data_block(plan->next)){
+		;
+	}
+	return 0;
 }
 
-static int unset_bits(struct fs_inode *inode, char *block_bitmap){
-	for (int i = 0; i < N_DIRECT; i++){
-		if (inode->direct[i] == 0){
-			return 0;
-		}
-		unset_block_bit(inode->direct[i], block_bitmap);
-	}
+static int remap_block_cb(uint32_t *ptr, void *arg){
+	struct compact_plan *plan = arg;
+	*ptr = plan->new_loc[*ptr];
+	return 0;
+}
 
-	if (inode->indir_1 == 0){
-		return 0;
-	}
-	uint32_t indir_1_block[PTRS_PER_BLK];
-	if (disk->ops->read(disk, inode->indir_1, 1, indir_1_block) != SUCCESS){
-		return -EIO;
+/*
+ * Rewrite every file's blocks in directory order into the data blocks
+ * from the first one on, leaving all free space at the end of the
+ * image. Blocks are moved along the cycles of the old to new mapping,
+ * so each is read and written once, even if clones share it. Blocks that no file owns are
+ * freed, except the dynamic inode tables and their map, which go
+ * first. The image is inconsistent while this runs, so it is meant
+ * for an unmounted image that has been copied first.
+ */
+static int defrag_compact(struct inode_order *order){
+	struct compact_plan plan = { calloc(superblock.num_blocks, sizeof(uint32_t)), groups[0].data };
+	char *moved = calloc(superblock.num_blocks, 1);
+	char *block_bitmap = calloc(block_bitmap_bytes, 1);
+	char *buf = malloc(2 * FS_BLOCK_SIZE);
+	int retval = 0;
+	if (plan.new_loc == NULL || moved == NULL || block_bitmap == NULL || buf == NULL){
+		retval = -ENOMEM;
+	}
+	if (retval == 0){
+		retval = walk_imap(plan_block_cb, &plan);
+	}
+	for (int i = 0; i < order->count && retval == 0; i++){
+		struct fs_inode inode;
+		if (read_inode(order->inodes[i], &inode) != 0){
+			retval = -EIO;
+		} else {
+			retval = walk_blocks(&inode, plan_block_cb, &plan);
+		}
 	}
-	for (int i = 0; i < PTRS_PER_BLK; i++){
-		if (indir_1_block[i] == 0){
-			return 0;
+	for (uint32_t b = 0; b < superblock.num_blocks && retval == 0; b++){
+		if (plan.new_loc[b] == 0 || plan.new_loc[b] == b || moved[b]){
+			continue;
+		}
+		/* carry the block along its chain until reaching a free block or closing the cycle */
+		char *carry = buf, *next = buf + FS_BLOCK_SIZE;
+		if (disk->ops->read(disk, b, 1, carry) != SUCCESS){
+			retval = -EIO;
+		}
+		for (uint32_t cur = b; retval == 0; ){
+			uint32_t dest = plan.new_loc[cur];
+			moved[cur] = 1;
+			bool occupied = (plan.new_loc[dest] != 0 && !moved[dest]);
+			if (occupied && disk->ops->read(disk, dest, 1, next) != SUCCESS){
+				retval = -EIO;
+			} else if (write_blocks(dest, 1, carry) != SUCCESS){
+				retval = -EIO;
+			} else if (!occupied){
+				break;
+			} else {
+				char *temp = carry;
+				carry = next;
+				next = temp;
+				cur = dest;
+			}
 		}
-		unset_block_bit(indir_1_block[i], block_bitmap);
 	}
-	unset_block_bit(inode->indir_1, block_bitmap);
-
-	if (inode->indir_2 == 0){
-		return 0;
+	/* blocks are all in place before anything points at them */
+	if (retval == 0 && blkdev_barrier(disk) != SUCCESS){
+		retval = -EIO;
 	}
-	uint32_t indir_2_block[PTRS_PER_BLK];
-	if (disk->ops->read(disk, inode->indir_2, 1, indir_2_block) != SUCCESS){
-		return -EIO;
+	/* dynamic inode table blocks first, so inodes are written where their tables went */
+	if (retval == 0){
+		retval = walk_imap(remap_block_cb, &plan);
 	}
-	for (int i = 0; i < PTRS_PER_BLK; i++){
-		if (indir_2_block[i] == 0){
-			return 0;
+	for (int i = 0; i < order->count && retval == 0; i++){
+		struct fs_inode inode;
+		if (read_inode(order->inodes[i], &inode) != 0){
+			retval = -EIO;
+		} else if ((retval = walk_blocks(&inode, remap_block_cb, &plan)) == 0){
+			retval = write_inode(order->inodes[i], &inode);
 		}
-		uint32_t second_level_block[PTRS_PER_BLK];
-		if (disk->ops->read(disk, indir_2_block[i], 1, second_level_block) != SUCCESS){
-			return -EIO;
+	}
+	/* the counts follow their blocks, once the map has been moved itself */
+	if (retval == 0 && refcounts != NULL){
+		uint16_t *moved_counts = calloc(refcount_map_blocks, FS_BLOCK_SIZE);
+		if (moved_counts == NULL){
+			retval = -ENOMEM;
+		} else {
+			for (uint32_t b = 0; b < superblock.num_blocks; b++){
+				if (refcounts[b] != 0){
+					moved_counts[plan.new_loc[b]] = refcounts[b];
+				}
+			}
+			memcpy(refcounts, moved_counts, refcount_map_blocks * FS_BLOCK_SIZE);
+			memset(refcount_dirty, 1, refcount_map_blocks);
+			free(moved_counts);
+			retval = refcount_flush();
 		}
-		for (int j = 0; j < PTRS_PER_BLK; j++){
-			if (second_level_block[j] == 0){
-				return 0;
+	}
+	if (retval == 0){
+		for (uint32_t b = 0; b < superblock.num_blocks; b++){
+			if (b < plan.next || !is_data_block(b)){
+				block_bitmap[b / 8] |= 1 << (b % 8);
 			}
-			unset_block_bit(second_level_block[j], block_bitmap);
 		}
-		unset_block_bit(indir_2_block[i], block_bitmap);
+		retval = write_block_bitmap(block_bitmap);
 	}
-	unset_block_bit(inode->indir_2, block_bitmap);
-	return 0;
+	free(plan.new_loc);
+	free(moved);
+	free(block_bitmap);
+	free(buf);
+	return retval;
 }
 
 /*
- * unlink - delete a file
- *
- * @param path: path to file
+ * Defragment the file system and report fragmentation before and after.
  *
- * @return 0 if successful, or error value
- *	-ENOENT   - file does not exist
- * 	-ENOTDIR  - component of path not a directory
- * 	-EISDIR   - cannot unlink a directory
-*/
-static int fs_unlink(const char *path)
-{
-	if (path[0] == '\0'){
+ * @param req: flags in, fragmentation reports out
+ * @return: 0 if successful, or -error number
+ */
+static int fs_defrag(struct fsx492_defrag *req){
+	if (req->flags & ~FSX492_DEFRAG_COMPACT){
 		return -EINVAL;
 	}
-	if (!strcmp(path, "/")){
-		return -EISDIR;
+	if ((req->flags & FSX492_DEFRAG_COMPACT) && n_snapshots > 0){
+		return -EBUSY; /* it would free the copies, which no file owns */
 	}
-	char temp_path[MAX_PATH];
-	char new_file_name[FS_FILENAME_SIZE];
-	if (split_path(path, temp_path, new_file_name) == -ENAMETOOLONG){
-		return -ENOENT; 
+	struct inode_order order;
+	int retval = inode_order_build(&order);
+	if (retval == 0){
+		retval = measure_fragmentation(&order, &req->before);
 	}
-	int inode_num_of_dir = inode_from_full_path(temp_path);
-	if (inode_num_of_dir == -1){
-		return -EIO;
+	if (retval == 0){
+		retval = (req->flags & FSX492_DEFRAG_COMPACT) ? defrag_compact(&order) : defrag_files(&order);
 	}
-	if (inode_num_of_dir < 0){
-		return inode_num_of_dir;
+	if (retval == 0){
+		retval = measure_fragmentation(&order, &req->after);
 	}
-	struct fs_inode dir_inode;
-	if (read_inode(inode_num_of_dir, &dir_inode) != 0){
-		return -EIO;
+	inode_order_free(&order);
+	/* blocks moved are not recorded against their files, so make everything durable */
+	if (retval == 0 && (blkdev_barrier(disk) != SUCCESS || flush_all() != SUCCESS)){
+		retval = -EIO;
 	}
-	if (!S_ISDIR(dir_inode.mode)){
-		return -ENOTDIR;
+	return retval;
+}
+
+/*
+ * Deduplication. FSX492_IOC_DEDUP reads the data blocks of the regular
+ * files in directory order and indexes them by the hash of their
+ * contents. A block with the same contents as one indexed before,
+ * compared in full as hashes can collide, is given up, and its file
+ * shares the earlier block instead, as a clone would. The index is
+ * kept in memory for the one pass.
+ */
+struct dedup_entry {
+	uint64_t hash; /* xxh64 of the block's contents */
+	uint32_t block; /* 0 for an empty slot */
+};
+
+/* a pointer of the file being deduplicated to move to another block */
+struct dedup_merge {
+	uint32_t from; /* the file's block */
+	uint32_t to; /* the block it shares instead */
+};
+
+struct dedup_pass {
+	struct dedup_entry *index; /* open addressing with linear probing */
+	uint32_t mask; /* index slots less 1, the slots a power of 2 */
+	uint32_t indexed; /* slots used */
+	struct dedup_merge *merges; /* in the current file */
+	int n_merges, merges_cap;
+	char *block, *other; /* the block visited and a candidate for it */
+	struct fsx492_dedup *report;
+};
+
+static int dedup_add_merge(struct dedup_pass *d, uint32_t from, uint32_t to){
+	if (d->n_merges == d->merges_cap){
+		int cap = (d->merges_cap == 0) ? PTRS_PER_BLK : 2 * d->merges_cap;
+		struct dedup_merge *merges = realloc(d->merges, cap * sizeof(struct dedup_merge));
+		if (merges == NULL){
+			return -ENOMEM;
+		}
+		d->merges = merges;
+		d->merges_cap = cap;
 	}
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	if (disk->ops->read(disk, dir_inode.direct[0], 1, entries) != SUCCESS){
+	d->merges[d->n_merges++] = (struct dedup_merge){ .from = from, .to = to };
+	refcount_get(to);
+	return 0;
+}
+
+/* block visitor: find an indexed block with the contents of *ptr, or index *ptr */
+static int dedup_find_cb(uint32_t *ptr, void *arg){
+	struct dedup_pass *d = arg;
+	if (disk->ops->read(disk, *ptr, 1, d->block) != SUCCESS){
 		return -EIO;
 	}
-	int entry_index = -1;
-	for (int i = 0; i < DIRENTS_PER_BLK; i++){
-		if (entries[i].valid && !strcmp(entries[i].name, new_file_name)){
-			entry_index = i;
-			break;
+	d->report->scanned++;
+	uint64_t hash = xxh64(d->block, FS_BLOCK_SIZE, 0);
+	uint32_t i = hash & d->mask;
+	for (; d->index[i].block != 0; i = (i + 1) & d->mask){
+		struct dedup_entry *e = &d->index[i];
+		if (e->hash != hash){
+			continue;
+		}
+		if (e->block == *ptr){
+			return 0; /* already shared */
+		}
+		if (refcounts[e->block] == UINT16_MAX){
+			continue;
+		}
+		if (disk->ops->read(disk, e->block, 1, d->other) != SUCCESS){
+			return -EIO;
+		}
+		if (memcmp(d->block, d->other, FS_BLOCK_SIZE) == 0){
+			return dedup_add_merge(d, *ptr, e->block);
 		}
 	}
-	if (entry_index == -1){
-		return -ENOENT;
+	/* the index has a slot for every block used when the pass began, and none are allocated since */
+	if (d->indexed < d->mask){
+		d->index[i] = (struct dedup_entry){ .hash = hash, .block = *ptr };
+		d->indexed++;
+	}
+	return 0;
+}
+
+static int dedup_merge_cmp(const void *a, const void *b){
+	uint32_t x = ((const struct dedup_merge *)a)->from, y = ((const struct dedup_merge *)b)->from;
+	return (x > y) - (x < y);
+}
+
+/* block visitor: move a pointer as the current file's merges say */
+static int dedup_remap_cb(uint32_t *ptr, void *arg){
+	struct dedup_pass *d = arg;
+	struct dedup_merge key = { .from = *ptr };
+	struct dedup_merge *m = bsearch(&key, d->merges, d->n_merges, sizeof(key), dedup_merge_cmp);
+	if (m != NULL){
+		*ptr = m->to;
 	}
+	return 0;
+}
 
-	struct fs_inode inode_of_file_to_be_removed;
-	if (read_inode(entries[entry_index].inode, &inode_of_file_to_be_removed) != 0){
+/*
+ * Deduplicate one file against the blocks indexed so far, and index
+ * its blocks that are new. The shares of the blocks the file moves to
+ * are counted before the file is written, and the blocks it moves
+ * from given up after, so an interrupted pass only leaks blocks.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int dedup_file(int inode_num, struct dedup_pass *d){
+	struct fs_inode inode;
+	if (read_inode(inode_num, &inode) != 0){
 		return -EIO;
 	}
-	if (S_ISDIR(inode_of_file_to_be_removed.mode)){
-		return -EISDIR;
+	if (!S_ISREG(inode.mode) || is_snapshot_map(inode_num) || inode_num == (int)superblock.refcount_inode){
+		return 0;
 	}
-	char *block_bitmap = malloc(FS_BLOCK_SIZE * superblock.block_map_sz);
-	if (block_bitmap == NULL){
-		return -EIO;
+	d->n_merges = 0;
+	int retval = walk_data_blocks(&inode, dedup_find_cb, d);
+	if (retval != 0 || d->n_merges == 0){
+		return retval;
 	}
-	if (disk->ops->read(disk, 1 + superblock.inode_map_sz, superblock.block_map_sz, block_bitmap) != SUCCESS){
-		free(block_bitmap);
-		return -EIO;
+	if ((retval = refcount_flush()) != 0){
+		return retval;
 	}
-	if (unset_bits(&inode_of_file_to_be_removed, block_bitmap) != 0){
-		free(block_bitmap);
+	if (blkdev_barrier(disk) != SUCCESS){
 		return -EIO;
 	}
-	char *inode_bitmap = malloc(FS_BLOCK_SIZE * superblock.inode_map_sz);
-	if (inode_bitmap == NULL){
-		free(block_bitmap);
-		return -EIO;
+	qsort(d->merges, d->n_merges, sizeof(struct dedup_merge), dedup_merge_cmp);
+	if ((retval = walk_data_blocks(&inode, dedup_remap_cb, d)) != 0){
+		return retval;
 	}
-	if (disk->ops->read(disk, 1, superblock.inode_map_sz, inode_bitmap) != SUCCESS){
-		free(inode_bitmap);
-		free(block_bitmap);
+	if (write_inode(inode_num, &inode) != 0 || blkdev_barrier(disk) != SUCCESS){
 		return -EIO;
 	}
-	inode_bitmap[entries[entry_index].inode / 8] &= ~(1 << (entries[entry_index].inode % 8));
-	entries[entry_index].valid = 0;
-	if (disk->ops->write(disk, 1 + superblock.inode_map_sz, superblock.block_map_sz, block_bitmap) != SUCCESS){
-		free(block_bitmap);
-		free(inode_bitmap);
-		return -EIO;
+	struct arena_mark mark = arena_mark();
+	char *block_bitmap = arena_alloc(block_bitmap_bytes);
+	if (block_bitmap == NULL){
+		arena_release(mark);
+		return -ENOMEM;
+	}
+	read_block_bitmap(block_bitmap);
+	for (int i = 0; i < d->n_merges && retval == 0; i++){
+		uint32_t from = d->merges[i].from;
+		if (block_shared(from)){
+			retval = refcount_put(from);
+		} else {
+			unset_block_bit(from, block_bitmap);
+		}
 	}
-	free(block_bitmap);
-	if (disk->ops->write(disk, 1, superblock.inode_map_sz, inode_bitmap) != SUCCESS){
-		free(inode_bitmap);
-		fprintf(stderr, "Error updating inode bitmap when deleting file '%s'. Disk is probably corrupt.\n", path);
-		return -EIO;
+	if (retval == 0){
+		retval = write_block_bitmap(block_bitmap);
 	}
-	free(inode_bitmap);
-	if (disk->ops->write(disk, dir_inode.direct[0], 1, entries) != SUCCESS){
-		fprintf(stderr, "Error updating contents of directory '%s' when deleting '%s'. This directory is now corrupt.\n", temp_path, new_file_name);
-		return -EIO;
+	arena_release(mark);
+	if (retval != 0){
+		refcount_abort();
+		return retval;
 	}
-	return 0;
+	d->report->merged += d->n_merges;
+	return refcount_commit();
 }
 
 /*
- * rmdir - remove a directory
- *
- * @param path: the path of the directory
+ * Merge data blocks of regular files that have the same contents.
+ * Files written later get blocks of their own again.
  *
+ * @param report: blocks scanned and merged, out
  * @return: 0 if successful, or -error number
- * 	-ENOENT   - file does not exist
- *  	-ENOTDIR  - component of path not a directory
- *  	-ENOTDIR  - path not a directory
- *  	-ENOEMPTY - directory not empty
-*/
-
-static int fs_rmdir(const char *path)
-{
-	if (path[0] == '\0'){
-		return -EINVAL;
-	}
-	if (!strcmp(path, "/")){
-		return -ENOTEMPTY;
+ */
+static int fs_dedup(struct fsx492_dedup *report){
+	memset(report, 0, sizeof(*report));
+	int retval = 0;
+	if (refcounts == NULL && (retval = refcount_create()) != 0){
+		return retval;
+	}
+	struct statvfs st;
+	fs_istatfs(&st);
+	uint32_t slots = 64;
+	while (slots < 2 * (st.f_blocks - st.f_bfree)){
+		slots *= 2;
+	}
+	struct dedup_pass d = { .mask = slots - 1, .report = report };
+	struct inode_order order;
+	struct arena_mark mark = arena_mark();
+	d.index = calloc(slots, sizeof(struct dedup_entry));
+	d.block = arena_alloc(FS_BLOCK_SIZE);
+	d.other = arena_alloc(FS_BLOCK_SIZE);
+	if (d.index == NULL || d.block == NULL || d.other == NULL){
+		retval = -ENOMEM;
+	} else {
+		retval = inode_order_build(&order);
+		for (int i = 0; i < order.count && retval == 0; i++){
+			retval = dedup_file(order.inodes[i], &d);
+		}
+		inode_order_free(&order);
 	}
-	char temp_path[MAX_PATH];
-	char dir_name[FS_FILENAME_SIZE];
-	if (split_path(path, temp_path, dir_name) == -ENAMETOOLONG){
-		return -ENOENT;
+	arena_release(mark);
+	free(d.index);
+	free(d.merges);
+	/* as with defrag, make everything durable */
+	if (retval == 0 && (blkdev_barrier(disk) != SUCCESS || flush_all() != SUCCESS)){
+		retval = -EIO;
 	}
+	return retval;
+}
 
-	int inode_num_of_containing_dir = inode_from_full_path(temp_path);
-	if (inode_num_of_containing_dir == -1){
-		return -EIO;
-	}
-	if (inode_num_of_containing_dir < 0){
-		return inode_num_of_containing_dir;
+/*
+ * Scrubbing. FSX492_IOC_SCRUB reads every block of the file system,
+ * which on an image with FS_FEAT_CSUM checks it against its checksum,
+ * in SCRUB_THREADS threads taking SCRUB_CHUNK blocks at a time. A
+ * chunk that fails is read again a block at a time to find the blocks
+ * at fault.
+ */
+enum { SCRUB_THREADS = 4, SCRUB_CHUNK = 256 };
+
+struct scrub {
+	pthread_mutex_t lock; /* protects the fields below */
+	uint32_t next; /* first block of the next chunk */
+	struct fsx492_scrub *report;
+	int error; /* 0, or -ENOMEM if a thread had no buffer */
+};
+
+static void *scrub_thread(void *arg){
+	struct scrub *s = arg;
+	char *buf = malloc(SCRUB_CHUNK * FS_BLOCK_SIZE);
+	uint32_t bad = 0, first_bad = UINT32_MAX;
+	while (buf != NULL){
+		pthread_mutex_lock(&s->lock);
+		uint32_t first = s->next;
+		s->next += (first < superblock.num_blocks) ? SCRUB_CHUNK : 0;
+		pthread_mutex_unlock(&s->lock);
+		if (first >= superblock.num_blocks){
+			break;
+		}
+		int count = (superblock.num_blocks - first < SCRUB_CHUNK) ? superblock.num_blocks - first : SCRUB_CHUNK;
+		if (disk->ops->read(disk, first, count, buf) == SUCCESS){
+			continue;
+		}
+		for (int i = 0; i < count; i++){
+			if (disk->ops->read(disk, first + i, 1, buf) != SUCCESS){
+				bad++;
+				first_bad = (first + i < first_bad) ? first + i : first_bad;
+			}
+		}
 	}
-	struct fs_inode containing_dir_inode;
-	if (read_inode(inode_num_of_containing_dir, &containing_dir_inode) != 0){
-		return -EIO;
+	pthread_mutex_lock(&s->lock);
+	s->report->bad += bad;
+	if (bad > 0 && (s->report->bad == bad || first_bad < s->report->first_bad)){
+		s->report->first_bad = first_bad;
 	}
-	if (!S_ISDIR(containing_dir_inode.mode)){
-		return -ENOTDIR;
+	if (buf == NULL){
+		s->error = -ENOMEM;
 	}
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	if (disk->ops->read(disk, containing_dir_inode.direct[0], 1, entries) != SUCCESS){
-		return -EIO;
+	pthread_mutex_unlock(&s->lock);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Read every block of the file system, checking checksums if the
+ * image has them. The calling thread scrubs along with the others,
+ * and alone if no threads can be started.
+ *
+ * @param report: blocks read and bad blocks found, out
+ * @return: 0 if successful, even if bad blocks were found, or -error number
+ */
+static int fs_scrub(struct fsx492_scrub *report){
+	memset(report, 0, sizeof(*report));
+	report->blocks = superblock.num_blocks;
+	struct scrub s = { .next = 0, .report = report, .error = 0 };
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_t threads[SCRUB_THREADS - 1];
+	int started = 0;
+	while (started < SCRUB_THREADS - 1 && pthread_create(&threads[started], NULL, scrub_thread, &s) == 0){
+		started++;
+	}
+	scrub_thread(&s);
+	for (int i = 0; i < started; i++){
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&s.lock);
+	return s.error;
+}
+
+/*
+ * Resizing. FSX492_IOC_RESIZE changes the number of blocks of the file
+ * system and of the device under it. Growing a grouped image fills out
+ * its last group and adds groups after it, each with its own bitmaps
+ * and an empty inode table. Growing an image without groups adds data
+ * blocks, and a block of block bitmap for every BITS_PER_BLK of them;
+ * the new bitmap blocks take the place of the first data blocks, which
+ * are moved out of the way, and the inode table moves up behind them.
+ * Shrinking moves the blocks in use past the new end to free blocks
+ * before it. No other data is copied.
+ *
+ * The superblock is written last, but the device changes size and
+ * blocks move before that, so the image is inconsistent while this
+ * runs and should be copied first if a crash would matter.
+ */
+
+/* where the blocks in use in a range of blocks move to */
+struct evacuation {
+	uint32_t first, end; /* the range */
+	uint32_t *new_loc; /* new block by block - first, 0 if it stays */
+};
+
+static int evacuate_cb(uint32_t *ptr, void *arg){
+	struct evacuation *ev = arg;
+	if (*ptr >= ev->first && *ptr < ev->end && ev->new_loc[*ptr - ev->first] != 0){
+		*ptr = ev->new_loc[*ptr - ev->first];
 	}
-	int entry_index = -1;
-	for (int i = 0; i < DIRENTS_PER_BLK; i++){
-		if (entries[i].valid && !strcmp(entries[i].name, dir_name)){
-			entry_index = i;
-			break;
+	return 0;
+}
+
+/*
+ * Move the data blocks in use from first to end - 1 to free blocks
+ * below limit outside that range, and point the files at them. The
+ * copies are written before any file points at them. The caller's
+ * block bitmap of limit bits and the reference counts, which must
+ * cover limit blocks, are updated for the caller to write.
+ *
+ * @return: 0 if successful, or -error number
+ *	-ENOSPC - too few free blocks; nothing has moved
+ */
+static int evacuate(char *bitmap, uint32_t limit, uint32_t first, uint32_t end){
+	uint32_t needed = 0, available = 0;
+	for (uint32_t b = groups[0].data; b < limit || b < end; b++){
+		bool used = bitmap[b / 8] & (1 << (b % 8));
+		if (b >= first && b < end){
+			needed += used && is_data_block(b);
+		} else if (b < limit){
+			available += !used;
 		}
 	}
-	if (entry_index == -1){
-		return -ENOENT;
+	if (needed > available){
+		return -ENOSPC;
 	}
-	
-	struct fs_inode inode_of_dir_to_be_removed;
-	if (read_inode(entries[entry_index].inode, &inode_of_dir_to_be_removed) != 0){
-		return -EIO;
+	struct evacuation ev = { first, end, calloc(end - first, sizeof(uint32_t)) };
+	char *block = malloc(FS_BLOCK_SIZE);
+	int retval = (ev.new_loc == NULL || block == NULL) ? -ENOMEM : 0;
+	uint32_t dest = groups[0].data;
+	for (uint32_t b = first; b < end && retval == 0; b++){
+		if (!(bitmap[b / 8] & (1 << (b % 8))) || !is_data_block(b)){
+			continue;
+		}
+		while ((dest >= first && dest < end) || (bitmap[dest / 8] & (1 << (dest % 8)))){
+			dest++;
+		}
+		if (disk->ops->read(disk, b, 1, block) != SUCCESS || write_blocks(dest, 1, block) != SUCCESS){
+			retval = -EIO;
+		}
+		bitmap[dest / 8] |= 1 << (dest % 8);
+		ev.new_loc[b - first] = dest;
 	}
-	if (!S_ISDIR(inode_of_dir_to_be_removed.mode)){
-		return -ENOTDIR;
+	if (retval == 0 && blkdev_barrier(disk) != SUCCESS){
+		retval = -EIO;
 	}
-	struct fs_dirent entries_of_dir_to_be_removed[DIRENTS_PER_BLK];
-	if (disk->ops->read(disk, inode_of_dir_to_be_removed.direct[0], 1, entries_of_dir_to_be_removed) != SUCCESS){
-		return -EIO;
+	/* inodes in dynamic table blocks that moved are read and written where they went */
+	if (retval == 0){
+		retval = walk_imap(evacuate_cb, &ev);
 	}
-	for (int i = 0; i < DIRENTS_PER_BLK; i++){
-		if (entries_of_dir_to_be_removed[i].valid){
-			return -ENOTEMPTY;
+	for (uint32_t i = 0; i < n_inodes && retval == 0; i++){
+		struct fs_inode inode, before;
+		if (!inode_used(i)){
+			continue;
+		}
+		if (read_inode(i, &inode) != 0){
+			retval = -EIO;
+		} else {
+			before = inode;
+			retval = walk_blocks(&inode, evacuate_cb, &ev);
+			if (retval == 0 && memcmp(&before, &inode, sizeof(inode)) != 0){
+				retval = write_inode(i, &inode);
+			}
 		}
 	}
-	char *block_bitmap = malloc(FS_BLOCK_SIZE * superblock.block_map_sz);
-	if (block_bitmap == NULL){
-		return -EIO;
-	}
-	if (disk->ops->read(disk, 1 + superblock.inode_map_sz, superblock.block_map_sz, block_bitmap) != 0){
-		free(block_bitmap);
-		return -EIO;
+	for (uint32_t b = first; b < end && retval == 0; b++){
+		uint32_t to = ev.new_loc[b - first];
+		if (to == 0){
+			continue;
+		}
+		bitmap[b / 8] &= ~(1 << (b % 8));
+		if (block_shared(b)){
+			refcounts[to] = refcounts[b];
+			refcounts[b] = 0;
+			refcount_dirty[to * sizeof(uint16_t) / FS_BLOCK_SIZE] = 1;
+			refcount_dirty[b * sizeof(uint16_t) / FS_BLOCK_SIZE] = 1;
+		}
 	}
-	unset_block_bit(inode_of_dir_to_be_removed.direct[0], block_bitmap);
-	
-	char *inode_bitmap = malloc(FS_BLOCK_SIZE * superblock.inode_map_sz);
-	if (inode_bitmap == NULL){
-		free(block_bitmap);
-		return -EIO;
+	free(ev.new_loc);
+	free(block);
+	return retval;
+}
+
+/* make the reference counts in memory cover blocks blocks, the new ones 0; returns 0 or -ENOMEM */
+static int refcount_extend(uint32_t blocks){
+	int map_blocks = ((uint64_t)blocks * sizeof(uint16_t) + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+	if (refcounts == NULL || map_blocks <= refcount_map_blocks){
+		return 0;
 	}
-	if (disk->ops->read(disk, 1, superblock.inode_map_sz, inode_bitmap) != SUCCESS){
-		free(inode_bitmap);
-		free(block_bitmap);
-		return -EIO;
+	uint16_t *counts = realloc(refcounts, (size_t)map_blocks * FS_BLOCK_SIZE);
+	if (counts == NULL){
+		return -ENOMEM;
 	}
-	inode_bitmap[entries[entry_index].inode / 8] &= ~(1 << (entries[entry_index].inode % 8));
-	entries[entry_index].valid = 0;
-	if (disk->ops->write(disk, 1 + superblock.inode_map_sz, superblock.block_map_sz, block_bitmap) != SUCCESS){
-		free(block_bitmap);
-		free(inode_bitmap);
-		return -EIO;
+	refcounts = counts;
+	char *dirty = realloc(refcount_dirty, map_blocks);
+	if (dirty == NULL){
+		return -ENOMEM;
 	}
-	free(block_bitmap);
-	if (disk->ops->write(disk, 1, superblock.inode_map_sz, inode_bitmap) != SUCCESS){
-		free(inode_bitmap);
-		fprintf(stderr, "Error updating inode bitmap when deleting directory '%s'. Disk is probably corrupt.\n", path);
+	refcount_dirty = dirty;
+	memset((char *)refcounts + (size_t)refcount_map_blocks * FS_BLOCK_SIZE, 0,
+			(size_t)(map_blocks - refcount_map_blocks) * FS_BLOCK_SIZE);
+	memset(refcount_dirty + refcount_map_blocks, 1, map_blocks - refcount_map_blocks);
+	refcount_map_blocks = map_blocks;
+	return 0;
+}
+
+/* give the map file a block for each block of counts in memory, and write the counts changed */
+static int refcount_fit_file(void){
+	struct fs_inode map;
+	if (read_inode(superblock.refcount_inode, &map) != 0){
 		return -EIO;
 	}
-	free(inode_bitmap);
-	if (disk->ops->write(disk, containing_dir_inode.direct[0], 1, entries) != SUCCESS){
-		fprintf(stderr, "Error updating contents of directory '%s' when deleting '%s'. This directory is now corrupt.\n", temp_path, dir_name);
-		return -EIO;
+	if (map.size < refcount_map_blocks * FS_BLOCK_SIZE){
+		int goal = group_of_inode(superblock.refcount_inode);
+		for (int i = map.size / FS_BLOCK_SIZE; i < refcount_map_blocks; i++){
+			int physical = map_block(&map, i, allocate_zeroed_block_cb, &goal, false);
+			if (physical < 0){
+				return physical;
+			}
+		}
+		map.size = refcount_map_blocks * FS_BLOCK_SIZE;
+		if (write_inode(superblock.refcount_inode, &map) != 0 || blkdev_barrier(disk) != SUCCESS){
+			return -EIO;
+		}
 	}
-	return 0;
+	return refcount_flush();
 }
 
 /*
- * rename - rename a file or directory. You can assume the destination 
- * and the source share the same path-prefix so the renaming changes
- * the name without moving the file or directory into another file or
- * directory.
+ * Lay the groups out again once the superblock has its new size, and
+ * write their bitmaps. The block bitmap for the new size, bitmap, is
+ * taken over; it needs only the bits of the groups' metadata set, and
+ * gets them here. Groups from old_groups on are new and get empty
+ * inode tables.
  *
- *  
- *  @param src_path: the source path
- *  @param dst_path: the destination path
+ * @return: 0 if successful, -ENOMEM with nothing changed, or -EIO
+ */
+static int groups_relayout(char *bitmap, int old_groups){
+	int kept_groups = n_groups;
+	uint32_t kept_inodes = n_inodes;
+	count_groups();
+	struct block_group *new_groups = calloc(n_groups, sizeof(struct block_group));
+	char *inode_bitmap = calloc((n_inodes + 7) / 8, 1);
+	char *zeros = calloc(superblock.inode_region_sz, FS_BLOCK_SIZE);
+	if (new_groups == NULL || inode_bitmap == NULL || zeros == NULL || summary_reserve(n_inodes) != 0){
+		free(new_groups);
+		free(inode_bitmap);
+		free(zeros);
+		n_groups = kept_groups;
+		n_inodes = kept_inodes;
+		return -ENOMEM;
+	}
+	memcpy(inode_bitmap, inode_bitmap_mem, (n_inodes < kept_inodes) ? (n_inodes + 7) / 8 : inode_bitmap_bytes);
+	for (int i = 0; i < kept_groups; i++){
+		pthread_mutex_destroy(&groups[i].lock);
+	}
+	free(groups);
+	free(block_bitmap_mem);
+	free(inode_bitmap_mem);
+	groups = new_groups;
+	block_bitmap_mem = bitmap;
+	inode_bitmap_mem = inode_bitmap;
+	block_bitmap_bytes = (superblock.num_blocks + 7) / 8;
+	inode_bitmap_bytes = (n_inodes + 7) / 8;
+	int retval = 0;
+	for (int i = 0; i < n_groups; i++){
+		struct block_group *g = &groups[i];
+		group_layout(g, i);
+		pthread_mutex_init(&g->lock, NULL);
+		for (uint32_t b = g->start; b < g->data; b++){
+			block_bitmap_mem[b / 8] |= 1 << (b % 8);
+		}
+		if (i >= old_groups && write_blocks(g->inode_table, superblock.inode_region_sz, zeros) != SUCCESS){
+			retval = -EIO;
+		}
+		if (write_block_slice(g) != 0 || write_inode_slice(g) != 0){
+			retval = -EIO;
+		}
+	}
+	summary_fill();
+	free(zeros);
+	return retval;
+}
+
+/*
+ * Grow or shrink the file system and its device.
  *
- *  @return: 0 if successful, or -error number
- *  -ENOENT - source file or directory does not exist
- *  -ENOTDIR - component of source or target path not a directory
- *  -EEXIST - destination already exists
- *  -EINVAL - source and destination not in the same directory
-*/
-static int fs_rename(const char *src_path, const char *dst_path)
-{
-	if (src_path[0] == '\0' || dst_path[0] == '\0'){
-		return -EINVAL;
+ * @param req: blocks wanted in, blocks the file system has out
+ * @return: 0 if successful, or -error number
+ *	-EINVAL - too few blocks for the metadata and a data block, or too many for the device
+ *	-EBUSY - there are snapshots, or inodes in use in groups that would go
+ *	-ENOSPC - too few free blocks to move the blocks in the way to
+ *	-EOPNOTSUPP - the device cannot change size
+ */
+static int fs_resize(struct fsx492_resize *req){
+	if (n_snapshots > 0){
+		return -EBUSY; /* their maps are of the blocks there are */
+	}
+	if (disk->ops->resize == NULL){
+		return -EOPNOTSUPP;
+	}
+	struct fs_super old = superblock;
+	bool grouped = superblock.features & FS_FEAT_GROUPS;
+	uint32_t blocks = req->blocks, shift = 0;
+	if (grouped && blocks > superblock.group_blocks){
+		uint32_t meta = superblock.inode_map_sz + superblock.block_map_sz + superblock.inode_region_sz;
+		uint32_t last = (blocks - 1) / superblock.group_blocks * superblock.group_blocks;
+		if (blocks - last < meta + 1){
+			blocks = last;
+		}
+	} else if (!grouped && blocks > old.num_blocks){
+		uint32_t map_sz = (blocks + BITS_PER_BLK - 1) / BITS_PER_BLK;
+		shift = (map_sz > old.block_map_sz) ? map_sz - old.block_map_sz : 0;
 	}
-	if (!strcmp(src_path, "/") || !strcmp(dst_path, "/")){
+	/* leave the device room for a checksum for each block */
+	if (blocks <= groups[0].data + shift || (uint64_t)blocks + blocks / PTRS_PER_BLK + 1 > INT_MAX){
 		return -EINVAL;
 	}
-	char src_prefix[MAX_PATH];
-	char src_suffix[FS_FILENAME_SIZE];
-	if (split_path(src_path, src_prefix, src_suffix) == -ENAMETOOLONG){
-		return -ENOENT; 
+	if (blocks == old.num_blocks){
+		req->blocks = blocks;
+		return 0;
 	}
-	char dest_prefix[MAX_PATH];
-	char dest_suffix[FS_FILENAME_SIZE];
-	if (split_path(dst_path, dest_prefix, dest_suffix) == -ENAMETOOLONG){
-		return -ENAMETOOLONG;
+	if (grouped && blocks < old.num_blocks){
+		for (int i = (blocks + superblock.group_blocks - 1) / superblock.group_blocks; i < n_groups; i++){
+			if (groups[i].free_inodes != groups[i].inodes){
+				return -EBUSY;
+			}
+		}
 	}
-	if (strcmp(src_prefix, dest_prefix)){
-		return -EINVAL; 
+	char *bitmap = calloc(((blocks > old.num_blocks) ? blocks : old.num_blocks) / 8 + 1, 1);
+	if (bitmap == NULL){
+		return -ENOMEM;
 	}
-	int inode_num_of_containing_dir = inode_from_full_path(src_prefix);
-	if (inode_num_of_containing_dir == -1){
-		return -EIO;
+	read_block_bitmap(bitmap);
+	int retval = 0;
+	if (blocks < old.num_blocks){
+		retval = evacuate(bitmap, blocks, blocks, old.num_blocks);
+		if (retval == 0){
+			retval = write_block_bitmap(bitmap);
+		}
+		if (retval == 0 && disk->ops->resize(disk, blocks) != SUCCESS){
+			retval = -EIO;
+		}
+		for (uint32_t b = blocks; b < (blocks + 7) / 8 * 8; b++){
+			bitmap[b / 8] &= ~(1 << (b % 8));
+		}
+	} else if (disk->ops->resize(disk, blocks) != SUCCESS){
+		retval = -EIO;
+	} else if ((retval = refcount_extend(blocks)) == 0 && shift > 0){
+		/* clear the blocks after the inode table and move it up into them */
+		uint32_t table = groups[0].inode_table, first = groups[0].data;
+		retval = evacuate(bitmap, blocks, first, first + shift);
+		char block[FS_BLOCK_SIZE];
+		for (int i = superblock.inode_region_sz - 1; i >= 0 && retval == 0; i--){
+			if (disk->ops->read(disk, table + i, 1, block) != SUCCESS || write_blocks(table + shift + i, 1, block) != SUCCESS){
+				retval = -EIO;
+			}
+		}
 	}
-	if (inode_num_of_containing_dir < 0){
-		return inode_num_of_containing_dir;
+	if (retval == 0){
+		superblock.num_blocks = blocks;
+		superblock.block_map_sz += shift;
+		if (superblock.features & FS_FEAT_CSUM){
+			superblock.csum_blocks = (blocks + PTRS_PER_BLK - 1) / PTRS_PER_BLK; /* as csum.c lays them out */
+		}
+		if ((retval = groups_relayout(bitmap, n_groups)) == -ENOMEM){
+			superblock = old;
+		}
+		bitmap = NULL;
 	}
-	struct fs_inode containing_dir_inode;
-	if (read_inode(inode_num_of_containing_dir, &containing_dir_inode) != 0){
-		return -EIO;
+	if (retval == 0 && refcounts != NULL){
+		retval = refcount_fit_file();
 	}
-	if (!S_ISDIR(containing_dir_inode.mode)){
-		return -ENOTDIR;
+	if (retval == 0 && write_blocks(0, 1, &superblock) != SUCCESS){
+		retval = -EIO;
 	}
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	if (disk->ops->read(disk, containing_dir_inode.direct[0], 1, entries) != SUCCESS){
+	/* blocks moved are not recorded against their files, so make everything durable */
+	if (retval == 0 && (blkdev_barrier(disk) != SUCCESS || flush_all() != SUCCESS)){
+		retval = -EIO;
+	}
+	free(bitmap);
+	if (retval == 0){
+		req->blocks = blocks;
+	}
+	return retval;
+}
+
+/*
+ * Point snap_held at held, a buffer of block_bitmap_bytes, filled with
+ * the blocks that held some snapshot's contents and have not been
+ * copied for it; or at nothing, freeing held, if there are no
+ * snapshots.
+ */
+static void snap_held_install(char *held){
+	free(snap_held);
+	snap_held = NULL;
+	if (n_snapshots == 0){
+		free(held);
+		return;
+	}
+	memset(held, 0, block_bitmap_bytes);
+	for (int i = 0; i < FS_MAX_SNAPSHOTS; i++){
+		struct snapshot *s = &snapshots[i];
+		for (uint32_t b = 0; s->map_num != 0 && b < superblock.num_blocks; b++){
+			if ((s->used[b / 8] & (1 << (b % 8))) && s->map[b] == 0){
+				held[b / 8] |= 1 << (b % 8);
+			}
+		}
+	}
+	snap_held = held;
+}
+
+/* write the blocks of a snapshot's map changed since they were last written; returns 0 or -error */
+static int snap_flush(struct snapshot *s){
+	struct fs_inode map;
+	if (read_inode(s->map_num, &map) != 0){
 		return -EIO;
 	}
-	int entry_index = -1;
-	for (int i = 0; i < DIRENTS_PER_BLK; i++){
-		if (!entries[i].valid){
+	int map_blocks = map_blocks_needed(sizeof(uint32_t));
+	for (int i = 0; i < map_blocks; i++){
+		if (s->map_dirty[i]){
+			if (write_block_to_file(i, &map, (char *)s->map + i * FS_BLOCK_SIZE) != 0){
+				return -EIO;
+			}
+			s->map_dirty[i] = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Copy the blocks from first that some snapshot still reads in place,
+ * before they are written, and record each copy in the map of every
+ * snapshot reading the block. Writing a copy or a map block may need
+ * copies for older snapshots in turn, which ends as each block is
+ * copied at most once.
+ *
+ * @return: 0 if successful, or -error number
+ */
+static int snap_preserve(uint32_t first, int count){
+	if (snap_held == NULL){
+		return 0;
+	}
+	bool copied = false;
+	for (uint32_t b = first; b < first + count; b++){
+		if (!(snap_held[b / 8] & (1 << (b % 8)))){
 			continue;
 		}
-		if (!strcmp(entries[i].name, dest_suffix)){
-			return -EEXIST;
+		char block[FS_BLOCK_SIZE];
+		if (disk->ops->read(disk, b, 1, block) != SUCCESS){
+			return -EIO;
 		}
-		if (entry_index == -1 && !strcmp(entries[i].name, src_suffix)){
-			entry_index = i;
+		int copy = allocate_block(group_of_block(b));
+		if (copy < 0){
+			return copy;
+		}
+		if (write_blocks(copy, 1, block) != SUCCESS){
+			return -EIO;
+		}
+		for (int i = 0; i < FS_MAX_SNAPSHOTS; i++){
+			struct snapshot *s = &snapshots[i];
+			if (s->map_num != 0 && (s->used[b / 8] & (1 << (b % 8))) && s->map[b] == 0){
+				s->map[b] = copy;
+				s->map_dirty[b * sizeof(uint32_t) / FS_BLOCK_SIZE] = 1;
+			}
 		}
+		snap_held[b / 8] &= ~(1 << (b % 8));
+		copied = true;
 	}
-	if (entry_index == -1){
-		return -ENOENT;
+	if (!copied){
+		return 0;
 	}
-	strcpy(entries[entry_index].name, dest_suffix);
-	if (disk->ops->write(disk, containing_dir_inode.direct[0], 1, entries) != SUCCESS){
-		return -EIO;
+	for (int i = 0; i < FS_MAX_SNAPSHOTS; i++){
+		if (snapshots[i].map_num != 0 && snap_flush(&snapshots[i]) != 0){
+			return -EIO;
+		}
 	}
-	return 0;
+	/* the copies and the maps naming them reach the disk before the blocks change */
+	return (blkdev_barrier(disk) == SUCCESS) ? 0 : -EIO;
+}
+
+/* free a snapshot's memory, leaving the slot empty */
+static void snap_free(struct snapshot *s){
+	free(s->map);
+	free(s->map_dirty);
+	free(s->used);
+	*s = (struct snapshot){ .map_num = 0 };
 }
 
 /*
- * chmod - change file permissions
- *
- * @param path: the file or directory path
- * @param mode: the mode_t mode value -- see man 'chmod'
- * for description
+ * Read the map of the snapshot in a slot, and the block bitmap it was
+ * taken with from the copies of the bitmap blocks.
  *
- *  @return: 0 if successful, or -error number
- *  	-ENOENT   - file does not exist
- *  	-ENOTDIR  - component of path not a directory
-*/
-static int fs_chmod(const char *path, mode_t mode)
-{
-	if (path[0] == '\0'){
-		return -EINVAL;
+ * @return: 0 if successful, or -error number
+ */
+static int snapshot_load(int slot){
+	struct snapshot *s = &snapshots[slot];
+	int map_blocks = map_blocks_needed(sizeof(uint32_t));
+	s->map_num = superblock.snapshots[slot];
+	s->map = calloc(map_blocks, FS_BLOCK_SIZE);
+	s->map_dirty = calloc(map_blocks, 1);
+	s->used = calloc(block_bitmap_bytes, 1);
+	char *slice = calloc(superblock.block_map_sz, FS_BLOCK_SIZE);
+	int retval = 0;
+	struct fs_inode map;
+	if (s->map == NULL || s->map_dirty == NULL || s->used == NULL || slice == NULL){
+		retval = -ENOMEM;
+	} else if (read_inode(s->map_num, &map) != 0){
+		retval = -EIO;
+	}
+	for (int i = 0; i < map_blocks && retval == 0; i++){
+		if (read_block_of_file(i, &map, (char *)s->map + i * FS_BLOCK_SIZE) != 0){
+			retval = -EIO;
+		}
 	}
-	int inode_num = inode_from_full_path(path);
-	if (inode_num == -1){
-		return -EIO;
+	for (int i = 0; i < n_groups && retval == 0; i++){
+		struct block_group *g = &groups[i];
+		for (uint32_t k = 0; k < superblock.block_map_sz && retval == 0; k++){
+			uint32_t copy = s->map[g->block_map + k];
+			if (copy == 0 || disk->ops->read(disk, copy, 1, slice + k * FS_BLOCK_SIZE) != SUCCESS){
+				retval = -EIO;
+			}
+		}
+		if (retval == 0){
+			memcpy(s->used + g->start / 8, slice, (g->blocks + 7) / 8);
+		}
 	}
-	if (inode_num < 0){
-		return inode_num;
+	free(slice);
+	if (retval != 0){
+		snap_free(s);
 	}
-	int block_number_that_contains_inode = 1 + superblock.inode_map_sz + superblock.block_map_sz + (inode_num / INODES_PER_BLK);
-	struct fs_inode block_containing_inode[INODES_PER_BLK];
-	if (disk->ops->read(disk, block_number_that_contains_inode, 1, block_containing_inode) != SUCCESS){
-		return -EIO;
+	return retval;
+}
+
+/* load the snapshots listed in the superblock; returns 0 or -error */
+static int snapshots_load(void){
+	for (int i = 0; i < FS_MAX_SNAPSHOTS; i++){
+		if (superblock.snapshots[i] != 0){
+			int retval = snapshot_load(i);
+			if (retval != 0){
+				return retval;
+			}
+			n_snapshots++;
+		}
 	}
-	block_containing_inode[inode_num % INODES_PER_BLK].mode =(block_containing_inode[inode_num % INODES_PER_BLK].mode & ~0777) | (mode & 0777);
-	if (disk->ops->write(disk, block_number_that_contains_inode, 1, block_containing_inode) != SUCCESS){
-		return -EIO;
+	char *held = malloc(block_bitmap_bytes);
+	if (held == NULL){
+		return -ENOMEM;
 	}
+	snap_held_install(held);
+	return 0;
+}
+
+/* block visitor: clear a block's bit in the bitmap arg */
+static int clear_bit_cb(uint32_t *ptr, void *arg){
+	char *bitmap = arg;
+	bitmap[*ptr / 8] &= ~(1 << (*ptr % 8));
 	return 0;
 }
 
 /*
- * Open a filesystem file or directory path.
- *
- * @param path: the path
- * @param fuse: file info data
+ * Read the superblock, bitmaps and inode tables, the blocks before the
+ * data blocks of each group, into meta, as a snapshot's copies of them:
+ * with no snapshots listed, and with the bitmaps given, in which the
+ * blocks and maps of existing snapshots are cleared. The dynamic inode
+ * table blocks follow, in the order of the inode map.
  *
  * @return: 0 if successful, or -error number
- *	-ENOENT - file does not exist
- *	-ENOTDIR - component of path not a directory
-*/
-static int fs_open(const char *path, struct fuse_file_info *fi)
-{
-	int inode_num = inode_from_full_path(path);
-	if (inode_num == -1){
-		return -EIO;
-	}
-	if (inode_num < 0){
-		return inode_num;
-	}
-	struct fs_inode inode;
-	if (read_inode(inode_num, &inode) != 0){
-		return -EIO;
+ */
+static int snap_capture(char *meta, char *used, char *inodes_used){
+	for (int i = 0; i < FS_MAX_SNAPSHOTS; i++){
+		struct snapshot *o = &snapshots[i];
+		if (o->map_num == 0){
+			continue;
+		}
+		struct fs_inode map;
+		if (read_inode(o->map_num, &map) != 0 || walk_blocks(&map, clear_bit_cb, used) != 0){
+			return -EIO;
+		}
+		inodes_used[o->map_num / 8] &= ~(1 << (o->map_num % 8));
+		for (uint32_t b = 0; b < superblock.num_blocks; b++){
+			if (o->map[b] != 0){
+				used[o->map[b] / 8] &= ~(1 << (o->map[b] % 8));
+			}
+		}
 	}
-	if (S_ISDIR(inode.mode)){
-		return -EISDIR;
+	char *g_meta = meta;
+	for (int i = 0; i < n_groups; i++){
+		struct block_group *g = &groups[i];
+		if (disk->ops->read(disk, g->start, g->data - g->start, g_meta) != SUCCESS){
+			return -EIO;
+		}
+		char *block_map = g_meta + (g->block_map - g->start) * FS_BLOCK_SIZE;
+		memset(block_map, 0, superblock.block_map_sz * FS_BLOCK_SIZE);
+		memcpy(block_map, used + g->start / 8, (g->blocks + 7) / 8);
+		char *inode_map = g_meta + (g->inode_map - g->start) * FS_BLOCK_SIZE;
+		memset(inode_map, 0, superblock.inode_map_sz * FS_BLOCK_SIZE);
+		memcpy(inode_map, inodes_used + g->first_inode / 8, (g->inodes + 7) / 8);
+		g_meta += (g->data - g->start) * FS_BLOCK_SIZE;
+	}
+	for (uint32_t i = 0; i < imap_count; i++, g_meta += FS_BLOCK_SIZE){
+		if (disk->ops->read(disk, imap[i].block, 1, g_meta) != SUCCESS){
+			return -EIO;
+		}
 	}
+	struct fs_super *sb = (struct fs_super *)meta;
+	memset(sb->snapshots, 0, sizeof(sb->snapshots));
+	sb->features &= ~FS_FEAT_SNAPSHOTS;
 	return 0;
 }
 
 /*
- * read - read data from an open file.
- *
- * 	@param path: the path to the file
- * 	@param buf: the buffer to keep the data
- * 	@param len: the number of bytes to read
- * 	@param offset: the location to start reading at
- * 	@param fi: fuse file info
+ * Take a snapshot of the file system as it is, in a free slot. Only
+ * the superblock, bitmaps and inode tables are copied now, so the time
+ * taken does not depend on how much data the files hold. If this
+ * fails, the blocks given to it may be lost, but nothing else changes.
  *
- * 	@return: return exactly the number of bytes requested, except:
- * 	- if offset >= file len, return 0
- * 	- if offset+len > file len, return bytes from offset to EOF
- * 	- on error, return <0
- * 		-ENOENT  - file does not exist
- * 		-ENOTDIR - component of path not a directory
- * 		-EIO     - error reading block
-*/
-static int fs_read(const char *path, char *buf, size_t len, off_t offset,
-		    struct fuse_file_info *fi)
-{
-	int inode_num = inode_from_full_path(path);
-	if (inode_num == -1){
-		return -EIO;
+ * @return: the slot, or -error number
+ * 	-ENOSPC   - no free slot, or not enough free blocks for the copies
+ */
+static int snapshot_create(void){
+	int slot = 0;
+	while (slot < FS_MAX_SNAPSHOTS && superblock.snapshots[slot] != 0){
+		slot++;
 	}
-	if (inode_num < 0){
-		return inode_num;
+	if (slot == FS_MAX_SNAPSHOTS){
+		return -ENOSPC;
 	}
-	struct fs_inode inode;
-	if (read_inode(inode_num, &inode) != 0){
-		return -EIO;
+	int n_meta = imap_count;
+	for (int i = 0; i < n_groups; i++){
+		n_meta += groups[i].data - groups[i].start;
 	}
-	if (S_ISDIR(inode.mode)){
-		return -EISDIR;
+	int map_blocks = map_blocks_needed(sizeof(uint32_t));
+	struct snapshot s = {
+		.map = calloc(map_blocks, FS_BLOCK_SIZE),
+		.map_dirty = malloc(map_blocks),
+		.used = malloc(block_bitmap_bytes),
+	};
+	char *inodes_used = malloc(inode_bitmap_bytes);
+	char *meta = malloc(n_meta * FS_BLOCK_SIZE);
+	char *held = malloc(block_bitmap_bytes);
+	int retval = 0;
+	if (s.map == NULL || s.map_dirty == NULL || s.used == NULL || inodes_used == NULL || meta == NULL || held == NULL){
+		retval = -ENOMEM;
+	}
+	if (retval == 0){
+		read_block_bitmap(s.used);
+		read_inode_bitmap(inodes_used);
+		retval = snap_capture(meta, s.used, inodes_used);
+	}
+	if (retval == 0){
+		s.map_num = create_map_file(map_blocks);
+		retval = (s.map_num < 0) ? s.map_num : 0;
+	}
+	struct block_pool pool;
+	if (retval == 0 && (retval = block_pool_reserve(&pool, n_meta, 0)) == 0){
+		char *block = meta;
+		for (int i = 0; i < n_groups; i++){
+			for (uint32_t b = groups[i].start; b < groups[i].data && retval == 0; b++, block += FS_BLOCK_SIZE){
+				s.map[b] = block_pool_alloc(&pool);
+				if (write_blocks(s.map[b], 1, block) != SUCCESS){
+					retval = -EIO;
+				}
+			}
+		}
+		for (uint32_t i = 0; i < imap_count && retval == 0; i++, block += FS_BLOCK_SIZE){
+			uint32_t b = imap[i].block;
+			s.map[b] = block_pool_alloc(&pool);
+			if (write_blocks(s.map[b], 1, block) != SUCCESS){
+				retval = -EIO;
+			}
+		}
+		block_pool_release(&pool);
+	}
+	memset(s.map_dirty, 1, map_blocks);
+	if (retval == 0){
+		retval = snap_flush(&s);
+	}
+	/* the copies and map are complete on disk before the superblock lists them */
+	if (retval == 0 && blkdev_barrier(disk) != SUCCESS){
+		retval = -EIO;
+	}
+	if (retval == 0){
+		uint32_t features = superblock.features;
+		superblock.snapshots[slot] = s.map_num;
+		superblock.features |= FS_FEAT_SNAPSHOTS;
+		if (write_blocks(0, 1, &superblock) != SUCCESS){
+			superblock.snapshots[slot] = 0;
+			superblock.features = features;
+			retval = -EIO;
+		}
 	}
-	int32_t file_size = inode.size;
-	if (offset >= file_size){
-		return 0;
+	free(inodes_used);
+	free(meta);
+	if (retval != 0){
+		snap_free(&s);
+		free(held);
+		return retval;
+	}
+	snapshots[slot] = s;
+	n_snapshots++;
+	snap_held_install(held);
+	return slot;
+}
+
+/*
+ * Delete the snapshot in a slot, freeing the copies no other snapshot
+ * uses and its map. It is dropped from the superblock first, so if
+ * freeing fails, the blocks are lost but no snapshot is damaged.
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOENT   - no snapshot in the slot
+ */
+static int snapshot_delete(uint32_t slot){
+	if (slot >= FS_MAX_SNAPSHOTS || snapshots[slot].map_num == 0){
+		return -ENOENT;
 	}
-	if (offset + len > file_size){
-		len = file_size - offset;
+	struct snapshot s = snapshots[slot];
+	char *held = malloc(block_bitmap_bytes);
+	char *block_bitmap = malloc(block_bitmap_bytes);
+	if (held == NULL || block_bitmap == NULL){
+		free(held);
+		free(block_bitmap);
+		return -ENOMEM;
 	}
-	size_t first_block_num = offset / FS_BLOCK_SIZE;
-	size_t last_block_num = (offset + len) / FS_BLOCK_SIZE;
-	char *all_blocks = malloc((last_block_num - first_block_num + 1) * FS_BLOCK_SIZE);
-	if (all_blocks == NULL){
+	superblock.snapshots[slot] = 0;
+	if (write_blocks(0, 1, &superblock) != SUCCESS || blkdev_barrier(disk) != SUCCESS){
+		superblock.snapshots[slot] = s.map_num;
+		free(held);
+		free(block_bitmap);
 		return -EIO;
 	}
-	int current_block_num = 0;
-	for (int i = first_block_num; i <= last_block_num; i++){
-		if (read_block_of_file(i, &inode, all_blocks + (current_block_num * FS_BLOCK_SIZE)) == -EIO){
-			free(all_blocks);
-			return -EIO;
+	snapshots[slot] = (struct snapshot){ .map_num = 0 };
+	n_snapshots--;
+	snap_held_install(held);
+	read_block_bitmap(block_bitmap);
+	for (uint32_t b = 0; b < superblock.num_blocks; b++){
+		bool shared = false;
+		for (int i = 0; i < FS_MAX_SNAPSHOTS && s.map[b] != 0; i++){
+			shared |= (snapshots[i].map_num != 0 && snapshots[i].map[b] == s.map[b]);
+		}
+		if (s.map[b] != 0 && !shared){
+			block_bitmap[s.map[b] / 8] &= ~(1 << (s.map[b] % 8));
 		}
-		current_block_num++;
 	}
-	memcpy(buf, all_blocks + (offset % FS_BLOCK_SIZE), len);
-	free(all_blocks);
-	return len;
+	int retval = write_block_bitmap(block_bitmap);
+	if (retval == 0){
+		retval = fs_ifree(s.map_num);
+	}
+	free(block_bitmap);
+	snap_free(&s);
+	return retval;
 }
 
 /*
- * write - write data to a file
- *
- * @param path: the file path
- * @param buf: the buffer to write
- * @param len: the number of bytes to write
- * @param offset: the offset to starting writing at
- * @param fi: the Fuse file info for writing
+ * Give a regular file or directory FS_INODE_COMPRESSED. A file's
+ * clusters already written stay as they are until written again.
  *
- * @return: It should return exactly the number of bytes requested, except on error:
- * 	-ENOENT  - file does not exist
- *	-ENOTDIR - component of path not a directory
- *	-EINVAL  - if 'offset' is greater than current file length. (POSIX semantics support the creation of files with "holes" in them, but we don't)
-*/
-static int fs_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi) {
-	int inode_num = inode_from_full_path(path);
-	if (inode_num == -1){
-		return -EIO;
-	}
-	if (inode_num < 0){
-		return inode_num;
-	}
+ * @return: 0 if successful, or -error number
+ * 	-EINVAL   - neither a regular file nor a directory
+ */
+static int set_compressed(int inode_num){
 	struct fs_inode inode;
 	if (read_inode(inode_num, &inode) != 0){
 		return -EIO;
 	}
-	if (S_ISDIR(inode.mode)){
-		return -EISDIR;
-	}
-	if (offset > inode.size){
+	if (!S_ISREG(inode.mode) && !S_ISDIR(inode.mode)){
 		return -EINVAL;
 	}
-	if (len == 0){
+	if (inode.flags & FS_INODE_COMPRESSED){
 		return 0;
 	}
-	const int MAX_FILE_SIZE = FS_BLOCK_SIZE * N_DIRECT + PTRS_PER_BLK * FS_BLOCK_SIZE + PTRS_PER_BLK * PTRS_PER_BLK * FS_BLOCK_SIZE;
-	if (offset == MAX_FILE_SIZE){
-		if (len == 0){
-			return 0;
-		} else {
-			return -EFBIG;
-		}
-	}
-	if (offset + len >= MAX_FILE_SIZE){
-		len = MAX_FILE_SIZE - offset;
-	}
-	uint32_t first_logical_block_num = offset / FS_BLOCK_SIZE;
-	uint32_t last_logical_block_num = (offset + len - 1) / FS_BLOCK_SIZE;
-	if (last_logical_block_num > N_DIRECT + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK){
-		last_logical_block_num = N_DIRECT + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK;
-		len = MAX_FILE_SIZE - offset;
-	}
-	char first_block[FS_BLOCK_SIZE];
-	switch(read_block_of_file(first_logical_block_num, &inode, first_block)){
-	case -EIO:
-		return -EIO;
-	case -1:
-		;
-		char empty_block[FS_BLOCK_SIZE];
-		memset(empty_block, 0, FS_BLOCK_SIZE);
-		int temp = put_block_in_file(&inode, first_logical_block_num, empty_block);
-		if (temp < 0){
-			return temp;
-		}
-		memset(first_block, 0, FS_BLOCK_SIZE);
-		break;
-	case 0:
-		;
+	int retval = enable_feature(FS_FEAT_COMPRESS);
+	if (retval != 0){
+		return retval;
 	}
-	memcpy(first_block + offset % FS_BLOCK_SIZE, buf, (len <= FS_BLOCK_SIZE - offset % FS_BLOCK_SIZE) ? len : FS_BLOCK_SIZE - offset % FS_BLOCK_SIZE);
-	switch(put_block_in_file(&inode, first_logical_block_num, first_block)){
-	case -EIO:
-		return -EIO;
-	case -ENOSPC:
-		return -ENOSPC;
+	inode.flags |= FS_INODE_COMPRESSED;
+	return write_inode(inode_num, &inode);
+}
+
+/* FSX492_IOC_CLONE on inode_num; returns 0 or -error number as for fs_iclone */
+static int clone_to_path(int inode_num, struct fsx492_clone *req){
+	if (memchr(req->dest, '\0', sizeof(req->dest)) == NULL || req->dest[0] != '/'){
+		return -EINVAL;
 	}
-	if (first_logical_block_num != last_logical_block_num){
-		size_t offset_in_buf = FS_BLOCK_SIZE - offset % FS_BLOCK_SIZE; //amount written to the first block
-		for (int log_block = first_logical_block_num + 1; log_block <= last_logical_block_num - 1; log_block++){
-			int temp = put_block_in_file(&inode, log_block, (void*)(buf + offset_in_buf));
-			if (temp < 0){
-				return temp;
-			}
-			offset_in_buf += FS_BLOCK_SIZE;
-		}
-		char last_block[FS_BLOCK_SIZE];
-		switch(read_block_of_file(last_logical_block_num, &inode, last_block)){
-		case -EIO:
-			return -EIO;
-		case -1:
-			;
-			char empty_block[FS_BLOCK_SIZE];
-			memset(empty_block, 0, FS_BLOCK_SIZE);
-			int temp = put_block_in_file(&inode, last_logical_block_num, empty_block);
-			if (temp < 0){
-				return temp;
-			}
-			memset(last_block, 0, FS_BLOCK_SIZE);
-			break;
-		}
-		memcpy(last_block, buf + offset_in_buf, len - offset_in_buf);
-		switch(put_block_in_file(&inode, last_logical_block_num, last_block)){
-		case -EIO:
-			return -EIO;
-		case -ENOSPC:
-			return -ENOSPC;
-		}
+	if (is_stats_file(req->dest)){
+		return -EEXIST;
 	}
-	uint32_t temp = offset + len;
-	if (temp > inode.size){
-		inode.size = temp;
+	char dir_path[MAX_PATH];
+	char name[FS_FILENAME_SIZE];
+	if (split_path(req->dest, dir_path, name) == -ENAMETOOLONG){
+		return -ENAMETOOLONG;
 	}
-	int block_number_that_contains_inode = 1 + superblock.inode_map_sz + superblock.block_map_sz + (inode_num / INODES_PER_BLK);
-	struct fs_inode block_containing_inode[INODES_PER_BLK];
-	if (disk->ops->read(disk, block_number_that_contains_inode, 1, block_containing_inode) != SUCCESS){
+	int dir_num = inode_from_full_path(dir_path);
+	if (dir_num == -1){
 		return -EIO;
 	}
-	memcpy(&block_containing_inode[inode_num % INODES_PER_BLK],
-			&inode, sizeof(struct fs_inode));
-	if (disk->ops->write(disk, block_number_that_contains_inode, 1, block_containing_inode) != SUCCESS){
-		return -EIO;
+	if (dir_num < 0){
+		return dir_num;
 	}
-	return len;
+	int retval = fs_iclone(inode_num, dir_num, name);
+	return (retval < 0) ? retval : 0;
 }
 
-
-/* 
- * Release resources created by pending open call.
- *
- * @param path: path to the file
- * @param fi: the fuse file info
- *
- * @return: 0 if successful, or -error number
- *	-ENOENT   - file does not exist
- *	-ENOTDIR  - component of path not a directory
-*/
-static int fs_release(const char *path, struct fuse_file_info *fi)
-{	
-	return fs_open(path, fi);
+/* ioctl by inode number; inode_num is 0 for the statistics file */
+int fs_iioctl(int inode_num, int cmd, void *data)
+{
+	switch ((unsigned int)cmd){
+	case FSX492_IOC_DEFRAG:
+		return fs_defrag(data);
+	case FSX492_IOC_CLONE:
+		return (inode_num == 0) ? -EINVAL : clone_to_path(inode_num, data);
+	case FSX492_IOC_SNAPSHOT:
+		;
+		int slot = snapshot_create();
+		if (slot < 0){
+			return slot;
+		}
+		((struct fsx492_snapshot *)data)->id = slot;
+		return 0;
+	case FSX492_IOC_SNAPSHOT_DELETE:
+		return snapshot_delete(((struct fsx492_snapshot *)data)->id);
+	case FSX492_IOC_COMPRESS:
+		return (inode_num == 0) ? -EINVAL : set_compressed(inode_num);
+	case FSX492_IOC_DEDUP:
+		return fs_dedup(data);
+	case FSX492_IOC_SCRUB:
+		return fs_scrub(data);
+	case FSX492_IOC_RESIZE:
+		return fs_resize(data);
+	default:
+		return -ENOTTY;
+	}
 }
 
-
 /*
- * statfs - get file system statistics. See 'man 2 statfs' for 
- * description of 'struct statvfs'.
- *
- * @param path: the path to the file
- * @param st: pointer to the destination statvfs struct
+ * ioctl - file system maintenance commands (see fsx492_ioctl.h).
+ * Except for FSX492_IOC_CLONE and FSX492_IOC_COMPRESS, which act on
+ * the file at path, the commands act on the whole file system.
  *
+ * @param cmd: the command
+ * @param data: the command's argument, updated in place
  * @return: 0 if successful, or -error number
- * 	-ENOENT  - a component of the path is not present
- *	-ENOTDIR - an intermediate component of path not a directory
-*/
-static int fs_statfs(const char *path, struct statvfs *st)
+ *	-ENOTTY - unknown command
+ */
+static int fs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+		unsigned int flags, void *data)
 {
-	char *block_bitmap = malloc(FS_BLOCK_SIZE * superblock.block_map_sz);
-	if (block_bitmap == NULL){
-		return -EIO;
-	}
-	if (disk->ops->read(disk, 1 + superblock.inode_map_sz, superblock.block_map_sz, block_bitmap) != SUCCESS){
-		free(block_bitmap);
-		return -EIO;
-	}
-	long available_blocks = 0;
-	for (long i = 1 + superblock.inode_map_sz + superblock.block_map_sz + superblock.inode_region_sz; i < superblock.num_blocks; i++){
-		if ( !(block_bitmap[i / 8] & (1 << (i % 8))) ){
-			available_blocks += 1;
+	int inode_num = 0;
+	if (!is_stats_file(path)){
+		inode_num = inode_from_full_path(path);
+		if (inode_num == -1){
+			return -EIO;
 		}
-	}
-	free(block_bitmap);
-
-	char *inode_bitmap = malloc(FS_BLOCK_SIZE * superblock.inode_map_sz);
-	if (inode_bitmap == NULL){
-		return -EIO;
-	}
-	if (disk->ops->read(disk, 1, superblock.inode_map_sz, inode_bitmap) != SUCCESS){
-		free(inode_bitmap);
-		return -EIO;
-	}
-	long available_inodes = 0;
-	for (long i = 0; i < superblock.inode_region_sz * INODES_PER_BLK; i++){
-		if ( !(inode_bitmap[i / 8] & (1 << (i % 8)))){
-			available_inodes += 1;
+		if (inode_num < 0){
+			return inode_num;
 		}
 	}
-	free(inode_bitmap);
-
-	st->f_bsize = FS_BLOCK_SIZE;
-	st->f_blocks = superblock.num_blocks - 1 - superblock.inode_map_sz - superblock.block_map_sz - superblock.inode_region_sz;
-	st->f_bfree = available_blocks;
-	st->f_bavail = available_blocks;
-	st->f_files = superblock.inode_region_sz * INODES_PER_BLK;
-	st->f_ffree = available_inodes;
-	st->f_namemax = FS_FILENAME_SIZE;
-	st->f_fsid = 0;
-	st->f_frsize = 0;
-	st->f_flag = 0;
-	return 0;
+	return fs_iioctl(inode_num, cmd, data);
 }
 
-static int fs_utime(const char *path, struct utimbuf *timebuf){
-	struct file *f;
-	f = find_file(path);
-	if (!f){
-		return -ENOENT;
+/*
+ * Entry points - each wraps the operation of the same name and records
+ * its latency in the calling thread's histogram (see stats.c).
+ *
+ * Operations that only read the file system hold fs_lock SHARED and may
+ * run concurrently; operations that change it hold it EXCLUSIVE. State
+ * that shared holders update, such as the directory entry cache, has
+ * its own lock. Each ends with a barrier, so that a device holding
+ * writes back has sent them on before the operation returns.
+ */
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+#define SHARED pthread_rwlock_rdlock
+#define EXCLUSIVE pthread_rwlock_wrlock
+
+/* operations taking the lock EXCLUSIVE are those that change the file system */
+#define TIMED(op, lock, call) \
+	uint64_t start = stats_now(); \
+	lock(&fs_lock); \
+	int retval = (lock == EXCLUSIVE && fs_options.read_only) ? -EROFS : call; \
+	if (blkdev_barrier(disk) != SUCCESS && retval >= 0) \
+		retval = -EIO; \
+	dirty_owner = 0; \
+	pthread_rwlock_unlock(&fs_lock); \
+	stats_record(op, start); \
+	return retval;
+
+uint64_t fs_op_begin(bool exclusive)
+{
+	uint64_t start = stats_now();
+	if (exclusive){
+		EXCLUSIVE(&fs_lock);
+	} else {
+		SHARED(&fs_lock);
 	}
-	return 0;
+	return start;
 }
 
-static int fs_truncate(const char *path, off_t offset){
-	return -ENOSYS;
+void fs_op_end(enum stats_op op, uint64_t start)
+{
+	blkdev_barrier(disk); /* a failure is reported by the next flush */
+	dirty_owner = 0;
+	pthread_rwlock_unlock(&fs_lock);
+	stats_record(op, start);
 }
 
+static int timed_getattr(const char *path, struct stat *sb)
+{ TIMED(STATS_GETATTR, SHARED, fs_getattr(path, sb)) }
+static int timed_opendir(const char *path, struct fuse_file_info *fi)
+{ TIMED(STATS_OPENDIR, SHARED, fs_opendir(path, fi)) }
+static int timed_readdir(const char *path, void *ptr, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{ TIMED(STATS_READDIR, SHARED, fs_readdir(path, ptr, filler, offset, fi)) }
+static int timed_releasedir(const char *path, struct fuse_file_info *fi)
+{ TIMED(STATS_RELEASEDIR, SHARED, fs_releasedir(path, fi)) }
+static int timed_mknod(const char *path, mode_t mode, dev_t dev)
+{ TIMED(STATS_MKNOD, EXCLUSIVE, fs_mknod(path, mode, dev)) }
+static int timed_mkdir(const char *path, mode_t mode)
+{ TIMED(STATS_MKDIR, EXCLUSIVE, fs_mkdir(path, mode)) }
+static int timed_unlink(const char *path)
+{ TIMED(STATS_UNLINK, EXCLUSIVE, fs_unlink(path)) }
+static int timed_rmdir(const char *path)
+{ TIMED(STATS_RMDIR, EXCLUSIVE, fs_rmdir(path)) }
+static int timed_rename(const char *src_path, const char *dst_path)
+{ TIMED(STATS_RENAME, EXCLUSIVE, fs_rename(src_path, dst_path)) }
+static int timed_link(const char *path, const char *new_path)
+{ TIMED(STATS_LINK, EXCLUSIVE, fs_link(path, new_path)) }
+static int timed_symlink(const char *target, const char *path)
+{ TIMED(STATS_SYMLINK, EXCLUSIVE, fs_symlink(target, path)) }
+static int timed_readlink(const char *path, char *buf, size_t size)
+{ TIMED(STATS_READLINK, SHARED, fs_readlink(path, buf, size)) }
+static int timed_chmod(const char *path, mode_t mode)
+{ TIMED(STATS_CHMOD, EXCLUSIVE, fs_chmod(path, mode)) }
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{ TIMED(STATS_OPEN, SHARED, fs_open(path, fi)) }
+static int timed_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+{ TIMED(STATS_READ, SHARED, fs_read(path, buf, len, offset, fi)) }
+static int timed_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+{ TIMED(STATS_WRITE, EXCLUSIVE, fs_write(path, buf, len, offset, fi)) }
+static int timed_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{ TIMED(STATS_WRITE, EXCLUSIVE, fs_write_buf(path, buf, offset, fi)) }
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{ TIMED(STATS_RELEASE, SHARED, fs_release(path, fi)) }
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{ TIMED(STATS_FSYNC, SHARED, fs_fsync(path, datasync, fi)) }
+static int timed_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{ TIMED(STATS_FSYNCDIR, SHARED, fs_fsyncdir(path, datasync, fi)) }
+static int timed_statfs(const char *path, struct statvfs *st)
+{ TIMED(STATS_STATFS, SHARED, fs_statfs(path, st)) }
+static int timed_utime(const char *path, struct utimbuf *timebuf)
+{ TIMED(STATS_UTIME, EXCLUSIVE, fs_utime(path, timebuf)) }
+static int timed_utimens(const char *path, const struct timespec tv[2])
+{ TIMED(STATS_UTIMENS, EXCLUSIVE, fs_utimens(path, tv)) }
+static int timed_truncate(const char *path, off_t offset)
+{ TIMED(STATS_TRUNCATE, EXCLUSIVE, fs_truncate(path, offset)) }
+static int timed_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi)
+{ TIMED(STATS_FALLOCATE, EXCLUSIVE, fs_fallocate(path, mode, offset, len, fi)) }
+static int timed_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+{ TIMED(STATS_IOCTL, EXCLUSIVE, fs_ioctl(path, cmd, arg, fi, flags, data)) }
+
 /**
  * Operations vector. Please don't rename it, as the
  * skeleton code in main.c assumes it is named 'fs_ops'.
  */
 struct fuse_operations fs_ops = {
     .init = fs_init,
-    .getattr = fs_getattr,
-    .opendir = fs_opendir,
-    .readdir = fs_readdir,
-    .releasedir = fs_releasedir,
-    .mknod = fs_mknod,
-    .mkdir = fs_mkdir,
-    .unlink = fs_unlink,
-    .rmdir = fs_rmdir,
-    .rename = fs_rename,
-    .chmod = fs_chmod,
-    .open = fs_open,
-    .read = fs_read,
-    .write = fs_write,
-    .release = fs_release,
-    .statfs = fs_statfs,
-	.utime = fs_utime, 
-	.truncate = fs_truncate,
+    .getattr = timed_getattr,
+    .opendir = timed_opendir,
+    .readdir = timed_readdir,
+    .releasedir = timed_releasedir,
+    .mknod = timed_mknod,
+    .mkdir = timed_mkdir,
+    .unlink = timed_unlink,
+    .rmdir = timed_rmdir,
+    .rename = timed_rename,
+    .link = timed_link,
+    .symlink = timed_symlink,
+    .readlink = timed_readlink,
+    .chmod = timed_chmod,
+    .open = timed_open,
+    .read = timed_read,
+    .write = timed_write,
+    .write_buf = timed_write_buf,
+    .release = timed_release,
+    .fsync = timed_fsync,
+    .fsyncdir = timed_fsyncdir,
+    .statfs = timed_statfs,
+	.utime = timed_utime,
+	.utimens = timed_utimens,
+	.truncate = timed_truncate,
+	.fallocate = timed_fallocate,
+	.ioctl = timed_ioctl,
 };
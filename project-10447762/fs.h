@@ -0,0 +1,111 @@
+/*
+ * file:        fs.h
+ * description: run-time options and inode-level interface of the
+ *              FSX492 file system
+ *
+ * Set the options before calling fs_init.
+ *
+ * The fs_i* functions are the operations of fs_ops with the file named
+ * by inode number, or by directory inode number and entry name, rather
+ * than by path. They are what the low-level FUSE interface (fs_ll.c)
+ * is built on. Callers must hold the file system lock, taken with
+ * fs_op_begin, shared for fs_iattr, fs_iopendir, fs_ireaddir, fs_iopen,
+ * fs_iread, fs_iread_buf, fs_ireadlink, fs_ifsync and fs_istatfs, and
+ * exclusive for the others. They return 0 or, for those creating an
+ * inode, its number if successful, or -error number as the fs_ops
+ * function of the same name.
+ */
+
+#ifndef FS_H_
+#define FS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+
+#include "stats.h"
+
+/** when reads update a file's access time */
+enum fs_atime {
+	FS_ATIME_RELATIME, /* only if atime is not after mtime, or is a day old */
+	FS_ATIME_NOATIME, /* never */
+	FS_ATIME_STRICT /* on every read */
+};
+
+struct fs_options {
+	enum fs_atime atime; /* access time policy, ignored with 64-byte inodes */
+	double attr_timeout; /* seconds to trust cached inodes and paths, 0 for as long as they are not changed through fs_ops */
+	double kernel_timeout; /* entry and attribute timeout the low-level interface gives the kernel */
+	bool read_only; /* refuse changes and leave access times alone, as for a snapshot */
+};
+
+extern struct fs_options fs_options;
+
+struct fuse_conn_info;
+struct fuse_bufvec;
+extern void *fs_init(struct fuse_conn_info *conn);
+
+/* take the file system lock; returns the start time to pass to fs_op_end */
+extern uint64_t fs_op_begin(bool exclusive);
+/* end the operation with a device barrier, release the lock and record its latency */
+extern void fs_op_end(enum stats_op op, uint64_t start);
+
+/* same as fuse_fill_dir_t */
+typedef int (*fs_filler_t)(void *buf, const char *name, const struct stat *sb, off_t off);
+
+/* look up a name in a directory; returns the inode number */
+extern int fs_ilookup(int dir_num, const char *name);
+extern int fs_iattr(int inode_num, struct stat *sb);
+extern int fs_iopendir(int inode_num);
+extern int fs_ireaddir(int inode_num, void *ptr, fs_filler_t filler, off_t offset);
+/* mode is used as given, without applying a umask */
+extern int fs_imknod(int dir_num, const char *name, mode_t mode, uid_t uid, gid_t gid);
+extern int fs_imkdir(int dir_num, const char *name, mode_t mode, uid_t uid, gid_t gid);
+/*
+ * With orphan not NULL, an inode losing its last link keeps its blocks
+ * and stays allocated, and its number is stored in *orphan, or 0 if
+ * it has other links; free it with fs_ifree once nothing refers to it.
+ */
+extern int fs_iunlink(int dir_num, const char *name, int *orphan);
+extern int fs_irmdir(int dir_num, const char *name, int *orphan);
+extern int fs_ifree(int inode_num);
+/* orphan as for fs_iunlink, set to the inode number of the entry replaced, or 0 */
+extern int fs_irename(int dir_num, const char *name, int new_dir_num, const char *new_name, int *orphan);
+extern int fs_ilink(int inode_num, int new_dir_num, const char *new_name);
+extern int fs_isymlink(int dir_num, const char *name, const char *target, uid_t uid, gid_t gid);
+/* the target, cut short to fit size bytes with its trailing NUL */
+extern int fs_ireadlink(int inode_num, char *buf, size_t size);
+extern int fs_ichmod(int inode_num, mode_t mode);
+extern int fs_iutimens(int inode_num, const struct timespec tv[2]);
+extern int fs_iopen(int inode_num);
+/* returns the number of bytes read or written */
+extern int fs_iread(int inode_num, char *buf, size_t len, off_t offset);
+extern int fs_iwrite(int inode_num, const char *buf, size_t len, off_t offset);
+/*
+ * The same from and to vectors of buffers. Whole blocks read are
+ * described as ranges of the device's file when it has one, valid only
+ * until the lock is released; free the vector with fs_free_buf, in the
+ * same thread and before anything else it read that way.
+ */
+extern int fs_iread_buf(int inode_num, struct fuse_bufvec **bufp, size_t len, off_t offset);
+extern int fs_iwrite_buf(int inode_num, struct fuse_bufvec *src, off_t offset);
+extern void fs_free_buf(struct fuse_bufvec *bufv);
+extern int fs_ifallocate(int inode_num, int mode, off_t offset, off_t len);
+extern int fs_ifsync(int inode_num);
+extern int fs_istatfs(struct statvfs *st);
+/* inode_num is 0 for the statistics file */
+extern int fs_iioctl(int inode_num, int cmd, void *data);
+
+/* the virtual statistics file, in the root directory */
+#define FS_STATS_NAME ".fsx492_stats"
+extern void fs_stats_getattr(struct stat *sb);
+/* a snapshot of the statistics report for the caller to free, or NULL */
+extern char *fs_stats_text(void);
+
+/* mount the file system with the low-level FUSE interface; returns an exit status */
+extern int fs_ll_main(int argc, char *argv[]);
+
+#endif /* FS_H_ */
@@ -0,0 +1,686 @@
+/*
+ * file:        fs_ll.c
+ * description: low-level (inode-based) FUSE interface to the FSX492
+ *              file system
+ *
+ * FUSE inode numbers are fsx492 inode numbers - the root is 1 in both -
+ * so no path is ever built or walked: each request names its file by
+ * inode, or by directory inode and entry name, and goes straight to the
+ * fs_i* functions of fs.c. The virtual statistics file gets an inode
+ * number past the 30 bits a directory entry can hold.
+ *
+ * The kernel holds a lookup count for every inode it knows, raised by
+ * each entry reply and lowered by forget. An inode unlinked while its
+ * count is not zero is kept as an orphan, with its blocks, until the
+ * count drops to zero, so open files stay readable after unlink and an
+ * inode number is never reused while the kernel still refers to it.
+ * Orphans are not recorded on disk; after a crash they stay allocated.
+ */
+
+#define FUSE_USE_VERSION 27
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fuse_lowlevel.h>
+
+#include "fs.h"
+#include "stats.h"
+
+#define STATS_INO ((fuse_ino_t)1 << 30)
+
+static bool is_stats_entry(fuse_ino_t parent, const char *name){
+	return parent == FUSE_ROOT_ID && !strcmp(name, FS_STATS_NAME);
+}
+
+/*
+ * Lookup counts, indexed by inode number. They change under refs_lock
+ * rather than the file system lock, since forget must not wait for a
+ * long exclusive operation just to lower a count. The arrays grow as
+ * inodes with higher numbers are looked up, as dynamic inodes and
+ * resizing add inode numbers.
+ */
+static pthread_mutex_t refs_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *nlookup;
+static bool *orphaned;
+static fuse_ino_t n_refs;
+
+/* make room for the counts of inodes up to ino; call with refs_lock held */
+static bool refs_fit(fuse_ino_t ino){
+	if (ino < n_refs){
+		return true;
+	}
+	fuse_ino_t n = (n_refs == 0) ? 1024 : n_refs;
+	while (n <= ino){
+		n *= 2;
+	}
+	uint64_t *counts = realloc(nlookup, n * sizeof(*nlookup));
+	if (counts != NULL){
+		nlookup = counts;
+	}
+	bool *flags = realloc(orphaned, n * sizeof(*orphaned));
+	if (flags != NULL){
+		orphaned = flags;
+	}
+	if (counts == NULL || flags == NULL){
+		return false;
+	}
+	memset(nlookup + n_refs, 0, (n - n_refs) * sizeof(*nlookup));
+	memset(orphaned + n_refs, 0, (n - n_refs) * sizeof(*orphaned));
+	n_refs = n;
+	return true;
+}
+
+static void ref_add(fuse_ino_t ino){
+	pthread_mutex_lock(&refs_lock);
+	if (refs_fit(ino)){
+		nlookup[ino]++;
+	}
+	pthread_mutex_unlock(&refs_lock);
+}
+
+/* lower a lookup count, freeing the inode if it was the last reference to an orphan */
+static void ref_drop(fuse_ino_t ino, uint64_t count){
+	bool release = false;
+	pthread_mutex_lock(&refs_lock);
+	if (ino < n_refs){
+		nlookup[ino] = (nlookup[ino] > count) ? nlookup[ino] - count : 0;
+		if (nlookup[ino] == 0 && orphaned[ino]){
+			orphaned[ino] = false;
+			release = true;
+		}
+	}
+	pthread_mutex_unlock(&refs_lock);
+	if (release){
+		uint64_t start = fs_op_begin(true);
+		fs_ifree(ino);
+		fs_op_end(STATS_FORGET, start);
+	}
+}
+
+/* dispose of an inode just unlinked; call with the file system lock held exclusive */
+static int settle_orphan(int ino){
+	bool referenced = false;
+	pthread_mutex_lock(&refs_lock);
+	if (ino < n_refs && nlookup[ino] > 0){
+		orphaned[ino] = referenced = true;
+	}
+	pthread_mutex_unlock(&refs_lock);
+	return referenced ? 0 : fs_ifree(ino);
+}
+
+/*
+ * Fill in the entry for an inode and count the lookup; call with the
+ * file system lock held, so the inode cannot be unlinked before it is
+ * counted.
+ */
+static int make_entry(fuse_ino_t ino, struct fuse_entry_param *e){
+	memset(e, 0, sizeof(*e));
+	e->ino = ino;
+	e->attr_timeout = e->entry_timeout = fs_options.kernel_timeout;
+	if (ino == STATS_INO){
+		fs_stats_getattr(&e->attr);
+		e->attr.st_ino = ino;
+		return 0;
+	}
+	int retval = fs_iattr(ino, &e->attr);
+	if (retval == 0){
+		ref_add(ino);
+	}
+	return retval;
+}
+
+/* send an entry made by make_entry, or an error */
+static void reply_entry(fuse_req_t req, int retval, struct fuse_entry_param *e){
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+	} else if (fuse_reply_entry(req, e) != 0){
+		ref_drop(e->ino, 1); /* the kernel never got it */
+	}
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	fs_init(conn);
+	pthread_mutex_lock(&refs_lock);
+	if (!refs_fit(FUSE_ROOT_ID)){
+		abort();
+	}
+	pthread_mutex_unlock(&refs_lock);
+}
+
+static void ll_destroy(void *userdata)
+{
+	free(nlookup);
+	free(orphaned);
+	nlookup = NULL;
+	orphaned = NULL;
+	n_refs = 0;
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	uint64_t start = fs_op_begin(false);
+	int retval = is_stats_entry(parent, name) ? STATS_INO : fs_ilookup(parent, name);
+	if (retval > 0){
+		retval = make_entry(retval, &e);
+	}
+	fs_op_end(STATS_LOOKUP, start);
+	reply_entry(req, retval, &e);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long count)
+{
+	ref_drop(ino, count);
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; i++){
+		ref_drop(forgets[i].ino, forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat sb;
+	int retval = 0;
+	if (ino == STATS_INO){
+		fs_stats_getattr(&sb);
+		sb.st_ino = ino;
+	} else {
+		uint64_t start = fs_op_begin(false);
+		retval = fs_iattr(ino, &sb);
+		fs_op_end(STATS_GETATTR, start);
+	}
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+	} else {
+		fuse_reply_attr(req, &sb, fs_options.kernel_timeout);
+	}
+}
+
+/* time to set for FUSE_SET_ATTR_ATIME or _MTIME */
+static struct timespec set_time(int to_set, int bit, int now_bit, struct timespec value){
+	if (!(to_set & bit)){
+		return (struct timespec){ .tv_nsec = UTIME_OMIT };
+	}
+	if (to_set & now_bit){
+		return (struct timespec){ .tv_nsec = UTIME_NOW };
+	}
+	return value;
+}
+
+#ifndef FUSE_SET_ATTR_ATIME_NOW
+#define FUSE_SET_ATTR_ATIME_NOW (1 << 7)
+#define FUSE_SET_ATTR_MTIME_NOW (1 << 8)
+#endif
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	if (ino == STATS_INO){
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	struct stat sb;
+	uint64_t start = fs_op_begin(true);
+	int retval = 0;
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID | FUSE_SET_ATTR_SIZE)){
+		retval = -ENOSYS; /* no chown, and no truncate, as in fs_ops */
+	}
+	if (retval == 0 && (to_set & FUSE_SET_ATTR_MODE)){
+		retval = fs_ichmod(ino, attr->st_mode);
+	}
+	if (retval == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))){
+		struct timespec tv[2] = {
+			set_time(to_set, FUSE_SET_ATTR_ATIME, FUSE_SET_ATTR_ATIME_NOW, attr->st_atim),
+			set_time(to_set, FUSE_SET_ATTR_MTIME, FUSE_SET_ATTR_MTIME_NOW, attr->st_mtim),
+		};
+		retval = fs_iutimens(ino, tv);
+	}
+	if (retval == 0){
+		retval = fs_iattr(ino, &sb);
+	}
+	fs_op_end(STATS_SETATTR, start);
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+	} else {
+		fuse_reply_attr(req, &sb, fs_options.kernel_timeout);
+	}
+}
+
+/* mode from the kernel already has the umask applied */
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+	if (!S_ISREG(mode)){
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	if (is_stats_entry(parent, name)){
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	struct fuse_entry_param e;
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_imknod(parent, name, mode, ctx->uid, ctx->gid);
+	if (retval > 0){
+		retval = make_entry(retval, &e);
+	}
+	fs_op_end(STATS_MKNOD, start);
+	reply_entry(req, retval, &e);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	if (is_stats_entry(parent, name)){
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	struct fuse_entry_param e;
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_imkdir(parent, name, mode, ctx->uid, ctx->gid);
+	if (retval > 0){
+		retval = make_entry(retval, &e);
+	}
+	fs_op_end(STATS_MKDIR, start);
+	reply_entry(req, retval, &e);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+	if (is_stats_entry(parent, name)){
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	struct fuse_entry_param e;
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_imknod(parent, name, S_IFREG | (mode & 07777), ctx->uid, ctx->gid);
+	if (retval > 0){
+		retval = make_entry(retval, &e);
+	}
+	fs_op_end(STATS_CREATE, start);
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+		return;
+	}
+	fi->keep_cache = 1;
+	if (fuse_reply_create(req, &e, fi) != 0){
+		ref_drop(e.ino, 1);
+	}
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	if (is_stats_entry(parent, name)){
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	int orphan;
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_iunlink(parent, name, &orphan);
+	if (retval == 0 && orphan != 0){
+		retval = settle_orphan(orphan);
+	}
+	fs_op_end(STATS_UNLINK, start);
+	fuse_reply_err(req, -retval);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int orphan;
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_irmdir(parent, name, &orphan);
+	if (retval == 0 && orphan != 0){
+		retval = settle_orphan(orphan);
+	}
+	fs_op_end(STATS_RMDIR, start);
+	fuse_reply_err(req, -retval);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+{
+	if (is_stats_entry(parent, name) || is_stats_entry(newparent, newname)){
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	int orphan;
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_irename(parent, name, newparent, newname, &orphan);
+	if (retval == 0 && orphan != 0){
+		retval = settle_orphan(orphan);
+	}
+	fs_op_end(STATS_RENAME, start);
+	fuse_reply_err(req, -retval);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+	if (ino == STATS_INO || is_stats_entry(newparent, newname)){
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	struct fuse_entry_param e;
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_ilink(ino, newparent, newname);
+	if (retval == 0){
+		retval = make_entry(ino, &e);
+	}
+	fs_op_end(STATS_LINK, start);
+	reply_entry(req, retval, &e);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+	if (is_stats_entry(parent, name)){
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	struct fuse_entry_param e;
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_isymlink(parent, name, link, ctx->uid, ctx->gid);
+	if (retval > 0){
+		retval = make_entry(retval, &e);
+	}
+	fs_op_end(STATS_SYMLINK, start);
+	reply_entry(req, retval, &e);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	if (ino == STATS_INO){
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	char target[PATH_MAX];
+	uint64_t start = fs_op_begin(false);
+	int retval = fs_ireadlink(ino, target, sizeof(target));
+	fs_op_end(STATS_READLINK, start);
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+	} else {
+		fuse_reply_readlink(req, target);
+	}
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	if (ino == STATS_INO){
+		if ((fi->flags & O_ACCMODE) != O_RDONLY){
+			fuse_reply_err(req, EACCES);
+			return;
+		}
+		/* snapshot the report so successive reads see consistent text */
+		char *text = fs_stats_text();
+		if (text == NULL){
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		fi->fh = (uint64_t)(uintptr_t)text;
+		fi->direct_io = 1; /* size reported by getattr is only a hint */
+		if (fuse_reply_open(req, fi) != 0){
+			free(text);
+		}
+		return;
+	}
+	uint64_t start = fs_op_begin(false);
+	int retval = fs_iopen(ino);
+	fs_op_end(STATS_OPEN, start);
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+		return;
+	}
+	fi->keep_cache = 1; /* all changes come through this mount */
+	fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	if (ino == STATS_INO){
+		const char *text = (const char *)(uintptr_t)fi->fh;
+		size_t text_len = strlen(text);
+		if (off >= text_len){
+			size = 0;
+		} else if (off + size > text_len){
+			size = text_len - off;
+		}
+		fuse_reply_buf(req, text + off, size);
+		return;
+	}
+	struct fuse_bufvec *bufv;
+	uint64_t start = fs_op_begin(false);
+	int retval = fs_iread_buf(ino, &bufv, size, off);
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+	} else {
+		/* the blocks may be reused once the lock is released */
+		fuse_reply_data(req, bufv, 0);
+		fs_free_buf(bufv);
+	}
+	fs_op_end(STATS_READ, start);
+}
+
+/* data arrives in memory, or spliced into a pipe if the kernel can */
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+	if (ino == STATS_INO){
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_iwrite_buf(ino, bufv, off);
+	fs_op_end(STATS_WRITE, start);
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+	} else {
+		fuse_reply_write(req, retval);
+	}
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	if (ino == STATS_INO){
+		free((char *)(uintptr_t)fi->fh);
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	int retval = 0;
+	if (ino != STATS_INO){
+		uint64_t start = fs_op_begin(false);
+		retval = fs_ifsync(ino);
+		fs_op_end(STATS_FSYNC, start);
+	}
+	fuse_reply_err(req, -retval);
+}
+
+static void ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	uint64_t start = fs_op_begin(false);
+	int retval = fs_ifsync(ino);
+	fs_op_end(STATS_FSYNCDIR, start);
+	fuse_reply_err(req, -retval);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	uint64_t start = fs_op_begin(false);
+	int retval = fs_iopendir(ino);
+	fs_op_end(STATS_OPENDIR, start);
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+	} else {
+		fuse_reply_open(req, fi);
+	}
+}
+
+/* reply buffer filled by readdir_filler */
+struct dirbuf {
+	fuse_req_t req;
+	char *buf;
+	size_t size; /* bytes the kernel asked for */
+	size_t used;
+};
+
+static int readdir_filler(void *ptr, const char *name, const struct stat *sb, off_t off)
+{
+	struct dirbuf *d = ptr;
+	size_t len = fuse_add_direntry(d->req, d->buf + d->used, d->size - d->used, name, sb, off);
+	if (len > d->size - d->used){
+		return 1; /* full; the kernel asks again from off */
+	}
+	d->used += len;
+	return 0;
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct dirbuf d = { .req = req, .buf = malloc(size), .size = size };
+	if (d.buf == NULL){
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	uint64_t start = fs_op_begin(false);
+	int retval = fs_ireaddir(ino, &d, readdir_filler, off);
+	fs_op_end(STATS_READDIR, start);
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+	} else {
+		fuse_reply_buf(req, d.buf, d.used);
+	}
+	free(d.buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, 0);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+	uint64_t start = fs_op_begin(false);
+	int retval = fs_istatfs(&st);
+	fs_op_end(STATS_STATFS, start);
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+	} else {
+		fuse_reply_statfs(req, &st);
+	}
+}
+
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	if (ino == STATS_INO){
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_ifallocate(ino, mode, offset, length);
+	fs_op_end(STATS_FALLOCATE, start);
+	fuse_reply_err(req, -retval);
+}
+
+/*
+ * The commands of fsx492_ioctl.h encode their argument size, so the
+ * kernel passes the argument in and takes out_bufsz bytes back.
+ */
+static void ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+		unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	if (flags & FUSE_IOCTL_COMPAT){
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	if (fs_options.read_only){
+		fuse_reply_err(req, EROFS); /* all commands change the file system */
+		return;
+	}
+	size_t size = (in_bufsz > out_bufsz) ? in_bufsz : out_bufsz;
+	char *data = calloc(1, size ? size : 1);
+	if (data == NULL){
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	memcpy(data, in_buf, in_bufsz);
+	uint64_t start = fs_op_begin(true);
+	int retval = fs_iioctl((ino == STATS_INO) ? 0 : ino, cmd, data);
+	fs_op_end(STATS_IOCTL, start);
+	if (retval < 0){
+		fuse_reply_err(req, -retval);
+	} else {
+		fuse_reply_ioctl(req, retval, data, out_bufsz);
+	}
+	free(data);
+}
+
+static const struct fuse_lowlevel_ops fs_ll_ops = {
+	.init = ll_init,
+	.destroy = ll_destroy,
+	.lookup = ll_lookup,
+	.forget = ll_forget,
+	.forget_multi = ll_forget_multi,
+	.getattr = ll_getattr,
+	.setattr = ll_setattr,
+	.mknod = ll_mknod,
+	.mkdir = ll_mkdir,
+	.create = ll_create,
+	.unlink = ll_unlink,
+	.rmdir = ll_rmdir,
+	.rename = ll_rename,
+	.link = ll_link,
+	.symlink = ll_symlink,
+	.readlink = ll_readlink,
+	.open = ll_open,
+	.read = ll_read,
+	.write_buf = ll_write_buf,
+	.release = ll_release,
+	.fsync = ll_fsync,
+	.opendir = ll_opendir,
+	.readdir = ll_readdir,
+	.releasedir = ll_releasedir,
+	.fsyncdir = ll_fsyncdir,
+	.statfs = ll_statfs,
+	.fallocate = ll_fallocate,
+	.ioctl = ll_ioctl,
+};
+
+int fs_ll_main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	char *mountpoint = NULL;
+	int multithreaded, foreground, err = -1;
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1){
+		return 1;
+	}
+	struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+	if (ch != NULL){
+		struct fuse_session *se = fuse_lowlevel_new(&args, &fs_ll_ops, sizeof(fs_ll_ops), NULL);
+		if (se != NULL){
+			if (fuse_set_signal_handlers(se) != -1){
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				/* the file system lock makes concurrent requests safe */
+				err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return err ? 1 : 0;
+}
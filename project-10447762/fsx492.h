@@ -25,23 +25,20 @@ struct fs_dirent {
     char name[FS_FILENAME_SIZE]; /* with trailing NUL */
 }; /* total 32 bytes */
 
-/**
- * Superblock - holds file system parameters.
- */
-struct fs_super {
-    uint32_t magic; /* magic number */
-    uint32_t inode_map_sz; /* inode map size in blocks */
-    uint32_t inode_region_sz; /* inode region size in blocks */
-    uint32_t block_map_sz; /* block map size in blocks */
-    uint32_t num_blocks; /* total blocks, including SB, bitmaps, inodes */
-    uint32_t root_inode; /* always inode 1 */
-    char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t)]; 
-}; /* total FS_BLOCK_SIZE bytes */
-
 /**
  * Inode - holds file entry information
+ *
+ * With FS_INODE_INLINE set, a file of at most FS_INLINE_SIZE bytes
+ * keeps its contents in the bytes used for block pointers otherwise,
+ * and has no blocks. A symbolic link keeps its target as its contents,
+ * without a trailing NUL.
+ *
+ * With FS_INODE_COMPRESSED set, a regular file is written in clusters
+ * (see below), and a directory gives the flag to the regular files
+ * and directories made in it.
  */
 enum {N_DIRECT = 6 }; /* number direct entries */
+enum {FS_INLINE_SIZE = (N_DIRECT + 4) * sizeof(uint32_t) }; /* bytes of inline data */
 struct fs_inode {
     uint16_t uid; /* user ID of file owner */
     uint16_t gid; /* group ID of file owner */
@@ -49,24 +46,149 @@ struct fs_inode {
     uint32_t ctime; /* creation time */
     uint32_t mtime; /* last modification time */
     int32_t size; /* size in bytes */
-    uint32_t direct[N_DIRECT]; /* direct block pointers */
-    uint32_t indir_1; /* single indirect block pointer */
-    uint32_t indir_2; /* double indirect block pointer */
-    uint32_t pad[3]; /* padding to make 64 bytes per inode */
+    union {
+        struct {
+            uint32_t direct[N_DIRECT]; /* direct block pointers */
+            uint32_t indir_1; /* single indirect block pointer */
+            uint32_t indir_2; /* double indirect block pointer */
+            uint32_t pad[2]; /* padding to make 64 bytes per inode */
+        };
+        char inline_data[FS_INLINE_SIZE]; /* contents, if FS_INODE_INLINE */
+    };
+    uint16_t flags; /* FS_INODE_* flags */
+    uint16_t nlink; /* directory entries naming the inode; 0, as in the original format, counts as 1 */
 }; /* total 64 bytes */
 
+/** inode flags */
+enum {
+    FS_INODE_INLINE = 0x1, /* contents are in inline_data */
+    FS_INODE_COMPRESSED = 0x2 /* data is stored in compressed clusters */
+};
+
+/**
+ * Superblock - holds file system parameters.
+ *
+ * With FS_FEAT_SNAPSHOTS, each nonzero entry of snapshots is the inode
+ * of a snapshot's map: a uint32_t per block of the image, the block
+ * holding that block's contents when the snapshot was taken, or 0 if
+ * the block itself still holds them. No directory names these inodes.
+ *
+ * With FS_FEAT_GROUPS, the image is divided into block groups of
+ * group_blocks blocks. Each group starts with its own block bitmap,
+ * inode bitmap and inode table, sized by inode_map_sz, block_map_sz
+ * and inode_region_sz, followed by its data blocks; group 0 starts
+ * after the superblock. Group g holds inodes g * group_inodes to
+ * (g + 1) * group_inodes - 1.
+ *
+ * With FS_FEAT_CSUM, the csum_blocks blocks after the file system's
+ * num_blocks hold a uint32_t for each of its blocks: the CRC32C of the
+ * block's contents, seeded with its block number so a block written
+ * in the wrong place fails as well. The block device in csum.c keeps
+ * them and checks every block read.
+ *
+ * With FS_FEAT_DYN_INODES, inodes from dyn_inode_base on are dynamic:
+ * their inode table blocks are taken from the data area as they are
+ * needed. The contents of inode_map, a file no inode number refers
+ * to, are a struct fs_imap_entry for each of these blocks in turn, so
+ * dynamic inode dyn_inode_base + i is in the block of entry i divided
+ * by the inodes per block. Groups have no inodes from dyn_inode_base
+ * on.
+ */
+enum { FS_MAX_SNAPSHOTS = 8 };
+struct fs_super {
+    uint32_t magic; /* magic number */
+    uint32_t inode_map_sz; /* inode map size in blocks (per group) */
+    uint32_t inode_region_sz; /* inode region size in blocks (per group) */
+    uint32_t block_map_sz; /* block map size in blocks (per group) */
+    uint32_t num_blocks; /* total blocks, including SB, bitmaps, inodes */
+    uint32_t root_inode; /* always inode 1 */
+    uint32_t features; /* FS_FEAT_* flags, 0 in the original format */
+    uint32_t group_blocks; /* blocks per group, a multiple of 8 */
+    uint32_t group_inodes; /* inodes per group, a whole number of inode table blocks */
+    uint32_t inode_size; /* bytes per inode, 0 for FS_INODE_V1_SIZE */
+    uint32_t refcount_inode; /* inode holding block reference counts, with FS_FEAT_REFLINK */
+    uint32_t snapshots[FS_MAX_SNAPSHOTS]; /* map inode of each snapshot, 0 for none */
+    uint32_t csum_blocks; /* blocks of checksums after num_blocks, with FS_FEAT_CSUM */
+    uint32_t dyn_inode_base; /* first dynamic inode, a multiple of 16, with FS_FEAT_DYN_INODES */
+    struct fs_inode inode_map; /* the map of dynamic inode table blocks, with FS_FEAT_DYN_INODES */
+    char pad[FS_BLOCK_SIZE - (13 + FS_MAX_SNAPSHOTS) * sizeof(uint32_t) - sizeof(struct fs_inode)];
+}; /* total FS_BLOCK_SIZE bytes */
+
+/** entry of the dynamic inode map, for an inode table block */
+struct fs_imap_entry {
+    uint32_t block; /* the table block */
+    uint16_t used; /* bit i set if inode i of the block is in use */
+    uint16_t reserved; /* must be 0 */
+};
+
+/** superblock feature flags */
+enum {
+    FS_FEAT_GROUPS = 0x1, /* block group layout */
+    FS_FEAT_INLINE = 0x2, /* some inodes have FS_INODE_INLINE; set by the first one */
+    FS_FEAT_BIG_INODES = 0x4, /* inode_size is larger than FS_INODE_V1_SIZE */
+    FS_FEAT_LINKS = 0x8, /* some inodes have nlink above 1; set by the first one */
+    FS_FEAT_REFLINK = 0x10, /* files may share data blocks; set by the first clone */
+    FS_FEAT_SNAPSHOTS = 0x20, /* snapshots may exist; set by the first one */
+    FS_FEAT_COMPRESS = 0x40, /* some inodes have FS_INODE_COMPRESSED; set by the first one */
+    FS_FEAT_CSUM = 0x80, /* blocks have checksums; set by mkfs */
+    FS_FEAT_DYN_INODES = 0x100 /* some inodes are dynamic; set by the first one */
+};
+
+/**
+ * Compressed clusters - a file with FS_INODE_COMPRESSED is divided into
+ * clusters of FS_CLUSTER_BLOCKS logical blocks. A cluster stored
+ * compressed has FS_CLUSTER_COMPRESSED, which is never a block
+ * number, as the pointer of its first logical block; the pointers
+ * after it lead to the blocks holding a struct fs_cluster followed by
+ * the cluster's data in the LZ4 block format, and the rest are 0. A
+ * cluster that would not take fewer blocks compressed is stored as
+ * in any other file.
+ */
+enum {
+    FS_CLUSTER_BLOCKS = 16,
+    FS_CLUSTER_COMPRESSED = 0x7fffffff
+};
+struct fs_cluster {
+    uint32_t compressed; /* bytes of compressed data following */
+    uint32_t size; /* bytes they decompress to; the rest of the cluster reads as 0 */
+};
+
+/**
+ * Inode extension - the 64 bytes after struct fs_inode in inodes of
+ * 128 bytes or more; 256-byte inodes keep the rest for in-inode
+ * extended attributes. With 64-byte inodes, access time is not
+ * stored and reads as mtime, and all nanoseconds read as 0.
+ */
+struct fs_inode_ext {
+    uint32_t atime; /* last access time */
+    uint32_t atime_ns; /* nanoseconds of atime */
+    uint32_t mtime_ns; /* nanoseconds of mtime */
+    uint32_t ctime_ns; /* nanoseconds of ctime */
+    uint32_t xattr_block; /* block of extended attributes, 0 if none */
+    uint32_t reserved[11]; /* must be 0 */
+}; /* total 64 bytes */
+
+/** supported inode sizes */
+enum {
+    FS_INODE_V1_SIZE = 64, /* struct fs_inode only */
+    FS_INODE_V2_SIZE = 128, /* followed by struct fs_inode_ext */
+    FS_INODE_MAX_SIZE = 256
+};
+
 /**
  * Constants for blocks
  *   DIRENTS_PER_BLK - number of directory entries per block
- *   INODES_PER_BLOCK - number of inodes per block
+ *   INODES_PER_BLOCK - number of FS_INODE_V1_SIZE inodes per block
  *   PTRS_PER_BLOCK - number of inode pointers per block
  *   BITS_PER_BLOCK - number of bits per block
+ *   IMAP_ENTRIES_PER_BLK - number of dynamic inode map entries per block
  */
 enum {
     DIRENTS_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_dirent),
 	INODES_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_inode),
     PTRS_PER_BLK = FS_BLOCK_SIZE / sizeof(uint32_t),
-	BITS_PER_BLK = FS_BLOCK_SIZE * 8
+	BITS_PER_BLK = FS_BLOCK_SIZE * 8,
+    IMAP_ENTRIES_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_imap_entry)
 };
 
 #endif
@@ -0,0 +1,103 @@
+/*
+ * file:        fsx492_ioctl.h
+ * description: ioctl commands for FSX492 file system maintenance
+ *
+ * These are issued on any open file or directory of a mounted file
+ * system, or through fs_ops.ioctl by the command interpreter. They
+ * act on the whole file system, not on the file they are issued on,
+ * except FSX492_IOC_CLONE and FSX492_IOC_COMPRESS.
+ */
+
+#ifndef FSX492_IOCTL_H_
+#define FSX492_IOCTL_H_
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/**
+ * Fragmentation report. A file's blocks, including indirect blocks,
+ * are counted in the order a sequential read visits them; an extent
+ * is a run of them that is also consecutive on disk.
+ */
+struct fsx492_frag {
+	uint32_t files; /* files and directories with at least one block */
+	uint32_t blocks; /* blocks owned by them */
+	uint32_t extents; /* total extents */
+	uint32_t fragmented; /* files with more than one extent */
+	uint32_t end; /* one past the highest allocated block */
+};
+
+/** defrag flags */
+enum {
+	FSX492_DEFRAG_COMPACT = 1 /* rewrite all blocks in directory order from the first data block */
+};
+
+/** argument of FSX492_IOC_DEFRAG */
+struct fsx492_defrag {
+	uint32_t flags; /* in: FSX492_DEFRAG_* */
+	struct fsx492_frag before; /* out: before defragmenting */
+	struct fsx492_frag after; /* out: after defragmenting */
+};
+
+#define FSX492_IOC_DEFRAG _IOWR('X', 1, struct fsx492_defrag)
+
+enum { FSX492_PATH_MAX = 1024 };
+
+/**
+ * argument of FSX492_IOC_CLONE, issued on a regular file to make a
+ * new file with the same contents that shares its blocks until one of
+ * the two writes them
+ */
+struct fsx492_clone {
+	char dest[FSX492_PATH_MAX]; /* in: path of the new file from the file system's root */
+};
+
+#define FSX492_IOC_CLONE _IOW('X', 2, struct fsx492_clone)
+
+/**
+ * argument of FSX492_IOC_SNAPSHOT, which takes a snapshot of the file
+ * system, and FSX492_IOC_SNAPSHOT_DELETE, which deletes one
+ */
+struct fsx492_snapshot {
+	uint32_t id; /* out for SNAPSHOT, in for SNAPSHOT_DELETE: the snapshot's slot */
+};
+
+#define FSX492_IOC_SNAPSHOT _IOR('X', 3, struct fsx492_snapshot)
+#define FSX492_IOC_SNAPSHOT_DELETE _IOW('X', 4, struct fsx492_snapshot)
+
+/*
+ * Issued on a regular file, store what is written to it from then on
+ * in compressed clusters; issued on a directory, do so for the files
+ * and directories then made in it. There is no turning it off.
+ */
+#define FSX492_IOC_COMPRESS _IO('X', 5)
+
+/** report of FSX492_IOC_DEDUP */
+struct fsx492_dedup {
+	uint32_t scanned; /* out: data blocks of regular files read */
+	uint32_t merged; /* out: blocks given up for an earlier block with the same contents */
+};
+
+#define FSX492_IOC_DEDUP _IOR('X', 6, struct fsx492_dedup)
+
+/** report of FSX492_IOC_SCRUB, which reads every block, checking its checksum if the image keeps them */
+struct fsx492_scrub {
+	uint32_t blocks; /* out: blocks read */
+	uint32_t bad; /* out: blocks that could not be read or failed their check */
+	uint32_t first_bad; /* out: the lowest of them, if any */
+};
+
+#define FSX492_IOC_SCRUB _IOR('X', 7, struct fsx492_scrub)
+
+/**
+ * argument of FSX492_IOC_RESIZE, which grows or shrinks the file
+ * system and its image. A grouped file system may get fewer blocks
+ * than asked for, as its last group must have room for a data block.
+ */
+struct fsx492_resize {
+	uint32_t blocks; /* in: blocks wanted; out: blocks the file system now has */
+};
+
+#define FSX492_IOC_RESIZE _IOWR('X', 8, struct fsx492_resize)
+
+#endif /* FSX492_IOCTL_H_ */
@@ -0,0 +1,194 @@
+/*
+ * file:        hash.c
+ * description: XXH64 and CRC32C hashing for FSX492 file system
+ *
+ * XXH64 input is consumed 32 bytes at a time by four independent 64-bit
+ * accumulators, which the processor can work on in parallel; they are
+ * then merged, the tail is mixed in, and the result is avalanched so
+ * every input bit affects every output bit.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "hash.h"
+
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t rotl(uint64_t x, int r){
+	return (x << r) | (x >> (64 - r));
+}
+
+/* little-endian reads, as the hash is defined */
+static uint64_t read64(const unsigned char *p){
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i--){
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+static uint32_t read32(const unsigned char *p){
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input){
+	return rotl(acc + input * PRIME2, 31) * PRIME1;
+}
+
+static uint64_t merge(uint64_t h, uint64_t acc){
+	return (h ^ round64(0, acc)) * PRIME1 + PRIME4;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed){
+	const unsigned char *p = data, *end = p + len;
+	uint64_t h;
+	if (len >= 32){
+		uint64_t v1 = seed + PRIME1 + PRIME2, v2 = seed + PRIME2, v3 = seed, v4 = seed - PRIME1;
+		for (; end - p >= 32; p += 32){
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+		}
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+	} else {
+		h = seed + PRIME5;
+	}
+	h += len;
+	for (; end - p >= 8; p += 8){
+		h = rotl(h ^ round64(0, read64(p)), 27) * PRIME1 + PRIME4;
+	}
+	if (end - p >= 4){
+		h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++){
+		h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+	}
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * CRC32C. The table version works a byte at a time through eight
+ * tables, each taking one more zero byte into account, so eight
+ * bytes are taken in one step of independent lookups.
+ */
+enum { CRC32C_POLY = 0x82F63B78 }; /* reflected Castagnoli polynomial */
+
+static uint32_t crc_table[8][256];
+static int have_sse42;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void){
+	for (int i = 0; i < 256; i++){
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++){
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		}
+		crc_table[0][i] = crc;
+	}
+	for (int i = 0; i < 256; i++){
+		for (int t = 1; t < 8; t++){
+			crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+		}
+	}
+#if defined(__x86_64__) && defined(__GNUC__)
+	have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len){
+	for (; len >= 8; p += 8, len -= 8){
+		uint32_t lo = crc ^ read32(p), hi = read32(p + 4);
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff]
+			^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24]
+			^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff]
+			^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+	}
+	for (; len > 0; p++, len--){
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xff];
+	}
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len){
+	uint64_t crc64 = crc;
+	for (; len >= 8; p += 8, len -= 8){
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = crc64;
+	for (; len > 0; p++, len--){
+		crc = _mm_crc32_u8(crc, *p);
+	}
+	return crc;
+}
+
+/*
+ * The crc32 instruction takes three cycles but a new one can start
+ * every cycle, so three buffers are taken together, one word of each
+ * in turn, to keep it busy; len must be a multiple of 8.
+ */
+__attribute__((target("sse4.2")))
+static void crc32c_sse42_x3(const uint32_t *crc, const unsigned char *p, size_t len, uint32_t *out){
+	uint64_t c0 = crc[0], c1 = crc[1], c2 = crc[2];
+	for (size_t i = 0; i < len; i += 8){
+		uint64_t v0, v1, v2;
+		memcpy(&v0, p + i, sizeof(v0));
+		memcpy(&v1, p + len + i, sizeof(v1));
+		memcpy(&v2, p + 2 * len + i, sizeof(v2));
+		c0 = _mm_crc32_u64(c0, v0);
+		c1 = _mm_crc32_u64(c1, v1);
+		c2 = _mm_crc32_u64(c2, v2);
+	}
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len){
+	pthread_once(&crc_once, crc32c_init);
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (have_sse42){
+		return ~crc32c_sse42(~crc, data, len);
+	}
+#endif
+	return ~crc32c_table(~crc, data, len);
+}
+
+void crc32c_blocks(uint32_t first, const void *data, size_t len, int count, uint32_t *crcs){
+	const unsigned char *p = data;
+	int i = 0;
+	pthread_once(&crc_once, crc32c_init);
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (have_sse42 && len % 8 == 0){
+		for (; count - i >= 3; i += 3){
+			uint32_t init[3] = { ~(first + i), ~(first + i + 1), ~(first + i + 2) };
+			crc32c_sse42_x3(init, p + i * len, len, crcs + i);
+			crcs[i] = ~crcs[i];
+			crcs[i + 1] = ~crcs[i + 1];
+			crcs[i + 2] = ~crcs[i + 2];
+		}
+	}
+#endif
+	for (; i < count; i++){
+		crcs[i] = crc32c(first + i, p + i * len, len);
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * file:        hash.h
+ * description: content hashing for FSX492 file system
+ */
+
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The XXH64 hash of len bytes: fast, well distributed, and the same
+ * on every platform, but not cryptographic, so equal hashes only
+ * suggest equal contents.
+ *
+ * @param seed: varies the hash; 0 for the standard XXH64 values
+ */
+extern uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+/*
+ * The CRC32C (Castagnoli) of len bytes, continuing from crc, which is
+ * 0 to start. Uses the SSE4.2 crc32 instruction where the processor
+ * has it, and tables otherwise; both give the same result.
+ */
+extern uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/*
+ * The CRC32Cs of count buffers of len bytes each, laid end to end,
+ * buffer i continuing from first + i: the same as calling crc32c on
+ * each, but faster, as several are worked on at once.
+ */
+extern void crc32c_blocks(uint32_t first, const void *data, size_t len, int count, uint32_t *crcs);
+
+#endif /* HASH_H_ */
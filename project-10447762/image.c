@@ -6,6 +6,7 @@
  * Philip Gust, Northeastern Computer Science, 2019
  */
 
+#define _GNU_SOURCE /* for sync_file_range where there is one */
 #define _XOPEN_SOURCE 500
 
 #include <stdio.h>
@@ -17,6 +18,7 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "blkdev.h"
@@ -24,11 +26,21 @@
 // should be defined in "string.h" but is not on macos
 extern char* strdup(const char *);
 
+/** number of threads carrying out submitted requests */
+enum { IMAGE_WORKERS = 4 };
+
 /** definition of image block device */
 struct image_dev {
     char *path; // path to device file
     int fd; // file descriptor of open file
     int nblks; // number of blocks in device
+    pthread_mutex_t lock; // protects the fields below
+    pthread_cond_t queued; // signalled when a request is queued or workers should stop
+    pthread_cond_t completed; // broadcast when a request completes
+    struct blkdev_req *head, *tail; // submitted requests not yet started
+    pthread_t workers[IMAGE_WORKERS];
+    int nworkers; // workers started, 0 until the first submit
+    int stopping; // set by close to stop the workers
 };
 
 /*
@@ -57,13 +69,9 @@ static int image_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
 	if (image_device->fd == -1){
 		return E_UNAVAIL;
 	}
-	off_t seek_result = lseek(image_device->fd, first_blk * BLOCK_SIZE, SEEK_SET);
-	if (seek_result == -1){
-		fprintf(stderr, "image_read: seek failed\n");
-		return E_SIZE;
-	}
+	/* pread rather than lseek+read, so concurrent callers don't race on the file offset */
 	int amount_to_try_to_read = nblks * BLOCK_SIZE;
-	ssize_t amount_actually_read = read(image_device->fd, buf, amount_to_try_to_read);
+	ssize_t amount_actually_read = pread(image_device->fd, buf, amount_to_try_to_read, (off_t)first_blk * BLOCK_SIZE);
 	if (amount_actually_read == -1){
 		return E_BADADDR;
 	}
@@ -89,12 +97,8 @@ static int image_write(struct blkdev * dev, int first_blk, int nblks, void *buf)
 	if (image_device->fd == -1){
 		return E_UNAVAIL;
 	}
-	if (lseek(image_device->fd, first_blk * BLOCK_SIZE, SEEK_SET) == -1){
-		fprintf(stderr, "image_write: seek failed\n");
-		return E_SIZE;
-	}
 	int amount_to_try_to_write = nblks * BLOCK_SIZE;
-	ssize_t amount_actually_written = write(image_device->fd, buf, amount_to_try_to_write);
+	ssize_t amount_actually_written = pwrite(image_device->fd, buf, amount_to_try_to_write, (off_t)first_blk * BLOCK_SIZE);
 	if (amount_actually_written == -1){
 		return E_BADADDR;
 	}
@@ -109,7 +113,7 @@ static int image_write(struct blkdev * dev, int first_blk, int nblks, void *buf)
  * Flush the block device.
  * @param dev: the block device
  * @aparam first_blk: index of the block to start flushing 
- * @param nblks: number of blocks to flush
+ * @param nblks: number of blocks to flush, 0 for all of them
  * @return: SUCCESS if successful, E_UNAVAIL if device unavailable
 */
 
@@ -119,12 +123,120 @@ static int image_flush(struct blkdev * dev, int first_blk, int nblks)
 	if (image_device->fd == -1){
 		return E_UNAVAIL;
 	}
+#ifdef SYNC_FILE_RANGE_WRITE
+	/*
+	 * Write back just the range, then flush the drive's cache. fdatasync
+	 * has no range form; after the range is written it has little left
+	 * to do unless other parts of the image are dirty too.
+	 */
+	if (nblks > 0 && sync_file_range(image_device->fd, (off_t)first_blk * BLOCK_SIZE, (off_t)nblks * BLOCK_SIZE,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1){
+		return E_UNAVAIL;
+	}
+	if (fdatasync(image_device->fd) == -1){
+		return E_UNAVAIL;
+	}
+#else
 	if (fsync(image_device->fd) == -1){
 		return E_UNAVAIL;
 	}
+#endif
+	return SUCCESS;
+}
+
+/*
+ * Worker thread: carry out submitted requests in order of submission.
+ * @param arg: the block device
+*/
+
+static void *image_worker(void *arg)
+{
+	struct blkdev *dev = arg;
+	struct image_dev *image_device = dev->private;
+	pthread_mutex_lock(&image_device->lock);
+	for (;;){
+		while (image_device->head == NULL && !image_device->stopping){
+			pthread_cond_wait(&image_device->queued, &image_device->lock);
+		}
+		struct blkdev_req *req = image_device->head;
+		if (req == NULL){
+			break;
+		}
+		if ((image_device->head = req->next) == NULL){
+			image_device->tail = NULL;
+		}
+		pthread_mutex_unlock(&image_device->lock);
+		int status = req->write ? image_write(dev, req->first_blk, req->num_blks, req->buf)
+				: image_read(dev, req->first_blk, req->num_blks, req->buf);
+		pthread_mutex_lock(&image_device->lock);
+		req->status = status;
+		req->complete = 1;
+		pthread_cond_broadcast(&image_device->completed);
+	}
+	pthread_mutex_unlock(&image_device->lock);
+	return NULL;
+}
+
+/*
+ * Queue a request for the worker threads. They are started by the first
+ * request rather than at creation, since a FUSE mount forks after the
+ * device is created and threads do not survive a fork.
+ * @param dev: the block device
+ * @param req: the request
+ * @return: SUCCESS if queued, E_UNAVAIL if device unavailable
+*/
+
+static int image_submit(struct blkdev *dev, struct blkdev_req *req)
+{
+	struct image_dev *image_device = dev->private;
+	if (image_device->fd == -1){
+		return E_UNAVAIL;
+	}
+	pthread_mutex_lock(&image_device->lock);
+	while (image_device->nworkers < IMAGE_WORKERS && !image_device->stopping){
+		if (pthread_create(&image_device->workers[image_device->nworkers], NULL, image_worker, dev) != 0){
+			break;
+		}
+		image_device->nworkers++;
+	}
+	if (image_device->nworkers == 0){
+		/* no threads to be had: carry it out here */
+		pthread_mutex_unlock(&image_device->lock);
+		req->status = req->write ? image_write(dev, req->first_blk, req->num_blks, req->buf)
+				: image_read(dev, req->first_blk, req->num_blks, req->buf);
+		req->complete = 1;
+		return SUCCESS;
+	}
+	req->next = NULL;
+	if (image_device->tail == NULL){
+		image_device->head = req;
+	} else {
+		image_device->tail->next = req;
+	}
+	image_device->tail = req;
+	pthread_cond_signal(&image_device->queued);
+	pthread_mutex_unlock(&image_device->lock);
 	return SUCCESS;
 }
 
+/*
+ * Wait for a submitted request to complete.
+ * @param dev: the block device
+ * @param req: the request
+ * @return: the request's status
+*/
+
+static int image_wait(struct blkdev *dev, struct blkdev_req *req)
+{
+	struct image_dev *image_device = dev->private;
+	pthread_mutex_lock(&image_device->lock);
+	while (!req->complete){
+		pthread_cond_wait(&image_device->completed, &image_device->lock);
+	}
+	pthread_mutex_unlock(&image_device->lock);
+	return req->status;
+}
+
 /* 
  * close the block device (if it's available).
  * @param dev: the block device
@@ -133,6 +245,14 @@ static int image_flush(struct blkdev * dev, int first_blk, int nblks)
 static void image_close(struct blkdev *dev)
 {
 	struct image_dev *image_device = dev->private;
+	pthread_mutex_lock(&image_device->lock);
+	image_device->stopping = 1;
+	pthread_cond_broadcast(&image_device->queued);
+	pthread_mutex_unlock(&image_device->lock);
+	for (int i = 0; i < image_device->nworkers; i++){
+		pthread_join(image_device->workers[i], NULL);
+	}
+	image_device->nworkers = 0;
 	if (image_device->fd == -1){
 		return;
 	}
@@ -142,6 +262,35 @@ static void image_close(struct blkdev *dev)
 	return;
 }
 
+/*
+ * Get the image file, whose layout matches the device's.
+ * @param dev: the block device
+ * @return: the file descriptor, or -1 if device unavailable
+*/
+
+static int image_fd(struct blkdev *dev)
+{
+	struct image_dev *image_device = dev->private;
+	return image_device->fd;
+}
+
+/*
+ * Change the size of the image file; blocks added read as zeros.
+ * @param dev: the block device
+ * @param nblks: the new number of blocks
+ * @return: SUCCESS if successful, E_UNAVAIL if device unavailable or
+ *   the file cannot be resized
+*/
+
+static int image_resize(struct blkdev *dev, int nblks)
+{
+	struct image_dev *image_device = dev->private;
+	if (image_device->fd == -1 || ftruncate(image_device->fd, (off_t)nblks * BLOCK_SIZE) == -1){
+		return E_UNAVAIL;
+	}
+	image_device->nblks = nblks;
+	return SUCCESS;
+}
 
 /** Operations on this block device */
 static struct blkdev_ops image_ops = {
@@ -149,7 +298,11 @@ static struct blkdev_ops image_ops = {
     .read = image_read,
     .write = image_write,
     .flush = image_flush,
-    .close = image_close
+    .close = image_close,
+    .fd = image_fd,
+    .submit = image_submit,
+    .wait = image_wait,
+    .resize = image_resize
 };
 
 /**
@@ -191,6 +344,12 @@ struct blkdev *image_create(char *path)
                 path, BLOCK_SIZE);
     }
     im->nblks = sb.st_size / BLOCK_SIZE;
+    pthread_mutex_init(&im->lock, NULL);
+    pthread_cond_init(&im->queued, NULL);
+    pthread_cond_init(&im->completed, NULL);
+    im->head = im->tail = NULL;
+    im->nworkers = 0;
+    im->stopping = 0;
     dev->private = im;
     dev->ops = &image_ops;
 
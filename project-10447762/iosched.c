@@ -0,0 +1,353 @@
+/*
+ * file:        iosched.c
+ * description: write-merging I/O scheduler stacked on a block device
+ *
+ * Writes are held in a queue of extents sorted by block number; a write
+ * overlapping or adjacent to queued extents is merged with them, so
+ * scattered small writes reach the lower device as a few large ones in
+ * ascending block order, issued together. Reads see queued data.
+ *
+ * The queue is dispatched at a barrier, when it holds IOSCHED_MAX_BLOCKS
+ * blocks, and before a flush or close, so writes made before a barrier
+ * reach the lower device before any made after it. The file system
+ * places barriers at the end of each operation and where a metadata
+ * update must not reach the device before the writes it depends on.
+ *
+ * A failed dispatch cannot be reported to the writes it carried, which
+ * have long returned, so it is reported by the next barrier or flush.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+#include "iosched.h"
+
+/** blocks queued before the queue is dispatched without a barrier */
+enum { IOSCHED_MAX_BLOCKS = 256 };
+
+/** queued data for a run of blocks */
+struct extent {
+	struct extent *next; /* next extent, at higher block numbers */
+	int first_blk;
+	int num_blks;
+	char *data;
+};
+
+/** definition of I/O scheduler block device */
+struct iosched_dev {
+	struct blkdev *lower; /* device requests are scheduled for */
+	pthread_mutex_t lock; /* protects the fields below */
+	struct extent *queue; /* sorted, with no two extents overlapping or adjacent */
+	int queued_blks; /* blocks held in queue */
+	int error; /* error from a dispatch not yet reported, or SUCCESS */
+};
+
+static int iosched_num_blocks(struct blkdev *dev)
+{
+	struct iosched_dev *sd = dev->private;
+	return sd->lower->ops->num_blocks(sd->lower);
+}
+
+/*
+ * Write the queue to the lower device, all extents at once, and empty
+ * it; call with the lock held. Extents stay visible to readers until
+ * they are written, as the lock is held throughout.
+ */
+static void dispatch(struct iosched_dev *sd)
+{
+	int count = 0;
+	for (struct extent *e = sd->queue; e != NULL; e = e->next){
+		count++;
+	}
+	if (count == 0){
+		return;
+	}
+	struct blkdev_req *reqs = calloc(count, sizeof(*reqs));
+	int i = 0;
+	for (struct extent *e = sd->queue; e != NULL; e = e->next, i++){
+		if (reqs == NULL){
+			/* no memory to have them all in flight: one at a time */
+			int status = sd->lower->ops->write(sd->lower, e->first_blk, e->num_blks, e->data);
+			if (status != SUCCESS && sd->error == SUCCESS){
+				sd->error = status;
+			}
+			continue;
+		}
+		reqs[i] = (struct blkdev_req){ .write = 1, .first_blk = e->first_blk, .num_blks = e->num_blks, .buf = e->data };
+		int status = blkdev_submit(sd->lower, &reqs[i]);
+		if (status != SUCCESS){
+			reqs[i].complete = 1;
+			reqs[i].status = status;
+		}
+	}
+	if (reqs != NULL){
+		for (i = 0; i < count; i++){
+			int status = reqs[i].complete ? reqs[i].status : blkdev_wait(sd->lower, &reqs[i]);
+			if (status != SUCCESS && sd->error == SUCCESS){
+				sd->error = status;
+			}
+		}
+		free(reqs);
+	}
+	while (sd->queue != NULL){
+		struct extent *e = sd->queue;
+		sd->queue = e->next;
+		free(e->data);
+		free(e);
+	}
+	sd->queued_blks = 0;
+}
+
+/*
+ * Queue a write, merging it with every extent it overlaps or touches;
+ * call with the lock held.
+ * @return: SUCCESS, or E_UNAVAIL if out of memory
+ */
+static int enqueue(struct iosched_dev *sd, int first_blk, int nblks, const void *buf)
+{
+	int last_blk = first_blk + nblks; /* one past */
+	struct extent **link = &sd->queue;
+	while (*link != NULL && (*link)->first_blk + (*link)->num_blks < first_blk){
+		link = &(*link)->next;
+	}
+	/* *link and those after it up to last_blk merge with the write */
+	struct extent *merged = *link;
+	int lo = first_blk, hi = last_blk;
+	int absorbed = 0;
+	for (struct extent *e = merged; e != NULL && e->first_blk <= last_blk; e = e->next){
+		if (e->first_blk < lo){
+			lo = e->first_blk;
+		}
+		if (e->first_blk + e->num_blks > hi){
+			hi = e->first_blk + e->num_blks;
+		}
+		absorbed++;
+	}
+	if (absorbed == 0){
+		struct extent *e = malloc(sizeof(*e));
+		if (e == NULL || (e->data = malloc((size_t)nblks * BLOCK_SIZE)) == NULL){
+			free(e);
+			return E_UNAVAIL;
+		}
+		memcpy(e->data, buf, (size_t)nblks * BLOCK_SIZE);
+		e->first_blk = first_blk;
+		e->num_blks = nblks;
+		e->next = *link;
+		*link = e;
+		sd->queued_blks += nblks;
+		return SUCCESS;
+	}
+	/* grow the first extent to cover them all; realloc is cheap when appending */
+	char *data = realloc(merged->data, (size_t)(hi - lo) * BLOCK_SIZE);
+	if (data == NULL){
+		return E_UNAVAIL;
+	}
+	if (merged->first_blk > lo){
+		memmove(data + (size_t)(merged->first_blk - lo) * BLOCK_SIZE, data, (size_t)merged->num_blks * BLOCK_SIZE);
+	}
+	merged->data = data;
+	sd->queued_blks -= merged->num_blks;
+	while (--absorbed > 0){
+		struct extent *e = merged->next;
+		memcpy(data + (size_t)(e->first_blk - lo) * BLOCK_SIZE, e->data, (size_t)e->num_blks * BLOCK_SIZE);
+		merged->next = e->next;
+		sd->queued_blks -= e->num_blks;
+		free(e->data);
+		free(e);
+	}
+	memcpy(data + (size_t)(first_blk - lo) * BLOCK_SIZE, buf, (size_t)nblks * BLOCK_SIZE);
+	merged->first_blk = lo;
+	merged->num_blks = hi - lo;
+	sd->queued_blks += merged->num_blks;
+	return SUCCESS;
+}
+
+/* does any queued extent overlap the range; call with the lock held */
+static int queued(struct iosched_dev *sd, int first_blk, int nblks)
+{
+	for (struct extent *e = sd->queue; e != NULL && e->first_blk < first_blk + nblks; e = e->next){
+		if (e->first_blk + e->num_blks > first_blk){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* copy queued data over blocks just read from the lower device; call with the lock held */
+static void overlay(struct iosched_dev *sd, int first_blk, int nblks, char *buf)
+{
+	for (struct extent *e = sd->queue; e != NULL && e->first_blk < first_blk + nblks; e = e->next){
+		int lo = (e->first_blk > first_blk) ? e->first_blk : first_blk;
+		int hi = (e->first_blk + e->num_blks < first_blk + nblks) ? e->first_blk + e->num_blks : first_blk + nblks;
+		if (lo < hi){
+			memcpy(buf + (size_t)(lo - first_blk) * BLOCK_SIZE, e->data + (size_t)(lo - e->first_blk) * BLOCK_SIZE,
+					(size_t)(hi - lo) * BLOCK_SIZE);
+		}
+	}
+}
+
+/*
+ * Read blocks, with queued writes applied. Reads of blocks with none
+ * queued go to the lower device without holding the lock.
+ */
+static int iosched_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct iosched_dev *sd = dev->private;
+	pthread_mutex_lock(&sd->lock);
+	if (!queued(sd, first_blk, nblks)){
+		pthread_mutex_unlock(&sd->lock);
+		return sd->lower->ops->read(sd->lower, first_blk, nblks, buf);
+	}
+	int retval = sd->lower->ops->read(sd->lower, first_blk, nblks, buf);
+	if (retval == SUCCESS){
+		overlay(sd, first_blk, nblks, buf);
+	}
+	pthread_mutex_unlock(&sd->lock);
+	return retval;
+}
+
+static int iosched_write(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct iosched_dev *sd = dev->private;
+	if (first_blk < 0 || first_blk + nblks > iosched_num_blocks(dev)){
+		return E_BADADDR;
+	}
+	pthread_mutex_lock(&sd->lock);
+	int retval = enqueue(sd, first_blk, nblks, buf);
+	if (retval != SUCCESS){
+		/* no memory to queue it: send everything, this one last */
+		dispatch(sd);
+		retval = sd->lower->ops->write(sd->lower, first_blk, nblks, buf);
+	} else if (sd->queued_blks >= IOSCHED_MAX_BLOCKS){
+		dispatch(sd);
+	}
+	pthread_mutex_unlock(&sd->lock);
+	return retval;
+}
+
+/*
+ * Dispatch the queue and pass the barrier on to the lower device;
+ * return any error from this or an earlier dispatch.
+ */
+static int iosched_barrier(struct blkdev *dev)
+{
+	struct iosched_dev *sd = dev->private;
+	pthread_mutex_lock(&sd->lock);
+	dispatch(sd);
+	int retval = sd->error;
+	sd->error = SUCCESS;
+	pthread_mutex_unlock(&sd->lock);
+	int lower = blkdev_barrier(sd->lower);
+	return (retval != SUCCESS) ? retval : lower;
+}
+
+static int iosched_flush(struct blkdev *dev, int first_blk, int nblks)
+{
+	struct iosched_dev *sd = dev->private;
+	int retval = iosched_barrier(dev);
+	int flushed = sd->lower->ops->flush(sd->lower, first_blk, nblks);
+	return (retval != SUCCESS) ? retval : flushed;
+}
+
+/*
+ * Writes complete once queued; reads of blocks with writes queued are
+ * done at once, others are passed to the lower device.
+ */
+static int iosched_submit(struct blkdev *dev, struct blkdev_req *req)
+{
+	struct iosched_dev *sd = dev->private;
+	if (req->write){
+		req->status = iosched_write(dev, req->first_blk, req->num_blks, req->buf);
+		req->complete = 1;
+		return SUCCESS;
+	}
+	pthread_mutex_lock(&sd->lock);
+	if (queued(sd, req->first_blk, req->num_blks)){
+		req->status = sd->lower->ops->read(sd->lower, req->first_blk, req->num_blks, req->buf);
+		if (req->status == SUCCESS){
+			overlay(sd, req->first_blk, req->num_blks, req->buf);
+		}
+		req->complete = 1;
+		pthread_mutex_unlock(&sd->lock);
+		return SUCCESS;
+	}
+	pthread_mutex_unlock(&sd->lock);
+	return blkdev_submit(sd->lower, req);
+}
+
+/* the lower device's wait handles requests completed here as well as its own */
+static int iosched_wait(struct blkdev *dev, struct blkdev_req *req)
+{
+	struct iosched_dev *sd = dev->private;
+	return blkdev_wait(sd->lower, req);
+}
+
+/*
+ * The lower device's file, with the queue dispatched first so that data
+ * written to the file directly is not overwritten by older queued data,
+ * and data read from it is current.
+ */
+static int iosched_fd(struct blkdev *dev)
+{
+	struct iosched_dev *sd = dev->private;
+	if (sd->lower->ops->fd == NULL){
+		return -1;
+	}
+	pthread_mutex_lock(&sd->lock);
+	dispatch(sd);
+	pthread_mutex_unlock(&sd->lock);
+	return sd->lower->ops->fd(sd->lower);
+}
+
+/* resize the lower device once the queue has reached it */
+static int iosched_resize(struct blkdev *dev, int nblks)
+{
+	struct iosched_dev *sd = dev->private;
+	if (sd->lower->ops->resize == NULL){
+		return E_UNAVAIL;
+	}
+	int retval = iosched_barrier(dev);
+	return (retval != SUCCESS) ? retval : sd->lower->ops->resize(sd->lower, nblks);
+}
+
+static void iosched_close(struct blkdev *dev)
+{
+	struct iosched_dev *sd = dev->private;
+	iosched_barrier(dev);
+	sd->lower->ops->close(sd->lower);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops iosched_ops = {
+    .num_blocks = iosched_num_blocks,
+    .read = iosched_read,
+    .write = iosched_write,
+    .flush = iosched_flush,
+    .close = iosched_close,
+    .fd = iosched_fd,
+    .submit = iosched_submit,
+    .wait = iosched_wait,
+    .barrier = iosched_barrier,
+    .resize = iosched_resize
+};
+
+struct blkdev *iosched_create(struct blkdev *lower)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct iosched_dev *sd = malloc(sizeof(*sd));
+    if (dev == NULL || sd == NULL){
+        free(dev);
+        free(sd);
+        return NULL;
+    }
+    sd->lower = lower;
+    pthread_mutex_init(&sd->lock, NULL);
+    sd->queue = NULL;
+    sd->queued_blks = 0;
+    sd->error = SUCCESS;
+    dev->private = sd;
+    dev->ops = &iosched_ops;
+    return dev;
+}
@@ -0,0 +1,20 @@
+/*
+ * file:        iosched.h
+ * description: creation function for the I/O scheduler block device
+ */
+
+#ifndef IOSCHED_H_
+#define IOSCHED_H_
+
+#include "blkdev.h"
+
+/*
+ * Create a block device that queues writes to another, merging and
+ * sorting them, and dispatches them at barriers.
+ *
+ * @param lower: the device to schedule requests for
+ * @return: the block device or NULL if out of memory
+*/
+extern struct blkdev *iosched_create(struct blkdev *lower);
+
+#endif /* IOSCHED_H_ */
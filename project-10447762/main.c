@@ -23,10 +23,22 @@ struct stat sb;
 #include <errno.h>
 #include <limits.h>
 #include <sys/types.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <fuse.h>
 #include "image.h"
+#include "iosched.h"
+#include "snapshot.h"
+#include "csum.h"
 
 #include "fsx492.h"		/* only for certain constants */
+#include "fsx492_ioctl.h"
+#include "mkfs.h"
+#include "fs.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01 /* from linux/falloc.h */
+#endif
 
 /*********** DO NOT MODIFY THIS FILE *************/
 
@@ -43,6 +55,16 @@ struct data {
     char *image_name;
     int part;
     int cmd_mode;
+    char *batch_file;
+    char *mkfs_groups;
+    int inode_size;
+    int csum;
+    int atime;
+    double ttl;
+    double cache_ttl;
+    int lowlevel;
+    int iosched;
+    char *snapshot;
 } _data;
 int homework_part;
 
@@ -51,23 +73,64 @@ int homework_part;
  */
 enum { MAX_PATH = 4096 };
 
+/**
+ * Default kernel entry and attribute timeout in seconds. All changes
+ * to a mounted image go through the kernel, which drops what it has
+ * cached for the files it changes, so this can be well above FUSE's
+ * default of 1 second.
+ */
+#define KERNEL_TTL 10.0
+
 static void help(){
     printf("Arguments:\n");
     printf(" -cmdline : Enter an interactive REPL that provides a filesystem view into the image\n");
     printf(" -image <name.img> : Use the provided image file that contains the filesystem\n");
+    printf(" -batch <file> : Run the REPL commands in file, then exit\n");
+    printf(" -mkfs <groups> : Format the image first, with <groups> block groups (0 for one global bitmap and inode region)\n");
+    printf(" -isize <bytes> : Inode size for -mkfs: 64 (no atime or nanoseconds), 128 (default) or 256\n");
+    printf(" -csum : With -mkfs, keep a checksum of every block and check blocks as they are read\n");
+    printf(" -relatime | -noatime | -strictatime : Update access times on reads only if not after modification\n"
+           "   or a day old (default), never, or always\n");
+    printf(" -ttl <seconds> : How long the kernel caches names and attributes of a mounted image (default %g)\n", KERNEL_TTL);
+    printf(" -cache_ttl <seconds> : Expire cached inodes and paths after this long (default 0, never)\n");
+    printf(" -lowlevel : Mount with the low-level FUSE interface, which names files by inode number\n");
+    printf(" -iosched : Queue writes to the image, merging and sorting them, until each operation ends\n");
+    printf(" -snapshot <id> : Use the image read-only, as it was when snapshot <id> was taken\n");
 }
 
 /*
  * See comments in /usr/include/fuse/fuse_opts.h for details of
  * FUSE argument processing.
  *
- *  usage: ./fsx492 [-cmdline] -image test/fsx492.img <directory>
+ *  usage: ./fsx492 [-cmdline | -batch file] -image test/fsx492.img <directory>
  *  		[-cmdline cmd]: optional; run the file system in cmdline mode
+ *  		[-batch file]: optional; run the commands in file, then exit
+ *  		[-mkfs groups]: optional; format the image before using it
+ *  		[-isize bytes]: optional; inode size for -mkfs
+ *  		[-csum]: optional; checksum blocks, for -mkfs
+ *  		[-relatime | -noatime | -strictatime]: optional; access time policy
+ *  		[-ttl seconds]: optional; kernel entry and attribute timeout
+ *  		[-cache_ttl seconds]: optional; expiry of the file system's own caches
+ *  		[-lowlevel]: optional; mount with the low-level FUSE interface
+ *  		[-iosched]: optional; schedule writes to the image
+ *  		[-snapshot id]: optional; use a snapshot of the image, read-only
  *              <directory> - directory to mount it on
  */
 static struct fuse_opt opts[] = {
         {"-image %s", offsetof(struct data, image_name), 0},
         {"-cmdline", offsetof(struct data, cmd_mode), 1},
+        {"-batch %s", offsetof(struct data, batch_file), 0},
+        {"-mkfs %s", offsetof(struct data, mkfs_groups), 0},
+        {"-isize %d", offsetof(struct data, inode_size), 0},
+        {"-csum", offsetof(struct data, csum), 1},
+        {"-relatime", offsetof(struct data, atime), FS_ATIME_RELATIME},
+        {"-noatime", offsetof(struct data, atime), FS_ATIME_NOATIME},
+        {"-strictatime", offsetof(struct data, atime), FS_ATIME_STRICT},
+        {"-ttl %lf", offsetof(struct data, ttl), 0},
+        {"-cache_ttl %lf", offsetof(struct data, cache_ttl), 0},
+        {"-lowlevel", offsetof(struct data, lowlevel), 1},
+        {"-iosched", offsetof(struct data, iosched), 1},
+        {"-snapshot %s", offsetof(struct data, snapshot), 0},
         FUSE_OPT_END
 };
 
@@ -86,7 +149,7 @@ static char *strmode(char *buf, int mode)
 {
     int mask = 0400;
     char *str = "rwxrwxrwx", *retval = buf;
-    *buf++ = S_ISDIR(mode) ? 'd' : '-';
+    *buf++ = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : '-';
     for (mask = 0400; mask != 0; str++, mask = mask >> 1)
         *buf++ = (mask & mode) ? *str : '-';
     *buf++ = 0;
@@ -428,6 +491,89 @@ static int do_rename(char *argv[])
     return fs_ops.rename(p1, p2);
 }
 
+/**
+ * Make a hard link.
+ *
+ * @param argv argv[0] is existing file, arg[1] is new name
+ *   relative to working directory
+ */
+static int do_ln(char *argv[])
+{
+    char p1[MAX_PATH], p2[MAX_PATH];
+    full_path(argv[0], p1);
+    full_path(argv[1], p2);
+    return fs_ops.link(p1, p2);
+}
+
+/**
+ * Make a copy of a file that shares its blocks until either is written.
+ *
+ * @param argv argv[0] is existing file, arg[1] is new name
+ *   relative to working directory
+ */
+static int do_clone(char *argv[])
+{
+    char p1[MAX_PATH], p2[MAX_PATH];
+    full_path(argv[0], p1);
+    full_path(argv[1], p2);
+    struct fsx492_clone req;
+    if (strlen(p2) >= sizeof(req.dest)){
+        return -ENAMETOOLONG;
+    }
+    memset(&req, 0, sizeof(req));
+    strcpy(req.dest, p2);
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    return fs_ops.ioctl(p1, FSX492_IOC_CLONE, NULL, &info, 0, &req);
+}
+
+/**
+ * Compress what is written to a file from now on, or to files made
+ * in a directory.
+ *
+ * @param argv argv[0] is the file or directory
+ */
+static int do_compress(char *argv[])
+{
+    char p1[MAX_PATH];
+    full_path(argv[0], p1);
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    return fs_ops.ioctl(p1, FSX492_IOC_COMPRESS, NULL, &info, 0, NULL);
+}
+
+/**
+ * Make a symbolic link.
+ *
+ * @param argv argv[0] is "-s", argv[1] is the target, stored as
+ *   given, argv[2] is link name relative to working directory
+ */
+static int do_ln_s(char *argv[])
+{
+    if (strcmp(argv[0], "-s") != 0){
+        return -EINVAL;
+    }
+    char path[MAX_PATH];
+    full_path(argv[2], path);
+    return fs_ops.symlink(argv[1], path);
+}
+
+/**
+ * Print the target of a symbolic link.
+ *
+ * @param argv argv[0] is link name
+ */
+static int do_readlink(char *argv[])
+{
+    char path[MAX_PATH], target[MAX_PATH];
+    full_path(argv[0], path);
+    int val = fs_ops.readlink(path, target, sizeof(target));
+    if (val == 0){
+        printf("%s\n", target);
+    }
+    return val;
+}
+
 /**
  * Make directory.
  *
@@ -467,6 +613,30 @@ static int do_rm(char *argv[])
 static int blksiz;		/* size of block buffer */
 static char *blkbuf;	/* block buffer for coping files */
 
+/**
+ * Write all of a buffer to a local file, retrying partial writes.
+ *
+ * @param fd the local file
+ * @param buf the data
+ * @param len length of data
+ * @return 0 if successful, -1 with errno set if not
+ */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0){
+        ssize_t n = write(fd, buf, len);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
 /**
  * Copy a file from localdir into filesystem
  *
@@ -492,6 +662,11 @@ static int do_put(char *argv[])
     if ((val = fs_ops.open(path, &info)) != 0){
         return val;
     }
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0){
+        // reserve all blocks up front; write loop then never allocates
+        fs_ops.fallocate(path, FALLOC_FL_KEEP_SIZE, 0, sb.st_size, &info);
+    }
     while ((len = read(fd, blkbuf, blksiz)) > 0){
         val = fs_ops.write(path, blkbuf, len, offset, &info);
         if (val != len){
@@ -517,6 +692,337 @@ static int do_put1(char *argv[])
     return do_put(args2);
 }
 
+/**
+ * A directory, or a chunk of a file, read from the local directory
+ * tree by the put -r reader thread, waiting to be written to the file
+ * system. The chunks of a file are queued in order, one after another.
+ */
+struct import_item {
+    struct import_item *next;
+    char path[MAX_PATH];    /* file system path */
+    mode_t mode;            /* local file mode */
+    off_t size;             /* size of the whole file */
+    off_t offset;           /* offset of data in the file */
+    char *data;             /* file contents, NULL for a directory */
+    size_t len;             /* length of data */
+    bool first;             /* first chunk of the file */
+    bool last;              /* last chunk of the file */
+    bool failed;            /* rest of the file could not be read */
+};
+
+/** Maximum file data buffered between the put -r reader and writer */
+enum { IMPORT_QUEUE_BYTES = 32 << 20 };
+
+/** Maximum file data in one queued item */
+enum { IMPORT_CHUNK_BYTES = 1 << 20 };
+
+/** Largest file the file system can hold */
+static const off_t import_max_size =
+    (off_t)FS_BLOCK_SIZE * (N_DIRECT + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK);
+
+/** Queue from the put -r reader thread to the writer */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct import_item *head, *tail;
+    size_t bytes;           /* file data held by queued items */
+    bool done;              /* reader has queued everything */
+    int errors;             /* local files that could not be read */
+} importq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void import_push(struct import_item *item)
+{
+    pthread_mutex_lock(&importq.lock);
+    while (importq.head != NULL && importq.bytes + item->len > IMPORT_QUEUE_BYTES){
+        pthread_cond_wait(&importq.changed, &importq.lock);
+    }
+    if (importq.tail == NULL){
+        importq.head = item;
+    } else {
+        importq.tail->next = item;
+    }
+    importq.tail = item;
+    importq.bytes += item->len;
+    pthread_cond_broadcast(&importq.changed);
+    pthread_mutex_unlock(&importq.lock);
+}
+
+/**
+ * Remove the next item from the import queue, waiting for the
+ * reader if necessary.
+ *
+ * @return the item, or NULL when the reader is done
+ */
+static struct import_item *import_pop(void)
+{
+    pthread_mutex_lock(&importq.lock);
+    while (importq.head == NULL && !importq.done){
+        pthread_cond_wait(&importq.changed, &importq.lock);
+    }
+    struct import_item *item = importq.head;
+    if (item != NULL){
+        importq.head = item->next;
+        if (importq.head == NULL){
+            importq.tail = NULL;
+        }
+        importq.bytes -= item->len;
+        pthread_cond_broadcast(&importq.changed);
+    }
+    pthread_mutex_unlock(&importq.lock);
+    return item;
+}
+
+static void import_error(const char *path)
+{
+    fprintf(stderr, "put -r: %s: %s\n", path, strerror(errno));
+    pthread_mutex_lock(&importq.lock);
+    importq.errors++;
+    pthread_mutex_unlock(&importq.lock);
+}
+
+/**
+ * Read a local file in chunks and queue them. The first item is
+ * allocated before the file is read, and each further one before the
+ * previous is queued, so a chunk already holding the file can always
+ * be marked failed if the rest of the file cannot be read.
+ *
+ * @param local the local file
+ * @param path the file system path
+ * @param sb status of the local file
+ */
+static void import_file(const char *local, const char *path, const struct stat *sb)
+{
+    int fd = open(local, O_RDONLY);
+    struct import_item *item = (fd < 0) ? NULL : calloc(1, sizeof(*item));
+    if (item == NULL){
+        import_error(local);
+        if (fd >= 0){
+            close(fd);
+        }
+        return;
+    }
+    item->first = true;
+    off_t offset = 0;
+    for (;;){
+        strcpy(item->path, path);
+        item->mode = sb->st_mode;
+        item->size = sb->st_size;
+        item->offset = offset;
+        size_t want = (sb->st_size - offset < IMPORT_CHUNK_BYTES)
+            ? (size_t)(sb->st_size - offset) : IMPORT_CHUNK_BYTES;
+        item->data = malloc(want > 0 ? want : 1);
+        size_t done = 0;
+        ssize_t n = 0;
+        while (item->data != NULL && done < want
+               && (n = read(fd, item->data + done, want - done)) > 0){
+            done += n;
+        }
+        bool more = item->data != NULL && n >= 0 && done == want
+            && offset + (off_t)done < sb->st_size;
+        struct import_item *next = more ? calloc(1, sizeof(*next)) : NULL;
+        if (item->data == NULL || n < 0 || (more && next == NULL)){
+            import_error(local);
+            free(item->data);
+            if (item->first){
+                free(item);     // nothing of the file is queued
+            } else {
+                item->data = NULL;
+                item->len = 0;
+                item->failed = true;
+                import_push(item);
+            }
+            break;
+        }
+        item->len = done;
+        item->last = (next == NULL);    // file may have shrunk since stat
+        offset += done;
+        import_push(item);
+        if (next == NULL){
+            break;
+        }
+        item = next;
+    }
+    close(fd);
+}
+
+/**
+ * Queue every file and directory below a local directory, parents
+ * before their children.
+ *
+ * @param outside local directory
+ * @param inside corresponding file system directory
+ */
+static void import_walk(const char *outside, const char *inside)
+{
+    DIR *dir = opendir(outside);
+    if (dir == NULL){
+        import_error(outside);
+        return;
+    }
+    const char *sep = (inside[strlen(inside) - 1] == '/') ? "" : "/";
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL){
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0){
+            continue;
+        }
+        char local[MAX_PATH];
+        snprintf(local, sizeof(local), "%s/%s", outside, de->d_name);
+        struct stat sb;
+        if (lstat(local, &sb) != 0){
+            import_error(local);
+            continue;
+        }
+        if (!S_ISDIR(sb.st_mode) && !S_ISREG(sb.st_mode)){
+            continue;   // only files and directories are stored
+        }
+        char child[MAX_PATH];
+        snprintf(child, sizeof(child), "%s%s%s", inside, sep, de->d_name);
+        if (S_ISREG(sb.st_mode)){
+            if (sb.st_size > import_max_size){
+                errno = EFBIG;  // rejected before reading any of it
+                import_error(local);
+            } else {
+                import_file(local, child, &sb);
+            }
+            continue;
+        }
+        struct import_item *item = calloc(1, sizeof(*item));
+        if (item == NULL){
+            import_error(local);
+            continue;
+        }
+        strcpy(item->path, child);
+        item->mode = sb.st_mode;
+        import_push(item);
+        import_walk(local, child);
+    }
+    closedir(dir);
+}
+
+/**
+ * Reader thread for put -r.
+ *
+ * @param arg array of local directory and file system directory
+ */
+static void *import_reader(void *arg)
+{
+    char **dirs = arg;
+    import_walk(dirs[0], dirs[1]);
+    pthread_mutex_lock(&importq.lock);
+    importq.done = true;
+    pthread_cond_broadcast(&importq.changed);
+    pthread_mutex_unlock(&importq.lock);
+    return NULL;
+}
+
+/**
+ * Write one queued item into the file system. A file is created and
+ * opened at its first chunk, when all its blocks are reserved with one
+ * fallocate, and released after its last chunk or an error. A file
+ * whose rest could not be read is removed.
+ *
+ * @param item the item
+ * @param info open file info, kept from one chunk of a file to the next
+ * @return 0 if successful, or -error number
+ */
+static int import_write(struct import_item *item, struct fuse_file_info *info)
+{
+    int val = 0;
+    if (S_ISDIR(item->mode)){
+        val = fs_ops.mkdir(item->path, item->mode & 0777);
+        return (val == -EEXIST) ? 0 : val;
+    }
+    if (item->first){
+        if ((val = fs_ops.mknod(item->path, (item->mode & 0777) | S_IFREG, 0)) != 0){
+            return val;
+        }
+        memset(info, 0, sizeof(struct fuse_file_info));
+        if ((val = fs_ops.open(item->path, info)) != 0){
+            return val;
+        }
+        if (item->size > 0){
+            val = fs_ops.fallocate(item->path, FALLOC_FL_KEEP_SIZE, 0, item->size, info);
+            val = (val == -EOPNOTSUPP) ? 0 : val;
+        }
+    }
+    if (val == 0 && item->len > 0){
+        val = fs_ops.write(item->path, item->data, item->len, item->offset, info);
+        val = (val < 0) ? val : (val == item->len) ? 0 : -EFBIG;
+    }
+    if (val != 0 || item->last || item->failed){
+        fs_ops.release(item->path, info);
+    }
+    if (val == 0 && item->failed){
+        fs_ops.unlink(item->path);  // reader has reported the error
+    }
+    return val;
+}
+
+/**
+ * Recursively copy a local directory into the file system. A reader
+ * thread walks and reads the local tree while this thread writes
+ * into the image.
+ *
+ * @param argv argv[0] is "-r", argv[1] is local directory,
+ *   argv[2] is file system directory
+ */
+static int do_put_r(char *argv[])
+{
+    if (strcmp(argv[0], "-r") != 0){
+        return -EINVAL;
+    }
+    char inside[MAX_PATH];
+    full_path(argv[2], inside);
+    struct stat sb;
+    if (stat(argv[1], &sb) != 0){
+        return -errno;
+    }
+    if (!S_ISDIR(sb.st_mode)){
+        return -ENOTDIR;
+    }
+    int val = fs_ops.mkdir(inside, sb.st_mode & 0777);
+    if (val != 0 && val != -EEXIST){
+        return val;
+    }
+
+    importq.done = false;
+    importq.errors = 0;
+    char *dirs[] = {argv[1], inside};
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, import_reader, dirs) != 0){
+        return -EAGAIN;
+    }
+    int retval = 0, count = 0;
+    bool skipping = false;  // rest of a file that failed to write
+    struct fuse_file_info info;
+    struct import_item *item;
+    while ((item = import_pop()) != NULL){
+        bool file = !S_ISDIR(item->mode);
+        if (file && !item->first && skipping){
+            // already reported and released
+        } else if ((val = import_write(item, &info)) != 0){
+            printf("put -r: %s: %s\n", item->path, strerror(-val));
+            if (retval == 0){
+                retval = val;
+            }
+            skipping = file;
+        } else {
+            skipping = false;
+            if (!file || item->last){
+                count++;
+            }
+        }
+        free(item->data);
+        free(item);
+    }
+    pthread_join(reader, NULL);
+    printf("put -r: copied %d files and directories\n", count);
+    if (retval == 0 && importq.errors > 0){
+        retval = -EIO;
+    }
+    return retval;
+}
+
 /**
  * Copy a file from filesystem to localdir
  *
@@ -530,24 +1036,23 @@ static int do_get(char *argv[])
     int len, fd, offset = 0;
 
     if ((fd = open(outside, O_WRONLY|O_CREAT|O_TRUNC, 0777)) < 0){
-        return fd;
+        return -errno;
     }
     full_path(inside, path);
     struct fuse_file_info info;
     memset(&info, 0, sizeof(struct fuse_file_info));
     int val;
     if ((val = fs_ops.open(path, &info)) != 0){
+        close(fd);
         return val;
     }
-    while (1){
-        len = fs_ops.read(path, blkbuf, blksiz, offset, &info);
-        if (len >= 0){
-            len = write(fd, blkbuf, len);
-            if (len <= 0){
-                break;
-            }
-            offset += len;
+    // stop at end of file (read returns 0) or on any error
+    while ((len = fs_ops.read(path, blkbuf, blksiz, offset, &info)) > 0){
+        if (write_all(fd, blkbuf, len) != 0){
+            len = -errno;
+            break;
         }
+        offset += len;
     }
     close(fd);
     fs_ops.release(path, &info);
@@ -567,6 +1072,375 @@ static int do_get1(char *argv[])
     return do_get(args2);
 }
 
+/** Number of get -r worker threads */
+enum { EXPORT_WORKERS = 4 };
+
+/** Bytes requested per read by get -r */
+enum { EXPORT_CHUNK = 256 * 1024 };
+
+/** A file queued for a get -r worker */
+struct export_item {
+    struct export_item *next;
+    char inside[MAX_PATH];  /* file system path */
+    char outside[MAX_PATH]; /* local path */
+    mode_t mode;            /* file mode */
+};
+
+/** Queue from the get -r directory walk to the workers */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct export_item *head, *tail;
+    bool done;              /* walk has queued everything */
+    int errors;             /* files that could not be copied */
+    int count;              /* files copied */
+} exportq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void export_push(struct export_item *item)
+{
+    pthread_mutex_lock(&exportq.lock);
+    if (exportq.tail == NULL){
+        exportq.head = item;
+    } else {
+        exportq.tail->next = item;
+    }
+    exportq.tail = item;
+    pthread_cond_signal(&exportq.changed);
+    pthread_mutex_unlock(&exportq.lock);
+}
+
+static struct export_item *export_pop(void)
+{
+    pthread_mutex_lock(&exportq.lock);
+    while (exportq.head == NULL && !exportq.done){
+        pthread_cond_wait(&exportq.changed, &exportq.lock);
+    }
+    struct export_item *item = exportq.head;
+    if (item != NULL){
+        exportq.head = item->next;
+        if (exportq.head == NULL){
+            exportq.tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&exportq.lock);
+    return item;
+}
+
+/**
+ * Report a get -r failure on stderr, which stays clean
+ * when a tar archive is streamed to stdout.
+ */
+static void export_error(const char *path, int err)
+{
+    fprintf(stderr, "get -r: %s: %s\n", path, strerror(-err));
+    pthread_mutex_lock(&exportq.lock);
+    exportq.errors++;
+    pthread_mutex_unlock(&exportq.lock);
+}
+
+/**
+ * Copy a file system file to a local file descriptor in
+ * EXPORT_CHUNK sized reads.
+ *
+ * @param inside the file system path
+ * @param fd the local file
+ * @param buf buffer of EXPORT_CHUNK bytes
+ * @return number of bytes copied, or -error number
+ */
+static off_t export_copy(const char *inside, int fd, char *buf)
+{
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    int len = fs_ops.open(inside, &info);
+    if (len != 0){
+        return len;
+    }
+    off_t offset = 0;
+    while ((len = fs_ops.read(inside, buf, EXPORT_CHUNK, offset, &info)) > 0){
+        if (write_all(fd, buf, len) != 0){
+            len = -errno;
+            break;
+        }
+        offset += len;
+    }
+    fs_ops.release(inside, &info);
+    return (len >= 0) ? offset : len;
+}
+
+/**
+ * Worker thread for get -r; copies queued files until the
+ * walk is done and the queue is empty.
+ */
+static void *export_worker(void *arg)
+{
+    char *buf = malloc(EXPORT_CHUNK);
+    struct export_item *item;
+    while ((item = export_pop()) != NULL){
+        int fd = open(item->outside, O_WRONLY|O_CREAT|O_TRUNC, item->mode & 0777);
+        off_t val = (fd < 0) ? -errno : (buf == NULL) ? -ENOMEM : export_copy(item->inside, fd, buf);
+        if (fd >= 0){
+            close(fd);
+        }
+        if (val < 0){
+            export_error(item->inside, val);
+        } else {
+            pthread_mutex_lock(&exportq.lock);
+            exportq.count++;
+            pthread_mutex_unlock(&exportq.lock);
+        }
+        free(item);
+    }
+    free(buf);
+    return NULL;
+}
+
+/** Entries of one file system directory, collected by readdir */
+struct export_dir {
+    int count;
+    struct {
+        char name[FS_FILENAME_SIZE];
+        struct stat sb;
+    } entries[DIRENTS_PER_BLK];
+};
+
+static int export_filler(void *buf, const char *name, const struct stat *sb, off_t off)
+{
+    struct export_dir *dir = buf;
+    if (dir->count == DIRENTS_PER_BLK){
+        return 1;
+    }
+    snprintf(dir->entries[dir->count].name, FS_FILENAME_SIZE, "%s", name);
+    dir->entries[dir->count++].sb = *sb;
+    return 0;
+}
+
+/**
+ * Read the entries of a file system directory.
+ *
+ * @return the entries, or NULL with *err set
+ */
+static struct export_dir *export_readdir(const char *inside, int *err)
+{
+    struct export_dir *dir = calloc(1, sizeof(*dir));
+    if (dir == NULL){
+        *err = -ENOMEM;
+        return NULL;
+    }
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    if ((*err = fs_ops.opendir(inside, &info)) == 0){
+        *err = fs_ops.readdir(inside, dir, export_filler, 0, &info);
+        fs_ops.releasedir(inside, &info);
+    }
+    if (*err != 0){
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+static void join_path(char *buf, const char *dir, const char *name)
+{
+    const char *sep = (dir[0] != '\0' && dir[strlen(dir) - 1] != '/') ? "/" : "";
+    snprintf(buf, MAX_PATH, "%s%s%s", dir, sep, name);
+}
+
+/**
+ * Create local directories for a file system subtree and queue
+ * its files for the workers.
+ *
+ * @param inside file system directory
+ * @param outside corresponding local directory
+ */
+static void export_walk(const char *inside, const char *outside)
+{
+    int err;
+    struct export_dir *dir = export_readdir(inside, &err);
+    if (dir == NULL){
+        export_error(inside, err);
+        return;
+    }
+    for (int i = 0; i < dir->count; i++){
+        struct export_item *item = calloc(1, sizeof(*item));
+        if (item == NULL){
+            export_error(inside, -ENOMEM);
+            break;
+        }
+        join_path(item->inside, inside, dir->entries[i].name);
+        join_path(item->outside, outside, dir->entries[i].name);
+        item->mode = dir->entries[i].sb.st_mode;
+        if (S_ISDIR(item->mode)){
+            if (mkdir(item->outside, (item->mode & 0777) | 0700) != 0 && errno != EEXIST){
+                export_error(item->outside, -errno);
+            } else {
+                export_walk(item->inside, item->outside);
+            }
+            free(item);
+        } else {
+            export_push(item);
+        }
+    }
+    free(dir);
+}
+
+/**
+ * Write a ustar header block for a file system entry.
+ *
+ * @param fd the archive
+ * @param name path of the entry within the archive
+ * @param sb the entry's attributes
+ * @return 0 if successful, or -error number
+ */
+static int tar_header(int fd, const char *name, const struct stat *sb)
+{
+    char hdr[512];
+    memset(hdr, 0, sizeof(hdr));
+    size_t len = strlen(name);
+    if (len <= 100){
+        memcpy(hdr, name, len);
+    } else {
+        // split the path between prefix (155 bytes) and name (100 bytes)
+        const char *slash = strchr(name + len - 101, '/');
+        if (slash == NULL || slash - name > 155){
+            return -ENAMETOOLONG;
+        }
+        memcpy(hdr, slash + 1, len - (slash + 1 - name));
+        memcpy(hdr + 345, name, slash - name);
+    }
+    bool dir = S_ISDIR(sb->st_mode);
+    sprintf(hdr + 100, "%07o", (unsigned)(sb->st_mode & 07777));
+    sprintf(hdr + 108, "%07o", (unsigned)sb->st_uid);
+    sprintf(hdr + 116, "%07o", (unsigned)sb->st_gid);
+    sprintf(hdr + 124, "%011jo", (uintmax_t)(dir ? 0 : sb->st_size));
+    sprintf(hdr + 136, "%011jo", (uintmax_t)sb->st_mtime);
+    hdr[156] = dir ? '5' : '0';
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+    memset(hdr + 148, ' ', 8);  // checksum is computed with its field as spaces
+    unsigned sum = 0;
+    for (int i = 0; i < sizeof(hdr); i++){
+        sum += (unsigned char)hdr[i];
+    }
+    sprintf(hdr + 148, "%06o", sum);
+    hdr[155] = ' ';
+    return (write_all(fd, hdr, sizeof(hdr)) == 0) ? 0 : -errno;
+}
+
+/**
+ * Stream a file system subtree to a file descriptor as a tar archive.
+ *
+ * @param fd the archive
+ * @param inside file system directory
+ * @param prefix path of the directory within the archive
+ * @param buf buffer of EXPORT_CHUNK bytes
+ */
+static void export_tar(int fd, const char *inside, const char *prefix, char *buf)
+{
+    int err;
+    struct export_dir *dir = export_readdir(inside, &err);
+    if (dir == NULL){
+        export_error(inside, err);
+        return;
+    }
+    for (int i = 0; i < dir->count; i++){
+        char child[MAX_PATH], name[MAX_PATH];
+        join_path(child, inside, dir->entries[i].name);
+        join_path(name, prefix, dir->entries[i].name);
+        struct stat *sb = &dir->entries[i].sb;
+        if (S_ISDIR(sb->st_mode)){
+            strcat(name, "/");
+            if ((err = tar_header(fd, name, sb)) != 0){
+                export_error(child, err);
+                continue;
+            }
+            export_tar(fd, child, name, buf);
+            continue;
+        }
+        if ((err = tar_header(fd, name, sb)) != 0){
+            export_error(child, err);
+            continue;
+        }
+        off_t copied = export_copy(child, fd, buf);
+        if (copied < 0 || copied != sb->st_size){
+            // the header promised st_size bytes; without them the archive is unusable
+            export_error(child, copied < 0 ? copied : -EIO);
+            break;
+        }
+        static const char zeros[512];
+        if (write_all(fd, zeros, (512 - sb->st_size % 512) % 512) != 0){
+            export_error(child, -errno);
+            break;
+        }
+        exportq.count++;
+    }
+    free(dir);
+}
+
+/**
+ * Recursively copy a file system directory to a local directory,
+ * or stream it to stdout as a tar archive if the local name is "-".
+ * Files are copied by a pool of worker threads while this thread
+ * walks the tree.
+ *
+ * @param argv argv[0] is "-r", argv[1] is file system directory,
+ *   argv[2] is local directory or "-"
+ */
+static int do_get_r(char *argv[])
+{
+    if (strcmp(argv[0], "-r") != 0){
+        return -EINVAL;
+    }
+    char inside[MAX_PATH];
+    full_path(argv[1], inside);
+    struct stat sb;
+    int val = fs_ops.getattr(inside, &sb);
+    if (val != 0){
+        return val;
+    }
+    if (!S_ISDIR(sb.st_mode)){
+        return -ENOTDIR;
+    }
+    exportq.done = false;
+    exportq.errors = exportq.count = 0;
+
+    if (strcmp(argv[2], "-") == 0){
+        char *buf = malloc(EXPORT_CHUNK);
+        if (buf == NULL){
+            return -ENOMEM;
+        }
+        export_tar(STDOUT_FILENO, inside, "", buf);
+        static const char end[1024];  // two zero blocks end the archive
+        if (write_all(STDOUT_FILENO, end, sizeof(end)) != 0){
+            exportq.errors++;
+        }
+        free(buf);
+    } else {
+        if (mkdir(argv[2], (sb.st_mode & 0777) | 0700) != 0 && errno != EEXIST){
+            return -errno;
+        }
+        pthread_t workers[EXPORT_WORKERS];
+        int nworkers;
+        for (nworkers = 0; nworkers < EXPORT_WORKERS; nworkers++){
+            if (pthread_create(&workers[nworkers], NULL, export_worker, NULL) != 0){
+                break;
+            }
+        }
+        if (nworkers == 0){
+            return -EAGAIN;
+        }
+        export_walk(inside, argv[2]);
+        pthread_mutex_lock(&exportq.lock);
+        exportq.done = true;
+        pthread_cond_broadcast(&exportq.changed);
+        pthread_mutex_unlock(&exportq.lock);
+        for (int i = 0; i < nworkers; i++){
+            pthread_join(workers[i], NULL);
+        }
+    }
+    fprintf(stderr, "get -r: copied %d files\n", exportq.count);
+    return (exportq.errors == 0) ? 0 : -EIO;
+}
+
 /**
  * Retrieve and print a file.
  *
@@ -605,11 +1479,161 @@ static int do_statfs(char *argv[])
         printf("block size: %lu\n", st.f_bsize);
         printf("no. blocks: %ju\n", st.f_blocks);
         printf("avail blocks: %ju\n", st.f_bavail);
+        printf("no. inodes: %ju\n", st.f_files);
+        printf("free inodes: %ju\n", st.f_ffree);
         printf("max name length: %lu\n", st.f_namemax);
     }
     return retval;
 }
 
+static void print_frag(const char *label, const struct fsx492_frag *frag)
+{
+    printf("%s: %u files, %u blocks, %u extents, %u fragmented, used region ends at block %u\n",
+           label, frag->files, frag->blocks, frag->extents, frag->fragmented, frag->end);
+}
+
+/**
+ * Defragment the file system and report fragmentation before and after.
+ *
+ * @param flags FSX492_DEFRAG_* flags
+ */
+static int _defrag(uint32_t flags)
+{
+    struct fsx492_defrag req;
+    memset(&req, 0, sizeof(req));
+    req.flags = flags;
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    int retval = fs_ops.ioctl("/", FSX492_IOC_DEFRAG, NULL, &info, 0, &req);
+    if (retval == 0){
+        print_frag("before", &req.before);
+        print_frag("after", &req.after);
+    }
+    return retval;
+}
+
+/**
+ * Move each fragmented file into a contiguous run of free blocks
+ *
+ * @argv unused
+ */
+static int do_defrag(char *argv[])
+{
+    return _defrag(0);
+}
+
+/**
+ * Rewrite all files in directory order at the start of the
+ * data region, so the image can be truncated after the last
+ * used block. The image must not be in use elsewhere.
+ *
+ * @param argv argv[0] is "-c"
+ */
+static int do_defrag_c(char *argv[])
+{
+    if (strcmp(argv[0], "-c") != 0){
+        return -EINVAL;
+    }
+    return _defrag(FSX492_DEFRAG_COMPACT);
+}
+
+/**
+ * Merge file blocks that have the same contents and print how many
+ *
+ * @argv unused
+ */
+static int do_dedup(char *argv[])
+{
+    struct fsx492_dedup req;
+    memset(&req, 0, sizeof(req));
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    int retval = fs_ops.ioctl("/", FSX492_IOC_DEDUP, NULL, &info, 0, &req);
+    if (retval == 0){
+        printf("%u blocks scanned, %u merged\n", req.scanned, req.merged);
+    }
+    return retval;
+}
+
+/**
+ * Read every block of the file system, checking checksums if it has
+ * them, and print how many were bad
+ *
+ * @argv unused
+ */
+static int do_scrub(char *argv[])
+{
+    struct fsx492_scrub req;
+    memset(&req, 0, sizeof(req));
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    int retval = fs_ops.ioctl("/", FSX492_IOC_SCRUB, NULL, &info, 0, &req);
+    if (retval == 0){
+        printf("%u blocks read, %u bad", req.blocks, req.bad);
+        if (req.bad > 0){
+            printf(", the first at block %u", req.first_bad);
+        }
+        printf("\n");
+    }
+    return retval;
+}
+
+/**
+ * Grow or shrink the file system and its image, and print the
+ * number of blocks it ends up with
+ *
+ * @param argv argv[0] is the number of blocks wanted
+ */
+static int do_resize(char *argv[])
+{
+    struct fsx492_resize req;
+    memset(&req, 0, sizeof(req));
+    req.blocks = strtoul(argv[0], NULL, 10);
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    int retval = fs_ops.ioctl("/", FSX492_IOC_RESIZE, NULL, &info, 0, &req);
+    if (retval == 0){
+        printf("%u blocks\n", req.blocks);
+    }
+    return retval;
+}
+
+/**
+ * Take a snapshot of the file system and print its id
+ *
+ * @argv unused
+ */
+static int do_snapshot(char *argv[])
+{
+    struct fsx492_snapshot req;
+    memset(&req, 0, sizeof(req));
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    int retval = fs_ops.ioctl("/", FSX492_IOC_SNAPSHOT, NULL, &info, 0, &req);
+    if (retval == 0){
+        printf("snapshot %u\n", req.id);
+    }
+    return retval;
+}
+
+/**
+ * Delete a snapshot
+ *
+ * @param argv argv[0] is "-d", argv[1] is the snapshot's id
+ */
+static int do_snapshot_d(char *argv[])
+{
+    if (strcmp(argv[0], "-d") != 0){
+        return -EINVAL;
+    }
+    struct fsx492_snapshot req;
+    memset(&req, 0, sizeof(req));
+    req.id = strtoul(argv[1], NULL, 10);
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    return fs_ops.ioctl("/", FSX492_IOC_SNAPSHOT_DELETE, NULL, &info, 0, &req);
+}
+
 /**
  * Print files statistics
  *
@@ -635,13 +1659,23 @@ static int do_stat(char *argv[])
  *
  * @param size read/write block size
  */
-static void _blksiz(int size)
+static void set_blksiz(int size)
 {
     blksiz = size; // record new block size
     if (blkbuf){ // free old block buffer
         free(blkbuf);
     }
     blkbuf = malloc(blksiz); // create new block buffer
+}
+
+/**
+ * Set read/write block size and report it
+ *
+ * @param size read/write block size
+ */
+static void _blksiz(int size)
+{
+    set_blksiz(size);
     printf("read/write block size: %d\n", blksiz);
 }
 
@@ -673,11 +1707,10 @@ static int do_truncate(char *argv[])
  */
 static int do_utime(char *argv[])
 {
-    struct utimbuf ut;
+    static const struct timespec tv[2] = {{ .tv_nsec = UTIME_NOW }, { .tv_nsec = UTIME_NOW }};
     char path[MAX_PATH];
     full_path(argv[0], path);
-    ut.actime = ut.modtime = time(NULL);	// set access time to now
-    return fs_ops.utime(path, &ut);
+    return fs_ops.utimens(path, tv);	// set access and modification time to now
 }
 
 /**
@@ -694,9 +1727,7 @@ static int do_touch(char *argv[])
     int status = fs_ops.mknod(path, 0777 | S_IFREG, 0);
     if (status == -EEXIST){
         // if exists, modify its access/mod time to now
-        struct utimbuf ut;
-        ut.actime = ut.modtime = time(NULL);
-        status = fs_ops.utime(path, &ut);
+        status = do_utime(argv);
     }
     return status;
 }
@@ -717,15 +1748,29 @@ static struct {
         {"ls-l", 1, do_lsdashl1, "ls-l <file> - display detailed file info"},
         {"chmod", 2, do_chmod, "chmod <mode> <file> - change permissions"},
         {"rename", 2, do_rename, "rename <oldname> <newname> - rename file"},
+        {"ln", 2, do_ln, "ln <file> <newname> - make a hard link"},
+        {"ln", 3, do_ln_s, "ln -s <target> <name> - make a symbolic link"},
+        {"clone", 2, do_clone, "clone <file> <newname> - copy a file, sharing blocks until written"},
+        {"compress", 1, do_compress, "compress <file> - compress data written to a file, or to new files in a directory"},
+        {"readlink", 1, do_readlink, "readlink <name> - print the target of a symbolic link"},
         {"mkdir", 1, do_mkdir, "mkdir <dir> - create directory"},
         {"rmdir", 1, do_rmdir, "rmdir <dir> - remove directory"},
         {"rm", 1, do_rm, "rm <file> - remove file"},
         {"put", 2, do_put, "put <outside> <inside> - copy a file from localdir into file system"},
         {"put", 1, do_put1, "put <name> - ditto, but keep the same name"},
+        {"put", 3, do_put_r, "put -r <outside> <inside> - recursively copy a local directory into file system"},
         {"get", 2, do_get, "get <inside> <outside> - retrieve a file from file system to local directory"},
         {"get", 1, do_get1, "get <name> - ditto, but keep the same name"},
+        {"get", 3, do_get_r, "get -r <inside> <outside> - recursively copy a directory to local directory, or to stdout as tar if <outside> is -"},
         {"show", 1, do_show, "show <file> - retrieve and print a file"},
         {"statfs", 0, do_statfs, "statfs - print file system info"},
+        {"defrag", 0, do_defrag, "defrag - make each fragmented file contiguous"},
+        {"defrag", 1, do_defrag_c, "defrag -c - compact all files in directory order so the image can be truncated"},
+        {"scrub", 0, do_scrub, "scrub - read every block, checking its checksum if the image has them"},
+        {"resize", 1, do_resize, "resize <blocks> - grow or shrink the file system and its image to a number of blocks"},
+        {"dedup", 0, do_dedup, "dedup - share file blocks that have the same contents"},
+        {"snapshot", 0, do_snapshot, "snapshot - take a snapshot of the file system, to use with -snapshot <id>"},
+        {"snapshot", 2, do_snapshot_d, "snapshot -d <id> - delete a snapshot"},
         {"blksiz", 1, do_blksiz, "blksiz - set read/write block size"},
         {"truncate", 1, do_truncate, "truncate <file> - truncate to zero length"},
         {"utime", 1, do_utime, "utime <file> - set modified time to current time"},
@@ -735,21 +1780,28 @@ static struct {
 };
 
 /**
- * Command loop for interactive command interpreter.
+ * Command loop for interactive command interpreter. When commands
+ * come from a batch file, the transcript goes to stderr so stdout
+ * carries only command output (e.g. get -r <dir> - archives).
+ *
+ * @param in stream commands are read from
+ * @return number of commands that failed
  */
-static int cmdloop(void)
+static int cmdloop(FILE *in)
 {
     char line[MAX_PATH];
+    int failures = 0;
+    FILE *out = (in == stdin) ? stdout : stderr;
 
     update_cwd(NULL, 0);
 
     while (true){
-        printf("cmd> "); fflush(stdout);
-        if (fgets(line, sizeof(line), stdin) == NULL)
+        fprintf(out, "cmd> "); fflush(out);
+        if (fgets(line, sizeof(line), in) == NULL)
             break;
 
-        if (!isatty(0)){
-            printf("%s", line);
+        if (!isatty(fileno(in))){
+            fprintf(out, "%s", line);
         }
 
         if (line[0] == '#')	{/* comment lines */
@@ -788,7 +1840,7 @@ static int cmdloop(void)
         // if command not recognized or incorrect arg count
         if (cmds[i].name == NULL){
             if (nargs > 0){
-                printf("bad command: %s\n", args[0]);
+                fprintf(out, "bad command: %s\n", args[0]);
             }
             continue;
         }
@@ -796,10 +1848,11 @@ static int cmdloop(void)
         // process command
         int err = cmds[i].f(&args[1]);
         if (err != 0){
-            printf("error: %s\n", strerror(-err));
+            fprintf(out, "error: %s\n", strerror(-err));
+            failures++;
         }
     }
-    return 0;
+    return failures;
 }
 
 
@@ -851,12 +1904,66 @@ int main(int argc, char **argv){
         exit(1);
     }
     homework_part = 2; // PJG
+    fs_options.atime = _data.atime;
+    fs_options.attr_timeout = _data.cache_ttl;
+
+    if (_data.mkfs_groups){
+        int err = fs_mkfs(disk, atoi(_data.mkfs_groups),
+                          _data.inode_size ? _data.inode_size : FS_INODE_V2_SIZE, _data.csum);
+        if (err != 0){
+            fprintf(stderr, "cannot format image file '%s': %s\n", file, strerror(-err));
+            exit(1);
+        }
+        if (!_data.cmd_mode && !_data.batch_file){
+            return 0;
+        }
+    }
+    if (_data.snapshot){
+        // the image is read unchecked: a mount of the live file system may go on
+        // writing blocks and their checksums, which checksums loaded here would miss
+        if ((disk = snapshot_view_create(disk, atoi(_data.snapshot))) == NULL){
+            fprintf(stderr, "cannot use snapshot %s of image file '%s': %s\n", _data.snapshot, file, strerror(errno));
+            exit(1);
+        }
+        fs_options.read_only = true;
+        fuse_opt_insert_arg(&args, 1, "-oro");
+    } else if ((disk = csum_create(disk)) == NULL){
+        fprintf(stderr, "cannot check image file '%s': %s\n", file, strerror(errno));
+        exit(1);
+    }
+    if (_data.iosched && (disk = iosched_create(disk)) == NULL){
+        fprintf(stderr, "cannot schedule image file '%s': out of memory\n", file);
+        exit(1);
+    }
+
+    if (_data.batch_file){
+        FILE *in = fopen(_data.batch_file, "r");
+        if (in == NULL){
+            fprintf(stderr, "cannot open batch file '%s': %s\n", _data.batch_file, strerror(errno));
+            exit(1);
+        }
+        fs_ops.init(NULL);
+        set_blksiz(FS_BLOCK_SIZE);
+        int failures = cmdloop(in);
+        fclose(in);
+        return (failures == 0) ? 0 : 1;
+    }
 
     if (_data.cmd_mode){
         fs_ops.init(NULL);
         _blksiz(FS_BLOCK_SIZE);
-        cmdloop();
+        cmdloop(stdin);
         return 0;
     }
+    double ttl = (_data.ttl > 0) ? _data.ttl : KERNEL_TTL;
+    if (_data.lowlevel){
+        // timeouts go out with each reply, and open asks to keep the page cache
+        fs_options.kernel_timeout = ttl;
+        return fs_ll_main(args.argc, args.argv);
+    }
+    // cache names, attributes and file pages in the kernel; later -o options override these
+    char kernel_opts[128];
+    snprintf(kernel_opts, sizeof(kernel_opts), "-ouse_ino,kernel_cache,entry_timeout=%g,attr_timeout=%g", ttl, ttl);
+    fuse_opt_insert_arg(&args, 1, kernel_opts);
     return fuse_main(args.argc, args.argv, &fs_ops, NULL);
 }
@@ -0,0 +1,152 @@
+/*
+ * file:        mkfs.c
+ * description: creation of an empty FSX492 file system
+ *
+ * The layout matches what fs.c expects (see struct fs_super): in a
+ * grouped image every group has one block of block bitmap, one block
+ * of inode bitmap and an inode table; group 0 starts after the
+ * superblock. With checksums, the region holding them takes the last
+ * blocks of the device, after the file system.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fsx492.h"
+#include "blkdev.h"
+#include "mkfs.h"
+#include "csum.h"
+
+enum {
+	BLOCKS_PER_INODE = 16 /* one inode for every this many blocks, as in the test image */
+};
+
+static uint32_t round_up(uint32_t n, uint32_t unit){
+	return (n + unit - 1) / unit * unit;
+}
+
+/* number of inodes for a group of blocks, in whole inode table blocks */
+static uint32_t inodes_for(uint32_t blocks, uint32_t per_blk){
+	uint32_t inodes = round_up(blocks / BLOCKS_PER_INODE, per_blk);
+	return (inodes == 0) ? per_blk : inodes;
+}
+
+static void set_bit(char *bitmap, uint32_t n){
+	bitmap[n / 8] |= 1 << (n % 8);
+}
+
+int fs_mkfs(struct blkdev *dev, int groups, int inode_size, bool checksums){
+	if (inode_size != FS_INODE_V1_SIZE && inode_size != FS_INODE_V2_SIZE && inode_size != FS_INODE_MAX_SIZE){
+		return -EINVAL;
+	}
+	uint32_t per_blk = FS_BLOCK_SIZE / inode_size;
+	struct fs_super sb;
+	memset(&sb, 0, sizeof(sb));
+	sb.magic = FS_MAGIC;
+	sb.num_blocks = dev->ops->num_blocks(dev);
+	if (checksums){
+		/* the fewest region blocks with a checksum for each block left */
+		sb.features |= FS_FEAT_CSUM;
+		sb.csum_blocks = (sb.num_blocks + PTRS_PER_BLK) / (PTRS_PER_BLK + 1);
+		sb.num_blocks -= sb.csum_blocks;
+	}
+	sb.root_inode = 1;
+	if (inode_size != FS_INODE_V1_SIZE){
+		sb.features |= FS_FEAT_BIG_INODES;
+		sb.inode_size = inode_size;
+	}
+	uint32_t n_groups, group_blocks, group_inodes;
+	if (groups <= 0){
+		group_blocks = sb.num_blocks;
+		group_inodes = inodes_for(group_blocks, per_blk);
+		sb.inode_map_sz = (group_inodes + BITS_PER_BLK - 1) / BITS_PER_BLK;
+		sb.block_map_sz = (sb.num_blocks + BITS_PER_BLK - 1) / BITS_PER_BLK;
+		n_groups = 1;
+	} else {
+		sb.features |= FS_FEAT_GROUPS;
+		group_blocks = round_up((sb.num_blocks + groups - 1) / groups, 8);
+		group_inodes = inodes_for(group_blocks, per_blk);
+		sb.group_blocks = group_blocks;
+		sb.group_inodes = group_inodes;
+		sb.inode_map_sz = sb.block_map_sz = 1;
+		n_groups = (sb.num_blocks + group_blocks - 1) / group_blocks;
+		if (group_blocks > BITS_PER_BLK || group_inodes > BITS_PER_BLK){
+			return -EINVAL;
+		}
+	}
+	sb.inode_region_sz = group_inodes / per_blk;
+	uint32_t meta = sb.inode_map_sz + sb.block_map_sz + sb.inode_region_sz;
+	/* every group needs a data block; group 0 also holds the superblock and root directory */
+	uint32_t last_blocks = sb.num_blocks - (n_groups - 1) * group_blocks;
+	if (last_blocks < meta + 1 + (n_groups == 1) || group_blocks < meta + 2){
+		return -EINVAL;
+	}
+
+	char *block_map = calloc(sb.block_map_sz, FS_BLOCK_SIZE);
+	char *inode_map = calloc(sb.inode_map_sz, FS_BLOCK_SIZE);
+	char *zeros = calloc(sb.inode_region_sz, FS_BLOCK_SIZE);
+	int retval = 0;
+	if (block_map == NULL || inode_map == NULL || zeros == NULL){
+		retval = -ENOMEM;
+	}
+	uint32_t root_block = 0;
+	for (uint32_t g = 0; g < n_groups && retval == 0; g++){
+		uint32_t start = g * group_blocks;
+		uint32_t first = (g == 0) ? 1 : start; /* first metadata block */
+		memset(block_map, 0, sb.block_map_sz * FS_BLOCK_SIZE);
+		memset(inode_map, 0, sb.inode_map_sz * FS_BLOCK_SIZE);
+		for (uint32_t b = start; b < first + meta; b++){
+			set_bit(block_map, b - start);
+		}
+		if (g == 0){
+			root_block = first + meta;
+			set_bit(block_map, root_block);
+			set_bit(inode_map, 0); /* inode 0 is never used */
+			set_bit(inode_map, sb.root_inode);
+		}
+		if (dev->ops->write(dev, first, sb.inode_map_sz, inode_map) != SUCCESS
+				|| dev->ops->write(dev, first + sb.inode_map_sz, sb.block_map_sz, block_map) != SUCCESS
+				|| dev->ops->write(dev, first + sb.inode_map_sz + sb.block_map_sz, sb.inode_region_sz, zeros) != SUCCESS){
+			retval = -EIO;
+		}
+	}
+	if (retval == 0){
+		char inodes[FS_BLOCK_SIZE];
+		memset(inodes, 0, sizeof(inodes));
+		struct fs_inode root = {
+			.uid = getuid(),
+			.gid = getgid(),
+			.mode = S_IFDIR | 0777,
+			.size = FS_BLOCK_SIZE,
+		};
+		struct fs_inode_ext root_ext;
+		memset(&root_ext, 0, sizeof(root_ext));
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		root.ctime = root.mtime = root_ext.atime = now.tv_sec;
+		root_ext.ctime_ns = root_ext.mtime_ns = root_ext.atime_ns = now.tv_nsec;
+		root.direct[0] = root_block;
+		memcpy(inodes + sb.root_inode * inode_size, &root, sizeof(root));
+		if (inode_size >= FS_INODE_V2_SIZE){
+			memcpy(inodes + sb.root_inode * inode_size + sizeof(root), &root_ext, sizeof(root_ext));
+		}
+		if (dev->ops->write(dev, root_block, 1, zeros) != SUCCESS
+				|| dev->ops->write(dev, 1 + sb.inode_map_sz + sb.block_map_sz, 1, inodes) != SUCCESS
+				|| dev->ops->write(dev, 0, 1, &sb) != SUCCESS){
+			retval = -EIO;
+		}
+	}
+	if (retval == 0 && checksums && csum_format(dev, sb.num_blocks) != SUCCESS){
+		retval = -EIO;
+	}
+	free(block_map);
+	free(inode_map);
+	free(zeros);
+	return retval;
+}
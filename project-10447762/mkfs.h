@@ -0,0 +1,30 @@
+/*
+ * file:        mkfs.h
+ * description: creation of an empty FSX492 file system
+ */
+
+#ifndef MKFS_H_
+#define MKFS_H_
+
+#include <stdbool.h>
+
+#include "blkdev.h"
+
+/*
+ * Write an empty file system holding only the root directory to a
+ * block device, using all of its blocks.
+ *
+ * @param dev: the block device
+ * @param groups: number of block groups, or 0 for the original
+ *   layout with one global bitmap and inode region
+ * @param inode_size: bytes per inode, FS_INODE_V1_SIZE for the
+ *   original format, FS_INODE_V2_SIZE or FS_INODE_MAX_SIZE
+ * @param checksums: keep a checksum of every block (FS_FEAT_CSUM),
+ *   in a region at the end of the device
+ * @return: 0 if successful, or -error number
+ *	-EINVAL - too many groups, groups too large for one bitmap block,
+ *	  or unsupported inode size
+*/
+extern int fs_mkfs(struct blkdev *dev, int groups, int inode_size, bool checksums);
+
+#endif /* MKFS_H_ */
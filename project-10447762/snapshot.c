@@ -0,0 +1,220 @@
+/*
+ * file:        snapshot.c
+ * description: read-only view of a snapshot of an FSX492 image
+ *
+ * A snapshot's map (see struct fs_super) gives for each block the copy
+ * the file system made before first writing the block after the
+ * snapshot was taken, or 0 if it has not written it since. Reads go to
+ * a block's copy if it has one and to the block itself if not; writes
+ * fail.
+ *
+ * The file system may go on writing the image while a snapshot is
+ * read, since it records each copy in the map before overwriting the
+ * block. A block read in place is the snapshot's as long as the map
+ * still has no copy for it after the read; if it has one by then, the
+ * block is read again from the copy. The map's own blocks are located
+ * once, as the file system does not move them while the snapshot
+ * exists.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fsx492.h"
+#include "blkdev.h"
+#include "snapshot.h"
+
+/** definition of snapshot block device */
+struct snapshot_dev {
+	struct blkdev *lower; /* device holding the image */
+	uint32_t *map_blocks; /* block holding each block of the map */
+	int num_blocks; /* blocks in the image */
+};
+
+static uint32_t file_block(struct blkdev *lower, const struct fs_inode *inode, uint32_t logical);
+
+/* read an inode, found where fs.c lays out inode tables or, if it is dynamic, through the inode map */
+static int read_inode(struct blkdev *lower, const struct fs_super *sb, uint32_t inode_num, struct fs_inode *inode)
+{
+	uint32_t inode_size = (sb->inode_size == 0) ? FS_INODE_V1_SIZE : sb->inode_size;
+	uint32_t per_blk = FS_BLOCK_SIZE / inode_size;
+	uint32_t group = 0, first_inode = 0, table_block;
+	char block[FS_BLOCK_SIZE];
+	if ((sb->features & FS_FEAT_DYN_INODES) && inode_num >= sb->dyn_inode_base){
+		struct fs_imap_entry *entries = (struct fs_imap_entry *)block;
+		uint32_t i = (inode_num - sb->dyn_inode_base) / per_blk;
+		uint32_t map_block = file_block(lower, &sb->inode_map, i / IMAP_ENTRIES_PER_BLK);
+		if (map_block == 0 || lower->ops->read(lower, map_block, 1, block) != SUCCESS){
+			return E_UNAVAIL;
+		}
+		first_inode = sb->dyn_inode_base;
+		table_block = entries[i % IMAP_ENTRIES_PER_BLK].block;
+	} else {
+		if (sb->features & FS_FEAT_GROUPS){
+			group = inode_num / sb->group_inodes;
+			first_inode = group * sb->group_inodes;
+		}
+		uint32_t inode_map = (group == 0) ? 1 : group * sb->group_blocks;
+		table_block = inode_map + sb->inode_map_sz + sb->block_map_sz + (inode_num - first_inode) / per_blk;
+	}
+	if (lower->ops->read(lower, table_block, 1, block) != SUCCESS){
+		return E_UNAVAIL;
+	}
+	memcpy(inode, block + (inode_num - first_inode) % per_blk * inode_size, sizeof(*inode));
+	return SUCCESS;
+}
+
+/* the block holding a logical block of a file, or 0 if none or it cannot be read */
+static uint32_t file_block(struct blkdev *lower, const struct fs_inode *inode, uint32_t logical)
+{
+	if (logical < N_DIRECT){
+		return inode->direct[logical];
+	}
+	logical -= N_DIRECT;
+	uint32_t table[PTRS_PER_BLK];
+	uint32_t indir = inode->indir_1;
+	if (logical >= PTRS_PER_BLK){
+		logical -= PTRS_PER_BLK;
+		if (inode->indir_2 == 0 || lower->ops->read(lower, inode->indir_2, 1, table) != SUCCESS){
+			return 0;
+		}
+		indir = table[logical / PTRS_PER_BLK];
+		logical %= PTRS_PER_BLK;
+	}
+	if (indir == 0 || lower->ops->read(lower, indir, 1, table) != SUCCESS){
+		return 0;
+	}
+	return table[logical];
+}
+
+/* read the map's entries for count blocks from first */
+static int read_entries(struct snapshot_dev *sd, int first, int count, uint32_t *entries)
+{
+	uint32_t block[PTRS_PER_BLK];
+	int loaded = -1;
+	for (int i = 0; i < count; i++){
+		int k = (first + i) / PTRS_PER_BLK;
+		if (k != loaded){
+			if (sd->lower->ops->read(sd->lower, sd->map_blocks[k], 1, block) != SUCCESS){
+				return E_UNAVAIL;
+			}
+			loaded = k;
+		}
+		entries[i] = block[(first + i) % PTRS_PER_BLK];
+	}
+	return SUCCESS;
+}
+
+static int snapshot_num_blocks(struct blkdev *dev)
+{
+	struct snapshot_dev *sd = dev->private;
+	return sd->num_blocks;
+}
+
+/* read blocks through the map, in one request for each run that is consecutive on the image */
+static int snapshot_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct snapshot_dev *sd = dev->private;
+	if (first_blk < 0 || first_blk + nblks > sd->num_blocks){
+		return E_BADADDR;
+	}
+	uint32_t *before = malloc(nblks * sizeof(uint32_t));
+	uint32_t *after = malloc(nblks * sizeof(uint32_t));
+	int retval = (before == NULL || after == NULL) ? E_UNAVAIL : read_entries(sd, first_blk, nblks, before);
+	for (int i = 0; i < nblks && retval == SUCCESS; ){
+		uint32_t start = (before[i] != 0) ? before[i] : (uint32_t)(first_blk + i);
+		int run = 1;
+		while (i + run < nblks && ((before[i + run] != 0) ? before[i + run] : (uint32_t)(first_blk + i + run)) == start + run){
+			run++;
+		}
+		retval = sd->lower->ops->read(sd->lower, start, run, (char *)buf + (size_t)i * BLOCK_SIZE);
+		i += run;
+	}
+	if (retval == SUCCESS){
+		retval = read_entries(sd, first_blk, nblks, after);
+	}
+	for (int i = 0; i < nblks && retval == SUCCESS; i++){
+		if (before[i] == 0 && after[i] != 0){
+			retval = sd->lower->ops->read(sd->lower, after[i], 1, (char *)buf + (size_t)i * BLOCK_SIZE);
+		}
+	}
+	free(before);
+	free(after);
+	return retval;
+}
+
+static int snapshot_write(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	return E_UNAVAIL;
+}
+
+/* nothing is ever written */
+static int snapshot_flush(struct blkdev *dev, int first_blk, int nblks)
+{
+	return SUCCESS;
+}
+
+static void snapshot_close(struct blkdev *dev)
+{
+	struct snapshot_dev *sd = dev->private;
+	sd->lower->ops->close(sd->lower);
+	free(sd->map_blocks);
+	free(sd);
+	free(dev);
+}
+
+/** Operations on this block device; there is no fd, as reads do not all come from the image's own place */
+static struct blkdev_ops snapshot_ops = {
+    .num_blocks = snapshot_num_blocks,
+    .read = snapshot_read,
+    .write = snapshot_write,
+    .flush = snapshot_flush,
+    .close = snapshot_close
+};
+
+struct blkdev *snapshot_view_create(struct blkdev *lower, int id)
+{
+    struct fs_super sb;
+    struct fs_inode map;
+    if (lower->ops->read(lower, 0, 1, &sb) != SUCCESS){
+        errno = EIO;
+        return NULL;
+    }
+    if (sb.magic != FS_MAGIC || !(sb.features & FS_FEAT_SNAPSHOTS)
+            || id < 0 || id >= FS_MAX_SNAPSHOTS || sb.snapshots[id] == 0){
+        errno = ENOENT;
+        return NULL;
+    }
+    if (read_inode(lower, &sb, sb.snapshots[id], &map) != SUCCESS){
+        errno = EIO;
+        return NULL;
+    }
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct snapshot_dev *sd = malloc(sizeof(*sd));
+    int map_blocks = (sb.num_blocks * sizeof(uint32_t) + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    uint32_t *blocks = calloc(map_blocks, sizeof(uint32_t));
+    if (dev == NULL || sd == NULL || blocks == NULL){
+        free(dev);
+        free(sd);
+        free(blocks);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (int k = 0; k < map_blocks; k++){
+        if ((blocks[k] = file_block(lower, &map, k)) == 0){
+            free(dev);
+            free(sd);
+            free(blocks);
+            errno = EIO;
+            return NULL;
+        }
+    }
+    sd->lower = lower;
+    sd->map_blocks = blocks;
+    sd->num_blocks = sb.num_blocks;
+    dev->private = sd;
+    dev->ops = &snapshot_ops;
+    return dev;
+}
@@ -0,0 +1,24 @@
+/*
+ * file:        snapshot.h
+ * description: creation function for the snapshot block device
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include "blkdev.h"
+
+/*
+ * Create a read-only block device presenting the FSX492 image on
+ * another device as it was when one of its snapshots was taken.
+ *
+ * @param lower: the device holding the image, not a checksumming device
+ *   (see csum_create) if the file system may be mounted and written
+ *   meanwhile, as its checksums would go stale
+ * @param id: the snapshot's slot
+ * @return: the block device, or NULL with errno set to ENOENT if there
+ *   is no such snapshot, or to EIO or ENOMEM
+*/
+extern struct blkdev *snapshot_view_create(struct blkdev *lower, int id);
+
+#endif /* SNAPSHOT_H_ */
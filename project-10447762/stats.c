@@ -0,0 +1,213 @@
+/*
+ * file:        stats.c
+ * description: per-operation latency histograms for FSX492 file system
+ *
+ * Each thread records into its own set of histograms, so recording
+ * needs no locks or atomic read-modify-write instructions. Buckets are
+ * log-linear in the style of HDR histograms: values below 2^SUB_BITS
+ * nanoseconds get one bucket each, and every power of two above that
+ * is divided into 2^SUB_BITS equal buckets, giving a relative error
+ * of at most 1/2^SUB_BITS.
+ *
+ * A thread's histograms outlive it: when it exits they are handed to
+ * the next thread to start recording, which adds to them. The counts
+ * are kept, and there are never more sets than threads recording at
+ * once.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+enum {
+	SUB_BITS = 4, /* linear sub-buckets per power of two, as bits */
+	SUB_COUNT = 1 << SUB_BITS,
+	MAX_EXP = 40, /* values >= 2^MAX_EXP ns land in the last bucket */
+	N_BUCKETS = (MAX_EXP - SUB_BITS + 1) * SUB_COUNT
+};
+
+/** names of operations, indexed by enum stats_op */
+static const char *op_names[STATS_NOPS] = {
+	"getattr", "opendir", "readdir", "releasedir",
+	"mknod", "mkdir", "unlink", "rmdir", "rename",
+	"chmod", "open", "read", "write", "release",
+	"statfs", "utime", "truncate", "fallocate", "ioctl",
+	"utimens", "lookup", "forget", "setattr", "create",
+	"fsync", "fsyncdir", "link", "symlink", "readlink",
+};
+
+/** latency histogram for one operation */
+struct histogram {
+	uint64_t count; /* number of samples */
+	uint64_t sum; /* total of samples in ns */
+	uint64_t max; /* largest sample in ns */
+	uint64_t buckets[N_BUCKETS];
+};
+
+/** histograms owned by one thread */
+struct thread_stats {
+	struct thread_stats *next; /* next thread in all_stats list */
+	int in_use; /* nonzero while a thread owns the histograms */
+	struct histogram ops[STATS_NOPS];
+};
+
+/** list of all threads' histograms, pushed to without locking */
+static struct thread_stats *all_stats;
+
+/** the calling thread's histograms */
+static __thread struct thread_stats *my_stats;
+
+/** key whose destructor gives up an exiting thread's histograms */
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t value)
+{
+	if (value < SUB_COUNT){
+		return value;
+	}
+	int exp = 63 - __builtin_clzll(value);
+	if (exp >= MAX_EXP){
+		return N_BUCKETS - 1;
+	}
+	return (exp - SUB_BITS + 1) * SUB_COUNT + ((value >> (exp - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* largest value that maps to bucket index */
+static uint64_t bucket_value(int index)
+{
+	if (index < SUB_COUNT){
+		return index;
+	}
+	int exp = index / SUB_COUNT + SUB_BITS - 1;
+	uint64_t sub = index % SUB_COUNT;
+	return ((SUB_COUNT + sub + 1) << (exp - SUB_BITS)) - 1;
+}
+
+/* single writer per histogram, so a relaxed load and store is enough */
+static inline void add_relaxed(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/* give up the histograms of a thread that is exiting, for another to take */
+static void thread_stats_release(void *arg)
+{
+	struct thread_stats *ts = arg;
+	__atomic_store_n(&ts->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void stats_key_create(void)
+{
+	pthread_key_create(&stats_key, thread_stats_release);
+}
+
+/* take histograms an exited thread gave up, or add new ones to the list */
+static struct thread_stats *thread_stats_create(void)
+{
+	pthread_once(&stats_key_once, stats_key_create);
+	struct thread_stats *ts;
+	for (ts = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next){
+		int free_slot = 0;
+		if (__atomic_compare_exchange_n(&ts->in_use, &free_slot, 1, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+			break;
+		}
+	}
+	if (ts == NULL){
+		if ((ts = calloc(1, sizeof(*ts))) == NULL){
+			return NULL;
+		}
+		ts->in_use = 1;
+		ts->next = __atomic_load_n(&all_stats, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&all_stats, &ts->next, ts, false,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+			;
+		}
+	}
+	pthread_setspecific(stats_key, ts);
+	return ts;
+}
+
+void stats_record(enum stats_op op, uint64_t start)
+{
+	uint64_t elapsed = stats_now() - start;
+	if (my_stats == NULL && (my_stats = thread_stats_create()) == NULL){
+		return;
+	}
+	struct histogram *h = &my_stats->ops[op];
+	add_relaxed(&h->buckets[bucket_index(elapsed)], 1);
+	add_relaxed(&h->sum, elapsed);
+	if (elapsed > __atomic_load_n(&h->max, __ATOMIC_RELAXED)){
+		__atomic_store_n(&h->max, elapsed, __ATOMIC_RELAXED);
+	}
+	add_relaxed(&h->count, 1);
+}
+
+/* value at or below which 'fraction' of the merged samples fall */
+static uint64_t percentile(const struct histogram *h, double fraction)
+{
+	uint64_t target = (uint64_t)(fraction * h->count + 0.5), seen = 0;
+	if (target == 0){
+		target = 1;
+	}
+	for (int i = 0; i < N_BUCKETS; i++){
+		seen += h->buckets[i];
+		if (seen >= target){
+			return bucket_value(i) < h->max ? bucket_value(i) : h->max;
+		}
+	}
+	return h->max;
+}
+
+int stats_render(char *buf, size_t size)
+{
+	static const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+	struct histogram *merged = calloc(1, sizeof(*merged));
+	if (merged == NULL){
+		return snprintf(buf, size, "out of memory\n");
+	}
+	size_t len = snprintf(buf, size, "%-12s %10s %10s %10s %10s %10s %10s %10s\n",
+			"op", "count", "mean_ns", "p50_ns", "p90_ns", "p99_ns", "p999_ns", "max_ns");
+	for (int op = 0; op < STATS_NOPS; op++){
+		memset(merged, 0, sizeof(*merged));
+		for (struct thread_stats *ts = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE);
+				ts != NULL; ts = ts->next){
+			const struct histogram *h = &ts->ops[op];
+			merged->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+			merged->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+			uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+			if (max > merged->max){
+				merged->max = max;
+			}
+			for (int i = 0; i < N_BUCKETS; i++){
+				merged->buckets[i] += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+			}
+		}
+		if (merged->count == 0 || len >= size){
+			continue;
+		}
+		len += snprintf(buf + len, size - len, "%-12s %10ju %10ju", op_names[op],
+				(uintmax_t)merged->count, (uintmax_t)(merged->sum / merged->count));
+		for (int i = 0; i < sizeof(fractions) / sizeof(fractions[0]) && len < size; i++){
+			len += snprintf(buf + len, size - len, " %10ju", (uintmax_t)percentile(merged, fractions[i]));
+		}
+		if (len < size){
+			len += snprintf(buf + len, size - len, " %10ju\n", (uintmax_t)merged->max);
+		}
+	}
+	free(merged);
+	return len < size ? len : size - 1;
+}
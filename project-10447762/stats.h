@@ -0,0 +1,45 @@
+/*
+ * file:        stats.h
+ * description: per-operation latency histograms for FSX492 file system
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** operations whose latency is recorded */
+enum stats_op {
+	STATS_GETATTR, STATS_OPENDIR, STATS_READDIR, STATS_RELEASEDIR,
+	STATS_MKNOD, STATS_MKDIR, STATS_UNLINK, STATS_RMDIR, STATS_RENAME,
+	STATS_CHMOD, STATS_OPEN, STATS_READ, STATS_WRITE, STATS_RELEASE,
+	STATS_STATFS, STATS_UTIME, STATS_TRUNCATE, STATS_FALLOCATE, STATS_IOCTL,
+	STATS_UTIMENS, STATS_LOOKUP, STATS_FORGET, STATS_SETATTR, STATS_CREATE,
+	STATS_FSYNC, STATS_FSYNCDIR, STATS_LINK, STATS_SYMLINK, STATS_READLINK,
+	STATS_NOPS
+};
+
+/*
+ * Get a monotonic timestamp in nanoseconds to pass to stats_record.
+ */
+extern uint64_t stats_now(void);
+
+/*
+ * Record one completed operation in the calling thread's histogram.
+ *
+ * @param op: the operation
+ * @param start: timestamp from stats_now() taken when the operation began
+ */
+extern void stats_record(enum stats_op op, uint64_t start);
+
+/*
+ * Merge the histograms of all threads and format them as text.
+ *
+ * @param buf: output buffer
+ * @param size: size of output buffer
+ * @return: number of characters written, excluding the trailing NUL
+ */
+extern int stats_render(char *buf, size_t size);
+
+#endif /* STATS_H_ */